@@ -0,0 +1,795 @@
+/**********************************************************************************
+Module name: Benchmark.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+// Builds an index of a generated volume and measures building, searching, saving and loading it.
+// The results are written as JSON, so they can be compared between versions. Usage:
+// Benchmark [-files n] [-dirs n] [-depth n] [-seed n] [-intl percent] [-repeat n] [-limit n] [-threads n] [-out file]
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <algorithm>
+#include "CDriveIndex.h"
+#include "SearchSession.h"
+#include "VolumeGenerator.h"
+
+//Drive letter of the generated volume
+#define BENCHMARK_DRIVE TEXT('B')
+
+//Size of the buffer that FetchResults() fills, like a client that shows one screen of results at a time
+#define FETCH_BUFFER_SIZE 0x10000
+
+
+
+// Writes indented JSON. Keys and strings are escaped and encoded as UTF-8.
+class CJsonWriter {
+public:
+	CJsonWriter()
+	{
+		rgFirst.insert(rgFirst.end(), true);
+	}
+
+	void BeginObject(const char *szKey = NULL)
+	{
+		Key(szKey);
+		m_strText += "{";
+		rgFirst.insert(rgFirst.end(), true);
+	}
+
+	void EndObject()
+	{
+		End("}");
+	}
+
+	void BeginArray(const char *szKey = NULL)
+	{
+		Key(szKey);
+		m_strText += "[";
+		rgFirst.insert(rgFirst.end(), true);
+	}
+
+	void EndArray()
+	{
+		End("]");
+	}
+
+	void Add(const char *szKey, DWORDLONG Value)
+	{
+		char szValue[32];
+		sprintf_s(szValue, "%llu", Value);
+		Key(szKey);
+		m_strText += szValue;
+	}
+
+	void Add(const char *szKey, int Value)
+	{
+		char szValue[32];
+		sprintf_s(szValue, "%d", Value);
+		Key(szKey);
+		m_strText += szValue;
+	}
+
+	void Add(const char *szKey, double Value)
+	{
+		char szValue[32];
+		sprintf_s(szValue, "%.4f", Value);
+		Key(szKey);
+		m_strText += szValue;
+	}
+
+	void Add(const char *szKey, const wstring &strValue)
+	{
+		Key(szKey);
+		string strUtf8;
+		if(strValue.length() != 0)
+		{
+			int cb = WideCharToMultiByte(CP_UTF8, 0, strValue.c_str(), (int) strValue.length(), NULL, 0, NULL, NULL);
+			strUtf8.resize(cb);
+			WideCharToMultiByte(CP_UTF8, 0, strValue.c_str(), (int) strValue.length(), &strUtf8[0], cb, NULL, NULL);
+		}
+		m_strText += "\"";
+		for(unsigned int i = 0; i != strUtf8.length(); i++)
+		{
+			unsigned char c = (unsigned char) strUtf8[i];
+			if(c == '"' || c == '\\')
+			{
+				m_strText += '\\';
+				m_strText += c;
+			}
+			else if(c < 0x20)
+			{
+				char szEscape[8];
+				sprintf_s(szEscape, "\\u%04x", c);
+				m_strText += szEscape;
+			}
+			else
+				m_strText += c;
+		}
+		m_strText += "\"";
+	}
+
+	const string& GetText()
+	{
+		return m_strText;
+	}
+
+protected:
+	//Starts a new member or element. Array elements have no key.
+	void Key(const char *szKey)
+	{
+		if(!rgFirst.back())
+			m_strText += ",";
+		rgFirst.back() = false;
+		if(rgFirst.size() > 1)
+			m_strText += "\n" + string(rgFirst.size() - 1, '\t');
+		if(szKey != NULL)
+			m_strText += "\"" + string(szKey) + "\": ";
+	}
+
+	void End(const char *szClose)
+	{
+		BOOL bEmpty = rgFirst.back();
+		rgFirst.pop_back();
+		if(!bEmpty)
+			m_strText += "\n" + string(rgFirst.size() - 1, '\t');
+		m_strText += szClose;
+	}
+
+	string m_strText;
+	vector<BOOL> rgFirst; //For each open object or array, whether it has no members yet
+};
+
+
+
+//Times of the repetitions of one measurement in milliseconds
+struct Measurement
+{
+	vector<double> rgTimes;
+
+	void Add(double Time)
+	{
+		rgTimes.insert(rgTimes.end(), Time);
+	}
+
+	void Write(CJsonWriter &Json, const char *szKey)
+	{
+		vector<double> rgSorted = rgTimes;
+		sort(rgSorted.begin(), rgSorted.end());
+		double Total = 0;
+		for(unsigned int i = 0; i != rgSorted.size(); i++)
+			Total += rgSorted[i];
+		Json.BeginObject(szKey);
+		Json.Add("min_ms", rgSorted.size() != 0 ? rgSorted.front() : 0.0);
+		Json.Add("median_ms", rgSorted.size() != 0 ? rgSorted[rgSorted.size() / 2] : 0.0);
+		Json.Add("mean_ms", rgSorted.size() != 0 ? Total / rgSorted.size() : 0.0);
+		Json.Add("max_ms", rgSorted.size() != 0 ? rgSorted.back() : 0.0);
+		Json.EndObject();
+	}
+};
+
+
+
+//A query of the benchmark
+struct BenchmarkQuery
+{
+	wstring strQuery;
+	wstring strPath; //Empty if the whole volume is searched
+	BOOL bEnhancedSearch;
+};
+
+//Options from the command line
+struct BenchmarkOptions
+{
+	VolumeProfile Profile;
+	unsigned int nRepeat; //Repetitions of each measurement
+	int maxResults; //Limit of the searches while typing
+	int nThreads;
+	wstring strOutput; //Empty for stdout
+	BenchmarkOptions()
+	{
+		nRepeat = 5;
+		maxResults = 100;
+		nThreads = 0;
+	}
+};
+
+
+
+static LARGE_INTEGER StartTimer()
+{
+	LARGE_INTEGER Start;
+	QueryPerformanceCounter(&Start);
+	return Start;
+}
+
+
+
+// Returns the milliseconds since Start
+static double GetElapsed(LARGE_INTEGER Start)
+{
+	LARGE_INTEGER Now, Frequency;
+	QueryPerformanceCounter(&Now);
+	QueryPerformanceFrequency(&Frequency);
+	return (Now.QuadPart - Start.QuadPart) * 1000.0 / Frequency.QuadPart;
+}
+
+
+
+// Searches for something that isn't on the volume, so the next search can't reuse the results of the last one
+static void ResetLastResult(CDriveIndex *pIndex)
+{
+	vector<SearchResultFile> rgResults;
+	wstring strQuery = TEXT("\x01");
+	pIndex->Find(&strQuery, NULL, &rgResults, false, SEARCH_SUBSTRING, -1);
+}
+
+
+
+static BOOL ParseOptions(int argc, WCHAR *argv[], BenchmarkOptions &Options)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		if(i + 1 == argc)
+			return false;
+		wstring strOption = argv[i];
+		WCHAR *szValue = argv[++i];
+		DWORDLONG Value = _wcstoui64(szValue, NULL, 10);
+		if(strOption == TEXT("-files"))
+			Options.Profile.nFiles = (unsigned int) Value;
+		else if(strOption == TEXT("-dirs"))
+			Options.Profile.nDirectories = max((unsigned int) Value, 1u);
+		else if(strOption == TEXT("-depth"))
+			Options.Profile.MaxDepth = max((unsigned int) Value, 1u);
+		else if(strOption == TEXT("-seed"))
+			Options.Profile.Seed = Value;
+		else if(strOption == TEXT("-intl"))
+			Options.Profile.InternationalPercent = min((unsigned int) Value, 100u);
+		else if(strOption == TEXT("-repeat"))
+			Options.nRepeat = max((unsigned int) Value, 1u);
+		else if(strOption == TEXT("-limit"))
+			Options.maxResults = (int) Value;
+		else if(strOption == TEXT("-threads"))
+			Options.nThreads = (int) Value;
+		else if(strOption == TEXT("-out"))
+			Options.strOutput = szValue;
+		else
+			return false;
+	}
+	return true;
+}
+
+
+
+// Builds the index Options.nRepeat times and returns the last one
+static CDriveIndex* BenchmarkPopulate(CBufferRecordSource &Source, SearchOptions &SearchOpts, BenchmarkOptions &Options, CJsonWriter &Json)
+{
+	Measurement Total;
+	CDriveIndex *pIndex = NULL;
+	for(unsigned int i = 0; i != Options.nRepeat; i++)
+	{
+		delete pIndex;
+		pIndex = new CDriveIndex();
+		pIndex->SetOptions(&SearchOpts);
+		Source.Rewind();
+		LARGE_INTEGER Start = StartTimer();
+		pIndex->PopulateIndex(&Source);
+		Total.Add(GetElapsed(Start));
+	}
+	BuildStats Stats = pIndex->GetBuildStats();
+	IndexMemoryInfo Memory = pIndex->GetMemoryInfo();
+	DriveInfo Info = pIndex->GetInfo();
+	Json.BeginObject("populate");
+	Total.Write(Json, "total");
+	Json.BeginObject("last_phases_us");
+	Json.Add("enumerate", Stats.Enumerate);
+	Json.Add("insert", Stats.Insert);
+	Json.Add("link", Stats.Link);
+	Json.Add("aggregate", Stats.Aggregate);
+	Json.Add("trigram_index", Stats.TrigramIndex);
+	Json.Add("compact_names", Stats.CompactNames);
+	Json.Add("filters", Stats.Filters);
+	Json.Add("reads", (DWORDLONG) Stats.nReads);
+	Json.EndObject();
+	Json.Add("files", Info.NumFiles);
+	Json.Add("directories", Info.NumDirectories);
+	Json.BeginObject("memory_bytes");
+	Json.Add("entries", Memory.Entries);
+	Json.Add("filters", Memory.Filters);
+	Json.Add("names", Memory.Names);
+	Json.Add("trigram_index", Memory.TrigramIndex);
+	Json.EndObject();
+	Json.EndObject();
+	return pIndex;
+}
+
+
+
+// Measures each query without usable results of the last query (cold) and repeated right after itself (warm),
+// which answers it from LastResult
+static void BenchmarkFind(CDriveIndex *pIndex, vector<BenchmarkQuery> &rgQueries, BenchmarkOptions &Options, CJsonWriter &Json)
+{
+	Json.BeginArray("find");
+	for(unsigned int q = 0; q != rgQueries.size(); q++)
+	{
+		BenchmarkQuery &Query = rgQueries[q];
+		wstring *pstrPath = Query.strPath.length() != 0 ? &Query.strPath : NULL;
+		Measurement Cold, Warm, Limited;
+		int nResults = 0;
+		SearchStats Stats;
+		for(unsigned int i = 0; i != Options.nRepeat; i++)
+		{
+			vector<SearchResultFile> rgResults;
+			ResetLastResult(pIndex);
+			LARGE_INTEGER Start = StartTimer();
+			nResults = pIndex->Find(&Query.strQuery, pstrPath, &rgResults, false, Query.bEnhancedSearch, -1);
+			Cold.Add(GetElapsed(Start));
+			Stats = pIndex->GetSearchStats();
+		}
+		for(unsigned int i = 0; i != Options.nRepeat; i++)
+		{
+			vector<SearchResultFile> rgResults;
+			LARGE_INTEGER Start = StartTimer();
+			pIndex->Find(&Query.strQuery, pstrPath, &rgResults, false, Query.bEnhancedSearch, -1);
+			Warm.Add(GetElapsed(Start));
+		}
+		for(unsigned int i = 0; i != Options.nRepeat; i++)
+		{
+			vector<SearchResultFile> rgResults;
+			ResetLastResult(pIndex);
+			LARGE_INTEGER Start = StartTimer();
+			pIndex->Find(&Query.strQuery, pstrPath, &rgResults, false, Query.bEnhancedSearch, Options.maxResults);
+			Limited.Add(GetElapsed(Start));
+		}
+		Json.BeginObject();
+		Json.Add("query", Query.strQuery);
+		Json.Add("path", Query.strPath);
+		Json.Add("mode", (int) Query.bEnhancedSearch);
+		Json.Add("results", nResults);
+		Cold.Write(Json, "cold");
+		Warm.Write(Json, "warm");
+		Limited.Write(Json, "cold_limited");
+		//Counters of the last cold search, nFilterPassed / nScanned is the selectivity of the filters
+		Json.BeginObject("cold_stats");
+		Json.Add("prepare_us", Stats.Prepare);
+		Json.Add("scan_us", Stats.Scan);
+		Json.Add("results_us", Stats.Results);
+		Json.Add("scanned", Stats.nScanned);
+		Json.Add("filter_passed", Stats.nFilterPassed);
+		Json.Add("false_positives", Stats.nFalsePositives);
+		Json.Add("index_candidates", Stats.nIndexCandidates);
+		Json.Add("fuzzy_searches", Stats.nFuzzySearches);
+		Json.Add("paths_built", Stats.nPathsBuilt);
+		Json.Add("names_decoded", Stats.nNamesDecoded);
+		Json.Add("sources", (int) Stats.Sources);
+		Json.EndObject();
+		Json.EndObject();
+	}
+	Json.EndArray();
+}
+
+
+
+// Compares the memory of the names and the cold searches in the normal and in the compact name mode (SearchOptions::bCompactNames).
+// The index is converted to the compact mode and back, which is measured as well.
+static void BenchmarkCompactNames(CDriveIndex *pIndex, vector<BenchmarkQuery> &rgQueries, SearchOptions &SearchOpts, BenchmarkOptions &Options, CJsonWriter &Json)
+{
+	vector<Measurement> rgNormal(rgQueries.size());
+	vector<Measurement> rgCompact(rgQueries.size());
+	vector<DWORDLONG> rgDecoded(rgQueries.size());
+	Measurement Compact, Expand;
+	NameStats Stats;
+	for(unsigned int i = 0; i != Options.nRepeat; i++)
+	{
+		for(unsigned int q = 0; q != rgQueries.size(); q++)
+		{
+			wstring *pstrPath = rgQueries[q].strPath.length() != 0 ? &rgQueries[q].strPath : NULL;
+			vector<SearchResultFile> rgResults;
+			ResetLastResult(pIndex);
+			LARGE_INTEGER Start = StartTimer();
+			pIndex->Find(&rgQueries[q].strQuery, pstrPath, &rgResults, false, rgQueries[q].bEnhancedSearch, -1);
+			rgNormal[q].Add(GetElapsed(Start));
+		}
+
+		SearchOpts.bCompactNames = true;
+		LARGE_INTEGER Start = StartTimer();
+		pIndex->SetOptions(&SearchOpts);
+		Compact.Add(GetElapsed(Start));
+		for(unsigned int q = 0; q != rgQueries.size(); q++)
+		{
+			wstring *pstrPath = rgQueries[q].strPath.length() != 0 ? &rgQueries[q].strPath : NULL;
+			vector<SearchResultFile> rgResults;
+			ResetLastResult(pIndex);
+			Start = StartTimer();
+			pIndex->Find(&rgQueries[q].strQuery, pstrPath, &rgResults, false, rgQueries[q].bEnhancedSearch, -1);
+			rgCompact[q].Add(GetElapsed(Start));
+			rgDecoded[q] = pIndex->GetSearchStats().nNamesDecoded;
+		}
+		Stats = pIndex->GetNameStats();
+
+		SearchOpts.bCompactNames = false;
+		Start = StartTimer();
+		pIndex->SetOptions(&SearchOpts);
+		Expand.Add(GetElapsed(Start));
+	}
+	Json.BeginObject("compact_names");
+	Json.Add("names", Stats.nNames);
+	Json.Add("distinct_names", Stats.nDistinctNames);
+	Json.Add("uncompressed_bytes", Stats.cbUncompressed);
+	Json.Add("compact_bytes", Stats.cbStored);
+	Json.Add("cache_hits", Stats.nCacheHits);
+	Json.Add("cache_misses", Stats.nCacheMisses);
+	Compact.Write(Json, "compact");
+	Expand.Write(Json, "expand");
+	Json.BeginArray("find");
+	for(unsigned int q = 0; q != rgQueries.size(); q++)
+	{
+		Json.BeginObject();
+		Json.Add("query", rgQueries[q].strQuery);
+		Json.Add("mode", (int) rgQueries[q].bEnhancedSearch);
+		rgNormal[q].Write(Json, "normal");
+		rgCompact[q].Write(Json, "compact");
+		Json.Add("names_decoded", rgDecoded[q]);
+		Json.EndObject();
+	}
+	Json.EndArray();
+	Json.EndObject();
+}
+
+
+
+// Filter counters of searches with one filter layout, see BenchmarkFilterLayout()
+struct FilterMeasurement
+{
+	DWORDLONG nScanned;
+	DWORDLONG nFilterPassed;
+	DWORDLONG nFalsePositives;
+	Measurement Cold;
+	FilterMeasurement()
+	{
+		nScanned = 0;
+		nFilterPassed = 0;
+		nFalsePositives = 0;
+	}
+	void Add(const SearchStats &Stats)
+	{
+		nScanned += Stats.nScanned;
+		nFilterPassed += Stats.nFilterPassed;
+		nFalsePositives += Stats.nFalsePositives;
+	}
+	void Write(CJsonWriter &Json, const char *szKey)
+	{
+		Json.BeginObject(szKey);
+		Json.Add("scanned", nScanned);
+		Json.Add("filter_passed", nFilterPassed);
+		Json.Add("false_positives", nFalsePositives);
+		Json.Add("false_positive_rate", nScanned != 0 ? (double) nFalsePositives / nScanned : 0.0);
+		if(Cold.rgTimes.size() != 0)
+			Cold.Write(Json, "cold");
+		Json.EndObject();
+	}
+};
+
+
+
+// Runs the queries with the current filter layout. The counters of the prefixes are summed up.
+static void MeasureFilterLayout(CDriveIndex *pIndex, vector<BenchmarkQuery> &rgQueries, vector<wstring> &rgPrefixes, BenchmarkOptions &Options, vector<FilterMeasurement> &rgMeasurements, FilterMeasurement &Prefixes)
+{
+	for(unsigned int q = 0; q != rgQueries.size(); q++)
+	{
+		wstring *pstrPath = rgQueries[q].strPath.length() != 0 ? &rgQueries[q].strPath : NULL;
+		for(unsigned int i = 0; i != Options.nRepeat; i++)
+		{
+			vector<SearchResultFile> rgResults;
+			ResetLastResult(pIndex);
+			LARGE_INTEGER Start = StartTimer();
+			pIndex->Find(&rgQueries[q].strQuery, pstrPath, &rgResults, false, rgQueries[q].bEnhancedSearch, -1);
+			rgMeasurements[q].Cold.Add(GetElapsed(Start));
+		}
+		rgMeasurements[q].Add(pIndex->GetSearchStats());
+	}
+
+	//Short queries like the ones typed into a search box
+	for(unsigned int j = 0; j != rgPrefixes.size(); j++)
+	{
+		vector<SearchResultFile> rgResults;
+		ResetLastResult(pIndex);
+		pIndex->Find(&rgPrefixes[j], NULL, &rgResults, false, SEARCH_SUBSTRING, -1);
+		Prefixes.Add(pIndex->GetSearchStats());
+	}
+}
+
+
+
+// Compares the false positive rate of the filters with the fixed layout and with the layout chosen for the volume
+// (SearchOptions::bAdaptiveFilters). Switching the layout makes all filters again, which is measured as well.
+static void BenchmarkFilterLayout(CDriveIndex *pIndex, vector<BenchmarkQuery> &rgQueries, vector<wstring> &rgWords, SearchOptions &SearchOpts, BenchmarkOptions &Options, CJsonWriter &Json)
+{
+	vector<wstring> rgPrefixes;
+	for(unsigned int w = 0; w != rgWords.size(); w++)
+		for(unsigned int n = 1; n <= rgWords[w].length(); n++)
+			rgPrefixes.insert(rgPrefixes.end(), rgWords[w].substr(0, n));
+	vector<FilterMeasurement> rgAdaptive(rgQueries.size());
+	vector<FilterMeasurement> rgFixed(rgQueries.size());
+	FilterMeasurement AdaptivePrefixes, FixedPrefixes;
+	MeasureFilterLayout(pIndex, rgQueries, rgPrefixes, Options, rgAdaptive, AdaptivePrefixes);
+	SearchOpts.bAdaptiveFilters = false;
+	LARGE_INTEGER Start = StartTimer();
+	pIndex->SetOptions(&SearchOpts);
+	double FixedTime = GetElapsed(Start);
+	MeasureFilterLayout(pIndex, rgQueries, rgPrefixes, Options, rgFixed, FixedPrefixes);
+	SearchOpts.bAdaptiveFilters = true;
+	Start = StartTimer();
+	pIndex->SetOptions(&SearchOpts);
+	double AdaptiveTime = GetElapsed(Start);
+
+	Json.BeginObject("filter_layout");
+	Json.Add("make_fixed_ms", FixedTime);
+	Json.Add("make_adaptive_ms", AdaptiveTime);
+	Json.BeginArray("find");
+	for(unsigned int q = 0; q != rgQueries.size(); q++)
+	{
+		Json.BeginObject();
+		Json.Add("query", rgQueries[q].strQuery);
+		Json.Add("mode", (int) rgQueries[q].bEnhancedSearch);
+		rgFixed[q].Write(Json, "fixed");
+		rgAdaptive[q].Write(Json, "adaptive");
+		Json.EndObject();
+	}
+	Json.EndArray();
+	Json.BeginObject("prefixes");
+	Json.Add("queries", (DWORDLONG) rgPrefixes.size());
+	FixedPrefixes.Write(Json, "fixed");
+	AdaptivePrefixes.Write(Json, "adaptive");
+	Json.EndObject();
+	Json.EndObject();
+}
+
+
+
+// Searches for every prefix of a word like a search box that searches while the user types.
+// Every query after the first one narrows the last one, so it is answered from LastResult.
+static void BenchmarkTyping(CDriveIndex *pIndex, vector<wstring> &rgWords, BenchmarkOptions &Options, CJsonWriter &Json)
+{
+	Json.BeginArray("typing");
+	for(unsigned int w = 0; w != rgWords.size(); w++)
+	{
+		wstring &strWord = rgWords[w];
+		vector<Measurement> rgSteps(strWord.length());
+		vector<int> rgResults(strWord.length());
+		Measurement Total;
+		for(unsigned int i = 0; i != Options.nRepeat; i++)
+		{
+			ResetLastResult(pIndex);
+			double TotalTime = 0;
+			for(unsigned int n = 1; n <= strWord.length(); n++)
+			{
+				vector<SearchResultFile> rgResultFiles;
+				wstring strQuery = strWord.substr(0, n);
+				LARGE_INTEGER Start = StartTimer();
+				rgResults[n - 1] = pIndex->Find(&strQuery, NULL, &rgResultFiles, true, SEARCH_ENHANCED, Options.maxResults);
+				double Time = GetElapsed(Start);
+				rgSteps[n - 1].Add(Time);
+				TotalTime += Time;
+			}
+			Total.Add(TotalTime);
+		}
+		Json.BeginObject();
+		Json.Add("word", strWord);
+		Total.Write(Json, "total");
+		Json.BeginArray("steps");
+		for(unsigned int n = 0; n != strWord.length(); n++)
+		{
+			Json.BeginObject();
+			Json.Add("query", strWord.substr(0, n + 1));
+			Json.Add("results", rgResults[n]);
+			rgSteps[n].Write(Json, "time");
+			Json.EndObject();
+		}
+		Json.EndArray();
+		Json.EndObject();
+	}
+	Json.EndArray();
+}
+
+
+
+// Submits every prefix of a word to a search session at once, like a user who types faster than the index is searched.
+// Each query cancels the one before it, so the time until the results of the whole word arrive can be compared to the
+// total of the blocking searches in "typing".
+static void BenchmarkSessionTyping(CDriveIndex *pIndex, vector<wstring> &rgWords, BenchmarkOptions &Options, CJsonWriter &Json)
+{
+	Json.BeginArray("session_typing");
+	for(unsigned int w = 0; w != rgWords.size(); w++)
+	{
+		wstring &strWord = rgWords[w];
+		Measurement LastResults;
+		int nResults = 0;
+		for(unsigned int i = 0; i != Options.nRepeat; i++)
+		{
+			ResetLastResult(pIndex);
+			CSearchSession Session(pIndex);
+			DWORD Ticket = 0;
+			LARGE_INTEGER Start = StartTimer();
+			for(unsigned int n = 1; n <= strWord.length(); n++)
+			{
+				wstring strQuery = strWord.substr(0, n);
+				Ticket = Session.Submit(&strQuery, NULL, true, SEARCH_ENHANCED, Options.maxResults, NULL, NULL);
+			}
+			Session.Wait(Ticket, INFINITE);
+			LastResults.Add(GetElapsed(Start));
+			vector<SearchResultFile> rgResultFiles;
+			nResults = Session.TakeResults(Ticket, rgResultFiles);
+		}
+		Json.BeginObject();
+		Json.Add("word", strWord);
+		Json.Add("results", nResults);
+		LastResults.Write(Json, "time");
+		Json.EndObject();
+	}
+	Json.EndArray();
+}
+
+
+
+// Saves the index, loads it again and searches the loaded index once, which is the first search after a restart
+static void BenchmarkSaveLoad(CDriveIndex *pIndex, wstring &strQuery, BenchmarkOptions &Options, CJsonWriter &Json)
+{
+	WCHAR szTempPath[MAX_PATH];
+	GetTempPath(MAX_PATH, szTempPath);
+	wstring strPath = wstring(szTempPath) + TEXT("FileSearchBenchmark.idx");
+	Measurement Save, Load, FirstFind;
+	DWORDLONG cbFile = 0;
+	for(unsigned int i = 0; i != Options.nRepeat; i++)
+	{
+		LARGE_INTEGER Start = StartTimer();
+		pIndex->SaveToDisk(strPath);
+		Save.Add(GetElapsed(Start));
+
+		Start = StartTimer();
+		CDriveIndex *pLoaded = new CDriveIndex(strPath);
+		Load.Add(GetElapsed(Start));
+
+		vector<SearchResultFile> rgResults;
+		Start = StartTimer();
+		pLoaded->Find(&strQuery, NULL, &rgResults, false, SEARCH_SUBSTRING, -1);
+		FirstFind.Add(GetElapsed(Start));
+		delete pLoaded;
+	}
+	WIN32_FILE_ATTRIBUTE_DATA Attributes;
+	if(GetFileAttributesEx(strPath.c_str(), GetFileExInfoStandard, &Attributes))
+		cbFile = (((DWORDLONG) Attributes.nFileSizeHigh) << 32) | Attributes.nFileSizeLow;
+	DeleteFile(strPath.c_str());
+	Json.BeginObject("save_load");
+	Json.Add("file_bytes", cbFile);
+	Save.Write(Json, "save");
+	Load.Write(Json, "load");
+	FirstFind.Write(Json, "first_find");
+	Json.EndObject();
+}
+
+
+
+// Measures the cost of turning results into the strings the exported functions return,
+// compared to the search alone
+static void BenchmarkMaterialize(CDriveIndex *pIndex, wstring &strQuery, BenchmarkOptions &Options, CJsonWriter &Json)
+{
+	Measurement FindOnly, SearchString, Cursor;
+	int nResults = 0;
+	vector<WCHAR> rgBuffer(FETCH_BUFFER_SIZE);
+	for(unsigned int i = 0; i != Options.nRepeat; i++)
+	{
+		vector<SearchResultFile> rgResults;
+		ResetLastResult(pIndex);
+		LARGE_INTEGER Start = StartTimer();
+		nResults = pIndex->Find(&strQuery, NULL, &rgResults, true, SEARCH_SUBSTRING, -1);
+		FindOnly.Add(GetElapsed(Start));
+
+		ResetLastResult(pIndex);
+		Start = StartTimer();
+		WCHAR *szResults = Search(pIndex, (WCHAR *) strQuery.c_str(), NULL, true, SEARCH_SUBSTRING, -1, NULL);
+		SearchString.Add(GetElapsed(Start));
+		FreeResultsBuffer(szResults);
+
+		Start = StartTimer();
+		SearchCursor *pCursor = OpenSearch(pIndex, (WCHAR *) strQuery.c_str(), NULL, SEARCH_SUBSTRING);
+		while(FetchResults(pCursor, &rgBuffer[0], FETCH_BUFFER_SIZE) > 0)
+			;
+		CloseSearch(pCursor);
+		Cursor.Add(GetElapsed(Start));
+	}
+	Json.BeginObject("materialize");
+	Json.Add("query", strQuery);
+	Json.Add("results", nResults);
+	FindOnly.Write(Json, "find_sorted");
+	SearchString.Write(Json, "search_string");
+	Cursor.Write(Json, "cursor_fetch");
+	Json.EndObject();
+}
+
+
+
+int wmain(int argc, WCHAR *argv[])
+{
+	BenchmarkOptions Options;
+	if(!ParseOptions(argc, argv, Options))
+	{
+		fprintf(stderr, "Usage: Benchmark [-files n] [-dirs n] [-depth n] [-seed n] [-intl percent] [-repeat n] [-limit n] [-threads n] [-out file]\n");
+		return 1;
+	}
+	SearchOptions SearchOpts;
+	SearchOpts.nThreads = Options.nThreads;
+
+	CJsonWriter Json;
+	Json.BeginObject();
+
+	//The volume is generated once, every build reads the same records
+	LARGE_INTEGER Start = StartTimer();
+	CVolumeGenerator Generator(Options.Profile);
+	CBufferRecordSource Source(BENCHMARK_DRIVE, GENERATED_ROOT_FRN);
+	Generator.Generate(&Source);
+	Json.BeginObject("volume");
+	Json.Add("files", (DWORDLONG) Options.Profile.nFiles);
+	Json.Add("directories", (DWORDLONG) Options.Profile.nDirectories);
+	Json.Add("seed", Options.Profile.Seed);
+	Json.Add("international_percent", (DWORDLONG) Options.Profile.InternationalPercent);
+	Json.Add("max_depth", (DWORDLONG) Generator.GetMaxDepth());
+	Json.Add("record_bytes", Generator.GetRecordBytes());
+	Json.Add("generate_ms", GetElapsed(Start));
+	Json.EndObject();
+	Json.Add("repeat", (DWORDLONG) Options.nRepeat);
+	Json.Add("limit", Options.maxResults);
+
+	CDriveIndex *pIndex = BenchmarkPopulate(Source, SearchOpts, Options, Json);
+
+	//Queries with many, few and no results, a path deep in the tree, names in other scripts that need case folding and the other search modes
+	unsigned int iDeepDirectory = 0;
+	for(unsigned int i = 0; i != Options.Profile.nDirectories; i++)
+		if(Generator.GetDirectoryDepth(i) > Generator.GetDirectoryDepth(iDeepDirectory) && Generator.GetDirectoryDepth(i) <= Generator.GetMaxDepth() / 2 + 1)
+			iDeepDirectory = i;
+	wstring strDeepPath = wstring(1, BENCHMARK_DRIVE) + TEXT(":\\") + Generator.GetDirectoryPath(iDeepDirectory);
+	wstring strFileName = Generator.GetName(Options.Profile.nDirectories + Options.Profile.nFiles / 2);
+	BenchmarkQuery rgQueryList[] = {
+		{ TEXT("e"), TEXT(""), SEARCH_SUBSTRING },
+		{ TEXT("dll"), TEXT(""), SEARCH_SUBSTRING },
+		{ TEXT("report"), TEXT(""), SEARCH_SUBSTRING },
+		{ strFileName, TEXT(""), SEARCH_SUBSTRING },
+		{ TEXT("qxzvj"), TEXT(""), SEARCH_SUBSTRING },
+		{ TEXT("conf"), strDeepPath, SEARCH_SUBSTRING },
+		{ TEXT("ext:png"), TEXT(""), SEARCH_SUBSTRING },
+		{ TEXT("\x0414\x041E\x041A\x0423\x041C\x0415\x041D\x0422"), TEXT(""), SEARCH_SUBSTRING },
+		{ TEXT("\x00FC") TEXT("bersicht"), TEXT(""), SEARCH_SUBSTRING },
+		{ TEXT("\x5199\x771F"), TEXT(""), SEARCH_SUBSTRING },
+		{ TEXT("thumbnail"), TEXT(""), SEARCH_ENHANCED },
+		{ TEXT("reprot"), TEXT(""), SEARCH_APPROXIMATE },
+		{ TEXT("*_core*.dll"), TEXT(""), SEARCH_GLOB },
+		{ TEXT("^setup\\d+\\.exe$"), TEXT(""), SEARCH_REGEX }
+	};
+	vector<BenchmarkQuery> rgQueries(rgQueryList, rgQueryList + sizeof(rgQueryList) / sizeof(rgQueryList[0]));
+	BenchmarkFind(pIndex, rgQueries, Options, Json);
+
+	const WCHAR *rgWordList[] = { TEXT("node_modules"), TEXT("thumbnail.png"), TEXT("System32") };
+	vector<wstring> rgWords(rgWordList, rgWordList + sizeof(rgWordList) / sizeof(rgWordList[0]));
+	BenchmarkTyping(pIndex, rgWords, Options, Json);
+	BenchmarkSessionTyping(pIndex, rgWords, Options, Json);
+
+	wstring strLoadQuery = TEXT("report");
+	BenchmarkSaveLoad(pIndex, strLoadQuery, Options, Json);
+	wstring strMaterializeQuery = TEXT("dll");
+	BenchmarkMaterialize(pIndex, strMaterializeQuery, Options, Json);
+	BenchmarkCompactNames(pIndex, rgQueries, SearchOpts, Options, Json);
+	BenchmarkFilterLayout(pIndex, rgQueries, rgWords, SearchOpts, Options, Json);
+	delete pIndex;
+
+	Json.EndObject();
+	FILE *pFile = stdout;
+	if(Options.strOutput.length() != 0 && _wfopen_s(&pFile, Options.strOutput.c_str(), TEXT("w")) != 0)
+	{
+		fprintf(stderr, "Can't write %ls\n", Options.strOutput.c_str());
+		return 1;
+	}
+	fprintf(pFile, "%s\n", Json.GetText().c_str());
+	if(pFile != stdout)
+		fclose(pFile);
+	return 0;
+}
@@ -0,0 +1,263 @@
+/**********************************************************************************
+Module name: VolumeGenerator.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "VolumeGenerator.h"
+
+//Parent of the entries in the root directory
+#define ROOT_PARENT 0xFFFFFFFF
+
+//The first MFT records belong to the metadata files of NTFS, the generated entries start after them
+#define FIRST_RECORD_NUMBER 24
+
+static const WCHAR *g_rgWords[] = {
+	TEXT("Windows"), TEXT("System32"), TEXT("Microsoft"), TEXT("Program"), TEXT("Files"), TEXT("node_modules"), TEXT("lib"),
+	TEXT("src"), TEXT("include"), TEXT("test"), TEXT("data"), TEXT("config"), TEXT("cache"), TEXT("temp"), TEXT("Users"),
+	TEXT("AppData"), TEXT("Local"), TEXT("Roaming"), TEXT("assets"), TEXT("images"), TEXT("icons"), TEXT("build"),
+	TEXT("debug"), TEXT("release"), TEXT("package"), TEXT("core"), TEXT("util"), TEXT("driver"), TEXT("update"),
+	TEXT("backup"), TEXT("Documents"), TEXT("Photos"), TEXT("Music"), TEXT("Video"), TEXT("report"), TEXT("invoice"),
+	TEXT("setup"), TEXT("readme"), TEXT("license"), TEXT("changelog"), TEXT("index"), TEXT("main"), TEXT("resources"),
+	TEXT("fonts"), TEXT("locale"), TEXT("plugin"), TEXT("module"), TEXT("service"), TEXT("thumbnail"), TEXT("Dokumente"),
+	TEXT("\x00DC") TEXT("bersicht"), TEXT("\x0434\x043E\x043A\x0443\x043C\x0435\x043D\x0442"), TEXT("\x5199\x771F")
+};
+
+//Words of VolumeProfile::InternationalPercent of the names: Russian, Greek, Chinese, Japanese, Korean, German, Polish and Czech
+static const WCHAR *g_rgInternationalWords[] = {
+	TEXT("\x041E\x0442\x0447\x0451\x0442"), TEXT("\x0434\x043E\x0433\x043E\x0432\x043E\x0440"), TEXT("\x0424\x043E\x0442\x043E"),
+	TEXT("\x03A3\x03CD\x03BC\x03B2\x03B1\x03C3\x03B7"), TEXT("\x03AD\x03BA\x03B8\x03B5\x03C3\x03B7"), TEXT("\x62A5\x544A"),
+	TEXT("\x8CC7\x6599"), TEXT("\x4F1A\x8B70"), TEXT("\x30C7\x30FC\x30BF"), TEXT("\xD504\xB85C\xC81D\xD2B8"),
+	TEXT("Stra\x00DF") TEXT("e"), TEXT("\x00C4nderungen"), TEXT("Rechnung"), TEXT("Sprawozdanie"), TEXT("\x0141\x00F3d\x017A"),
+	TEXT("Z\x00E1lohy"), TEXT("\x010Cesk\x00FD")
+};
+
+//Extensions and their weights. "" are names without extension, NULL stands for a random extension from the long tail.
+static const WCHAR *g_rgExtensions[] = {
+	TEXT("dll"), TEXT("js"), TEXT("png"), TEXT("h"), TEXT("cpp"), TEXT("xml"), TEXT("txt"), TEXT("json"), TEXT("html"),
+	TEXT("exe"), TEXT("mui"), TEXT("jpg"), TEXT("py"), TEXT("pyc"), TEXT("cs"), TEXT("css"), TEXT("gif"), TEXT("ico"),
+	TEXT("manifest"), TEXT("cat"), TEXT("log"), TEXT("ini"), TEXT("dat"), TEXT("tmp"), TEXT("mp3"), TEXT("pdf"), TEXT("docx"),
+	TEXT("zip"), TEXT("sys"), TEXT("lnk"), TEXT("map"), TEXT("ts"), TEXT("svg"), TEXT("tar.gz"), TEXT(""), NULL
+};
+static const unsigned int g_rgExtensionWeights[] = {
+	12, 8, 8, 6, 4, 5, 5, 5, 4,
+	4, 4, 4, 3, 2, 2, 2, 2, 2,
+	3, 2, 2, 2, 2, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 2, 1, 6, 2
+};
+
+static const WCHAR *g_rgSeparators[] = { TEXT(""), TEXT("_"), TEXT("-"), TEXT("."), TEXT(" ") };
+
+
+
+CVolumeGenerator::CVolumeGenerator(const VolumeProfile &Profile)
+{
+	m_Profile = Profile;
+	m_cbRecords = 0;
+	m_MaxDepth = 0;
+	BuildTree();
+}
+
+
+
+//xorshift64*, the same numbers on every platform
+DWORDLONG CVolumeGenerator::Random(DWORDLONG &State)
+{
+	State ^= State >> 12;
+	State ^= State << 25;
+	State ^= State >> 27;
+	return State * 0x2545F4914F6CDD1Dui64;
+}
+
+
+
+unsigned int CVolumeGenerator::RandomBelow(DWORDLONG &State, unsigned int n)
+{
+	return (unsigned int) ((Random(State) >> 32) % n);
+}
+
+
+
+//Chooses the parents of all entries and their record numbers
+void CVolumeGenerator::BuildTree()
+{
+	DWORDLONG State = m_Profile.Seed * 0x9E3779B97F4A7C15ui64 + 1;
+	unsigned int nEntries = m_Profile.nDirectories + m_Profile.nFiles;
+	rgParents.resize(nEntries);
+	rgDepths.resize(m_Profile.nDirectories);
+
+	//New directories are mostly created close to the ones created before them, which nests them deeply
+	for(unsigned int i = 0; i != m_Profile.nDirectories; i++)
+	{
+		unsigned int iParent = ROOT_PARENT;
+		unsigned int r = RandomBelow(State, 100);
+		if(i != 0 && r < 60)
+			iParent = i - 1 - RandomBelow(State, min(i, 8u));
+		else if(i != 0 && r < 97)
+			iParent = RandomBelow(State, i);
+		if(iParent != ROOT_PARENT && rgDepths[iParent] >= m_Profile.MaxDepth)
+			iParent = ROOT_PARENT;
+		rgParents[i] = iParent;
+		rgDepths[i] = iParent == ROOT_PARENT ? 1 : rgDepths[iParent] + 1;
+		m_MaxDepth = max(m_MaxDepth, rgDepths[i]);
+	}
+
+	//Every 97th directory is a big one like System32 or a cache directory
+	unsigned int nHot = m_Profile.nDirectories / 97;
+	for(unsigned int i = m_Profile.nDirectories; i != nEntries; i++)
+	{
+		unsigned int r = RandomBelow(State, 100);
+		if(m_Profile.nDirectories == 0 || r < 2)
+			rgParents[i] = ROOT_PARENT;
+		else if(nHot != 0 && r < 25)
+			rgParents[i] = RandomBelow(State, nHot) * 97;
+		else
+			rgParents[i] = RandomBelow(State, m_Profile.nDirectories);
+	}
+
+	//Record numbers are a random permutation, the MFT reuses free records in no particular order
+	rgRecordNumbers.resize(nEntries);
+	for(unsigned int i = 0; i != nEntries; i++)
+		rgRecordNumbers[i] = FIRST_RECORD_NUMBER + i;
+	for(unsigned int i = nEntries; i > 1; i--)
+		swap(rgRecordNumbers[i - 1], rgRecordNumbers[RandomBelow(State, i)]);
+}
+
+
+
+//The name of an entry only depends on the seed and its position, so it doesn't need to be stored
+wstring CVolumeGenerator::GetName(unsigned int iEntry)
+{
+	DWORDLONG State = (m_Profile.Seed + 1) * 0xD6E8FEB86659FD93ui64 ^ ((DWORDLONG) iEntry + 1) * 0x9E3779B97F4A7C15ui64;
+	Random(State);
+	unsigned int nWords = sizeof(g_rgWords) / sizeof(g_rgWords[0]);
+	wstring strName = g_rgWords[RandomBelow(State, nWords)];
+	//Without international names no random number is drawn, so the volumes of a seed stay the same
+	if(m_Profile.InternationalPercent != 0 && RandomBelow(State, 100) < m_Profile.InternationalPercent)
+		strName = g_rgInternationalWords[RandomBelow(State, sizeof(g_rgInternationalWords) / sizeof(g_rgInternationalWords[0]))];
+	unsigned int r = RandomBelow(State, 100);
+	if(IsDirectory(iEntry))
+	{
+		if(r < 20)
+			strName += wstring(g_rgSeparators[RandomBelow(State, 3)]) + g_rgWords[RandomBelow(State, nWords)];
+		else if(r < 30)
+			strName += to_wstring((long long) RandomBelow(State, 100));
+		return strName;
+	}
+
+	//Files have up to three words, version numbers or hashes like cache files
+	unsigned int nMoreWords = r < 50 ? 0 : (r < 85 ? 1 : 2);
+	for(unsigned int i = 0; i != nMoreWords; i++)
+		strName += wstring(g_rgSeparators[RandomBelow(State, 5)]) + g_rgWords[RandomBelow(State, nWords)];
+	r = RandomBelow(State, 100);
+	if(r < 20)
+		strName += to_wstring((long long) RandomBelow(State, 1000));
+	else if(r < 25)
+		strName += TEXT("-") + to_wstring((long long) RandomBelow(State, 10)) + TEXT(".") + to_wstring((long long) RandomBelow(State, 20)) + TEXT(".") + to_wstring((long long) RandomBelow(State, 100));
+	else if(r < 33)
+	{
+		strName += TEXT("_");
+		unsigned int nHexDigits = 8 + RandomBelow(State, 25);
+		for(unsigned int i = 0; i != nHexDigits; i++)
+			strName += TEXT("0123456789abcdef")[RandomBelow(State, 16)];
+	}
+
+	unsigned int nTotalWeight = 0;
+	for(unsigned int i = 0; i != sizeof(g_rgExtensionWeights) / sizeof(g_rgExtensionWeights[0]); i++)
+		nTotalWeight += g_rgExtensionWeights[i];
+	unsigned int w = RandomBelow(State, nTotalWeight);
+	unsigned int iExtension = 0;
+	while(w >= g_rgExtensionWeights[iExtension])
+		w -= g_rgExtensionWeights[iExtension++];
+	if(g_rgExtensions[iExtension] == NULL)
+	{
+		strName += TEXT(".");
+		for(unsigned int i = 0; i != 3; i++)
+			strName += (WCHAR) (TEXT('a') + RandomBelow(State, 26));
+	}
+	else if(g_rgExtensions[iExtension][0] != 0)
+		strName += wstring(TEXT(".")) + g_rgExtensions[iExtension];
+	return strName;
+}
+
+
+
+BOOL CVolumeGenerator::IsDirectory(unsigned int iEntry)
+{
+	return iEntry < m_Profile.nDirectories;
+}
+
+
+
+unsigned int CVolumeGenerator::GetEntryCount()
+{
+	return (unsigned int) rgParents.size();
+}
+
+
+
+wstring CVolumeGenerator::GetDirectoryPath(unsigned int iDirectory)
+{
+	wstring strPath = GetName(iDirectory);
+	for(unsigned int i = rgParents[iDirectory]; i != ROOT_PARENT; i = rgParents[i])
+		strPath = GetName(i) + TEXT("\\") + strPath;
+	return strPath;
+}
+
+
+
+unsigned int CVolumeGenerator::GetDirectoryDepth(unsigned int iDirectory)
+{
+	return rgDepths[iDirectory];
+}
+
+
+
+unsigned int CVolumeGenerator::GetMaxDepth()
+{
+	return m_MaxDepth;
+}
+
+
+
+DWORDLONG CVolumeGenerator::GetRecordBytes()
+{
+	return m_cbRecords;
+}
+
+
+
+//Adds the records of all entries in the order of their record numbers
+void CVolumeGenerator::Generate(CBufferRecordSource *pSource)
+{
+	vector<unsigned int> rgEntries(rgRecordNumbers.size());
+	for(unsigned int i = 0; i != rgRecordNumbers.size(); i++)
+		rgEntries[rgRecordNumbers[i] - FIRST_RECORD_NUMBER] = i;
+	vector<BYTE> rgRecord;
+	m_cbRecords = 0;
+	for(unsigned int i = 0; i != rgEntries.size(); i++)
+		AddRecord(pSource, rgEntries[i], rgRecord);
+}
+
+
+
+void CVolumeGenerator::AddRecord(CBufferRecordSource *pSource, unsigned int iEntry, vector<BYTE> &rgRecord)
+{
+	wstring strName = GetName(iEntry);
+	DWORD cbName = (DWORD) (strName.length() * sizeof(WCHAR));
+	DWORD RecordLength = (DWORD) ((FIELD_OFFSET(USN_RECORD, FileName) + cbName + 7) & ~7);
+	rgRecord.assign(RecordLength, 0);
+	USN_RECORD *pRecord = (USN_RECORD *) &rgRecord[0];
+	pRecord->RecordLength = RecordLength;
+	pRecord->MajorVersion = 2;
+	//The sequence numbers in the upper 16 bits are different for every entry, like on a volume that reused its records
+	pRecord->FileReferenceNumber = ((DWORDLONG) (iEntry % 7 + 1) << 48) | rgRecordNumbers[iEntry];
+	unsigned int iParent = rgParents[iEntry];
+	pRecord->ParentFileReferenceNumber = iParent == ROOT_PARENT ? GENERATED_ROOT_FRN : ((DWORDLONG) (iParent % 7 + 1) << 48) | rgRecordNumbers[iParent];
+	pRecord->FileAttributes = IsDirectory(iEntry) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+	pRecord->FileNameLength = (WORD) cbName;
+	pRecord->FileNameOffset = (WORD) FIELD_OFFSET(USN_RECORD, FileName);
+	memcpy(pRecord->FileName, strName.c_str(), cbName);
+	pSource->AddRecord(pRecord);
+	m_cbRecords += RecordLength;
+}
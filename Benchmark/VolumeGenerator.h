@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <Windows.h>
+#include "CRecordSource.h"
+using namespace std;
+
+//FileReferenceNumber of the root directory of NTFS volumes: MFT record 5, sequence number 5
+#define GENERATED_ROOT_FRN 0x0005000000000005ui64
+
+//Shape of a generated volume
+struct VolumeProfile
+{
+	unsigned int nFiles;
+	unsigned int nDirectories;
+	unsigned int MaxDepth; //Directories are not nested deeper than this
+	DWORDLONG Seed; //The same seed always generates the same volume
+	unsigned int InternationalPercent; //Share of names that start with a word in Cyrillic, Greek, CJK or accented Latin
+	VolumeProfile()
+	{
+		nFiles = 1000000;
+		nDirectories = 100000;
+		MaxDepth = 32;
+		Seed = 1;
+		InternationalPercent = 0;
+	}
+};
+
+// Generates the USN_RECORDs of a synthetic NTFS volume, so the index can be built and searched without a real volume.
+// Names are made of common words, version numbers and separators like on system and project drives, and their
+// extensions follow a weighted distribution with a long tail. Names of file servers in other languages can be mixed in. Most directories are created below recently created
+// ones, which gives deep trees, and a few directories get many files. The records are returned in the order of
+// their record numbers like FSCTL_ENUM_USN_DATA does, so children are often seen before their parents.
+// The generator uses its own random numbers, so a seed gives the same volume with every compiler.
+class CVolumeGenerator {
+public:
+	CVolumeGenerator(const VolumeProfile &Profile);
+	// Adds all records of the volume to pSource
+	void Generate(CBufferRecordSource *pSource);
+	// Name of an entry, also used to build queries that find something
+	wstring GetName(unsigned int iEntry);
+	BOOL IsDirectory(unsigned int iEntry);
+	unsigned int GetEntryCount();
+	// Full path of a directory below the root, e.g. "windows\system32"
+	wstring GetDirectoryPath(unsigned int iDirectory);
+	// Depth of a directory, 1 for the directories in the root
+	unsigned int GetDirectoryDepth(unsigned int iDirectory);
+	// Depth of the deepest directory that was generated
+	unsigned int GetMaxDepth();
+	// Number of bytes of the generated records
+	DWORDLONG GetRecordBytes();
+
+protected:
+	DWORDLONG Random(DWORDLONG &State);
+	unsigned int RandomBelow(DWORDLONG &State, unsigned int n);
+	void BuildTree();
+	void AddRecord(CBufferRecordSource *pSource, unsigned int iEntry, vector<BYTE> &rgRecord);
+
+	VolumeProfile m_Profile;
+	vector<unsigned int> rgParents; //Parent directory of each entry, directories come first. NO_PARENT for the root.
+	vector<unsigned int> rgDepths; //Depth of each directory
+	vector<unsigned int> rgRecordNumbers; //MFT record number of each entry
+	DWORDLONG m_cbRecords;
+	unsigned int m_MaxDepth;
+};
@@ -23,6 +23,19 @@ CDriveIndex* _stdcall CreateIndex(WCHAR cDrive)
 
 
 
+// Exported function to create the index of a drive, reading the MFT in chunks of cbEnumBuffer bytes.
+// Larger buffers make indexing faster on volumes with many files.
+CDriveIndex* _stdcall CreateIndexEx(WCHAR cDrive, DWORD cbEnumBuffer)
+{
+	CDriveIndex *di = new CDriveIndex();
+	di->Init(cDrive);
+	di->SetEnumBufferSize(cbEnumBuffer);
+	di->PopulateIndex();
+	return di;
+}
+
+
+
 // Exported function to delete the index of a drive
 void _stdcall DeleteIndex(CDriveIndex *di)
 {
@@ -69,6 +82,62 @@ void _stdcall FreeResultsBuffer(WCHAR *szResults)
 
 
 
+// Exported function that starts a search whose results are fetched with FetchResults().
+// Results are found page by page while they are fetched, so the first results are available without searching the whole index.
+// They are not sorted. The cursor needs to be closed with CloseSearch() before the index is deleted.
+SearchCursor* _stdcall OpenSearch(CDriveIndex *di, WCHAR *szQuery, WCHAR *szPath, BOOL bEnhancedSearch)
+{
+	if(dynamic_cast<CDriveIndex*>(di) && szQuery)
+		return di->OpenCursor(&wstring(szQuery), szPath != NULL ? &wstring(szPath) : NULL, bEnhancedSearch);
+	return NULL;
+}
+
+
+
+// Exported function that copies as many of the next results of a cursor into szBuffer as fit, including the terminating 0.
+// The paths are separated by newlines like in Search(). Returns the number of copied results, 0 if there are no more results,
+// FETCH_BUFFER_TOO_SMALL if not even the next result fits and FETCH_INDEX_CHANGED if the index changed after the cursor was opened.
+int _stdcall FetchResults(SearchCursor *pCursor, WCHAR *szBuffer, DWORD cchBuffer)
+{
+	if(!dynamic_cast<SearchCursor*>(pCursor) || !szBuffer || cchBuffer == 0)
+		return 0;
+	int nResults = 0;
+	DWORD cchUsed = 0;
+	szBuffer[0] = 0;
+	for(;;)
+	{
+		if(pCursor->iNextResult == pCursor->Results.size() && !pCursor->pIndex->NextResults(pCursor))
+			break;
+		SearchResultFile &srf = pCursor->Results[pCursor->iNextResult];
+		size_t cchResult = (nResults == 0 ? 0 : 1) + srf.Path.length() + srf.Filename.length();
+		if(cchUsed + cchResult + 1 > cchBuffer)
+			return nResults == 0 ? FETCH_BUFFER_TOO_SMALL : nResults;
+		if(nResults != 0)
+			szBuffer[cchUsed++] = L'\n';
+		memcpy(szBuffer + cchUsed, srf.Path.c_str(), srf.Path.length() * sizeof(WCHAR));
+		cchUsed += (DWORD) srf.Path.length();
+		memcpy(szBuffer + cchUsed, srf.Filename.c_str(), srf.Filename.length() * sizeof(WCHAR));
+		cchUsed += (DWORD) srf.Filename.length();
+		szBuffer[cchUsed] = 0;
+		pCursor->iNextResult++;
+		nResults++;
+	}
+	if(nResults == 0 && pCursor->bIndexChanged)
+		return FETCH_INDEX_CHANGED;
+	return nResults;
+}
+
+
+
+// Exported function that ends a search started with OpenSearch(). This can be called before all results were fetched.
+void _stdcall CloseSearch(SearchCursor *pCursor)
+{
+	if(dynamic_cast<SearchCursor*>(pCursor))
+		delete pCursor;
+}
+
+
+
 // Exported function that loads the database from disk
 CDriveIndex* _stdcall LoadIndexFromDisk(WCHAR *szPath)
 {
@@ -88,6 +157,83 @@ BOOL _stdcall SaveIndexToDisk(CDriveIndex *di, WCHAR *szPath)
 }
 
 
+// Exported function that applies the changes recorded in the USN journal since the index was created or last updated.
+// Returns the number of changed files and directories, or -1 if the journal was reset or wrapped around and the
+// index had to be rebuilt.
+int _stdcall UpdateIndex(CDriveIndex *di)
+{
+	if(dynamic_cast<CDriveIndex*>(di))
+		return di->UpdateIndex();
+	return 0;
+}
+
+
+
+// Exported function that sets the number of search threads and other options for searching
+void _stdcall SetSearchOptions(CDriveIndex *di, SearchOptions *Options)
+{
+	if(dynamic_cast<CDriveIndex*>(di) && Options)
+		di->SetOptions(Options);
+}
+
+
+
+// Exported function that enables or disables the trigram index for substring searches.
+// Enabling it builds the index immediately, use GetIndexMemoryInfo() to see how much memory it needs.
+void _stdcall SetTrigramIndex(CDriveIndex *di, BOOL bEnable)
+{
+	if(dynamic_cast<CDriveIndex*>(di))
+		di->SetTrigramIndex(bEnable);
+}
+
+
+
+// Exported function that returns the memory used by the index
+void _stdcall GetIndexMemoryInfo(CDriveIndex *di, IndexMemoryInfo *Info)
+{
+	if(dynamic_cast<CDriveIndex*>(di) && Info)
+		*Info = di->GetMemoryInfo();
+}
+
+
+
+// Exported function that returns how long the phases of building the index took
+void _stdcall GetBuildStats(CDriveIndex *di, BuildStats *Stats)
+{
+	if(dynamic_cast<CDriveIndex*>(di) && Stats)
+		*Stats = di->GetBuildStats();
+}
+
+
+
+// Exported function that returns the counters and timings of the last search
+void _stdcall GetSearchStats(CDriveIndex *di, SearchStats *Stats)
+{
+	if(dynamic_cast<CDriveIndex*>(di) && Stats)
+		*Stats = di->GetSearchStats();
+}
+
+
+
+// Exported function that returns the distribution of the times of the last searches.
+// SearchOptions::nSearchHistory sets how many searches are kept.
+void _stdcall GetSearchHistogram(CDriveIndex *di, SearchHistogram *Histogram)
+{
+	if(dynamic_cast<CDriveIndex*>(di) && Histogram)
+		*Histogram = di->GetSearchHistogram();
+}
+
+
+
+// Exported function that returns how much memory the names need in both storage modes and how well the decode cache works
+void _stdcall GetNameStats(CDriveIndex *di, NameStats *Stats)
+{
+	if(dynamic_cast<CDriveIndex*>(di) && Stats)
+		*Stats = di->GetNameStats();
+}
+
+
+
 // Exported function that returns the number of files and directories
 void _stdcall GetDriveInfo(CDriveIndex *di, DriveInfo *driveInfo)
 {
@@ -102,6 +248,22 @@ CDriveIndex::CDriveIndex()
 {
 	// Initialize member variables
 	m_hVol = INVALID_HANDLE_VALUE;
+	m_UsnJournalID = 0;
+	m_NextUsn = 0;
+	m_nUnusedNames = 0;
+	m_bTrigramIndex = false;
+	m_bCompactNames = false;
+	m_bAdaptiveFilters = false;
+	m_hIndexFile = INVALID_HANDLE_VALUE;
+	m_hIndexMapping = NULL;
+	m_pIndexView = NULL;
+	m_cbEnumBuffer = ENUM_BUFFER_SIZE;
+	m_nGeneration = 0;
+	m_iNextSearchStats = 0;
+	m_nSearches = 0;
+	m_pCancel = NULL;
+	SearchOptions Options;
+	SetOptions(&Options);
 }
 
 
@@ -110,6 +272,7 @@ CDriveIndex::CDriveIndex()
 CDriveIndex::~CDriveIndex()
 {
 	CleanUp();
+	CloseIndexFile();
 }
 
 
@@ -191,15 +354,27 @@ void CDriveIndex::ClearLastResult()
 	LastResult = SearchResult();
 }
 
+
+
+// Checks the cancel flag of the running Find() call
+BOOL CDriveIndex::IsSearchCancelled()
+{
+	return m_pCancel != NULL && *m_pCancel != 0;
+}
+
+
+
 // Adds a file to the database
 BOOL CDriveIndex::Add(DWORDLONG Index, wstring *szName, DWORDLONG ParentIndex, DWORDLONG Filter)
 {
 	IndexedFile i;
-	i.Index = Index;
+	i.RecordNumber = RECORD_NUMBER(Index);
 	if(!Filter)
 		Filter = MakeFilter(szName);
-	i.Filter = Filter;
+	i.NameOffset = AddName(szName);
+	i.NameLength = (unsigned int) szName->length();
 	rgFiles.insert(rgFiles.end(), i);
+	rgFileFilters.insert(rgFileFilters.end(), Filter);
 	return(TRUE);
 }
 
@@ -209,132 +384,288 @@ BOOL CDriveIndex::Add(DWORDLONG Index, wstring *szName, DWORDLONG ParentIndex, D
 BOOL CDriveIndex::AddDir(DWORDLONG Index, wstring *szName, DWORDLONG ParentIndex, DWORDLONG Filter)
 {
 	IndexedDirectory i;
-	i.Index = Index;
+	i.RecordNumber = RECORD_NUMBER(Index);
 	if(!Filter)
 		Filter = MakeFilter(szName);
-	i.Filter = Filter;
+	i.NameOffset = AddName(szName);
+	i.NameLength = (unsigned int) szName->length();
 	i.nFiles = 0;
 	rgDirectories.insert(rgDirectories.end(), i);
+	rgDirectoryFilters.insert(rgDirectoryFilters.end(), Filter);
 	return(TRUE);
 }
 
 
 
+// Appends a name to the name buffer and returns its position. In the compact name mode the id of the name in the dictionary is returned.
+unsigned int CDriveIndex::AddName(wstring *szName)
+{
+	if(m_bCompactNames)
+		return NameDictionary.Add(szName->c_str(), (unsigned int) szName->length());
+	unsigned int iOffset = (unsigned int) rgNames.size();
+	rgNames.insert(rgNames.end(), szName->begin(), szName->end());
+	return iOffset;
+}
+
+
+
+// Returns the name of a file or directory
+wstring CDriveIndex::GetName(IndexedFile *i)
+{
+	if(i->NameLength == 0)
+		return wstring();
+	return wstring(GetNameCharsCached(i), i->NameLength);
+}
+
+
+
+// Returns the characters of the name of an entry, they are not terminated. In the compact name mode the name is decoded
+// into strBuffer, otherwise it is returned in place. This can be called by the search threads.
+const WCHAR *CDriveIndex::GetNameChars(IndexedFile *i, wstring &strBuffer)
+{
+	if(i->NameLength == 0)
+		return TEXT("");
+	return m_bCompactNames ? NameDictionary.Decode(i->NameOffset, strBuffer) : &rgNames[i->NameOffset];
+}
+
+
+
+// Copies the name of an entry to szName, which needs room for NameLength characters. Unlike GetNameChars() this never
+// allocates memory, also in the compact name mode. This can be called by the search threads.
+void CDriveIndex::CopyName(IndexedFile *i, WCHAR *szName)
+{
+	if(i->NameLength == 0)
+		return;
+	if(m_bCompactNames)
+		NameDictionary.DecodeTo(i->NameOffset, szName, i->NameLength);
+	else
+		memcpy(szName, &rgNames[i->NameOffset], i->NameLength * sizeof(WCHAR));
+}
+
+
+
+// Same as GetNameChars(), but names are decoded with the cache of the dictionary. The result is valid until the next call.
+// Only for the thread that changes the index, e.g. for building paths.
+const WCHAR *CDriveIndex::GetNameCharsCached(IndexedFile *i)
+{
+	if(i->NameLength == 0)
+		return TEXT("");
+	return m_bCompactNames ? NameDictionary.DecodeCached(i->NameOffset) : &rgNames[i->NameOffset];
+}
+
+
+
 // Calculates a 64bit value that is used to filter out many files before comparing their filenames
-// This method gives a huge speed boost.
+// This method gives a huge speed boost. The bits are described in FilterLayout.h, which of them the characters
+// set depends on FilterLayout.
 DWORDLONG CDriveIndex::MakeFilter(wstring *szName)
 {
-	/*
-	Creates an address that is used to filter out strings that don't contain the queried characters
-	Explanation of the meaning of the single bits:
-	0-25 a-z
-	26-35 0-9
-	36 .
-	37 space
-	38 !#$&'()+,-~_
-	39 2 same characters
-	40 3 same characters
-	The fields below indicate the presence of 2-character sequences. Based off http://en.wikipedia.org/wiki/Letter_frequency
-	41 TH
-	42 HE
-	43 AN
-	44 RE
-	45 ER
-	46 IN
-	47 ON
-	48 AT
-	49 ND
-	50 ST
-	51 ES
-	52 EN
-	53 OF
-	54 TE
-	55 ED
-	56 OR
-	57 TI
-	58 HI
-	59 AS
-	60 TO
-	61-63 length (max. 8 characters. Queries are usually shorter than this)
-	*/
-	if(!(szName->length() > 0))
-		return 0;
-	DWORDLONG Address = 0;
-	WCHAR c;
 	wstring szlower(*szName);
-	transform(szlower.begin(), szlower.end(), szlower.begin(), tolower);
-	int counts[26] = {0}; //This array is used to check if characters occur two or three times in the string
-	wstring::size_type l = szlower.length();
-	for(unsigned int i = 0; i != l; i++)
+	FoldString(szlower);
+	return FilterLayout.MakeFilter(szlower.c_str(), szlower.length());
+}
+
+
+
+// Chooses FilterLayout for the names of the index, or the default layout if adaptive filters are disabled.
+// Up to FILTER_LAYOUT_SAMPLE names are sampled evenly from the files and directories. The filters need to be made again.
+void CDriveIndex::ChooseFilterLayout()
+{
+	DWORDLONG nEntries = rgFiles.size() + rgDirectories.size();
+	if(!m_bAdaptiveFilters || nEntries == 0)
+	{
+		FilterLayout.SetDefault();
+		return;
+	}
+	unsigned int nSample = (unsigned int) min(nEntries, (DWORDLONG) FILTER_LAYOUT_SAMPLE);
+	vector<wstring> rgSample(nSample);
+	wstring strName;
+	for(unsigned int j = 0; j != nSample; j++)
+	{
+		unsigned int iEntry = (unsigned int) (j * nEntries / nSample);
+		IndexedFile *i = iEntry < rgFiles.size() ? &rgFiles[iEntry] : (IndexedFile*) &rgDirectories[iEntry - (unsigned int) rgFiles.size()];
+		rgSample[j].assign(GetNameChars(i, strName), i->NameLength);
+		FoldString(rgSample[j]);
+	}
+	FilterLayout.Choose(rgSample);
+}
+
+
+
+// Makes the filters of all entries with the current FilterLayout. The entries are split into chunks like for a search.
+void CDriveIndex::MakeFilters()
+{
+	FilterJob Job;
+	Job.pIndex = this;
+	Job.nFileChunks = ((unsigned int) rgFiles.size() + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE;
+	Job.nChunks = Job.nFileChunks + ((unsigned int) rgDirectories.size() + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE;
+	Job.iNextChunk = 0;
+	Job.hDone = NULL;
+	//The calling thread works on the chunks too, so it counts as running until it called FilterWorker() below
+	Job.nRunning = 1;
+	unsigned int nThreads = min(GetSearchThreads(), Job.nChunks);
+	if(nThreads > 1)
+		Job.hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	for(unsigned int t = 1; t < nThreads && Job.hDone != NULL; t++)
 	{
-		c = szlower[i];
-		if(c > 96 && c < 123) //a-z
+		InterlockedIncrement(&Job.nRunning);
+		if(!QueueUserWorkItem(FilterWorker, &Job, WT_EXECUTEDEFAULT))
 		{
-			Address |= 1ui64 << (DWORDLONG)((DWORDLONG)c - 97ui64);
-			counts[c-97]++;
-			if(i < l - 1)
-			{
-				if(c == L't' && szlower[i+1] == L'h') //th
-					Address |= 1ui64 << 41;
-				else if(c == L'h' && szlower[i+1] == L'e') //he
-					Address |= 1ui64 << 41;
-				else if(c == L'a' && szlower[i+1] == L'n') //an
-					Address |= 1ui64 << 41;
-				else if(c == L'r' && szlower[i+1] == L'e') //re
-					Address |= 1ui64 << 41;
-				else if(c == L'e' && szlower[i+1] == L'r') //er
-					Address |= 1ui64 << 41;
-				else if(c == L'i' && szlower[i+1] == L'n') //in
-					Address |= 1ui64 << 41;
-				else if(c == L'o' && szlower[i+1] == L'n') //on
-					Address |= 1ui64 << 41;
-				else if(c == L'a' && szlower[i+1] == L't') //at
-					Address |= 1ui64 << 41;
-				else if(c == L'n' && szlower[i+1] == L'd') //nd
-					Address |= 1ui64 << 41;
-				else if(c == L's' && szlower[i+1] == L't') //st
-					Address |= 1ui64 << 41;
-				else if(c == L'e' && szlower[i+1] == L's') //es
-					Address |= 1ui64 << 41;
-				else if(c == L'e' && szlower[i+1] == L'n') //en
-					Address |= 1ui64 << 41;
-				else if(c == L'o' && szlower[i+1] == L'f') //of
-					Address |= 1ui64 << 41;
-				else if(c == L't' && szlower[i+1] == L'e') //te
-					Address |= 1ui64 << 41;
-				else if(c == L'e' && szlower[i+1] == L'd') //ed
-					Address |= 1ui64 << 41;
-				else if(c == L'o' && szlower[i+1] == L'r') //or
-					Address |= 1ui64 << 41;
-				else if(c == L't' && szlower[i+1] == L'i') //ti
-					Address |= 1ui64 << 41;
-				else if(c == L'h' && szlower[i+1] == L'i') //hi
-					Address |= 1ui64 << 41;
-				else if(c == L'a' && szlower[i+1] == L's') //as
-					Address |= 1ui64 << 41;
-				else if(c == L't' && szlower[i+1] == L'o') //to
-					Address |= 1ui64 << 41;
-			}
+			InterlockedDecrement(&Job.nRunning);
+			break;
+		}
+	}
+	FilterWorker(&Job);
+	if(Job.hDone != NULL)
+	{
+		WaitForSingleObject(Job.hDone, INFINITE);
+		CloseHandle(Job.hDone);
+	}
+}
+
+
+
+// Thread function of MakeFilters(). Claims chunks of files or directories until all filters are made.
+DWORD WINAPI CDriveIndex::FilterWorker(LPVOID lpParameter)
+{
+	FilterJob *Job = (FilterJob*) lpParameter;
+	CDriveIndex *pIndex = Job->pIndex;
+	wstring strName;
+	wstring strLower;
+	for(;;)
+	{
+		unsigned int iChunk = (unsigned int) InterlockedIncrement(&Job->iNextChunk) - 1;
+		if(iChunk >= Job->nChunks)
+			break;
+		BOOL bFiles = iChunk < Job->nFileChunks;
+		unsigned int nEntries = (unsigned int) (bFiles ? pIndex->rgFiles.size() : pIndex->rgDirectories.size());
+		unsigned int iBegin = (bFiles ? iChunk : iChunk - Job->nFileChunks) * SCAN_CHUNK_SIZE;
+		unsigned int iEnd = min(iBegin + SCAN_CHUNK_SIZE, nEntries);
+		CIndexArray<DWORDLONG> &rgFilters = bFiles ? pIndex->rgFileFilters : pIndex->rgDirectoryFilters;
+		for(unsigned int j = iBegin; j != iEnd; j++)
+		{
+			IndexedFile *i = bFiles ? &pIndex->rgFiles[j] : (IndexedFile*) &pIndex->rgDirectories[j];
+			strLower.assign(pIndex->GetNameChars(i, strName), i->NameLength);
+			FoldString(strLower);
+			rgFilters[j] = pIndex->FilterLayout.MakeFilter(strLower.c_str(), strLower.length());
+		}
+	}
+	if(InterlockedDecrement(&Job->nRunning) == 0 && Job->hDone != NULL)
+		SetEvent(Job->hDone);
+	return 0;
+}
+
+
+
+// Switches between the default filter layout and one chosen for the names of the index. The filters of all entries
+// are made again, results and cursors of earlier searches can't be used with the new filters.
+void CDriveIndex::SetAdaptiveFilters(BOOL bAdaptive)
+{
+	if(bAdaptive == m_bAdaptiveFilters)
+		return;
+	m_bAdaptiveFilters = bAdaptive;
+	if(rgFiles.size() == 0 && rgDirectories.size() == 0)
+		return;
+	ChooseFilterLayout();
+	MakeFilters();
+	ClearLastResult();
+	m_nGeneration++;
+}
+
+
+
+// Combines the filters of the literals that every match of a pattern contains, so the filters can be scanned like for
+// other queries. The bits for repeated characters are left out, they describe exact numbers of repetitions.
+void CDriveIndex::MakePatternFilter(CPatternMatcher *pPattern, DWORDLONG &QueryFilter, DWORDLONG &QueryLength)
+{
+	QueryFilter = 0;
+	const vector<wstring> &rgLiterals = pPattern->GetRequiredLiterals();
+	for(unsigned int j = 0; j != rgLiterals.size(); j++)
+		QueryFilter |= MakeFilter(&wstring(rgLiterals[j]));
+	QueryFilter &= 0x1FFFFFFFFFFFFFFFui64 & ~(3ui64 << 39);
+	QueryLength = min(pPattern->GetMinLength(), 7u);
+}
+
+
+
+// Checks if strPath is the directory strParentLower or inside of it. Both paths may end with a backslash.
+// strPath is folded while it is compared, strParentLower needs to be folded already.
+static BOOL IsSubPath(const wstring &strPath, const wstring &strParentLower)
+{
+	size_t n = strParentLower.length();
+	while(n != 0 && strParentLower[n - 1] == L'\\')
+		n--;
+	if(strPath.length() < n || FindFolded(strPath.c_str(), (unsigned int) n, strParentLower.c_str(), (unsigned int) n) != 0)
+		return false;
+	return strPath.length() == n || strPath[n] == L'\\';
+}
+
+
+
+// Removes the ext: operator from a query and returns the extensions it lists (e.g. "report ext:doc,.pdf") in rgExtensions,
+// folded and without the dot. A query that consists of a dot and an extension only (e.g. ".log") is a query for that extension, too.
+// Patterns are not changed, but a glob like "*.log" matches the same names as the extension, so its candidates are in the same list.
+static void ParseExtensionQuery(wstring &strQuery, BOOL bSearchMode, vector<wstring> &rgExtensions)
+{
+	if(bSearchMode == SEARCH_GLOB || bSearchMode == SEARCH_REGEX)
+	{
+		if(bSearchMode == SEARCH_GLOB && strQuery.length() > 2 && strQuery[0] == L'*' && strQuery[1] == L'.' && strQuery.find_first_of(TEXT("*?."), 2) == wstring::npos)
+		{
+			rgExtensions.insert(rgExtensions.end(), strQuery.substr(2));
+			FoldString(rgExtensions[0]);
+		}
+		return;
+	}
+	size_t iToken = 0;
+	while(iToken < strQuery.length())
+	{
+		size_t iEnd = strQuery.find(L' ', iToken);
+		if(iEnd == wstring::npos)
+			iEnd = strQuery.length();
+		if(iEnd - iToken <= 4 || _wcsnicmp(&strQuery[iToken], TEXT("ext:"), 4) != 0)
+		{
+			iToken = iEnd + 1;
+			continue;
+		}
+		for(size_t iExtension = iToken + 4; iExtension < iEnd;)
+		{
+			size_t iNext = strQuery.find_first_of(TEXT(",;"), iExtension);
+			if(iNext == wstring::npos || iNext > iEnd)
+				iNext = iEnd;
+			while(iExtension < iNext && strQuery[iExtension] == L'.')
+				iExtension++;
+			if(iExtension < iNext)
+				rgExtensions.insert(rgExtensions.end(), strQuery.substr(iExtension, iNext - iExtension));
+			iExtension = iNext + 1;
 		}
-		else if(c >= L'0' && c <= '9') //0-9
-			Address |= 1ui64 << (c - L'0' + 26ui64);
-		else if(c == L'.') //.
-			Address |= 1ui64 << 36;
-		else if(c == L' ') // space
-			Address |= 1ui64 << 37;
-		else if(c == L'!' || c == L'#' || c == L'$' || c == L'&' || c == L'\'' || c == L'(' || c == L')' || c == L'+' || c == L',' || c == L'-' || c == L'~' || c == L'_')
-			Address |= 1ui64 << 38; // !#$&'()+,-~_
+		//Remove the operator together with the space that separates it from the rest of the query
+		if(iToken > 0)
+			strQuery.erase(iToken - 1, iEnd - iToken + 1);
+		else
+			strQuery.erase(0, min(iEnd + 1, strQuery.length()));
 	}
-	for(unsigned int i = 0; i != 26; i++)
+	if(rgExtensions.size() == 0 && strQuery.length() > 1 && strQuery[0] == L'.' && strQuery.find_first_of(TEXT(". "), 1) == wstring::npos)
 	{
-		if(counts[i] == 2)
-			Address |= 1ui64 << 39;
-		else if(counts[i] > 2)
-			Address |= 1ui64 << 40;
+		rgExtensions.insert(rgExtensions.end(), strQuery.substr(1));
+		strQuery.clear();
 	}
-	DWORDLONG length = (szlower.length() > 7 ? 7ui64 : (DWORDLONG)szlower.length()) & 0x00000007ui64; //3 bits for length -> 8 max
-	Address |= length << 61ui64;
-	return Address;
+	for(unsigned int j = 0; j != rgExtensions.size(); j++)
+		FoldString(rgExtensions[j]);
+	sort(rgExtensions.begin(), rgExtensions.end());
+	rgExtensions.erase(unique(rgExtensions.begin(), rgExtensions.end()), rgExtensions.end());
+}
+
+
+
+// Returns the microseconds since Start and sets Start to the current time. Used for the timings in m_BuildStats and m_SearchStats.
+static DWORDLONG StopTimer(LARGE_INTEGER &Start)
+{
+	LARGE_INTEGER Now, Frequency;
+	QueryPerformanceCounter(&Now);
+	QueryPerformanceFrequency(&Frequency);
+	DWORDLONG Elapsed = (DWORDLONG) (Now.QuadPart - Start.QuadPart) * 1000000ui64 / (DWORDLONG) Frequency.QuadPart;
+	Start = Now;
+	return Elapsed;
 }
 
 
@@ -342,8 +673,12 @@ DWORDLONG CDriveIndex::MakeFilter(wstring *szName)
 // Internal function for searching in the database.
 // For projects in C++ which use this project it might be preferable to use this function
 // to skip the wrapper.
-// Returns: number of results, -1 if maxResults != -1 and not all results were found
-int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchResultFile> *rgsrfResults, BOOL bSort, BOOL bEnhancedSearch, int maxResults)
+// bEnhancedSearch is one of the SEARCH_ modes. Glob and regex queries that can't be compiled find nothing.
+// pCancel can be set to a value other than 0 by another thread to stop the search, see CSearchSession. The scan stops
+// at the next chunk then, and the results of the last search stay available for the next query.
+// bTopResults returns the best maxResults matches like SearchOptions::bTopResults does, even if the option isn't set.
+// Returns: number of results, -1 if maxResults != -1 and not all results were found, FIND_CANCELLED if the search was cancelled
+int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchResultFile> *rgsrfResults, BOOL bSort, BOOL bEnhancedSearch, int maxResults, volatile LONG *pCancel, BOOL bTopResults)
 {
 	//These variables are used to control the flow of execution in this function.
 
@@ -357,13 +692,29 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 	//Number of results in this search. -1 if more than maximum number of results.
 	int nResults = 0;
 
+	//Counters and timings of this search, see GetSearchStats()
+	m_SearchStats = SearchStats();
+	LARGE_INTEGER SearchStart, Timer;
+	QueryPerformanceCounter(&SearchStart);
+	Timer = SearchStart;
+	m_pCancel = pCancel;
+
+	//Extensions are looked up in the extension index, the rest of the query is matched with the names
+	wstring strNameQuery(*strQuery);
+	vector<wstring> rgExtensions;
+	ParseExtensionQuery(strNameQuery, bEnhancedSearch, rgExtensions);
+	vector<wstring> *pExtensions = rgExtensions.size() != 0 ? &rgExtensions : NULL;
+	wstring strExtensions;
+	for(unsigned int j = 0; j != rgExtensions.size(); j++)
+		strExtensions += (j == 0 ? TEXT("") : TEXT(",")) + rgExtensions[j];
+
 	//No query, just ignore this call
-	if(strQuery->length() == 0)
+	if(strNameQuery.length() == 0 && pExtensions == NULL)
 	{
 		// Store this query
 		LastResult.Query = wstring(TEXT(""));
 		LastResult.Results = vector<SearchResultFile>();
-		return nResults;
+		return EndSearch(SearchStart, nResults, 0);
 	}
 
 	if(strQueryPath != NULL)
@@ -374,23 +725,32 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 		for(unsigned int j = 0; j != _MAX_DRIVE; j++)
 			szDrive[j] = toupper(szDrive[j]);
 		if(wstring(szDrive).compare(wstring(1,toupper(m_cDrive))) == 0)
-			return 0;
+			return EndSearch(SearchStart, 0, 0);
 	}
 
 	//Create lower query string for case-insensitive search
-	wstring strQueryLower(*strQuery);
-	for(unsigned int j = 0; j != strQueryLower.length(); j++)
-		strQueryLower[j] = tolower(strQueryLower[j]);
+	wstring strQueryLower(strNameQuery);
+	FoldString(strQueryLower);
 	const WCHAR *szQueryLower = strQueryLower.c_str();
 	
 	//Create lower query path string for case-insensitive search
 	wstring strQueryPathLower(strQueryPath != NULL ? *strQueryPath : TEXT(""));
-	for(unsigned int j = 0; j != strQueryPathLower.length(); j++)
-		strQueryPathLower[j] = tolower((*strQueryPath)[j]);
+	FoldString(strQueryPathLower);
 	wstring* pstrQueryPathLower = strQueryPath != NULL && strQueryPathLower.length() > 0 ? &strQueryPathLower : NULL;
+	//A path of a directory in the index limits the search to its subtree, other paths only need to be contained in the path of a result
+	BOOL bPathInIndex = pstrQueryPathLower != NULL && FindDirectoryByPath(strQueryPathLower) != NO_PARENT;
 
 	//If the query path is different from the last query so that the results are not valid anymore, the last query needs to be dropped
-	if(!(strQueryPath != NULL && (LastResult.maxResults == -1 || LastResult.iOffset == 0) && (LastResult.SearchPath.length() == 0 || strQueryPathLower.find(LastResult.SearchPath) == 0)))
+	if(!(strQueryPath != NULL && (LastResult.maxResults == -1 || LastResult.iOffset == 0) && (LastResult.SearchPath.length() == 0 || IsSubPath(strQueryPathLower, LastResult.SearchPath))))
+		LastResult = SearchResult();
+
+	//Other search modes find other results. The number of typos in approximate searches depends on the length of the query,
+	//so the results of a shorter query don't contain the results of a longer one. The same is true for patterns.
+	if(LastResult.bEnhancedSearch != bEnhancedSearch || bEnhancedSearch == SEARCH_APPROXIMATE || bEnhancedSearch == SEARCH_GLOB || bEnhancedSearch == SEARCH_REGEX)
+		LastResult = SearchResult();
+
+	//Results of other extensions can't be reused either
+	if(LastResult.Extensions.compare(strExtensions) != 0)
 		LastResult = SearchResult();
 
 	//Calculate Filter value and length of the current query which are compared with the cached ones to skip many of them
@@ -398,6 +758,42 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 	DWORDLONG QueryLength = (QueryFilter & 0xE000000000000000ui64) >> 61ui64; //Bits 61-63 for storing lengths up to 8
 	QueryFilter = QueryFilter & 0x1FFFFFFFFFFFFFFFui64; //All but the last 3 bits
 
+	//Patterns are compiled once for all search threads. Their filter is made of the literals that every match contains.
+	CPatternMatcher Pattern;
+	CPatternMatcher *pPattern = NULL;
+	if(bEnhancedSearch == SEARCH_GLOB || bEnhancedSearch == SEARCH_REGEX)
+	{
+		if(!Pattern.Compile(strNameQuery, bEnhancedSearch == SEARCH_REGEX))
+			return EndSearch(SearchStart, 0, 0);
+		MakePatternFilter(&Pattern, QueryFilter, QueryLength);
+		pPattern = &Pattern;
+	}
+	m_SearchStats.Prepare += StopTimer(Timer);
+
+	//The best results depend on the whole index, so they are never combined with the results of the last query
+	if((m_bTopResults || bTopResults) && maxResults > 0)
+	{
+		LastResult = SearchResult();
+		int nFileResults = 0, nDirectoryResults = 0;
+		FindInJournal(strNameQuery, szQueryLower, QueryFilter, QueryLength, pstrQueryPathLower, rgFiles, rgFileFilters, !bEnhancedSearch ? &FileTrigrams : NULL, &FileExtensions, pExtensions, pPattern, *rgsrfResults, iOffset, bEnhancedSearch, maxResults, nFileResults, true);
+		FindInJournal(strNameQuery, szQueryLower, QueryFilter, QueryLength, pstrQueryPathLower, rgDirectories, rgDirectoryFilters, !bEnhancedSearch ? &DirectoryTrigrams : NULL, &DirectoryExtensions, pExtensions, pPattern, *rgsrfResults, iOffset, bEnhancedSearch, maxResults, nDirectoryResults, true);
+		if(IsSearchCancelled())
+		{
+			rgsrfResults->clear();
+			return EndSearch(SearchStart, FIND_CANCELLED, 0);
+		}
+		QueryPerformanceCounter(&Timer);
+		//Both lists are ordered by quality, files come first if the quality is equal
+		stable_sort(rgsrfResults->begin(), rgsrfResults->end(), SearchResultFile::HasBetterQuality);
+		nResults = nFileResults == -1 || nDirectoryResults == -1 || rgsrfResults->size() > (unsigned int) maxResults ? -1 : (int) rgsrfResults->size();
+		if(rgsrfResults->size() > (unsigned int) maxResults)
+			rgsrfResults->resize(maxResults);
+		if(bSort)
+			sort(rgsrfResults->begin(), rgsrfResults->end());
+		m_SearchStats.Sort += StopTimer(Timer);
+		return EndSearch(SearchStart, nResults, rgsrfResults->size());
+	}
+
 	//If the same query string as in the last query was used
 	if(strQueryLower.compare(LastResult.Query) == 0 && LastResult.Results.size() > 0 && (LastResult.SearchEndedWhere == NO_WHERE && iOffset != 1)) // need proper condition here to skip
 	{
@@ -405,16 +801,15 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 		SearchWhere = LastResult.SearchEndedWhere;
 		iOffset = LastResult.iOffset;
 		bSkipSearch = true;
+		m_SearchStats.Sources |= SEARCH_SOURCE_LAST_RESULT;
+		QueryPerformanceCounter(&Timer);
 		for(int i = 0; i != LastResult.Results.size(); i++)
 		{
 			BOOL bFound = true;
-			if(pstrQueryPathLower != NULL)
-			{
-				wstring strPathLower(LastResult.Results[i].Path);
-				for(unsigned int j = 0; j != strPathLower.length(); j++)
-					strPathLower[j] = tolower(LastResult.Results[i].Path[j]);
-				bFound = strPathLower.find(strQueryPathLower) != -1;
-			}
+			if(bPathInIndex)
+				bFound = IsSubPath(LastResult.Results[i].Path, strQueryPathLower);
+			else if(pstrQueryPathLower != NULL)
+				bFound = FindFolded(LastResult.Results[i].Path.c_str(), (unsigned int) LastResult.Results[i].Path.length(), strQueryPathLower.c_str(), (unsigned int) strQueryPathLower.length()) != -1;
 			if(bFound)
 			{
 				nResults++;
@@ -432,6 +827,7 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 				rgsrfResults->insert(rgsrfResults->end(), LastResult.Results[i]);
 			}
 		}
+		m_SearchStats.PreviousResults += StopTimer(Timer);
 		//if the last search was limited and didn't finish because it found enough files and we don't have the maximum number of results yet
 		//we need to continue the search where the last one stopped.
 		if(LastResult.maxResults != -1 && LastResult.SearchEndedWhere != NO_WHERE && (maxResults == -1 || nResults < maxResults))
@@ -444,37 +840,23 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 		//Keep the position of the last result
 		SearchWhere = LastResult.SearchEndedWhere;
 		iOffset = LastResult.iOffset;
-		FindInPreviousResults(*strQuery, szQueryLower, QueryFilter, QueryLength, pstrQueryPathLower, *rgsrfResults, 0, bEnhancedSearch, maxResults, nResults);
+		m_SearchStats.Sources |= SEARCH_SOURCE_PREVIOUS_RESULTS;
+		QueryPerformanceCounter(&Timer);
+		FindInPreviousResults(strNameQuery, szQueryLower, QueryFilter, QueryLength, pstrQueryPathLower, bPathInIndex, *rgsrfResults, 0, bEnhancedSearch, maxResults, nResults);
+		m_SearchStats.PreviousResults += StopTimer(Timer);
 
 		//if the last search was limited and didn't finish because it found enough files and we don't have the maximum number of results yet
 		//we need to continue the search where the last one stopped.
 		if(LastResult.maxResults != -1 && LastResult.SearchEndedWhere != NO_WHERE && (maxResults == -1 || nResults < maxResults))
 			bSkipSearch = false;
 	}
-	DWORDLONG FRNPath;
-	long long nFilesInDir = -1;
-	if(strQueryPath != NULL && strQueryPath->length())
-	{
-		FRNPath = PathToFRN(strQueryPath);
-		wstring strPath2;
-		GetDir(FRNPath, &strPath2);
-		int iOffset = (int) FindDirOffsetByIndex(FRNPath);
-		if(iOffset != -1)
-			nFilesInDir = rgDirectories[iOffset].nFiles;
-	}
-	if(SearchWhere == IN_FILES && iOffset == 0 && nFilesInDir != -1 && nFilesInDir < 10000 && !bSkipSearch)
-	{
-		FindRecursively(*strQuery, szQueryLower, QueryFilter, QueryLength, strQueryPath, *rgsrfResults, bEnhancedSearch, maxResults, nResults);
-		SearchWhere = NO_WHERE;
-	}
-	else if(SearchWhere == IN_FILES && !bSkipSearch)
+	if(SearchWhere == IN_FILES && !bSkipSearch)
 	{
 		//Find in file index
-		FindInJournal(*strQuery, szQueryLower, QueryFilter, QueryLength, (strQueryPath != NULL ? &strQueryPathLower : NULL), rgFiles, *rgsrfResults, iOffset, bEnhancedSearch, maxResults, nResults);
-		//If we found the maximum number of results in the file index we stop here
-		if(maxResults != -1 && nResults == -1)
-			iOffset++; //Start with next entry on the next incremental search
-		else //Search isn't limited or not all results found yet, continue in directory index
+		FindInJournal(strNameQuery, szQueryLower, QueryFilter, QueryLength, pstrQueryPathLower, rgFiles, rgFileFilters, !bEnhancedSearch ? &FileTrigrams : NULL, &FileExtensions, pExtensions, pPattern, *rgsrfResults, iOffset, bEnhancedSearch, maxResults, nResults);
+		//If we found the maximum number of results in the file index we stop here.
+		//iOffset is the entry where the next incremental search continues.
+		if(!(maxResults != -1 && nResults == -1)) //Search isn't limited or not all results found yet, continue in directory index
 		{
 			SearchWhere = IN_DIRECTORIES;
 			iOffset = 0;
@@ -484,20 +866,27 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 	if(SearchWhere == IN_DIRECTORIES && !bSkipSearch)
 	{
 		//Find in directory index
-		FindInJournal(*strQuery, szQueryLower, QueryFilter, QueryLength, pstrQueryPathLower, rgDirectories, *rgsrfResults, iOffset, bEnhancedSearch, maxResults, nResults);
+		FindInJournal(strNameQuery, szQueryLower, QueryFilter, QueryLength, pstrQueryPathLower, rgDirectories, rgDirectoryFilters, !bEnhancedSearch ? &DirectoryTrigrams : NULL, &DirectoryExtensions, pExtensions, pPattern, *rgsrfResults, iOffset, bEnhancedSearch, maxResults, nResults);
 		//If we found the maximum number of results in the directory index we stop here
-		if(maxResults != -1 && nResults == -1)
-			iOffset++; //Start with next entry on the next incremental search
-		else //Search isn't limited or less than the maximum number of results found
+		if(!(maxResults != -1 && nResults == -1)) //Search isn't limited or less than the maximum number of results found
 		{
 			SearchWhere = NO_WHERE;
 			iOffset = 0;
 		}
 	}
 
+	//A cancelled search returns nothing. LastResult isn't changed, so the next query can still use the results of the last one.
+	if(IsSearchCancelled())
+	{
+		rgsrfResults->clear();
+		return EndSearch(SearchStart, FIND_CANCELLED, 0);
+	}
+
 	//Sort by match quality and name
+	QueryPerformanceCounter(&Timer);
 	if(bSort)
 		sort(rgsrfResults->begin(), rgsrfResults->end());
+	m_SearchStats.Sort += StopTimer(Timer);
 	
 	// Store this query
 	LastResult.Query = wstring(strQueryLower);
@@ -514,6 +903,10 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 	//Store if this search was limited
 	LastResult.maxResults = maxResults;
 
+	LastResult.bEnhancedSearch = bEnhancedSearch;
+
+	LastResult.Extensions = strExtensions;
+
 	//Store where the current search ended due to file limit (or if it didn't);
 	LastResult.SearchEndedWhere = SearchWhere;
 
@@ -521,149 +914,453 @@ int CDriveIndex::Find(wstring *strQuery, wstring *strQueryPath, vector<SearchRes
 	for(unsigned int i = 0; i != rgsrfResults->size(); i++)
 		LastResult.Results.insert(LastResult.Results.end(), (*rgsrfResults)[i]);
 
-	return nResults;
+	return EndSearch(SearchStart, nResults, rgsrfResults->size());
 }
 
-void CDriveIndex::FindRecursively(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring* strQueryPath, vector<SearchResultFile> &rgsrfResults, BOOL bEnhancedSearch, int maxResults, int &nResults)
-{
-	WIN32_FIND_DATA ffd;
-	size_t length_of_arg;
-	HANDLE hFind = INVALID_HANDLE_VALUE;
 
-	// Check that the input path plus 3 is not longer than MAX_PATH.
-	// Three characters are for the "\*" plus NULL appended below.
-	length_of_arg = strQueryPath->length();
-	if (length_of_arg > (MAX_PATH - 3))
-		return;
 
-	// Prepare string for use with FindFile functions.  First, copy the
-	// string to a buffer, then append '\*' to the directory name.
-	wstring strPath = wstring(*strQueryPath);
-	if((*strQueryPath)[strQueryPath->length() - 1] != L'\\')
-		strPath += wstring(TEXT("\\*"));
-	else
-		strPath += wstring(TEXT("*"));
+// Starts a search whose results are found page by page with NextResults()
+SearchCursor* CDriveIndex::OpenCursor(wstring *strQuery, wstring *strQueryPath, BOOL bEnhancedSearch)
+{
+	SearchCursor *pCursor = new SearchCursor();
+	pCursor->pIndex = this;
+	pCursor->Query = *strQuery;
+	ParseExtensionQuery(pCursor->Query, bEnhancedSearch, pCursor->Extensions);
+	pCursor->QueryLower = pCursor->Query;
+	FoldString(pCursor->QueryLower);
+	if(strQueryPath != NULL)
+	{
+		pCursor->QueryPathLower = *strQueryPath;
+		FoldString(pCursor->QueryPathLower);
+	}
+	DWORDLONG QueryFilter = MakeFilter(&pCursor->QueryLower);
+	pCursor->QueryLength = (QueryFilter & 0xE000000000000000ui64) >> 61ui64;
+	pCursor->QueryFilter = QueryFilter & 0x1FFFFFFFFFFFFFFFui64;
+	pCursor->bEnhancedSearch = bEnhancedSearch;
+	pCursor->SearchWhere = pCursor->Query.length() != 0 || pCursor->Extensions.size() != 0 ? IN_FILES : NO_WHERE;
+	if(bEnhancedSearch == SEARCH_GLOB || bEnhancedSearch == SEARCH_REGEX)
+	{
+		if(pCursor->Pattern.Compile(pCursor->Query, bEnhancedSearch == SEARCH_REGEX))
+			MakePatternFilter(&pCursor->Pattern, pCursor->QueryFilter, pCursor->QueryLength);
+		else
+			pCursor->SearchWhere = NO_WHERE;
+	}
+	pCursor->nGeneration = m_nGeneration;
+	return pCursor;
+}
 
-	const WCHAR* szDir = strPath.c_str();
 
-	// Find the first file in the directory.
-	hFind = FindFirstFile(szDir, &ffd);
 
-	if (hFind == INVALID_HANDLE_VALUE)
-		return;
-	unsigned int nFiles = 0;
-	// List all the files in the directory with some info about them.
-	do
+// Replaces the results of a cursor with the next page of up to CURSOR_PAGE_SIZE results.
+// Each page continues the scan where the previous one stopped. Returns false if there are no more results.
+BOOL CDriveIndex::NextResults(SearchCursor *pCursor)
+{
+	m_SearchStats = SearchStats();
+	LARGE_INTEGER SearchStart;
+	QueryPerformanceCounter(&SearchStart);
+	pCursor->Results.clear();
+	pCursor->iNextResult = 0;
+	if(pCursor->SearchWhere != NO_WHERE && pCursor->nGeneration != m_nGeneration)
 	{
-		if(ffd.dwFileAttributes & FILE_ATTRIBUTE_VIRTUAL || ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
-			continue;
-		float MatchQuality;
-		wstring strFilename(ffd.cFileName);
-		if(strFilename.compare(TEXT(".")) == 0 || strFilename.compare(TEXT("..")) == 0)
-			continue;
-		nFiles++;
-		if(bEnhancedSearch)
-			MatchQuality = FuzzySearch(strFilename, strQuery);
+		//The offsets of the cursor are not valid anymore
+		pCursor->bIndexChanged = true;
+		pCursor->SearchWhere = NO_WHERE;
+	}
+	const WCHAR *szQueryLower = pCursor->QueryLower.c_str();
+	wstring *pstrQueryPathLower = pCursor->QueryPathLower.length() != 0 ? &pCursor->QueryPathLower : NULL;
+	vector<wstring> *pExtensions = pCursor->Extensions.size() != 0 ? &pCursor->Extensions : NULL;
+	CPatternMatcher *pPattern = pCursor->Pattern.IsCompiled() ? &pCursor->Pattern : NULL;
+	while(pCursor->Results.size() == 0 && pCursor->SearchWhere != NO_WHERE)
+	{
+		int nResults = 0;
+		if(pCursor->SearchWhere == IN_FILES)
+			FindInJournal(pCursor->Query, szQueryLower, pCursor->QueryFilter, pCursor->QueryLength, pstrQueryPathLower, rgFiles, rgFileFilters, !pCursor->bEnhancedSearch ? &FileTrigrams : NULL, &FileExtensions, pExtensions, pPattern, pCursor->Results, pCursor->iOffset, pCursor->bEnhancedSearch, CURSOR_PAGE_SIZE, nResults);
 		else
+			FindInJournal(pCursor->Query, szQueryLower, pCursor->QueryFilter, pCursor->QueryLength, pstrQueryPathLower, rgDirectories, rgDirectoryFilters, !pCursor->bEnhancedSearch ? &DirectoryTrigrams : NULL, &DirectoryExtensions, pExtensions, pPattern, pCursor->Results, pCursor->iOffset, pCursor->bEnhancedSearch, CURSOR_PAGE_SIZE, nResults);
+		//The page is full if the limit was reached, otherwise this index is finished
+		if(nResults != -1)
 		{
-			wstring szLower(strFilename);
-			for(unsigned int j = 0; j != szLower.length(); j++)
-				szLower[j] = tolower(szLower[j]);
-			MatchQuality = szLower.find(strQuery) != -1;
+			pCursor->SearchWhere = pCursor->SearchWhere == IN_FILES ? IN_DIRECTORIES : NO_WHERE;
+			pCursor->iOffset = 0;
 		}
+	}
+	EndSearch(SearchStart, (int) pCursor->Results.size(), pCursor->Results.size());
+	return pCursor->Results.size() != 0;
+}
 
-		if(MatchQuality > 0.6f)
+//T needs to be IndexedFile or IndexedDirectory
+//Searches rgJournalIndex starting at iOffset. The index is split into chunks which are scanned by several threads.
+//If more than maxResults results are found, nResults is set to -1 and iOffset is set to the entry where the next search needs to continue.
+//If bTopResults is set, the best maxResults matches are returned ordered by quality instead of the first ones. Such a search
+//can't be continued, iOffset is not changed.
+template <class T>
+void CDriveIndex::FindInJournal(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, CIndexArray<T> &rgJournalIndex, CIndexArray<DWORDLONG> &rgFilters, CTrigramIndex *pTrigrams, CExtensionIndex *pExtensions, vector<wstring> *rgExtensions, CPatternMatcher *pPattern, vector<SearchResultFile> &rgsrfResults, unsigned int &iOffset, BOOL bEnhancedSearch, int maxResults, int &nResults, BOOL bTopResults)
+{
+	LARGE_INTEGER Timer;
+	QueryPerformanceCounter(&Timer);
+	ScanJob<T> Job;
+	Job.pIndex = this;
+	Job.rgJournalIndex = &rgJournalIndex;
+	Job.rgFilters = &rgFilters;
+	//Substring searches can use the trigram index (if it is built) instead of scanning all filters
+	vector<unsigned int> rgCandidates;
+	Job.rgCandidates = pTrigrams != NULL && pTrigrams->Find(strQuery, rgCandidates) ? &rgCandidates : NULL;
+	if(Job.rgCandidates != NULL)
+		m_SearchStats.Sources |= SEARCH_SOURCE_TRIGRAMS;
+	//Queries for extensions only look at the entries with these extensions
+	if(rgExtensions != NULL)
+	{
+		vector<unsigned int> rgExtensionCandidates;
+		pExtensions->Find(*rgExtensions, rgExtensionCandidates);
+		if(Job.rgCandidates != NULL)
+		{
+			vector<unsigned int> rgBoth;
+			set_intersection(rgCandidates.begin(), rgCandidates.end(), rgExtensionCandidates.begin(), rgExtensionCandidates.end(), back_inserter(rgBoth));
+			rgCandidates.swap(rgBoth);
+		}
+		else
+			rgCandidates.swap(rgExtensionCandidates);
+		Job.rgCandidates = &rgCandidates;
+		m_SearchStats.Sources |= SEARCH_SOURCE_EXTENSIONS;
+	}
+	if(Job.rgCandidates == NULL)
+		m_SearchStats.Sources |= SEARCH_SOURCE_SCAN;
+	Job.strQuery = &strQuery;
+	Job.szQueryLower = szQueryLower;
+	Job.QueryFilter = QueryFilter;
+	Job.QueryLength = QueryLength;
+	//Paths of directories in the index are checked by the depth-first numbers of the parents, other paths by the full path of each match
+	unsigned int iScope = strQueryPath != NULL ? FindDirectoryByPath(*strQueryPath) : NO_PARENT;
+	Job.strQueryPath = iScope == NO_PARENT ? strQueryPath : NULL;
+	Job.rgPreorder = iScope != NO_PARENT ? &rgPreorder[0] : NULL;
+	Job.iScopeBegin = iScope != NO_PARENT ? rgPreorder[iScope] : 0;
+	Job.nScope = iScope != NO_PARENT ? rgDirectories[iScope].nDirectories + 1 : 0;
+	Job.bEnhancedSearch = bEnhancedSearch;
+	Job.pPattern = pPattern;
+	Job.pCancel = m_pCancel;
+	CApproximateMatcher Approximate;
+	if(bEnhancedSearch == SEARCH_APPROXIMATE && m_nMaxEditDistance > 0)
+		Approximate.Init(szQueryLower, (unsigned int) strQuery.length(), min((unsigned int) m_nMaxEditDistance, (unsigned int) strQuery.length() / CHARACTERS_PER_EDIT));
+	Job.pApproximate = Approximate.IsEnabled() ? &Approximate : NULL;
+	Job.iStart = iOffset;
+	//One more match than allowed is needed to know where the next search continues
+	Job.nHitsNeeded = maxResults == -1 ? NO_LIMIT : (unsigned int) (maxResults > nResults ? maxResults - nResults + 1 : 1);
+	//When only the best matches are kept, nothing later can beat maxResults perfect matches. One more is needed to know that there are more results.
+	//MatchCandidates() also ends the scan when the heap of one thread is full of perfect matches.
+	Job.nTopHits = bTopResults && maxResults > 0 ? (unsigned int) maxResults : 0;
+	if(Job.nTopHits != 0)
+		Job.nHitsNeeded = Job.nTopHits + 1;
+	unsigned int nEntries = rgJournalIndex.size() > iOffset ? (unsigned int) rgJournalIndex.size() - iOffset : 0;
+	Job.nChunks = (nEntries + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE;
+	Job.iNextChunk = 0;
+	Job.iNextThread = 0;
+	Job.nHits = 0;
+	Job.nMatches = 0;
+	Job.nScanned = 0;
+	Job.nFilterPassed = 0;
+	Job.nFalsePositives = 0;
+	Job.nIndexCandidates = 0;
+	Job.nFuzzySearches = 0;
+	Job.nPathChecks = 0;
+	Job.nNamesDecoded = 0;
+	m_SearchStats.Prepare += StopTimer(Timer);
+
+	vector<ScanHit> rgHits;
+	unsigned int nThreads = min(GetSearchThreads(), Job.nChunks);
+	if(Job.rgCandidates != NULL && rgCandidates.size() < SCAN_CHUNK_SIZE)
+		nThreads = 1; //Not worth starting threads
+	if(nThreads <= 1 && Job.pCancel == NULL)
+		ScanRange(Job, iOffset, (unsigned int) rgJournalIndex.size(), rgHits);
+	else if(nThreads <= 1)
+	{
+		//Chunk by chunk like the search threads, so a cancelled search stops at the next chunk
+		for(unsigned int iChunk = 0; iChunk != Job.nChunks && *Job.pCancel == 0 && (Job.nHitsNeeded == NO_LIMIT || (unsigned int) Job.nHits < Job.nHitsNeeded); iChunk++)
+		{
+			unsigned int iBegin = iOffset + iChunk * SCAN_CHUNK_SIZE;
+			Job.nHits += ScanRange(Job, iBegin, min(iBegin + SCAN_CHUNK_SIZE, (unsigned int) rgJournalIndex.size()), rgHits);
+		}
+	}
+	else
+	{
+		Job.rgThreadHits.resize(nThreads);
+		Job.hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+		//The calling thread scans too, so it counts as running until it called ScanWorker() below
+		Job.nRunning = 1;
+		for(unsigned int t = 1; t != nThreads; t++)
 		{
-			nResults++;
-			if(maxResults != -1 && nResults > maxResults)
+			InterlockedIncrement(&Job.nRunning);
+			if(!QueueUserWorkItem(ScanWorker<T>, &Job, WT_EXECUTEDEFAULT))
 			{
-				nResults = -1;
+				InterlockedDecrement(&Job.nRunning);
 				break;
 			}
-			SearchResultFile srf;
-			srf.Filename = strFilename;
-			srf.Path = *strQueryPath + TEXT("\\");
-			srf.Filter = MAXULONG64;
-			srf.MatchQuality = MatchQuality;
-			rgsrfResults.insert(rgsrfResults.end(), srf);
 		}
+		ScanWorker<T>(&Job);
+		WaitForSingleObject(Job.hDone, INFINITE);
+		CloseHandle(Job.hDone);
+
+		//Merge the buffers of all threads. Each buffer is ordered, but the chunks are distributed among the threads.
+		//Limited searches need the order to find the entry where the next search continues.
+		for(unsigned int t = 0; t != nThreads; t++)
+			rgHits.insert(rgHits.end(), Job.rgThreadHits[t].begin(), Job.rgThreadHits[t].end());
+		if(Job.nTopHits == 0 && (m_bDeterministicSearch || Job.nHitsNeeded != NO_LIMIT))
+			sort(rgHits.begin(), rgHits.end());
+	}
 
-		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+	BOOL bLimitReached;
+	if(Job.nTopHits != 0)
+	{
+		//Each thread kept its best matches in a heap, the best of all of them are returned
+		sort(rgHits.begin(), rgHits.end(), ScanHit::IsBetter);
+		if(rgHits.size() > Job.nTopHits)
+			rgHits.resize(Job.nTopHits);
+		bLimitReached = (unsigned int) Job.nMatches > Job.nTopHits;
+	}
+	else
+	{
+		//The last match exceeds the limit. It is not returned, the next incremental search starts with it.
+		bLimitReached = Job.nHitsNeeded != NO_LIMIT && rgHits.size() >= Job.nHitsNeeded;
+		if(bLimitReached)
 		{
-			wstring strSubPath = wstring(*strQueryPath);
-			if((*strQueryPath)[strQueryPath->length() - 1] != L'\\')
-				strSubPath += L'\\';
-			strSubPath += ffd.cFileName;
-			FindRecursively(strQuery, szQueryLower, QueryFilter, QueryLength, &strSubPath, rgsrfResults, bEnhancedSearch, maxResults, nResults);
-			if(nResults == -1)
-				break;
+			iOffset = rgHits[Job.nHitsNeeded - 1].iOffset;
+			rgHits.resize(Job.nHitsNeeded - 1);
 		}
 	}
-	while (FindNextFile(hFind, &ffd) != 0);
-	FindClose(hFind);
+
+	m_SearchStats.Scan += StopTimer(Timer);
+	m_SearchStats.nScanned += (DWORDLONG) Job.nScanned;
+	m_SearchStats.nFilterPassed += (DWORDLONG) Job.nFilterPassed;
+	m_SearchStats.nFalsePositives += (DWORDLONG) Job.nFalsePositives;
+	m_SearchStats.nIndexCandidates += (DWORDLONG) Job.nIndexCandidates;
+	m_SearchStats.nFuzzySearches += (DWORDLONG) Job.nFuzzySearches;
+	m_SearchStats.nPathsBuilt += (DWORDLONG) Job.nPathChecks + rgHits.size();
+	m_SearchStats.nNamesDecoded += (DWORDLONG) Job.nNamesDecoded;
+	if(IsSearchCancelled())
+		return;
+
+	//Build the results. This uses the path cache, so it is done on this thread only.
+	rgsrfResults.reserve(rgsrfResults.size() + rgHits.size());
+	for(unsigned int j = 0; j != rgHits.size(); j++)
+	{
+		IndexedFile* i = (IndexedFile*)&rgJournalIndex[rgHits[j].iOffset];
+		SearchResultFile srf;
+		srf.Filename = GetName(i);
+		srf.Path.reserve(MAX_PATH);
+		GetDirPath(i->ParentOffset, &srf.Path);
+		if(srf.Path.length() != 0)
+			srf.Path += TEXT("\\");
+		srf.Filter = rgFilters[rgHits[j].iOffset];
+		srf.MatchQuality = rgHits[j].MatchQuality;
+		rgsrfResults.insert(rgsrfResults.end(), srf);
+	}
+	nResults = bLimitReached ? -1 : nResults + (int) rgHits.size();
+	m_SearchStats.Results += StopTimer(Timer);
 }
 
-//T needs to be IndexedFile or IndexedDirectory
+
+
+//Scans the entries from iBegin to iEnd and adds the matches to rgHits. Stops after Job.nHitsNeeded matches.
+//The filters are tested block by block with ScanFilters(), only the candidates it returns are compared by name.
+//This is called by several threads at once, so it must not modify the database or use the path cache.
+//Returns the number of matches that count towards Job.nHitsNeeded.
 template <class T>
-void CDriveIndex::FindInJournal(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, vector<T> &rgJournalIndex, vector<SearchResultFile> &rgsrfResults, unsigned int iOffset, BOOL bEnhancedSearch, int maxResults, int &nResults)
+unsigned int CDriveIndex::ScanRange(ScanJob<T> &Job, unsigned int iBegin, unsigned int iEnd, vector<ScanHit> &rgHits)
 {
-	for(unsigned int j = 0; j != rgJournalIndex.size(); j++)
+	unsigned int nFound = 0;
+	unsigned int nMatches = 0;
+	ScanCounters Counters;
+	if(Job.rgCandidates != NULL)
 	{
-		IndexedFile* i = (IndexedFile*)&rgJournalIndex[j];
-		DWORDLONG Length = (i->Filter & 0xE000000000000000ui64) >> 61ui64; //Bits 61-63 for storing lengths up to 8
-		DWORDLONG Filter = i->Filter & 0x1FFFFFFFFFFFFFFFui64; //All but the last 3 bits
-		if((Filter & QueryFilter) == QueryFilter && QueryLength <= Length)
-		{
-			USNEntry file = FRNToName(i->Index);
-			float MatchQuality;
-			if(bEnhancedSearch)
-				MatchQuality = FuzzySearch(file.Name, strQuery);
+		//The trigram index already selected the candidates
+		vector<unsigned int>::iterator itBegin = lower_bound(Job.rgCandidates->begin(), Job.rgCandidates->end(), iBegin);
+		vector<unsigned int>::iterator itEnd = lower_bound(itBegin, Job.rgCandidates->end(), iEnd);
+		Counters.nIndexCandidates = (unsigned int) (itEnd - itBegin);
+		if(itBegin != itEnd)
+			MatchCandidates(Job, &*itBegin, (unsigned int) (itEnd - itBegin), rgHits, nFound, nMatches, Counters);
+	}
+	else
+	{
+		unsigned int rgCandidates[FILTER_BLOCK_SIZE];
+		for(unsigned int iBlock = iBegin; iBlock < iEnd; iBlock += FILTER_BLOCK_SIZE)
+		{
+			unsigned int nCandidates;
+			if(Job.pApproximate != NULL)
+				nCandidates = ScanFiltersLoose(&(*Job.rgFilters)[0], iBlock, min(iBlock + FILTER_BLOCK_SIZE, iEnd), Job.QueryFilter, Job.QueryLength, Job.pApproximate->GetMaxEdits(), rgCandidates);
 			else
-			{
-				wstring szLower(file.Name);
-				for(unsigned int j = 0; j != szLower.length(); j++)
-					szLower[j] = tolower(szLower[j]);
-				MatchQuality = szLower.find(strQuery) != -1;
-			}
+				nCandidates = ScanFilters(&(*Job.rgFilters)[0], iBlock, min(iBlock + FILTER_BLOCK_SIZE, iEnd), Job.QueryFilter, Job.QueryLength, rgCandidates);
+			Counters.nScanned += min(iBlock + FILTER_BLOCK_SIZE, iEnd) - iBlock;
+			Counters.nFilterPassed += nCandidates;
+			if(MatchCandidates(Job, rgCandidates, nCandidates, rgHits, nFound, nMatches, Counters))
+				break;
+		}
+	}
+	if(nMatches != 0)
+		InterlockedExchangeAdd(&Job.nMatches, (LONG) nMatches);
+	InterlockedExchangeAdd(&Job.nScanned, (LONG) Counters.nScanned);
+	InterlockedExchangeAdd(&Job.nFilterPassed, (LONG) Counters.nFilterPassed);
+	InterlockedExchangeAdd(&Job.nFalsePositives, (LONG) Counters.nFalsePositives);
+	InterlockedExchangeAdd(&Job.nIndexCandidates, (LONG) Counters.nIndexCandidates);
+	InterlockedExchangeAdd(&Job.nFuzzySearches, (LONG) Counters.nFuzzySearches);
+	InterlockedExchangeAdd(&Job.nPathChecks, (LONG) Counters.nPathChecks);
+	InterlockedExchangeAdd(&Job.nNamesDecoded, (LONG) Counters.nNamesDecoded);
+	return nFound;
+}
+
+
 
-			if(MatchQuality > 0.6f)
+//Compares the names of the candidates with the query and adds the matches to rgHits.
+//If only the best Job.nTopHits matches are kept, rgHits is a heap whose first element is the worst of them.
+//Returns true when Job.nHitsNeeded matches were found, or when the heap is full of perfect matches and another
+//match was found. Candidates are passed in ascending order, so no later match can replace a perfect one then.
+template <class T>
+BOOL CDriveIndex::MatchCandidates(ScanJob<T> &Job, const unsigned int *rgCandidates, unsigned int nCandidates, vector<ScanHit> &rgHits, unsigned int &nFound, unsigned int &nMatches, ScanCounters &Counters)
+{
+	wstring strName;
+	for(unsigned int c = 0; c != nCandidates; c++)
+	{
+		unsigned int j = rgCandidates[c];
+		IndexedFile* i = (IndexedFile*)&(*Job.rgJournalIndex)[j];
+		//Entries without a parent can't be in a subtree, their unsigned difference is always out of range
+		if(Job.rgPreorder != NULL && (i->ParentOffset == NO_PARENT || Job.rgPreorder[i->ParentOffset] - Job.iScopeBegin >= Job.nScope))
+			continue;
+		//The name is compared in place, the candidates are not copied. Only the compact name mode needs to decode it.
+		const WCHAR *szName = GetNameChars(i, strName);
+		if(m_bCompactNames)
+			Counters.nNamesDecoded++;
+		float MatchQuality;
+		if(Job.pPattern != NULL)
+			MatchQuality = Job.pPattern->Match(szName, i->NameLength) ? 1.0f : 0.0f;
+		else if(Job.bEnhancedSearch)
+		{
+			Counters.nFuzzySearches++;
+			MatchQuality = FuzzySearch(szName, i->NameLength, Job.strQuery->c_str(), Job.szQueryLower, (unsigned int) Job.strQuery->length());
+			if(MatchQuality == 0.0f && Job.pApproximate != NULL)
+				MatchQuality = Job.pApproximate->MatchQuality(szName, i->NameLength);
+		}
+		else
+			MatchQuality = FindFolded(szName, i->NameLength, Job.szQueryLower, (unsigned int) Job.strQuery->length()) != -1;
+
+		//Only candidates whose filter was tested count, the ones from the trigram or extension index weren't tested
+		if(MatchQuality <= 0.6f && Job.rgCandidates == NULL)
+			Counters.nFalsePositives++;
+		if(MatchQuality > 0.6f && Job.strQueryPath != NULL)
+			Counters.nPathChecks++;
+		if(MatchQuality > 0.6f && (Job.strQueryPath == NULL || IsInPath(i, Job.strQueryPath)))
+		{
+			ScanHit hit;
+			hit.iOffset = j;
+			hit.MatchQuality = MatchQuality;
+			nMatches++;
+			if(Job.nTopHits == 0)
+				rgHits.insert(rgHits.end(), hit);
+			else
 			{
-				nResults++;
-				if(maxResults != -1 && nResults > maxResults)
-				{
-					nResults = -1;
-					break;
-				}
-				SearchResultFile srf;
-				srf.Filename = file.Name;
-				srf.Path.reserve(MAX_PATH);
-				Get(i->Index, &srf.Path);
-				BOOL bFound = true;
-				if(strQueryPath != NULL)
-				{
-					wstring strPathLower(srf.Path);
-					for(unsigned int j = 0; j != strPathLower.length(); j++)
-						strPathLower[j] = tolower(strPathLower[j]);
-					bFound = strPathLower.find(*strQueryPath) != -1;
-				}
-				if(bFound)
+				if(rgHits.size() == Job.nTopHits)
 				{
-					//split path
-					WCHAR szDrive[_MAX_DRIVE];
-					WCHAR szPath[_MAX_PATH];
-					WCHAR szName[_MAX_FNAME];
-					WCHAR szExt[_MAX_EXT];
-					_wsplitpath(srf.Path.c_str(), szDrive, szPath, szName, szExt);
-					srf.Path = wstring(szDrive) + wstring(szPath);
-					srf.Filter = i->Filter;
-					srf.MatchQuality = MatchQuality;
-					rgsrfResults.insert(rgsrfResults.end(), srf);
+					if(!ScanHit::IsBetter(hit, rgHits.front()))
+					{
+						//The heap is full of perfect matches that come before this one. Nothing after it can be better,
+						//and this match tells that there are more results than are returned.
+						if(rgHits.front().MatchQuality == 1.0f)
+						{
+							nFound = Job.nHitsNeeded;
+							return true;
+						}
+						continue;
+					}
+					pop_heap(rgHits.begin(), rgHits.end(), ScanHit::IsBetter);
+					rgHits.pop_back();
 				}
+				rgHits.insert(rgHits.end(), hit);
+				push_heap(rgHits.begin(), rgHits.end(), ScanHit::IsBetter);
+				//Only perfect matches count, any other match could still be replaced by a better one. The perfect
+				//matches of several threads together can end the scan before the heap of one thread is full.
+				if(MatchQuality < 1.0f)
+					continue;
 			}
+			if(++nFound == Job.nHitsNeeded)
+				return true;
 		}
 	}
+	return false;
+}
+
+
+
+//Thread function of the search threads. Claims chunks in ascending order until all chunks are scanned,
+//enough matches were found or the search was cancelled. Chunks that were claimed are always completed,
+//so the scanned part of the index is contiguous.
+template <class T>
+DWORD WINAPI CDriveIndex::ScanWorker(LPVOID lpParameter)
+{
+	ScanJob<T> *Job = (ScanJob<T>*) lpParameter;
+	vector<ScanHit> &rgHits = Job->rgThreadHits[InterlockedIncrement(&Job->iNextThread) - 1];
+	while((Job->nHitsNeeded == NO_LIMIT || (unsigned int) Job->nHits < Job->nHitsNeeded) && (Job->pCancel == NULL || *Job->pCancel == 0))
+	{
+		unsigned int iChunk = (unsigned int) InterlockedIncrement(&Job->iNextChunk) - 1;
+		if(iChunk >= Job->nChunks)
+			break;
+		unsigned int iBegin = Job->iStart + iChunk * SCAN_CHUNK_SIZE;
+		unsigned int iEnd = min(iBegin + SCAN_CHUNK_SIZE, (unsigned int) Job->rgJournalIndex->size());
+		InterlockedExchangeAdd(&Job->nHits, (LONG) Job->pIndex->ScanRange(*Job, iBegin, iEnd, rgHits));
+	}
+	if(InterlockedDecrement(&Job->nRunning) == 0)
+		SetEvent(Job->hDone);
+	return 0;
+}
+
+
+
+//Returns the number of threads used for scanning the index
+unsigned int CDriveIndex::GetSearchThreads()
+{
+	if(m_nSearchThreads > 0)
+		return min((unsigned int) m_nSearchThreads, (unsigned int) MAX_SEARCH_THREADS);
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return min((unsigned int) si.dwNumberOfProcessors, (unsigned int) MAX_SEARCH_THREADS);
+}
+
+
+
+//Checks if the full path of an entry contains strQueryPath (lowercase).
+//The path cache is not used here, so this can be called by the search threads. The path is folded into a buffer on the
+//stack from its end, the name of the entry first and then the names of its parents, so nothing is allocated.
+BOOL CDriveIndex::IsInPath(IndexedFile *i, wstring *strQueryPath)
+{
+	//A directory can't have more ancestors than there are directories
+	size_t nPath = i->NameLength;
+	size_t nParents = 0;
+	for(unsigned int iDir = i->ParentOffset; iDir != NO_PARENT && nParents < rgDirectories.size(); iDir = rgDirectories[iDir].ParentOffset, nParents++)
+		nPath += rgDirectories[iDir].NameLength + 1;
+	if(nPath < strQueryPath->length())
+		return false;
+
+	WCHAR szStackPath[PATH_BUFFER_SIZE];
+	vector<WCHAR> rgHeapPath;
+	WCHAR *szPath = szStackPath;
+	if(nPath > PATH_BUFFER_SIZE)
+	{
+		rgHeapPath.resize(nPath);
+		szPath = &rgHeapPath[0];
+	}
+	size_t iPosition = nPath - i->NameLength;
+	CopyName(i, szPath + iPosition);
+	unsigned int iDir = i->ParentOffset;
+	for(size_t j = 0; j != nParents; j++, iDir = rgDirectories[iDir].ParentOffset)
+	{
+		IndexedFile *d = (IndexedFile*) &rgDirectories[iDir];
+		szPath[--iPosition] = TEXT('\\');
+		iPosition -= d->NameLength;
+		CopyName(d, szPath + iPosition);
+	}
+	FoldString(szPath, nPath, szPath);
+	return FindString(szPath, (unsigned int) nPath, strQueryPath->c_str(), (unsigned int) strQueryPath->length()) != -1;
 }
-void CDriveIndex::FindInPreviousResults(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, vector<SearchResultFile> &rgsrfResults, unsigned int  iOffset, BOOL bEnhancedSearch, int maxResults, int &nResults)
+
+
+
+void CDriveIndex::FindInPreviousResults(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, BOOL bPathInIndex, vector<SearchResultFile> &rgsrfResults, unsigned int  iOffset, BOOL bEnhancedSearch, int maxResults, int &nResults)
 {
 	for(int i = 0; i != LastResult.Results.size() && (maxResults == -1 || i < maxResults); i++)
 	{
@@ -673,24 +1370,19 @@ void CDriveIndex::FindInPreviousResults(wstring &strQuery, const WCHAR* &szQuery
 		if((Filter & QueryFilter) == QueryFilter && QueryLength <= Length)
 		{
 			if(bEnhancedSearch)
-				srf->MatchQuality = FuzzySearch(srf->Filename, strQuery);
-			else
 			{
-				wstring szLower(srf->Filename);
-				for(unsigned int j = 0; j != szLower.length(); j++)
-					szLower[j] = tolower(szLower[j]);
-				srf->MatchQuality = szLower.find(szQueryLower) != -1;
+				m_SearchStats.nFuzzySearches++;
+				srf->MatchQuality = FuzzySearch(srf->Filename.c_str(), (unsigned int) srf->Filename.length(), strQuery.c_str(), szQueryLower, (unsigned int) strQuery.length());
 			}
+			else
+				srf->MatchQuality = FindFolded(srf->Filename.c_str(), (unsigned int) srf->Filename.length(), szQueryLower, (unsigned int) strQuery.length()) != -1;
 			if(srf->MatchQuality > 0.6f)
 			{
 				BOOL bFound = true;
-				if(strQueryPath != NULL)
-				{
-					wstring strPathLower(srf->Path);
-					for(unsigned int j = 0; j != srf->Path.length(); j++)
-						strPathLower[j] = tolower(srf->Path[j]);
-					bFound = strPathLower.find(*strQueryPath) != -1;
-				}
+				if(bPathInIndex)
+					bFound = IsSubPath(srf->Path, *strQueryPath);
+				else if(strQueryPath != NULL)
+					bFound = FindFolded(srf->Path.c_str(), (unsigned int) srf->Path.length(), strQueryPath->c_str(), (unsigned int) strQueryPath->length()) != -1;
 				if(bFound)
 				{
 					nResults++;
@@ -712,22 +1404,39 @@ BOOL CDriveIndex::Empty()
 {
 	rgFiles.clear();
 	rgDirectories.clear();
+	rgFileFilters.clear();
+	rgDirectoryFilters.clear();
+	rgNames.clear();
+	NameDictionary.Clear();
+	FileTrigrams.Clear();
+	DirectoryTrigrams.Clear();
+	FileExtensions.Clear();
+	DirectoryExtensions.Clear();
+	CloseIndexFile();
+	DirPathCache.clear();
+	vector<unsigned int>().swap(rgChildStart);
+	vector<unsigned int>().swap(rgChildDirectories);
+	vector<unsigned int>().swap(rgPreorder);
+	vector<unsigned int>().swap(rgRecordOffsets);
+	PendingChanges.clear();
+	m_nUnusedNames = 0;
+	m_nGeneration++;
 	return(TRUE);
 }
 
 
 
-// Constructs a path for a file
+// Constructs a path for a file or directory
 BOOL CDriveIndex::Get(DWORDLONG Index, wstring *sz)
 {
-	*sz = TEXT("");
-	int n = 0;
-	do {
-		USNEntry file = FRNToName(Index);
-		*sz = file.Name + ((n != 0) ? TEXT("\\") : TEXT("")) + *sz;
-		Index = file.ParentIndex;
-		n++;
-	} while (Index != 0);
+	INT64 iOffset = FindOffsetByIndex(Index);
+	if(iOffset == -1)
+		return GetDir(Index, sz);
+	IndexedFile *i = &rgFiles[(unsigned int) iOffset];
+	GetDirPath(i->ParentOffset, sz);
+	if(sz->length() != 0)
+		*sz += TEXT("\\");
+	*sz += GetName(i);
 	return(TRUE);
 }
 
@@ -736,208 +1445,974 @@ BOOL CDriveIndex::Get(DWORDLONG Index, wstring *sz)
 // Constructs a path for a directory
 BOOL CDriveIndex::GetDir(DWORDLONG Index, wstring *sz)
 {
-	*sz = TEXT("");
-	do {
-		USNEntry file = FRNToName(Index);
-		*sz = file.Name + ((sz->length() != 0) ? TEXT("\\") : TEXT("")) + *sz;
-		Index = file.ParentIndex;
-	} while (Index != 0);
+	INT64 iOffset = FindDirOffsetByIndex(Index);
+	if(iOffset == -1)
+	{
+		*sz = TEXT("");
+		return(FALSE);
+	}
+	GetDirPath((unsigned int) iOffset, sz);
 	return(TRUE);
 }
 
 
 
-//Finds the position of a file in the database by the FileReferenceNumber
+// Constructs the path of a directory by following the parent offsets. The paths of the directory and
+// all of its parents are cached, so results in the same folder only need to build their path once.
+void CDriveIndex::GetDirPath(unsigned int iDirectory, wstring *sz)
+{
+	*sz = TEXT("");
+	vector<unsigned int> rgChain;
+	unsigned int iDir = iDirectory;
+	//Walk up to the first directory whose path is known (a directory can't have more ancestors than there are directories)
+	while(iDir != NO_PARENT && rgChain.size() < rgDirectories.size())
+	{
+		hash_map<unsigned int, wstring>::iterator it = DirPathCache.find(iDir);
+		if(it != DirPathCache.end())
+		{
+			*sz = it->second;
+			break;
+		}
+		rgChain.insert(rgChain.end(), iDir);
+		iDir = rgDirectories[iDir].ParentOffset;
+	}
+	if(DirPathCache.size() + rgChain.size() > DIR_PATH_CACHE_SIZE)
+		DirPathCache.clear();
+
+	//Append the missing names top-down
+	for(size_t j = rgChain.size(); j != 0; j--)
+	{
+		IndexedFile *d = (IndexedFile*) &rgDirectories[rgChain[j - 1]];
+		if(sz->length() != 0)
+			*sz += TEXT("\\");
+		sz->append(GetNameCharsCached(d), d->NameLength);
+		DirPathCache[rgChain[j - 1]] = *sz;
+	}
+}
+
+
+
+//Finds the position of a file in the database by the FileReferenceNumber or record number
 INT64 CDriveIndex::FindOffsetByIndex(DWORDLONG Index) {
 
-	vector<IndexedFile>::difference_type pos;
-	IndexedFile i;
-	i.Index = Index;
-	pos = distance(rgFiles.begin(), lower_bound(rgFiles.begin(), rgFiles.end(), i));
-	return (INT64) (pos == rgFiles.size() ? -1 : pos); // this is valid because the number of files doesn't exceed the range of INT64
+	unsigned int RecordNumber = RECORD_NUMBER(Index);
+	unsigned int iOffset = RecordNumber < rgRecordOffsets.size() ? rgRecordOffsets[RecordNumber] : NO_RECORD;
+	return iOffset == NO_RECORD || (iOffset & RECORD_DIRECTORY) != 0 ? -1 : (INT64) iOffset;
 }
 
 
 
-//Finds the position of a directory in the database by the FileReferenceNumber
+//Finds the position of a directory in the database by the FileReferenceNumber or record number
 INT64 CDriveIndex::FindDirOffsetByIndex(DWORDLONG Index)
 {
-	vector<IndexedDirectory>::difference_type pos;
-	IndexedDirectory i;
-	i.Index = Index;
-	pos = distance(rgDirectories.begin(), lower_bound(rgDirectories.begin(), rgDirectories.end(), i));
-	return (INT64) (pos == rgDirectories.size() ? -1 : pos); // this is valid because the number of files doesn't exceed the range of INT64
+	unsigned int RecordNumber = RECORD_NUMBER(Index);
+	unsigned int iOffset = RecordNumber < rgRecordOffsets.size() ? rgRecordOffsets[RecordNumber] : NO_RECORD;
+	return iOffset == NO_RECORD || (iOffset & RECORD_DIRECTORY) == 0 ? -1 : (INT64) (iOffset & ~RECORD_DIRECTORY);
 }
 
-DWORDLONG PathToFRN(wstring* strPath)
+
+
+//Builds rgRecordOffsets from the record numbers of all entries. The table has one position per record up to the
+//highest record number, which is about the size of the MFT.
+void CDriveIndex::BuildRecordTable()
 {
-	HANDLE hDir = CreateFile(strPath->c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
-	if(hDir == INVALID_HANDLE_VALUE)
-		return 0;
-	BY_HANDLE_FILE_INFORMATION fi;
-	GetFileInformationByHandle(hDir, &fi);
-	CloseHandle(hDir);
-	return (((DWORDLONG) fi.nFileIndexHigh) << 32) | fi.nFileIndexLow;
+	unsigned int nRecords = 0;
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+		nRecords = max(nRecords, rgFiles[j].RecordNumber + 1);
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+		nRecords = max(nRecords, rgDirectories[j].RecordNumber + 1);
+	rgRecordOffsets.assign(nRecords, NO_RECORD);
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+		rgRecordOffsets[rgFiles[j].RecordNumber] = j;
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+		rgRecordOffsets[rgDirectories[j].RecordNumber] = j | RECORD_DIRECTORY;
 }
 
 // Enumerate the MFT for all entries. Store the file reference numbers of
 // any directories in the database.
 void CDriveIndex::PopulateIndex()
 {
-	Empty();
-	
-	vector<DWORDLONG> FileParents;
-	vector<DWORDLONG> DirectoryParents;
-
 	USN_JOURNAL_DATA ujd;
 	Query(&ujd);
+	CVolumeRecordSource Source(m_hVol, m_cDrive, ujd.NextUsn);
+	PopulateIndex(&Source);
+
+	// Changes after this point are picked up by UpdateIndex()
+	m_UsnJournalID = ujd.UsnJournalID;
+	m_NextUsn = ujd.NextUsn;
+}
+
+
+
+// Builds the database from the records supplied by pSource.
+// The records are read on this thread and parsed by several parser threads (see ReadRecords()),
+// the entries they produce are merged in the order they were read, so the result doesn't depend on the number of threads.
+void CDriveIndex::PopulateIndex(CRecordSource *pSource)
+{
+	Empty();
+	//The records are parsed into rgNames in both name modes, the indexes are built faster from it.
+	//The dictionary is built at the end.
+	BOOL bCompactNames = m_bCompactNames;
+	m_bCompactNames = false;
+	m_BuildStats = BuildStats();
+	m_BuildStats.cbEnumBuffer = m_cbEnumBuffer;
+	LARGE_INTEGER Timer;
+	QueryPerformanceCounter(&Timer);
 
 	// Get the FRN of the root directory
 	// This had BETTER work, or we can't do anything
+	m_cDrive = pSource->GetDrive();
+	m_dwDriveFRN = pSource->GetRootIndex();
+
+	BuildJob Job;
+	ReadRecords(pSource, Job, Timer);
+
+	//The record numbers of the parents are kept in the order of the entries until they are linked
+	vector<unsigned int> FileParents;
+	vector<unsigned int> DirectoryParents;
+	MergeStages(Job, FileParents, DirectoryParents);
+	vector<BuildStage>().swap(Job.rgStages);
+	m_BuildStats.Insert += StopTimer(Timer);
+
+	//The filters are made once the layout was chosen for the names that were read
+	ChooseFilterLayout();
+	MakeFilters();
+	m_BuildStats.Filters = StopTimer(Timer);
+
+	//Link all entries to the position of their parent directory. The entries stay in the order they were read,
+	//which is the order of their record numbers, they are found through the record table.
+	BuildRecordTable();
+	LinkParents(FileParents, DirectoryParents);
+	m_BuildStats.Link = StopTimer(Timer);
+
+	//Calculate files per directory and number the directories for searches in a path
+	CountSubtrees();
+	BuildDirectoryTree();
+	BuildExtensionIndex();
+	m_BuildStats.Aggregate = StopTimer(Timer);
+	if(m_bTrigramIndex)
+	{
+		BuildTrigramIndex();
+		m_BuildStats.TrigramIndex = StopTimer(Timer);
+	}
+
+	if(bCompactNames)
+	{
+		SetCompactNames(true);
+		m_BuildStats.CompactNames = StopTimer(Timer);
+	}
+}
+
+
+
+// Reads all records from pSource and lets the parser threads add them to Job.rgStages.
+// If no parser thread can be started, the records are parsed on this thread.
+void CDriveIndex::ReadRecords(CRecordSource *pSource, BuildJob &Job, LARGE_INTEGER &Timer)
+{
+	unsigned int nParsers = min(max(GetSearchThreads(), 2u) - 1, (unsigned int) MAX_BUILD_THREADS);
+	unsigned int nBuffers = nParsers * BUILD_BUFFERS_PER_THREAD + 1;
+	Job.pIndex = this;
+	Job.rgBuffers.resize(nBuffers, vector<BYTE>(sizeof(DWORDLONG) + m_cbEnumBuffer));
+	Job.rgBufferSizes.resize(nBuffers);
+	Job.rgBufferSequence.resize(nBuffers);
+	for(unsigned int j = 0; j != nBuffers; j++)
+		Job.rgFreeBuffers.insert(Job.rgFreeBuffers.end(), j);
+	Job.rgStages.resize(nParsers + 1);
+	InitializeCriticalSection(&Job.csBuffers);
+	Job.hFree = CreateSemaphore(NULL, nBuffers, nBuffers, NULL);
+	Job.hFilled = CreateSemaphore(NULL, 0, nBuffers + nParsers, NULL);
+	Job.hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	Job.iNextThread = 0;
+	Job.nRunning = 0;
+	unsigned int nStarted = 0;
+	if(Job.hFree != NULL && Job.hFilled != NULL && Job.hDone != NULL)
+	{
+		for(; nStarted != nParsers; nStarted++)
+		{
+			InterlockedIncrement(&Job.nRunning);
+			if(!QueueUserWorkItem(ParseWorker, &Job, WT_EXECUTELONGFUNCTION))
+			{
+				InterlockedDecrement(&Job.nRunning);
+				break;
+			}
+		}
+	}
+
+	unsigned int iSequence = 0;
+	for(;;)
+	{
+		int iBuffer = 0;
+		if(nStarted > 0)
+		{
+			WaitForSingleObject(Job.hFree, INFINITE);
+			EnterCriticalSection(&Job.csBuffers);
+			iBuffer = Job.rgFreeBuffers.back();
+			Job.rgFreeBuffers.pop_back();
+			LeaveCriticalSection(&Job.csBuffers);
+		}
+		DWORD cb;
+		BOOL bRead = pSource->Read(&Job.rgBuffers[iBuffer][0], (DWORD) Job.rgBuffers[iBuffer].size(), &cb);
+		m_BuildStats.Enumerate += StopTimer(Timer);
+		if(!bRead)
+			break;
+		m_BuildStats.nReads++;
+		if(nStarted == 0)
+		{
+			ParseBuffer(Job.rgStages.back(), &Job.rgBuffers[iBuffer][0], cb, iSequence++);
+			m_BuildStats.Insert += StopTimer(Timer);
+			continue;
+		}
+		Job.rgBufferSizes[iBuffer] = cb;
+		Job.rgBufferSequence[iBuffer] = iSequence++;
+		EnterCriticalSection(&Job.csBuffers);
+		Job.rgFilledBuffers.push_back(iBuffer);
+		LeaveCriticalSection(&Job.csBuffers);
+		ReleaseSemaphore(Job.hFilled, 1, NULL);
+	}
+
+	//Stop the parsers after they parsed the remaining buffers
+	if(nStarted > 0)
+	{
+		EnterCriticalSection(&Job.csBuffers);
+		for(unsigned int t = 0; t != nStarted; t++)
+			Job.rgFilledBuffers.push_back(-1);
+		LeaveCriticalSection(&Job.csBuffers);
+		ReleaseSemaphore(Job.hFilled, nStarted, NULL);
+		WaitForSingleObject(Job.hDone, INFINITE);
+		m_BuildStats.Insert += StopTimer(Timer);
+	}
+	if(Job.hFree != NULL)
+		CloseHandle(Job.hFree);
+	if(Job.hFilled != NULL)
+		CloseHandle(Job.hFilled);
+	if(Job.hDone != NULL)
+		CloseHandle(Job.hDone);
+	DeleteCriticalSection(&Job.csBuffers);
+	vector<vector<BYTE> >().swap(Job.rgBuffers);
+}
+
 
+
+// Thread function of the parser threads. Parses the queued buffers into its own stage until it takes a stop marker.
+DWORD WINAPI CDriveIndex::ParseWorker(LPVOID lpParameter)
+{
+	BuildJob *Job = (BuildJob*) lpParameter;
+	BuildStage &Stage = Job->rgStages[InterlockedIncrement(&Job->iNextThread) - 1];
+	for(;;)
+	{
+		WaitForSingleObject(Job->hFilled, INFINITE);
+		EnterCriticalSection(&Job->csBuffers);
+		int iBuffer = Job->rgFilledBuffers.front();
+		Job->rgFilledBuffers.pop_front();
+		LeaveCriticalSection(&Job->csBuffers);
+		if(iBuffer == -1)
+			break;
+		Job->pIndex->ParseBuffer(Stage, &Job->rgBuffers[iBuffer][0], Job->rgBufferSizes[iBuffer], Job->rgBufferSequence[iBuffer]);
+		EnterCriticalSection(&Job->csBuffers);
+		Job->rgFreeBuffers.push_back(iBuffer);
+		LeaveCriticalSection(&Job->csBuffers);
+		ReleaseSemaphore(Job->hFree, 1, NULL);
+	}
+	if(InterlockedDecrement(&Job->nRunning) == 0)
+		SetEvent(Job->hDone);
+	return 0;
+}
+
+
+
+// Adds the records of an enumeration buffer to a stage as one batch.
+// This is called by several threads at once, so it must not modify the database.
+void CDriveIndex::ParseBuffer(BuildStage &Stage, PBYTE pData, DWORD cb, unsigned int iSequence)
+{
+	BuildBatch Batch;
+	Batch.iSequence = iSequence;
+	Batch.iFile = Stage.Files.size();
+	Batch.iDirectory = Stage.Directories.size();
+	Batch.iName = Stage.Names.size();
+	PUSN_RECORD pRecord = (PUSN_RECORD) &pData[sizeof(USN)];
+	while ((PBYTE) pRecord < (pData + cb))
+	{
+		wstring sz((LPCWSTR) ((PBYTE) pRecord + pRecord->FileNameOffset), pRecord->FileNameLength / sizeof(WCHAR));
+		if ((pRecord->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		{
+			IndexedDirectory i;
+			i.RecordNumber = RECORD_NUMBER(pRecord->FileReferenceNumber);
+			i.NameOffset = (unsigned int) (Stage.Names.size() - Batch.iName);
+			i.NameLength = (unsigned int) sz.length();
+			Stage.Directories.Add(i);
+			Stage.DirectoryParents.Add(RECORD_NUMBER(pRecord->ParentFileReferenceNumber));
+		}
+		else
+		{
+			IndexedFile i;
+			i.RecordNumber = RECORD_NUMBER(pRecord->FileReferenceNumber);
+			i.NameOffset = (unsigned int) (Stage.Names.size() - Batch.iName);
+			i.NameLength = (unsigned int) sz.length();
+			Stage.Files.Add(i);
+			Stage.FileParents.Add(RECORD_NUMBER(pRecord->ParentFileReferenceNumber));
+		}
+		Stage.Names.Add(sz.c_str(), sz.length());
+		pRecord = (PUSN_RECORD) ((PBYTE) pRecord + pRecord->RecordLength);
+	}
+	Batch.nFiles = Stage.Files.size() - Batch.iFile;
+	Batch.nDirectories = Stage.Directories.size() - Batch.iDirectory;
+	Batch.nNames = Stage.Names.size() - Batch.iName;
+	Stage.Batches.insert(Stage.Batches.end(), Batch);
+}
+
+
+
+// Copies the batches of all stages into the database in the order they were read. The root directory is added first.
+// The record numbers of the parents are stored in the vectors, in the same order as the entries.
+void CDriveIndex::MergeStages(BuildJob &Job, vector<unsigned int> &rgFileParents, vector<unsigned int> &rgDirectoryParents)
+{
 	WCHAR szRoot[_MAX_PATH];
-	wsprintf(szRoot, TEXT("%c:\\"), m_cDrive);
-	HANDLE hDir = CreateFile(szRoot, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
-		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
-
-	BY_HANDLE_FILE_INFORMATION fi;
-	GetFileInformationByHandle(hDir, &fi);
-	CloseHandle(hDir);
-	DWORDLONG IndexRoot = (((DWORDLONG) fi.nFileIndexHigh) << 32) | fi.nFileIndexLow;
 	wsprintf(szRoot, TEXT("%c:"), m_cDrive);
-	AddDir(IndexRoot, &wstring(szRoot), 0);
-	DirectoryParents.insert(DirectoryParents.end(), 0);
-	m_dwDriveFRN = IndexRoot;
+	wstring strRoot(szRoot);
 
-	MFT_ENUM_DATA med;
-	med.StartFileReferenceNumber = 0;
-	med.LowUsn = 0;
-	med.HighUsn = ujd.NextUsn;
+	vector<BuildBatch> rgBatches;
+	size_t nFiles = 0;
+	size_t nDirectories = 1;
+	size_t nNames = strRoot.length();
+	for(unsigned int t = 0; t != Job.rgStages.size(); t++)
+	{
+		for(unsigned int j = 0; j != Job.rgStages[t].Batches.size(); j++)
+		{
+			BuildBatch &Batch = Job.rgStages[t].Batches[j];
+			Batch.iStage = t;
+			nFiles += Batch.nFiles;
+			nDirectories += Batch.nDirectories;
+			nNames += Batch.nNames;
+			rgBatches.insert(rgBatches.end(), Batch);
+		}
+	}
+	sort(rgBatches.begin(), rgBatches.end());
+
+	rgFiles.resize(nFiles);
+	rgFileFilters.resize(nFiles);
+	rgFileParents.resize(nFiles);
+	rgDirectories.resize(nDirectories);
+	rgDirectoryFilters.resize(nDirectories);
+	rgDirectoryParents.resize(nDirectories);
+	rgNames.resize(nNames);
+
+	rgDirectories[0].RecordNumber = RECORD_NUMBER(m_dwDriveFRN);
+	rgDirectories[0].NameOffset = 0;
+	rgDirectories[0].NameLength = (unsigned int) strRoot.length();
+	rgDirectoryParents[0] = NO_RECORD;
+	copy(strRoot.begin(), strRoot.end(), rgNames.begin());
+
+	size_t iFile = 0;
+	size_t iDirectory = 1;
+	size_t iName = strRoot.length();
+	for(unsigned int j = 0; j != rgBatches.size(); j++)
+	{
+		BuildBatch &Batch = rgBatches[j];
+		BuildStage &Stage = Job.rgStages[Batch.iStage];
+		if(Batch.nFiles > 0)
+		{
+			Stage.Files.CopyTo(Batch.iFile, Batch.nFiles, &rgFiles[iFile]);
+			Stage.FileParents.CopyTo(Batch.iFile, Batch.nFiles, &rgFileParents[iFile]);
+			for(size_t k = iFile; k != iFile + Batch.nFiles; k++)
+				rgFiles[k].NameOffset += (unsigned int) iName;
+			iFile += Batch.nFiles;
+		}
+		if(Batch.nDirectories > 0)
+		{
+			Stage.Directories.CopyTo(Batch.iDirectory, Batch.nDirectories, &rgDirectories[iDirectory]);
+			Stage.DirectoryParents.CopyTo(Batch.iDirectory, Batch.nDirectories, &rgDirectoryParents[iDirectory]);
+			for(size_t k = iDirectory; k != iDirectory + Batch.nDirectories; k++)
+				rgDirectories[k].NameOffset += (unsigned int) iName;
+			iDirectory += Batch.nDirectories;
+		}
+		if(Batch.nNames > 0)
+			Stage.Names.CopyTo(Batch.iName, Batch.nNames, &rgNames[iName]);
+		iName += Batch.nNames;
+	}
+	m_BuildStats.nRecords = nFiles + nDirectories - 1;
+}
+
+
+
+// Sets the ParentOffset members. The vectors contain the record numbers of the parents in the order of rgFiles and rgDirectories.
+// rgRecordOffsets needs to be up to date.
+void CDriveIndex::LinkParents(vector<unsigned int> &rgFileParents, vector<unsigned int> &rgDirectoryParents)
+{
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+	{
+		INT64 iOffset = FindDirOffsetByIndex(rgFileParents[j]);
+		rgFiles[j].ParentOffset = iOffset == -1 ? NO_PARENT : (unsigned int) iOffset;
+	}
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+	{
+		INT64 iOffset = FindDirOffsetByIndex(rgDirectoryParents[j]);
+		rgDirectories[j].ParentOffset = iOffset == -1 || iOffset == j ? NO_PARENT : (unsigned int) iOffset; // A directory must not be its own parent
+	}
+	DirPathCache.clear();
+}
+
+
+
+// Restores the names and parent links of an index that was loaded from a file written by an older version.
+// This queries the volume once per entry.
+void CDriveIndex::ResolveFromVolume()
+{
+	vector<unsigned int> FileParents(rgFiles.size());
+	vector<unsigned int> DirectoryParents(rgDirectories.size());
+	rgNames.clear();
+	NameDictionary.Clear();
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+	{
+		USNEntry file = FRNToName(rgFiles[j].RecordNumber);
+		rgFiles[j].NameOffset = AddName(&file.Name);
+		rgFiles[j].NameLength = (unsigned int) file.Name.length();
+		FileParents[j] = RECORD_NUMBER(file.ParentIndex);
+	}
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+	{
+		USNEntry file = FRNToName(rgDirectories[j].RecordNumber);
+		rgDirectories[j].NameOffset = AddName(&file.Name);
+		rgDirectories[j].NameLength = (unsigned int) file.Name.length();
+		DirectoryParents[j] = RECORD_NUMBER(file.ParentIndex);
+	}
+	LinkParents(FileParents, DirectoryParents);
+}
+
+// Reads all new records from the USN journal and applies them to the database in one batch.
+// If records were lost because the journal was deleted or wrapped around, the database is rebuilt from the MFT.
+int CDriveIndex::UpdateIndex()
+{
+	USN_JOURNAL_DATA ujd;
+	if(!Query(&ujd))
+		return 0;
+	if(m_NextUsn == 0 || ujd.UsnJournalID != m_UsnJournalID || m_NextUsn < ujd.LowestValidUsn)
+	{
+		PopulateIndex();
+		return -1;
+	}
 
-	// Process MFT in 64k chunks
-	BYTE pData[sizeof(DWORDLONG) + 0x10000];
-	DWORDLONG fnLast = 0;
+	READ_USN_JOURNAL_DATA rujd;
+	rujd.StartUsn = m_NextUsn;
+	rujd.ReasonMask = JOURNAL_REASON_MASK;
+	rujd.ReturnOnlyOnClose = FALSE;
+	rujd.Timeout = 0;
+	rujd.BytesToWaitFor = 0;
+	rujd.UsnJournalID = m_UsnJournalID;
+
+	BYTE pData[sizeof(USN) + ENUM_BUFFER_SIZE];
 	DWORD cb;
-	unsigned int num = 0;
-	unsigned int numDirs = 1;
-	while (DeviceIoControl(m_hVol, FSCTL_ENUM_USN_DATA, &med, sizeof(med), pData, sizeof(pData), &cb, NULL) != FALSE) {
+	while (DeviceIoControl(m_hVol, FSCTL_READ_USN_JOURNAL, &rujd, sizeof(rujd), pData, sizeof(pData), &cb, NULL) != FALSE)
+	{
+		// Only the next USN is returned when there are no more records
+		if(cb <= sizeof(USN))
+			break;
+		ReadJournalBuffer(pData, cb);
+		rujd.StartUsn = m_NextUsn;
+	}
+	DWORD dwError = GetLastError();
+	if(dwError == ERROR_JOURNAL_ENTRY_DELETED || dwError == ERROR_JOURNAL_NOT_ACTIVE || dwError == ERROR_JOURNAL_DELETE_IN_PROGRESS)
+	{
+		PopulateIndex();
+		return -1;
+	}
+	return ApplyJournalChanges();
+}
 
-		PUSN_RECORD pRecord = (PUSN_RECORD) &pData[sizeof(USN)];
-		while ((PBYTE) pRecord < (pData + cb)) {
-			if ((pRecord->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
-				numDirs++;
-			else
-				num++;
-			pRecord = (PUSN_RECORD) ((PBYTE) pRecord + pRecord->RecordLength);
+
+
+// Decodes a buffer in the format returned by FSCTL_READ_USN_JOURNAL (the next USN, followed by USN_RECORDs)
+// and remembers the changes until ApplyJournalChanges() is called. Only the most recent state of each record is kept,
+// a record that was reused for a new entry only keeps the state of the new entry.
+void CDriveIndex::ReadJournalBuffer(PBYTE pData, DWORD cb)
+{
+	if(cb < sizeof(USN))
+		return;
+	PUSN_RECORD pRecord = (PUSN_RECORD) &pData[sizeof(USN)];
+	while ((PBYTE) pRecord < (pData + cb) && pRecord->RecordLength != 0)
+	{
+		if(pRecord->MajorVersion == 2)
+		{
+			if(pRecord->Reason & USN_REASON_FILE_DELETE)
+			{
+				JournalChange &change = PendingChanges[RECORD_NUMBER(pRecord->FileReferenceNumber)];
+				change.bDeleted = true;
+				change.bDirectory = (pRecord->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			}
+			else if(pRecord->Reason & (USN_REASON_FILE_CREATE | USN_REASON_RENAME_NEW_NAME))
+			{
+				//Creations, renames and moves all carry the current name and parent
+				JournalChange &change = PendingChanges[RECORD_NUMBER(pRecord->FileReferenceNumber)];
+				change.Name = wstring((LPCWSTR) ((PBYTE) pRecord + pRecord->FileNameOffset), pRecord->FileNameLength / sizeof(WCHAR));
+				change.ParentIndex = pRecord->ParentFileReferenceNumber;
+				change.bDirectory = (pRecord->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+				change.bDeleted = false;
+			}
 		}
-		med.StartFileReferenceNumber = * (DWORDLONG *) pData;
+		pRecord = (PUSN_RECORD) ((PBYTE) pRecord + pRecord->RecordLength);
 	}
-	
-	FileParents.reserve(num);
-	DirectoryParents.reserve(numDirs);
-	rgFiles.reserve(num);
-	rgDirectories.reserve(numDirs);
-	hash_map<DWORDLONG, HashMapEntry> hmFiles;
-	hash_map<DWORDLONG, HashMapEntry> hmDirectories;
-	hash_map<DWORDLONG, HashMapEntry>::iterator it;
-	med.StartFileReferenceNumber = 0;
-	while (DeviceIoControl(m_hVol, FSCTL_ENUM_USN_DATA, &med, sizeof(med), pData, sizeof(pData), &cb, NULL) != FALSE)
+	m_NextUsn = * (USN *) pData;
+}
+
+
+
+//Removes the entries at the positions in rgDeleted from rgIndex and appends the entries in rgNew. The other entries keep
+//their order. rgFilters and rgNewFilters contain the filters of the entries and are changed the same way.
+//If rgRemap is not NULL it receives the new position of every previous entry (NO_PARENT for removed ones).
+template <class T>
+void MergeEntries(CIndexArray<T> &rgIndex, CIndexArray<DWORDLONG> &rgFilters, vector<unsigned int> &rgDeleted, vector<T> &rgNew, vector<DWORDLONG> &rgNewFilters, vector<unsigned int> *rgRemap)
+{
+	sort(rgDeleted.begin(), rgDeleted.end());
+	vector<T> rgMerged;
+	vector<DWORDLONG> rgMergedFilters;
+	rgMerged.reserve(rgIndex.size() - rgDeleted.size() + rgNew.size());
+	rgMergedFilters.reserve(rgMerged.capacity());
+	if(rgRemap != NULL)
+		rgRemap->resize(rgIndex.size());
+	unsigned int iDeleted = 0;
+	for(unsigned int j = 0; j != rgIndex.size(); j++)
 	{
-		PUSN_RECORD pRecord = (PUSN_RECORD) &pData[sizeof(USN)];
-		while ((PBYTE) pRecord < (pData + cb))
+		if(iDeleted != rgDeleted.size() && rgDeleted[iDeleted] == j)
+		{
+			while(iDeleted != rgDeleted.size() && rgDeleted[iDeleted] == j)
+				iDeleted++;
+			if(rgRemap != NULL)
+				(*rgRemap)[j] = NO_PARENT;
+			continue;
+		}
+		if(rgRemap != NULL)
+			(*rgRemap)[j] = (unsigned int) rgMerged.size();
+		rgMerged.insert(rgMerged.end(), rgIndex[j]);
+		rgMergedFilters.insert(rgMergedFilters.end(), rgFilters[j]);
+	}
+	rgMerged.insert(rgMerged.end(), rgNew.begin(), rgNew.end());
+	rgMergedFilters.insert(rgMergedFilters.end(), rgNewFilters.begin(), rgNewFilters.end());
+	rgIndex.swap(rgMerged);
+	rgFilters.swap(rgMergedFilters);
+}
+
+
+
+// Applies the changes collected by ReadJournalBuffer(). New entries are appended to rgFiles and rgDirectories,
+// the parent offsets are updated if directories were added or removed.
+// Returns the number of changed files and directories.
+int CDriveIndex::ApplyJournalChanges()
+{
+	if(PendingChanges.size() == 0)
+		return 0;
+	int nChanges = 0;
+	BOOL bDirectoriesChanged = false;
+	BOOL bRecount = false;
+	vector<unsigned int> rgDeletedFiles;
+	vector<unsigned int> rgDeletedDirectories;
+	vector<IndexedFile> rgNewFiles;
+	vector<IndexedDirectory> rgNewDirectories;
+	vector<pair<unsigned int, unsigned int> > rgFileParents; //Entries whose parent needs to be set after merging, record number -> record number of the parent
+	vector<pair<unsigned int, unsigned int> > rgDirectoryParents;
+
+	for(hash_map<unsigned int, JournalChange>::iterator it = PendingChanges.begin(); it != PendingChanges.end(); it++)
+	{
+		JournalChange &change = it->second;
+		//A record that belongs to an entry of the other kind was reused, the old entry was deleted
+		INT64 iOther = change.bDirectory ? FindOffsetByIndex(it->first) : FindDirOffsetByIndex(it->first);
+		if(iOther != -1)
 		{
-			wstring sz((LPCWSTR) ((PBYTE) pRecord + pRecord->FileNameOffset), pRecord->FileNameLength / sizeof(WCHAR));
-			if ((pRecord->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+			IndexedFile *i = change.bDirectory ? &rgFiles[(unsigned int) iOther] : (IndexedFile*) &rgDirectories[(unsigned int) iOther];
+			m_nUnusedNames += i->NameLength;
+			nChanges++;
+			if(change.bDirectory)
 			{
-				AddDir(pRecord->FileReferenceNumber, &sz, pRecord->ParentFileReferenceNumber);
-				//DirectoryParents.insert(DirectoryParents.end(), pRecord->ParentFileReferenceNumber);
-				HashMapEntry hme;
-				hme.iOffset = rgDirectories.size() - 1;
-				hme.ParentFRN = pRecord->ParentFileReferenceNumber;
-				hmDirectories[pRecord->FileReferenceNumber] = hme;
+				AdjustFileCount(i->ParentOffset, -1);
+				rgDeletedFiles.insert(rgDeletedFiles.end(), (unsigned int) iOther);
 			}
 			else
 			{
-				Add(pRecord->FileReferenceNumber, &sz, pRecord->ParentFileReferenceNumber);
-				HashMapEntry hme;
-				hme.iOffset = rgFiles.size() - 1;
-				hme.ParentFRN = pRecord->ParentFileReferenceNumber;
-				//FileParents.insert(FileParents.end(), pRecord->ParentFileReferenceNumber);
-				hmFiles[pRecord->FileReferenceNumber] = hme;
+				rgDeletedDirectories.insert(rgDeletedDirectories.end(), (unsigned int) iOther);
+				bDirectoriesChanged = true;
 			}
-			pRecord = (PUSN_RECORD) ((PBYTE) pRecord + pRecord->RecordLength);
 		}
-		med.StartFileReferenceNumber = * (DWORDLONG *) pData;
+		INT64 iOffset = change.bDirectory ? FindDirOffsetByIndex(it->first) : FindOffsetByIndex(it->first);
+		if(iOffset == -1)
+		{
+			//New entry. Entries that were created and deleted again in the same batch are skipped.
+			if(change.bDeleted)
+				continue;
+			if(change.bDirectory)
+			{
+				IndexedDirectory i;
+				i.RecordNumber = it->first;
+				i.NameOffset = AddName(&change.Name);
+				i.NameLength = (unsigned int) change.Name.length();
+				rgNewDirectories.insert(rgNewDirectories.end(), i);
+				rgDirectoryParents.insert(rgDirectoryParents.end(), pair<unsigned int, unsigned int>(it->first, RECORD_NUMBER(change.ParentIndex)));
+				bDirectoriesChanged = true;
+			}
+			else
+			{
+				IndexedFile i;
+				i.RecordNumber = it->first;
+				i.NameOffset = AddName(&change.Name);
+				i.NameLength = (unsigned int) change.Name.length();
+				rgNewFiles.insert(rgNewFiles.end(), i);
+				rgFileParents.insert(rgFileParents.end(), pair<unsigned int, unsigned int>(it->first, RECORD_NUMBER(change.ParentIndex)));
+			}
+			nChanges++;
+			continue;
+		}
+
+		//Existing entry. Deletions, renames and moves are handled while the offsets are still valid.
+		IndexedFile *i = change.bDirectory ? (IndexedFile*) &rgDirectories[(unsigned int) iOffset] : &rgFiles[(unsigned int) iOffset];
+		nChanges++;
+		if(change.bDirectory)
+			bDirectoriesChanged = true;
+		else //The file is counted again for its new parent below
+			AdjustFileCount(i->ParentOffset, -1);
+		if(change.bDeleted)
+		{
+			m_nUnusedNames += i->NameLength;
+			if(change.bDirectory)
+				rgDeletedDirectories.insert(rgDeletedDirectories.end(), (unsigned int) iOffset);
+			else
+				rgDeletedFiles.insert(rgDeletedFiles.end(), (unsigned int) iOffset);
+			continue;
+		}
+		if(GetName(i).compare(change.Name) != 0)
+		{
+			m_nUnusedNames += i->NameLength;
+			i->NameOffset = AddName(&change.Name);
+			i->NameLength = (unsigned int) change.Name.length();
+			(change.bDirectory ? rgDirectoryFilters : rgFileFilters)[(unsigned int) iOffset] = MakeFilter(&change.Name);
+		}
+		if(change.bDirectory)
+		{
+			//A moved directory takes all of its files and subdirectories with it, this is handled by counting them again
+			if(i->ParentOffset == NO_PARENT || rgDirectories[i->ParentOffset].RecordNumber != RECORD_NUMBER(change.ParentIndex))
+				bRecount = true;
+			rgDirectoryParents.insert(rgDirectoryParents.end(), pair<unsigned int, unsigned int>(it->first, RECORD_NUMBER(change.ParentIndex)));
+		}
+		else
+			rgFileParents.insert(rgFileParents.end(), pair<unsigned int, unsigned int>(it->first, RECORD_NUMBER(change.ParentIndex)));
 	}
+	PendingChanges.clear();
+
+	//New and deleted directories change the number of subdirectories of all of their parents
+	if(rgDeletedDirectories.size() != 0 || rgNewDirectories.size() != 0)
+		bRecount = true;
 
-	//Calculate files per directory. This takes most of the indexing time, but this information can be useful to reduce the time needed
-	//for searching in directories with few files (less than 10k).
-	for ( it=hmFiles.begin() ; it != hmFiles.end(); it++ )
+	//Directories are referenced by their position, so all parent offsets need to be moved when directories are added or removed
+	if(rgDeletedDirectories.size() != 0 || rgNewDirectories.size() != 0)
 	{
-		HashMapEntry* hme = &hmDirectories[it->second.ParentFRN];
-		do
+		vector<unsigned int> rgRemap;
+		sort(rgNewDirectories.begin(), rgNewDirectories.end());
+		vector<DWORDLONG> rgNewFilters(rgNewDirectories.size());
+		for(unsigned int j = 0; j != rgNewDirectories.size(); j++)
+			rgNewFilters[j] = MakeFilter(&GetName((IndexedFile*) &rgNewDirectories[j]));
+		MergeEntries(rgDirectories, rgDirectoryFilters, rgDeletedDirectories, rgNewDirectories, rgNewFilters, &rgRemap);
+		for(unsigned int j = 0; j != rgFiles.size(); j++)
+			if(rgFiles[j].ParentOffset != NO_PARENT)
+				rgFiles[j].ParentOffset = rgRemap[rgFiles[j].ParentOffset];
+		for(unsigned int j = 0; j != rgDirectories.size(); j++)
+			if(rgDirectories[j].ParentOffset != NO_PARENT && rgDirectories[j].ParentOffset < rgRemap.size())
+				rgDirectories[j].ParentOffset = rgRemap[rgDirectories[j].ParentOffset];
+	}
+	if(rgDeletedFiles.size() != 0 || rgNewFiles.size() != 0)
+	{
+		sort(rgNewFiles.begin(), rgNewFiles.end());
+		vector<DWORDLONG> rgNewFilters(rgNewFiles.size());
+		for(unsigned int j = 0; j != rgNewFiles.size(); j++)
+			rgNewFilters[j] = MakeFilter(&GetName(&rgNewFiles[j]));
+		MergeEntries(rgFiles, rgFileFilters, rgDeletedFiles, rgNewFiles, rgNewFilters, (vector<unsigned int>*) NULL);
+	}
+
+	//Parents can only be resolved after all directories are at their final position
+	if(rgDeletedDirectories.size() != 0 || rgNewDirectories.size() != 0 || rgDeletedFiles.size() != 0 || rgNewFiles.size() != 0)
+		BuildRecordTable();
+	for(unsigned int j = 0; j != rgDirectoryParents.size(); j++)
+	{
+		INT64 iOffset = FindDirOffsetByIndex(rgDirectoryParents[j].first);
+		INT64 iParent = FindDirOffsetByIndex(rgDirectoryParents[j].second);
+		rgDirectories[(unsigned int) iOffset].ParentOffset = iParent == -1 || iParent == iOffset ? NO_PARENT : (unsigned int) iParent;
+	}
+	for(unsigned int j = 0; j != rgFileParents.size(); j++)
+	{
+		INT64 iOffset = FindOffsetByIndex(rgFileParents[j].first);
+		INT64 iParent = FindDirOffsetByIndex(rgFileParents[j].second);
+		rgFiles[(unsigned int) iOffset].ParentOffset = iParent == -1 ? NO_PARENT : (unsigned int) iParent;
+		if(!bRecount)
+			AdjustFileCount(rgFiles[(unsigned int) iOffset].ParentOffset, 1);
+	}
+	if(bRecount)
+	{
+		CountSubtrees();
+		BuildDirectoryTree();
+	}
+
+	if(bDirectoriesChanged)
+		DirPathCache.clear();
+	//Names are shared in the compact name mode, so m_nUnusedNames overestimates the unused ones there. The dictionary
+	//is also compacted when many names were appended, they aren't front-coded and take longer to find.
+	if(m_bCompactNames)
+	{
+		if(m_nUnusedNames > NameDictionary.GetData().size() || NameDictionary.GetAppendedCount() > NameDictionary.GetSortedCount() / 8)
+			CompactNames();
+	}
+	else if(m_nUnusedNames > rgNames.size() / 2)
+		CompactNames();
+
+	//The posting lists refer to positions which have changed
+	if(m_bTrigramIndex)
+		BuildTrigramIndex();
+	BuildExtensionIndex();
+
+	//Previous results may contain entries that don't exist anymore
+	ClearLastResult();
+	m_nGeneration++;
+	return nChanges;
+}
+
+
+
+// Adds nFiles to the file count of a directory and all of its parents
+void CDriveIndex::AdjustFileCount(unsigned int iDirectory, int nFiles)
+{
+	unsigned int nLevels = 0;
+	while(iDirectory != NO_PARENT && nLevels++ != rgDirectories.size())
+	{
+		rgDirectories[iDirectory].nFiles += nFiles;
+		iDirectory = rgDirectories[iDirectory].ParentOffset;
+	}
+}
+
+
+
+// Returns the positions of all directories, ordered so that each directory comes before its parent.
+// Directories that are part of a parent cycle (which only happens with damaged data) are left out.
+void CDriveIndex::GetBottomUpOrder(vector<unsigned int> &rgOrder)
+{
+	//Start with the directories without subdirectories, a parent follows once all of its subdirectories were added
+	vector<unsigned int> rgSubdirectories(rgDirectories.size(), 0);
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+		if(rgDirectories[j].ParentOffset != NO_PARENT)
+			rgSubdirectories[rgDirectories[j].ParentOffset]++;
+	rgOrder.clear();
+	rgOrder.reserve(rgDirectories.size());
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+		if(rgSubdirectories[j] == 0)
+			rgOrder.insert(rgOrder.end(), j);
+	for(unsigned int j = 0; j != rgOrder.size(); j++)
+	{
+		unsigned int iParent = rgDirectories[rgOrder[j]].ParentOffset;
+		if(iParent != NO_PARENT && --rgSubdirectories[iParent] == 0)
+			rgOrder.insert(rgOrder.end(), iParent);
+	}
+}
+
+
+
+// Sets nFiles and nDirectories of all directories. Each entry is visited once: the files are counted
+// for their parent, then the counts are added to the parents from the bottom of the tree to the top.
+void CDriveIndex::CountSubtrees()
+{
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+	{
+		rgDirectories[j].nFiles = 0;
+		rgDirectories[j].nDirectories = 0;
+	}
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+		if(rgFiles[j].ParentOffset != NO_PARENT)
+			rgDirectories[rgFiles[j].ParentOffset].nFiles++;
+	vector<unsigned int> rgOrder;
+	GetBottomUpOrder(rgOrder);
+	for(unsigned int j = 0; j != rgOrder.size(); j++)
+	{
+		IndexedDirectory &Directory = rgDirectories[rgOrder[j]];
+		if(Directory.ParentOffset != NO_PARENT)
+		{
+			rgDirectories[Directory.ParentOffset].nFiles += Directory.nFiles;
+			rgDirectories[Directory.ParentOffset].nDirectories += Directory.nDirectories + 1;
+		}
+	}
+}
+
+
+
+// Builds the lists of subdirectories and numbers the directories in depth-first order. All subdirectories of a directory
+// follow it directly in this order, so directory k is inside directory j if rgPreorder[k] - rgPreorder[j] <= nDirectories of j.
+// Directories that are part of a parent cycle (which only happens with damaged data) can't be reached and get NO_PARENT.
+// CountSubtrees() needs to be called first.
+void CDriveIndex::BuildDirectoryTree()
+{
+	//Sort the directories by their parent
+	unsigned int nDirectories = (unsigned int) rgDirectories.size();
+	rgChildStart.assign(nDirectories + 1, 0);
+	for(unsigned int j = 0; j != nDirectories; j++)
+		if(rgDirectories[j].ParentOffset != NO_PARENT)
+			rgChildStart[rgDirectories[j].ParentOffset + 1]++;
+	for(unsigned int j = 0; j != nDirectories; j++)
+		rgChildStart[j + 1] += rgChildStart[j];
+	rgChildDirectories.resize(rgChildStart[nDirectories]);
+	vector<unsigned int> rgNext(rgChildStart.begin(), rgChildStart.end() - 1);
+	for(unsigned int j = 0; j != nDirectories; j++)
+		if(rgDirectories[j].ParentOffset != NO_PARENT)
+			rgChildDirectories[rgNext[rgDirectories[j].ParentOffset]++] = j;
+
+	//Traverse the trees of all directories without parent. The subdirectories are pushed on the stack at once,
+	//but the subtree of the one on top is completed before the next one is taken.
+	rgPreorder.assign(nDirectories, NO_PARENT);
+	unsigned int nVisited = 0;
+	vector<unsigned int> rgStack;
+	for(unsigned int j = 0; j != nDirectories; j++)
+	{
+		if(rgDirectories[j].ParentOffset != NO_PARENT)
+			continue;
+		rgStack.insert(rgStack.end(), j);
+		while(rgStack.size() != 0)
 		{
-			rgDirectories[hme->iOffset].nFiles++;
-			HashMapEntry* hme2 = &hmDirectories[it->second.ParentFRN];
+			unsigned int iDirectory = rgStack.back();
+			rgStack.pop_back();
+			rgPreorder[iDirectory] = nVisited++;
+			for(unsigned int k = rgChildStart[iDirectory + 1]; k != rgChildStart[iDirectory]; k--)
+				rgStack.insert(rgStack.end(), rgChildDirectories[k - 1]);
+		}
+	}
+}
+
 
-			if(hme != hme2)
-				hme = hme2;
-			else // This must not happen, otherwise a directory is its own parent!
+
+// Finds a directory by its path (lowercase) by following the lists of subdirectories from the root of the volume,
+// without accessing the volume. Empty parts of the path (e.g. a trailing backslash) are ignored.
+// Returns the position of the directory or NO_PARENT if the path is not a directory in the index.
+unsigned int CDriveIndex::FindDirectoryByPath(wstring &strPathLower)
+{
+	INT64 iRoot = FindDirOffsetByIndex(m_dwDriveFRN);
+	if(iRoot == -1 || rgChildStart.size() != rgDirectories.size() + 1)
+		return NO_PARENT;
+	unsigned int iDirectory = NO_PARENT;
+	size_t iStart = 0;
+	while(iStart < strPathLower.length())
+	{
+		size_t iEnd = strPathLower.find(L'\\', iStart);
+		if(iEnd == wstring::npos)
+			iEnd = strPathLower.length();
+		const WCHAR *szPart = strPathLower.c_str() + iStart;
+		unsigned int nPart = (unsigned int) (iEnd - iStart);
+		iStart = iEnd + 1;
+		if(nPart == 0)
+			continue;
+		//The first part is the name of the root directory (the drive), the others are subdirectories
+		unsigned int k = iDirectory == NO_PARENT ? 0 : rgChildStart[iDirectory];
+		unsigned int kEnd = iDirectory == NO_PARENT ? 1 : rgChildStart[iDirectory + 1];
+		for(; k != kEnd; k++)
+		{
+			unsigned int iChild = iDirectory == NO_PARENT ? (unsigned int) iRoot : rgChildDirectories[k];
+			IndexedDirectory &Child = rgDirectories[iChild];
+			if(Child.NameLength == nPart && FindFolded(GetNameCharsCached((IndexedFile*) &Child), nPart, szPart, nPart) == 0)
+			{
+				iDirectory = iChild;
 				break;
-		} while(hme->ParentFRN != 0);
-	}
-	//for(unsigned int i = 0; i != FileParents.size(); i++)
-	//{
-	//	DWORDLONG dwIndex = FileParents[i];
-	//	while(dwIndex != 0)
-	//	{
-	//		int iOffset = -1;
-	//		for(unsigned int j = 0; j != rgDirectories.size(); j++)
-	//			if(rgDirectories[j].Index == dwIndex)
-	//			{
-	//				iOffset = j;
-	//				break;
-	//			}
-	//		if(iOffset == -1)
-	//			break;
-	//		rgDirectories[iOffset].nFiles++;
-	//		DWORDLONG dwIndex2 = DirectoryParents[iOffset];
-
-	//		if(dwIndex != dwIndex2)
-	//			dwIndex = dwIndex2;
-	//		else // This must not happen, otherwise a directory is its own parent!
-	//			break;
-	//	}
-	//	//wstring strPath;
-	//	//GetDir(dwIndex, &strPath);
-
-	//	//do {
-	//	//	//USNEntry file = FRNToName(dwIndex);
-	//	//	int iOffset = -1;
-	//	//	for(int j = 0; j != rgDirectories.size(); j++)
-	//	//		if(rgDirectories[j].Index == dwIndex)
-	//	//		{
-	//	//				iOffset = j;
-	//	//				break;
-	//	//		}
-	//	//	if(iOffset == -1)
-	//	//		break;
-	//	//	//USNEntry parent = FRNToName(file.ParentIndex);
-	//	//	//USNEntry parent2 = FRNToName(rgDirectories[iOffset].Index);
-	//	//	rgDirectories[iOffset].nFiles++;
-	//	//	dwIndex = file.ParentIndex;
-	//	//} while (dwIndex != 0);
-	//}
-	rgFiles.shrink_to_fit();
-	rgDirectories.shrink_to_fit();
-	sort(rgFiles.begin(), rgFiles.end());
-	sort(rgDirectories.begin(), rgDirectories.end());
+			}
+		}
+		if(k == kEnd)
+			return NO_PARENT;
+	}
+	return iDirectory;
+}
+
+
+
+// Rebuilds the name buffer without the names of deleted and renamed entries
+void CDriveIndex::CompactNames()
+{
+	if(m_bCompactNames)
+	{
+		NameDictionary.Compact(rgFiles, rgDirectories);
+		m_nUnusedNames = 0;
+		return;
+	}
+	vector<WCHAR> rgCompacted;
+	rgCompacted.reserve(rgNames.size() - m_nUnusedNames);
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+	{
+		unsigned int iOffset = (unsigned int) rgCompacted.size();
+		if(rgFiles[j].NameLength != 0)
+			rgCompacted.insert(rgCompacted.end(), rgNames.begin() + rgFiles[j].NameOffset, rgNames.begin() + rgFiles[j].NameOffset + rgFiles[j].NameLength);
+		rgFiles[j].NameOffset = iOffset;
+	}
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+	{
+		unsigned int iOffset = (unsigned int) rgCompacted.size();
+		if(rgDirectories[j].NameLength != 0)
+			rgCompacted.insert(rgCompacted.end(), rgNames.begin() + rgDirectories[j].NameOffset, rgNames.begin() + rgDirectories[j].NameOffset + rgDirectories[j].NameLength);
+		rgDirectories[j].NameOffset = iOffset;
+	}
+	rgNames.swap(rgCompacted);
+	m_nUnusedNames = 0;
+}
+
+
+
+// Switches between storing every name in rgNames and storing each distinct name once in NameDictionary.
+// The names of all entries are converted immediately, their positions don't change.
+void CDriveIndex::SetCompactNames(BOOL bCompact)
+{
+	if(bCompact == m_bCompactNames)
+		return;
+	if(bCompact)
+	{
+		NameDictionary.Build(rgFiles, rgDirectories, rgNames);
+		rgNames.clear();
+		rgNames.shrink_to_fit();
+	}
+	else
+	{
+		vector<WCHAR> rgExpanded;
+		wstring strName;
+		for(unsigned int j = 0; j != rgFiles.size(); j++)
+		{
+			unsigned int iOffset = (unsigned int) rgExpanded.size();
+			const WCHAR *szName = GetNameChars(&rgFiles[j], strName);
+			rgExpanded.insert(rgExpanded.end(), szName, szName + rgFiles[j].NameLength);
+			rgFiles[j].NameOffset = iOffset;
+		}
+		for(unsigned int j = 0; j != rgDirectories.size(); j++)
+		{
+			unsigned int iOffset = (unsigned int) rgExpanded.size();
+			const WCHAR *szName = GetNameChars((IndexedFile*) &rgDirectories[j], strName);
+			rgExpanded.insert(rgExpanded.end(), szName, szName + rgDirectories[j].NameLength);
+			rgDirectories[j].NameOffset = iOffset;
+		}
+		rgNames.swap(rgExpanded);
+		NameDictionary.Clear();
+	}
+	m_bCompactNames = bCompact;
+	m_nUnusedNames = 0;
+}
+
+
+
+// Builds the trigram indices of files and directories
+void CDriveIndex::BuildTrigramIndex()
+{
+	CNameDictionary *pDictionary = m_bCompactNames ? &NameDictionary : NULL;
+	FileTrigrams.Build(rgFiles, rgNames, pDictionary);
+	DirectoryTrigrams.Build(rgDirectories, rgNames, pDictionary);
+}
+
+
+
+// Groups the files and directories by extension. This is always done, the lists refer to positions which change with every update.
+void CDriveIndex::BuildExtensionIndex()
+{
+	CNameDictionary *pDictionary = m_bCompactNames ? &NameDictionary : NULL;
+	FileExtensions.Build(rgFiles, rgNames, pDictionary);
+	DirectoryExtensions.Build(rgDirectories, rgNames, pDictionary);
 }
 
+
+
 // Resolve FRN to filename by enumerating USN journal with StartFileReferenceNumber=FRN
 USNEntry CDriveIndex::FRNToName(DWORDLONG FRN)
 {
-	if(FRN == m_dwDriveFRN)
+	if(RECORD_NUMBER(FRN) == RECORD_NUMBER(m_dwDriveFRN))
 		return USNEntry(wstring(1, m_cDrive) + wstring(TEXT(":")), 0);
 	USN_JOURNAL_DATA ujd;
 	Query(&ujd);
@@ -954,7 +2429,7 @@ USNEntry CDriveIndex::FRNToName(DWORDLONG FRN)
 
 		PUSN_RECORD pRecord = (PUSN_RECORD) &pData[sizeof(USN)];
 		while ((PBYTE) pRecord < (pData + cb)) {
-			if(pRecord->FileReferenceNumber == FRN)
+			if(RECORD_NUMBER(pRecord->FileReferenceNumber) == RECORD_NUMBER(FRN))
 				return USNEntry(wstring((LPCWSTR) ((PBYTE) pRecord + pRecord->FileNameOffset), pRecord->FileNameLength / sizeof(WCHAR)), pRecord->ParentFileReferenceNumber);
 			pRecord = (PUSN_RECORD) ((PBYTE) pRecord + pRecord->RecordLength);
 		}
@@ -965,32 +2440,96 @@ USNEntry CDriveIndex::FRNToName(DWORDLONG FRN)
 
 
 
+// Rounds a position in an index file up to the next section boundary
+static DWORDLONG AlignSection(DWORDLONG Offset)
+{
+	return (Offset + INDEX_FILE_ALIGNMENT - 1) & ~((DWORDLONG) INDEX_FILE_ALIGNMENT - 1);
+}
+
+
+
+// Sets the position of a section that starts at or after Offset and returns the end of the section
+static DWORDLONG PlaceSection(IndexFileSection &Section, DWORDLONG Offset, size_t Count, size_t cbElement)
+{
+	Section.Offset = AlignSection(Offset);
+	Section.Count = Count;
+	return Section.Offset + Count * cbElement;
+}
+
+
+
+// Writes the padding up to the start of a section and the section itself
+static void WriteSection(ofstream &file, IndexFileSection &Section, const void *pData, size_t cbElement)
+{
+	static const char Padding[INDEX_FILE_ALIGNMENT] = {0};
+	DWORDLONG Position = (DWORDLONG) file.tellp();
+	if(Section.Offset > Position)
+		file.write(Padding, (streamsize) (Section.Offset - Position));
+	if(Section.Count > 0)
+		file.write((const char*) pData, (streamsize) (Section.Count * cbElement));
+}
+
+
+
+// Checks that a section of an index file lies within the file
+static BOOL IsValidSection(IndexFileSection &Section, size_t cbElement, DWORDLONG cbFile)
+{
+	return Section.Offset % INDEX_FILE_ALIGNMENT == 0 && Section.Offset <= cbFile && Section.Count <= (cbFile - Section.Offset) / cbElement
+		&& Section.Count <= (DWORDLONG) MAXUINT;
+}
+
+
+
 // Saves the database to disk. The file can be used to create an instance of CDriveIndex.
+// All arrays are written the same way they are stored in memory, so the file can be mapped by LoadIndexFile().
 BOOL CDriveIndex::SaveToDisk(wstring &strPath)
 {
-	ofstream::pos_type size;
+	//A mapped file can't be overwritten. The arrays are copied to memory before it is replaced.
+	if(m_pIndexView != NULL && _wcsicmp(strPath.c_str(), m_strIndexFile.c_str()) == 0)
+		DetachIndexFile();
+
 	ofstream file (strPath.c_str(), ios::out|ios::binary|ios::trunc);
 	if (file.is_open())
 	{
-		//Drive character
-		file.write((char*) &m_cDrive, sizeof(m_cDrive));
-
-		//Drive FileReferenceNumber
-		file.write((char*) &m_dwDriveFRN, sizeof(m_dwDriveFRN));
-
-		unsigned int size = rgFiles.size();
-		//Number of files
-		file.write((char*) &size, sizeof(rgFiles.size()));
-		//indexed files
-		file.write((char*) &(rgFiles[0]), sizeof(IndexedFile) * rgFiles.size());
-
-		size = rgDirectories.size();
-		//Number of directories
-		file.write((char*) &size, sizeof(rgDirectories.size()));
-		//indexed directories
-		file.write((char*) &(rgDirectories[0]), sizeof(IndexedDirectory) * rgDirectories.size());
+		IndexFileHeader Header;
+		ZeroMemory(&Header, sizeof(Header));
+		Header.Magic = INDEX_FILE_MAGIC;
+		Header.Version = INDEX_FILE_VERSION;
+		Header.cbHeader = sizeof(IndexFileHeader);
+		Header.cbIndexedFile = sizeof(IndexedFile);
+		Header.cbIndexedDirectory = sizeof(IndexedDirectory);
+		Header.Drive = m_cDrive;
+		Header.DriveFRN = m_dwDriveFRN;
+		Header.UsnJournalID = m_UsnJournalID;
+		Header.NextUsn = m_NextUsn;
+		DWORDLONG Offset = sizeof(IndexFileHeader);
+		Offset = PlaceSection(Header.Files, Offset, rgFiles.size(), sizeof(IndexedFile));
+		Offset = PlaceSection(Header.Directories, Offset, rgDirectories.size(), sizeof(IndexedDirectory));
+		Offset = PlaceSection(Header.FileFilters, Offset, rgFileFilters.size(), sizeof(DWORDLONG));
+		Offset = PlaceSection(Header.DirectoryFilters, Offset, rgDirectoryFilters.size(), sizeof(DWORDLONG));
+		//In the compact name mode the dictionary is stored, its appended names stay as they are
+		CIndexArray<WCHAR> &rgNameData = m_bCompactNames ? NameDictionary.GetData() : rgNames;
+		Offset = PlaceSection(Header.Names, Offset, rgNameData.size(), sizeof(WCHAR));
+		if(m_bCompactNames)
+		{
+			Offset = PlaceSection(Header.NameBlocks, Offset, NameDictionary.GetBlockOffsets().size(), sizeof(unsigned int));
+			Header.nSortedNames = NameDictionary.GetSortedCount();
+			Header.Flags |= INDEX_FILE_COMPACT_NAMES;
+		}
+		Offset = PlaceSection(Header.FilterLayout, Offset, 1, sizeof(FilterLayoutData));
+
+		file.write((char*) &Header, sizeof(Header));
+		WriteSection(file, Header.Files, rgFiles.begin(), sizeof(IndexedFile));
+		WriteSection(file, Header.Directories, rgDirectories.begin(), sizeof(IndexedDirectory));
+		WriteSection(file, Header.FileFilters, rgFileFilters.begin(), sizeof(DWORDLONG));
+		WriteSection(file, Header.DirectoryFilters, rgDirectoryFilters.begin(), sizeof(DWORDLONG));
+		WriteSection(file, Header.Names, rgNameData.begin(), sizeof(WCHAR));
+		if(m_bCompactNames)
+			WriteSection(file, Header.NameBlocks, NameDictionary.GetBlockOffsets().begin(), sizeof(unsigned int));
+		WriteSection(file, Header.FilterLayout, &FilterLayout.GetData(), sizeof(FilterLayoutData));
+		BOOL bOk = !file.fail();
 		file.close();
-		return true;
+		return bOk;
 	}
 	return false;
 }
@@ -1001,10 +2540,193 @@ BOOL CDriveIndex::SaveToDisk(wstring &strPath)
 CDriveIndex::CDriveIndex(wstring &strPath)
 {
 	m_hVol = INVALID_HANDLE_VALUE;
+	m_UsnJournalID = 0;
+	m_NextUsn = 0;
+	m_nUnusedNames = 0;
+	m_bTrigramIndex = false;
+	m_bCompactNames = false;
+	m_bAdaptiveFilters = false;
+	m_hIndexFile = INVALID_HANDLE_VALUE;
+	m_hIndexMapping = NULL;
+	m_pIndexView = NULL;
+	m_cbEnumBuffer = ENUM_BUFFER_SIZE;
+	m_nGeneration = 0;
+	m_iNextSearchStats = 0;
+	m_nSearches = 0;
+	m_pCancel = NULL;
+	SearchOptions Options;
+	SetOptions(&Options);
 	Empty();
 
-	ifstream::pos_type size;
+	//Files written by older versions start with the drive letter instead of INDEX_FILE_MAGIC
+	DWORD Magic = 0;
+	ifstream file (strPath.c_str(), ios::in | ios::binary);
+	if (file.is_open())
+	{
+		file.read((char*) &Magic, sizeof(Magic));
+		file.close();
+	}
+	if(Magic == INDEX_FILE_MAGIC)
+		LoadIndexFile(strPath);
+	else
+		LoadLegacyFile(strPath);
+}
+
+
+
+// Checks the entries of an index file before they are attached, since searching and building paths trust them.
+// Each name has to lie within the names (or be a name of the dictionary with the same length in the compact name mode),
+// each parent has to be a directory and the parents of the directories must not form a cycle.
+BOOL CDriveIndex::AreValidEntries(const IndexedFile *pFiles, size_t nFiles, const IndexedDirectory *pDirectories, size_t nDirectories, size_t nNames, BOOL bCompactNames)
+{
+	for(size_t j = 0; j != nFiles + nDirectories; j++)
+	{
+		//IndexedDirectory starts like IndexedFile
+		const IndexedFile *i = j < nFiles ? &pFiles[j] : (const IndexedFile*) &pDirectories[j - nFiles];
+		if(i->RecordNumber == NO_RECORD || (i->ParentOffset != NO_PARENT && i->ParentOffset >= nDirectories))
+			return false;
+		if(bCompactNames ? i->NameOffset >= NameDictionary.GetCount() || NameDictionary.GetLength(i->NameOffset) != i->NameLength
+			: (DWORDLONG) i->NameOffset + i->NameLength > nNames)
+			return false;
+	}
+
+	//Follow the parents of each directory until a directory that was already checked is reached.
+	//Meeting a directory of the current walk again means there is a cycle.
+	vector<BYTE> rgState(nDirectories, 0); //0: not checked, 1: on the current walk, 2: checked
+	for(size_t j = 0; j != nDirectories; j++)
+	{
+		unsigned int iDirectory = (unsigned int) j;
+		while(iDirectory != NO_PARENT && rgState[iDirectory] == 0)
+		{
+			rgState[iDirectory] = 1;
+			iDirectory = pDirectories[iDirectory].ParentOffset;
+		}
+		if(iDirectory != NO_PARENT && rgState[iDirectory] == 1)
+			return false;
+		for(iDirectory = (unsigned int) j; iDirectory != NO_PARENT && rgState[iDirectory] == 1; iDirectory = pDirectories[iDirectory].ParentOffset)
+			rgState[iDirectory] = 2;
+	}
+	return true;
+}
+
+
+
+// Loads a file written by SaveToDisk(). The file is mapped copy-on-write and the arrays are attached to the view,
+// so nothing is copied. Changes made by UpdateIndex() never reach the file, arrays that change their size are
+// copied to memory. Returns false if the file is damaged or has another version.
+BOOL CDriveIndex::LoadIndexFile(wstring &strPath)
+{
+	m_hIndexFile = CreateFile(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if(m_hIndexFile == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER cbFile;
+	if(!GetFileSizeEx(m_hIndexFile, &cbFile) || cbFile.QuadPart < (LONGLONG) sizeof(IndexFileHeader))
+	{
+		CloseIndexFile();
+		return false;
+	}
+	m_hIndexMapping = CreateFileMapping(m_hIndexFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if(m_hIndexMapping != NULL)
+		m_pIndexView = MapViewOfFile(m_hIndexMapping, FILE_MAP_COPY, 0, 0, 0);
+	if(m_pIndexView == NULL)
+	{
+		CloseIndexFile();
+		return false;
+	}
+	m_strIndexFile = strPath;
+
+	DWORDLONG Size = (DWORDLONG) cbFile.QuadPart;
+	IndexFileHeader *pHeader = (IndexFileHeader*) m_pIndexView;
+	BOOL bCompactNames = (pHeader->Flags & INDEX_FILE_COMPACT_NAMES) != 0;
+	if(pHeader->Magic != INDEX_FILE_MAGIC || pHeader->Version != INDEX_FILE_VERSION || pHeader->cbHeader != sizeof(IndexFileHeader)
+		|| pHeader->cbIndexedFile != sizeof(IndexedFile) || pHeader->cbIndexedDirectory != sizeof(IndexedDirectory)
+		|| !IsValidSection(pHeader->Files, sizeof(IndexedFile), Size) || !IsValidSection(pHeader->Directories, sizeof(IndexedDirectory), Size)
+		|| !IsValidSection(pHeader->FileFilters, sizeof(DWORDLONG), Size) || !IsValidSection(pHeader->DirectoryFilters, sizeof(DWORDLONG), Size)
+		|| !IsValidSection(pHeader->Names, sizeof(WCHAR), Size) || (bCompactNames && !IsValidSection(pHeader->NameBlocks, sizeof(unsigned int), Size))
+		|| pHeader->FileFilters.Count != pHeader->Files.Count || pHeader->DirectoryFilters.Count != pHeader->Directories.Count
+		|| !IsValidSection(pHeader->FilterLayout, sizeof(FilterLayoutData), Size) || pHeader->FilterLayout.Count != 1
+		|| !FilterLayout.SetData(*(FilterLayoutData*) ((BYTE*) m_pIndexView + pHeader->FilterLayout.Offset)))
+	{
+		CloseIndexFile();
+		return false;
+	}
+	BYTE *pView = (BYTE*) m_pIndexView;
+	if(bCompactNames)
+	{
+		if(!NameDictionary.Attach((WCHAR*) (pView + pHeader->Names.Offset), (size_t) pHeader->Names.Count,
+			(unsigned int*) (pView + pHeader->NameBlocks.Offset), (size_t) pHeader->NameBlocks.Count, pHeader->nSortedNames))
+		{
+			CloseIndexFile();
+			return false;
+		}
+	}
+	if(!AreValidEntries((IndexedFile*) (pView + pHeader->Files.Offset), (size_t) pHeader->Files.Count, (IndexedDirectory*) (pView + pHeader->Directories.Offset),
+		(size_t) pHeader->Directories.Count, (size_t) pHeader->Names.Count, bCompactNames))
+	{
+		NameDictionary.Clear();
+		CloseIndexFile();
+		return false;
+	}
+	if(bCompactNames)
+		m_bCompactNames = true;
+	else
+		rgNames.Attach((WCHAR*) (pView + pHeader->Names.Offset), (size_t) pHeader->Names.Count);
+
+	//The volume is only needed for updating the index, searching works without it
+	Init(pHeader->Drive);
+	m_cDrive = pHeader->Drive;
+	m_dwDriveFRN = pHeader->DriveFRN;
+	m_UsnJournalID = pHeader->UsnJournalID;
+	m_NextUsn = pHeader->NextUsn;
+	rgFileFilters.Attach((DWORDLONG*) (pView + pHeader->FileFilters.Offset), (size_t) pHeader->FileFilters.Count);
+	rgDirectoryFilters.Attach((DWORDLONG*) (pView + pHeader->DirectoryFilters.Offset), (size_t) pHeader->DirectoryFilters.Count);
+	rgFiles.Attach((IndexedFile*) (pView + pHeader->Files.Offset), (size_t) pHeader->Files.Count);
+	rgDirectories.Attach((IndexedDirectory*) (pView + pHeader->Directories.Offset), (size_t) pHeader->Directories.Count);
+	m_bAdaptiveFilters = !FilterLayout.IsDefault();
+	BuildRecordTable();
+	BuildDirectoryTree();
+	BuildExtensionIndex();
+	return true;
+}
+
 
+
+// Copies all arrays that still use the view of the index file to memory and closes the file
+void CDriveIndex::DetachIndexFile()
+{
+	rgFiles.Detach();
+	rgDirectories.Detach();
+	rgFileFilters.Detach();
+	rgDirectoryFilters.Detach();
+	rgNames.Detach();
+	NameDictionary.Detach();
+	CloseIndexFile();
+}
+
+
+
+// Unmaps the index file. No array may be attached to it anymore.
+void CDriveIndex::CloseIndexFile()
+{
+	if(m_pIndexView != NULL)
+		UnmapViewOfFile(m_pIndexView);
+	if(m_hIndexMapping != NULL)
+		CloseHandle(m_hIndexMapping);
+	if(m_hIndexFile != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hIndexFile);
+	m_pIndexView = NULL;
+	m_hIndexMapping = NULL;
+	m_hIndexFile = INVALID_HANDLE_VALUE;
+	m_strIndexFile = wstring();
+}
+
+
+
+// Loads a file written by older versions. It contains the drive letter and the FileReferenceNumber of the root,
+// followed by the number of files, the files, the number of directories and the directories. Names and parents
+// are resolved through the volume.
+void CDriveIndex::LoadLegacyFile(wstring &strPath)
+{
 	ifstream file (strPath.c_str(), ios::in | ios::binary);
 	if (file.is_open())
 	{
@@ -1016,102 +2738,265 @@ CDriveIndex::CDriveIndex(wstring &strPath)
 		{
 			// Drive FileReferenceNumber
 			file.read((char*) &m_dwDriveFRN, sizeof(m_dwDriveFRN));
-			
-			//Number of files
+			streamoff posCounts = file.tellg();
+
+			//x86 builds wrote the counts with 4 bytes and x64 builds with 8 bytes, whose upper half is garbage. Only the
+			//right width makes the file end after the directories, each file takes 16 bytes and each directory 24 bytes.
+			file.seekg(0, ios::end);
+			DWORDLONG cbFile = (DWORDLONG) file.tellg();
 			unsigned int numFiles = 0;
-			file.read((char*) &numFiles, sizeof(numFiles));
+			unsigned int numDirs = 0;
+			streamoff cbCount = 0;
+			for(streamoff cbWidth = sizeof(unsigned int); cbWidth <= sizeof(DWORDLONG) && cbCount == 0; cbWidth += sizeof(unsigned int))
+			{
+				file.clear();
+				file.seekg(posCounts);
+				file.read((char*) &numFiles, sizeof(numFiles));
+				DWORDLONG posDirs = posCounts + cbWidth + 16ui64 * numFiles;
+				if(file.fail() || posDirs + cbWidth > cbFile)
+					continue;
+				file.seekg((streamoff) posDirs);
+				file.read((char*) &numDirs, sizeof(numDirs));
+				if(!file.fail() && posDirs + cbWidth + 24ui64 * numDirs == cbFile)
+					cbCount = cbWidth;
+			}
+			if(cbCount == 0)
+			{
+				file.close();
+				return;
+			}
+			file.seekg(posCounts + cbCount);
 			rgFiles.reserve(numFiles);
+			rgFileFilters.reserve(numFiles);
 
 			//indexed files
 			for(unsigned int j = 0; j != numFiles; j++)
 			{
 				IndexedFile i;
-				file.read((char*) &i, sizeof(IndexedFile));
+				DWORDLONG FRN;
+				DWORDLONG Filter;
+				file.read((char*) &FRN, sizeof(FRN));
+				file.read((char*) &Filter, sizeof(Filter));
+				i.RecordNumber = RECORD_NUMBER(FRN);
 				rgFiles.insert(rgFiles.end(), i);
+				rgFileFilters.insert(rgFileFilters.end(), Filter);
 			}
-		
-			//Number of directories
-			unsigned int numDirs = 0;
-			file.read((char*) &numDirs, sizeof(numDirs));
+
+			//Number of directories, it was read above
+			file.seekg(cbCount, ios::cur);
 			rgDirectories.reserve(numDirs);
+			rgDirectoryFilters.reserve(numDirs);
 
 			//indexed directories
 			for(unsigned int j = 0; j != numDirs; j++)
 			{
 				IndexedDirectory i;
-				file.read((char*) &i, sizeof(IndexedDirectory));
+				DWORDLONG FRN;
+				DWORDLONG Filter;
+				unsigned int padding;
+				file.read((char*) &FRN, sizeof(FRN));
+				file.read((char*) &Filter, sizeof(Filter));
+				i.RecordNumber = RECORD_NUMBER(FRN);
+				file.read((char*) &i.nFiles, sizeof(i.nFiles));
+				file.read((char*) &padding, sizeof(padding));
 				rgDirectories.insert(rgDirectories.end(), i);
+				rgDirectoryFilters.insert(rgDirectoryFilters.end(), Filter);
 			}
+
+			BuildRecordTable();
+			ResolveFromVolume();
+			//The filters of these versions were made with the fixed layout that counted repeated characters differently
+			ChooseFilterLayout();
+			MakeFilters();
+			//Older versions only counted the files directly in a directory
+			CountSubtrees();
+			BuildDirectoryTree();
+			BuildExtensionIndex();
 		}
 		file.close();
 	}
-	return;
 }
 
 
 
-// Returns the number of files and folders on this drive
-DriveInfo CDriveIndex::GetInfo()
+// Sets the options for searching
+void CDriveIndex::SetOptions(SearchOptions *Options)
 {
-	DriveInfo di;
- 	di.NumFiles = (DWORDLONG) rgFiles.size();
-	di.NumDirectories = (DWORDLONG) rgDirectories.size();
-	return di;
+	if(Options->cbSize < RTL_SIZEOF_THROUGH_FIELD(SearchOptions, bDeterministic))
+		return;
+	m_nSearchThreads = Options->nThreads;
+	m_bDeterministicSearch = Options->bDeterministic;
+	//bTopResults was added later, callers which use the older structure don't set it
+	m_bTopResults = Options->cbSize >= RTL_SIZEOF_THROUGH_FIELD(SearchOptions, bTopResults) && Options->bTopResults;
+	if(Options->cbSize >= RTL_SIZEOF_THROUGH_FIELD(SearchOptions, nMaxEditDistance))
+		m_nMaxEditDistance = Options->nMaxEditDistance;
+	if(Options->cbSize >= RTL_SIZEOF_THROUGH_FIELD(SearchOptions, nSearchHistory))
+	{
+		unsigned int nSearchHistory = (unsigned int) max(0, min(Options->nSearchHistory, MAX_SEARCH_HISTORY));
+		//Changing the size starts a new history
+		if(nSearchHistory != rgSearchHistory.size())
+		{
+			rgSearchHistory.assign(nSearchHistory, SearchStats());
+			m_iNextSearchStats = 0;
+			m_nSearches = 0;
+		}
+	}
+	//Switching the mode converts the names of the index right away
+	if(Options->cbSize >= RTL_SIZEOF_THROUGH_FIELD(SearchOptions, bCompactNames))
+		SetCompactNames(Options->bCompactNames);
+	//The filters are made again with the other layout
+	if(Options->cbSize >= RTL_SIZEOF_THROUGH_FIELD(SearchOptions, bAdaptiveFilters))
+		SetAdaptiveFilters(Options->bAdaptiveFilters);
 }
 
 
 
+// Sets the size of the buffer for reading the MFT. It is used the next time the index is built.
+void CDriveIndex::SetEnumBufferSize(DWORD cbEnumBuffer)
+{
+	m_cbEnumBuffer = max((DWORD) MIN_ENUM_BUFFER_SIZE, min(cbEnumBuffer, (DWORD) MAX_ENUM_BUFFER_SIZE));
+}
+
+
 
-//Performs a fuzzy search for shorter in longer.
-//return values range from 0.0 = identical to 1.0 = completely different. 0.4 seems appropriate
-float FuzzySearch(wstring &longer, wstring &shorter)
+// Returns the timings of the last time the index was built
+BuildStats CDriveIndex::GetBuildStats()
 {
-	//Note: All string lengths are shorter than MAX_PATH, so an uint is perfectly fitted.
-	unsigned int lenl = (unsigned int) longer.length();
-	unsigned int lens = (unsigned int) shorter.length();
+	return m_BuildStats;
+}
 
-	if(lens > lenl)
-		return 0.0f;
 
-	//Check if the shorter string is a substring of the longer string
-	unsigned int Contained = (unsigned int) longer.find(shorter);
-	if(Contained != wstring::npos)
-		return Contained == 0 ? 1.0f : 0.8f;
 
-	wstring longerlower(longer);
-	wstring shorterlower(shorter);
-	for(unsigned int i = 0; i != lenl; i++)
-		longerlower[i] = tolower(longer[i]);
-	for(unsigned int i = 0; i != lens; i++)
-		shorterlower[i] = tolower(shorter[i]);
+// Returns the counters and timings of the last search
+SearchStats CDriveIndex::GetSearchStats()
+{
+	return m_SearchStats;
+}
+
 
-	//Check if the shorter string is a substring of the longer string
-	Contained = (unsigned int) longerlower.find(shorterlower);
-	if(Contained != wstring::npos)
-		return Contained == 0 ? 0.9f : 0.7f;
 
-	//Check if string can be matched by omitting characters
-	if(lens < 5)
+// Returns how long the searches in the history took and the sums of their counters
+SearchHistogram CDriveIndex::GetSearchHistogram()
+{
+	SearchHistogram Histogram;
+	Histogram.nSearches = m_nSearches;
+	for(unsigned int j = 0; j != m_nSearches; j++)
 	{
-		unsigned int pos = 0;
-		unsigned int matched = 0;
-		for(unsigned int i = 0; i != lens; i++)
-		{
-			WCHAR c = toupper(shorter[i]); //only look for capital letters in longer string, (e.g. match tc in TrueCrypt)
-			for(unsigned int j = 0; j != lenl - pos; j++)
-			{
-				if(longer[pos + j] == c)
-				{
-					pos = j;
-					matched++;
-					break;
-				}
-				else
-					continue;
-			}
-		}
-		if(matched == lens)
-			return 0.9f; //Slightly worse than direct matches
+		SearchStats &Stats = rgSearchHistory[j];
+		unsigned int iBucket = 0;
+		for(DWORDLONG Total = Stats.Total; Total > 1 && iBucket != SEARCH_HISTOGRAM_BUCKETS - 1; Total >>= 1)
+			iBucket++;
+		Histogram.rgBuckets[iBucket]++;
+		Histogram.nScanned += Stats.nScanned;
+		Histogram.nFilterPassed += Stats.nFilterPassed;
+		Histogram.nFalsePositives += Stats.nFalsePositives;
+		Histogram.nIndexCandidates += Stats.nIndexCandidates;
+		Histogram.nFuzzySearches += Stats.nFuzzySearches;
+		Histogram.nPathsBuilt += Stats.nPathsBuilt;
 	}
-	return 0;
+	return Histogram;
+}
+
+
+
+// Completes the statistics of a search and adds them to the history. Returns nResults, so Find() can return it directly.
+// nReturned is the number of results in the list, nResults is -1 if the search was limited. Cancelled searches are not
+// added to the history, their time depends on when they were cancelled.
+int CDriveIndex::EndSearch(LARGE_INTEGER &Start, int nResults, size_t nReturned)
+{
+	m_SearchStats.Total = StopTimer(Start);
+	m_SearchStats.nResults = nReturned;
+	m_pCancel = NULL;
+	if(rgSearchHistory.size() != 0 && nResults != FIND_CANCELLED)
+	{
+		rgSearchHistory[m_iNextSearchStats] = m_SearchStats;
+		m_iNextSearchStats = (m_iNextSearchStats + 1) % (unsigned int) rgSearchHistory.size();
+		m_nSearches = min(m_nSearches + 1, (unsigned int) rgSearchHistory.size());
+	}
+	return nResults;
+}
+
+
+
+// Enables or disables the trigram index. The index is built immediately and rebuilt whenever the database changes.
+void CDriveIndex::SetTrigramIndex(BOOL bEnable)
+{
+	if(bEnable && !m_bTrigramIndex)
+		BuildTrigramIndex();
+	else if(!bEnable)
+	{
+		FileTrigrams.Clear();
+		DirectoryTrigrams.Clear();
+	}
+	m_bTrigramIndex = bEnable;
+}
+
+
+
+// Returns the memory used by the database
+IndexMemoryInfo CDriveIndex::GetMemoryInfo()
+{
+	IndexMemoryInfo Info;
+	Info.Entries = (DWORDLONG) (rgFiles.capacity() * sizeof(IndexedFile) + rgDirectories.capacity() * sizeof(IndexedDirectory));
+	Info.Entries += (DWORDLONG) ((rgChildStart.capacity() + rgChildDirectories.capacity() + rgPreorder.capacity() + rgRecordOffsets.capacity()) * sizeof(unsigned int));
+	Info.Entries += (DWORDLONG) (FileExtensions.GetMemoryUsage() + DirectoryExtensions.GetMemoryUsage());
+	Info.Filters = (DWORDLONG) ((rgFileFilters.capacity() + rgDirectoryFilters.capacity()) * sizeof(DWORDLONG));
+	Info.Names = (DWORDLONG) (rgNames.capacity() * sizeof(WCHAR) + NameDictionary.GetMemoryUsage());
+	Info.TrigramIndex = (DWORDLONG) (FileTrigrams.GetMemoryUsage() + DirectoryTrigrams.GetMemoryUsage());
+	if(rgFiles.IsAttached())
+		Info.MappedFile += rgFiles.size() * sizeof(IndexedFile);
+	if(rgDirectories.IsAttached())
+		Info.MappedFile += rgDirectories.size() * sizeof(IndexedDirectory);
+	if(rgFileFilters.IsAttached())
+		Info.MappedFile += rgFileFilters.size() * sizeof(DWORDLONG);
+	if(rgDirectoryFilters.IsAttached())
+		Info.MappedFile += rgDirectoryFilters.size() * sizeof(DWORDLONG);
+	if(rgNames.IsAttached())
+		Info.MappedFile += rgNames.size() * sizeof(WCHAR);
+	Info.MappedFile += NameDictionary.GetAttachedSize();
+	return Info;
+}
+
+
+
+// Returns the size of the names in the current storage mode and in the normal mode, so both can be compared
+NameStats CDriveIndex::GetNameStats()
+{
+	NameStats Stats;
+	Stats.bCompactNames = m_bCompactNames;
+	Stats.nNames = (DWORDLONG) (rgFiles.size() + rgDirectories.size());
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+		Stats.cbUncompressed += rgFiles[j].NameLength * sizeof(WCHAR);
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+		Stats.cbUncompressed += rgDirectories[j].NameLength * sizeof(WCHAR);
+	if(m_bCompactNames)
+	{
+		Stats.nDistinctNames = NameDictionary.GetCount();
+		Stats.nAppendedNames = NameDictionary.GetAppendedCount();
+		Stats.cbStored = (DWORDLONG) (NameDictionary.GetMemoryUsage() + NameDictionary.GetAttachedSize());
+		Stats.nCacheHits = NameDictionary.GetCacheHits();
+		Stats.nCacheMisses = NameDictionary.GetCacheMisses();
+	}
+	else
+		Stats.cbStored = (DWORDLONG) (rgNames.IsAttached() ? rgNames.size() : rgNames.capacity()) * sizeof(WCHAR);
+	return Stats;
+}
+
+
+
+// Returns the number of files and folders on this drive
+DriveInfo CDriveIndex::GetInfo()
+{
+	DriveInfo di;
+ 	di.NumFiles = (DWORDLONG) rgFiles.size();
+	di.NumDirectories = (DWORDLONG) rgDirectories.size();
+	return di;
+}
+
+
+
+// Returns the drive letter of the indexed volume
+WCHAR CDriveIndex::GetDrive()
+{
+	return m_cDrive;
 }
\ No newline at end of file
@@ -13,46 +13,116 @@ Credits for original code this is based on: Jeffrey Cooperstein & Jeffrey Richte
 #include <stdio.h>
 #include <sstream>
 #include <hash_map>
+#include <deque>
+#include "CRecordSource.h"
+#include "FilterScan.h"
+#include "FilterLayout.h"
+#include "TrigramIndex.h"
+#include "ExtensionIndex.h"
+#include "NameDictionary.h"
+#include "PatternMatch.h"
+#include "IndexArray.h"
+#include "ChunkedArray.h"
+#include "StringMatch.h"
 using namespace std;
 
 #define NO_WHERE 0
 #define IN_FILES 1
 #define IN_DIRECTORIES 2
-struct HashMapEntry
-{
-	DWORDLONG ParentFRN;
-	unsigned int iOffset;
-};
+
+//ParentOffset of entries without a parent directory in the index (i.e. the root directory)
+#define NO_PARENT 0xFFFFFFFF
+
+//Entries are identified by their MFT record number, the FileReferenceNumber without the sequence number in the upper 16 bits.
+//NTFS volumes can't have more than 2^32 records, so it fits in 32 bits. The record numbers of a volume are dense,
+//so they are used as positions in CDriveIndex::rgRecordOffsets.
+#define RECORD_NUMBER(FRN) ((unsigned int) ((FRN) & 0xFFFFFFFFui64))
+
+//Marks the directories in CDriveIndex::rgRecordOffsets, the other positions are in rgFiles
+#define RECORD_DIRECTORY 0x80000000
+
+//Records without an entry in CDriveIndex::rgRecordOffsets
+#define NO_RECORD 0xFFFFFFFF
+
+//Maximum number of directory paths kept by the path cache
+#define DIR_PATH_CACHE_SIZE 65536
+
+//Length of the paths that IsInPath() builds on the stack, longer paths are built on the heap
+#define PATH_BUFFER_SIZE 0x1000
+
+//Number of entries a search thread scans at once
+#define SCAN_CHUNK_SIZE 0x10000
+
+//Maximum number of threads used for searching
+#define MAX_SEARCH_THREADS 64
+
+//Maximum number of threads that parse the records while the index is built
+#define MAX_BUILD_THREADS 8
+
+//Number of enumeration buffers per parser thread. The reader fills the next buffers while the parsers are busy.
+#define BUILD_BUFFERS_PER_THREAD 2
+
+//Number of matches a scan should find when the number of results is not limited
+#define NO_LIMIT 0xFFFFFFFF
+
+//Values of the bEnhancedSearch parameter of the search functions
+#define SEARCH_SUBSTRING 0 //Case-insensitive substring search
+#define SEARCH_ENHANCED 1 //FuzzySearch()
+#define SEARCH_APPROXIMATE 2 //FuzzySearch(), names that don't match are compared with CApproximateMatcher
+#define SEARCH_GLOB 3 //The query is a pattern with * and ? that matches whole names, see CPatternMatcher
+#define SEARCH_REGEX 4 //The query is a regular expression that matches a part of the names
+
+//Return value of Find() when its cancel flag was set before the search finished. Nothing is returned then.
+#define FIND_CANCELLED -2
+
+//Number of query characters per allowed edit in approximate searches. Shorter queries would match almost everything.
+#define CHARACTERS_PER_EDIT 3
+
+//Journal records that are relevant for the database
+#define JOURNAL_REASON_MASK (USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME)
+//IndexedFile and IndexedDirectory need to share the layout of the common members,
+//FindInJournal() accesses both through an IndexedFile pointer.
+//The filters are kept in separate arrays (rgFileFilters and rgDirectoryFilters) at the same positions.
 struct IndexedFile
 {
-	DWORDLONG Index;
+	unsigned int RecordNumber; //See RECORD_NUMBER()
 	//DWORDLONG ParentIndex;
-	DWORDLONG Filter;
+	unsigned int NameOffset; //Position of the name in CDriveIndex::rgNames, or its id in CDriveIndex::NameDictionary in the compact name mode
+	unsigned int NameLength; //Length of the name in characters
+	unsigned int ParentOffset; //Position of the parent directory in rgDirectories or NO_PARENT
 	bool operator<(const IndexedFile& i)
 	{
-		return Index < i.Index;
+		return RecordNumber < i.RecordNumber;
 	}
 	IndexedFile()
 	{
-		Index = 0;
-		Filter = 0;
+		RecordNumber = 0;
+		NameOffset = 0;
+		NameLength = 0;
+		ParentOffset = NO_PARENT;
 	}
 };
 struct IndexedDirectory
 {
-	DWORDLONG Index;
+	unsigned int RecordNumber; //See RECORD_NUMBER()
 	//DWORDLONG ParentIndex;
-	DWORDLONG Filter;
-	unsigned int nFiles;
+	unsigned int NameOffset; //Position of the name in CDriveIndex::rgNames, or its id in CDriveIndex::NameDictionary in the compact name mode
+	unsigned int NameLength; //Length of the name in characters
+	unsigned int ParentOffset; //Position of the parent directory in rgDirectories or NO_PARENT
+	unsigned int nFiles; //Number of files in this directory and all of its subdirectories, see CountSubtrees()
+	unsigned int nDirectories; //Number of subdirectories, including the ones in subdirectories
 	bool operator<(const IndexedDirectory& i)
 	{
-		return Index < i.Index;
+		return RecordNumber < i.RecordNumber;
 	}
 	IndexedDirectory()
 	{
-		Index = 0;
-		Filter = 0;
+		RecordNumber = 0;
+		NameOffset = 0;
+		NameLength = 0;
+		ParentOffset = NO_PARENT;
 		nFiles = 0;
+		nDirectories = 0;
 	}
 };
 struct USNEntry
@@ -71,6 +141,376 @@ struct USNEntry
 	}
 };
 
+//A change read from the USN journal that hasn't been applied to the index yet
+struct JournalChange
+{
+	DWORDLONG ParentIndex;
+	wstring Name;
+	BOOL bDirectory;
+	BOOL bDeleted;
+	JournalChange()
+	{
+		ParentIndex = 0;
+		Name = wstring();
+		bDirectory = false;
+		bDeleted = false;
+	}
+};
+
+//Position and quality of a match found while scanning the index. The result is built from it after the scan.
+struct ScanHit
+{
+	unsigned int iOffset;
+	float MatchQuality;
+	bool operator<(const ScanHit& h) const
+	{
+		return iOffset < h.iOffset;
+	}
+	//Ranking of the top results: better matches first, equal ones in index order
+	static bool IsBetter(const ScanHit& a, const ScanHit& b)
+	{
+		return a.MatchQuality != b.MatchQuality ? a.MatchQuality > b.MatchQuality : a.iOffset < b.iOffset;
+	}
+};
+
+class CDriveIndex;
+
+//State of a scan of rgFiles or rgDirectories which is split into chunks of SCAN_CHUNK_SIZE entries.
+//The chunks are claimed in order by the search threads, each of them collects its matches in its own buffer.
+template <class T>
+struct ScanJob
+{
+	CDriveIndex *pIndex;
+	CIndexArray<T> *rgJournalIndex;
+	CIndexArray<DWORDLONG> *rgFilters;
+	vector<unsigned int> *rgCandidates; //Candidates from the trigram index or NULL if all filters are scanned
+	wstring *strQuery;
+	const WCHAR *szQueryLower;
+	DWORDLONG QueryFilter;
+	DWORDLONG QueryLength;
+	wstring *strQueryPath; //Lowercase path that the full path of a match needs to contain, NULL if the path is a directory in the index or not set
+	const unsigned int *rgPreorder; //CDriveIndex::rgPreorder if the search is limited to the subtree of a directory, NULL otherwise
+	unsigned int iScopeBegin; //Matches need a parent with a depth-first number in [iScopeBegin, iScopeBegin + nScope)
+	unsigned int nScope;
+	BOOL bEnhancedSearch;
+	CApproximateMatcher *pApproximate; //Matcher for names with typos in approximate searches, NULL otherwise
+	CPatternMatcher *pPattern; //Compiled query of glob and regex searches, NULL otherwise
+	volatile LONG *pCancel; //No more chunks are claimed once this is not 0, NULL if the search can't be cancelled
+	unsigned int iStart; //Offset where the scan starts
+	unsigned int nChunks;
+	unsigned int nHitsNeeded; //The scan stops after this many matches, NO_LIMIT if the number of results is not limited
+	unsigned int nTopHits; //Only the best nTopHits matches are kept, 0 to keep all. Then nHitsNeeded counts only perfect matches.
+	volatile LONG iNextChunk;
+	volatile LONG iNextThread;
+	volatile LONG nHits;
+	volatile LONG nMatches; //All matches, including the ones that were dropped because they weren't among the best nTopHits
+	volatile LONG nScanned; //Counters for SearchStats, summed up from the ScanCounters of all threads
+	volatile LONG nFilterPassed;
+	volatile LONG nFalsePositives;
+	volatile LONG nIndexCandidates;
+	volatile LONG nFuzzySearches;
+	volatile LONG nPathChecks;
+	volatile LONG nNamesDecoded;
+	volatile LONG nRunning;
+	HANDLE hDone; //Set when the last thread finished
+	vector<vector<ScanHit> > rgThreadHits;
+};
+
+//Counters of one ScanRange() call, see SearchStats
+struct ScanCounters
+{
+	unsigned int nScanned;
+	unsigned int nFilterPassed;
+	unsigned int nFalsePositives;
+	unsigned int nIndexCandidates;
+	unsigned int nFuzzySearches;
+	unsigned int nPathChecks;
+	unsigned int nNamesDecoded;
+	ScanCounters()
+	{
+		nScanned = 0;
+		nFilterPassed = 0;
+		nFalsePositives = 0;
+		nIndexCandidates = 0;
+		nFuzzySearches = 0;
+		nPathChecks = 0;
+		nNamesDecoded = 0;
+	}
+};
+
+//Entries parsed from one enumeration buffer. Their positions refer to the arrays of a BuildStage.
+struct BuildBatch
+{
+	unsigned int iSequence; //Position of the buffer in the enumeration
+	unsigned int iStage;
+	size_t iFile;
+	size_t nFiles;
+	size_t iDirectory;
+	size_t nDirectories;
+	size_t iName; //NameOffset of the entries is relative to this position
+	size_t nNames;
+	bool operator<(const BuildBatch& b) const
+	{
+		return iSequence < b.iSequence;
+	}
+};
+
+//Entries parsed by one parser thread. The parents are record numbers, they are linked after merging.
+struct BuildStage
+{
+	CChunkedArray<IndexedFile> Files;
+	CChunkedArray<unsigned int> FileParents;
+	CChunkedArray<IndexedDirectory> Directories;
+	CChunkedArray<unsigned int> DirectoryParents;
+	CChunkedArray<WCHAR> Names;
+	vector<BuildBatch> Batches;
+};
+
+//State of building the index with a reader and several parser threads, see PopulateIndex().
+//The reader fills free buffers and queues them in the order they were read, the parsers take them from the queue.
+struct BuildJob
+{
+	CDriveIndex *pIndex;
+	vector<vector<BYTE> > rgBuffers;
+	vector<DWORD> rgBufferSizes; //Number of bytes read into each buffer
+	vector<unsigned int> rgBufferSequence; //Position of each buffer in the enumeration
+	vector<int> rgFreeBuffers;
+	deque<int> rgFilledBuffers; //-1 tells a parser to stop
+	CRITICAL_SECTION csBuffers; //Protects rgFreeBuffers and rgFilledBuffers
+	HANDLE hFree; //Semaphore counting rgFreeBuffers
+	HANDLE hFilled; //Semaphore counting rgFilledBuffers
+	volatile LONG iNextThread;
+	volatile LONG nRunning;
+	HANDLE hDone; //Set when the last parser finished
+	vector<BuildStage> rgStages; //One per parser, the last one is used by the reader if no parser could be started
+};
+
+//State of making the filters of all entries with several threads, see MakeFilters()
+struct FilterJob
+{
+	CDriveIndex *pIndex;
+	unsigned int nFileChunks; //Chunks of SCAN_CHUNK_SIZE files, the chunks of the directories follow them
+	unsigned int nChunks;
+	volatile LONG iNextChunk;
+	volatile LONG nRunning;
+	HANDLE hDone; //Set when the last thread finished
+};
+
+//Options for searching, see SetSearchOptions()
+struct SearchOptions
+{
+	DWORD cbSize; //sizeof(SearchOptions)
+	int nThreads; //Number of threads used for scanning and building the index, 0 for one per processor
+	BOOL bDeterministic; //Return results in the same order as a single-threaded search, even if they are not sorted
+	BOOL bTopResults; //If the number of results is limited, return the best matches instead of the first ones
+	int nMaxEditDistance; //Maximum number of typos in a match of an approximate search (SEARCH_APPROXIMATE)
+	int nSearchHistory; //Number of searches whose statistics are kept for GetSearchHistogram(), 0 to keep none
+	BOOL bCompactNames; //Store every distinct name once in a CNameDictionary. Saves memory, but the names need to be decoded for comparing them.
+	BOOL bAdaptiveFilters; //Choose the characters and pairs of the filters for the names of the volume, see CFilterLayout
+	SearchOptions()
+	{
+		cbSize = sizeof(SearchOptions);
+		nThreads = 0;
+		bDeterministic = true;
+		bTopResults = false;
+		nMaxEditDistance = 2;
+		nSearchHistory = 0;
+		bCompactNames = false;
+		bAdaptiveFilters = true;
+	}
+};
+
+//Memory used by the parts of an index in bytes, see GetIndexMemoryInfo()
+struct IndexMemoryInfo
+{
+	DWORDLONG Entries;
+	DWORDLONG Filters;
+	DWORDLONG Names;
+	DWORDLONG TrigramIndex; //0 if the trigram index is disabled
+	DWORDLONG MappedFile; //Arrays that are used in place from a mapped index file, not included above
+	IndexMemoryInfo()
+	{
+		Entries = 0;
+		Filters = 0;
+		Names = 0;
+		TrigramIndex = 0;
+		MappedFile = 0;
+	}
+};
+
+//Size of the names in both storage modes and use of the decode cache, see GetNameStats().
+//Searches in the compact name mode count the decoded names in SearchStats::nNamesDecoded.
+struct NameStats
+{
+	BOOL bCompactNames; //The names are stored in the compact mode, see SearchOptions::bCompactNames
+	DWORDLONG nNames; //Names of all entries
+	DWORDLONG nDistinctNames; //Names in the dictionary, only counted in the compact mode
+	DWORDLONG nAppendedNames; //Names added to the dictionary after it was built, they are not front-coded yet
+	DWORDLONG cbUncompressed; //Bytes the names need when every name is stored completely, like in the normal mode
+	DWORDLONG cbStored; //Bytes the names need in the current mode, including the ones in a mapped index file
+	DWORDLONG nCacheHits; //Names that were decoded for paths and results in the compact mode and found in the cache
+	DWORDLONG nCacheMisses;
+	NameStats()
+	{
+		bCompactNames = false;
+		nNames = 0;
+		nDistinctNames = 0;
+		nAppendedNames = 0;
+		cbUncompressed = 0;
+		cbStored = 0;
+		nCacheHits = 0;
+		nCacheMisses = 0;
+	}
+};
+
+//Time spent in the phases of the last PopulateIndex() call in microseconds, see GetBuildStats()
+struct BuildStats
+{
+	DWORDLONG Enumerate; //Reading the records from the MFT
+	DWORDLONG Insert; //Parsing the records and adding them to the database, as far as this didn't overlap with Enumerate
+	DWORDLONG Aggregate; //Counting the files and directories below each directory
+	DWORDLONG Link; //Building the record table and linking the entries to their parents
+	DWORDLONG TrigramIndex; //Building the trigram index, 0 if it is disabled
+	DWORDLONG CompactNames; //Building the name dictionary, 0 unless SearchOptions::bCompactNames is set
+	DWORDLONG Filters; //Choosing the filter layout and making the filters of all entries
+	DWORDLONG nRecords; //Number of records that were read
+	DWORD nReads; //Number of FSCTL_ENUM_USN_DATA calls
+	DWORD cbEnumBuffer; //Size of the buffer used for reading the records
+	BuildStats()
+	{
+		Enumerate = 0;
+		Insert = 0;
+		Aggregate = 0;
+		Link = 0;
+		TrigramIndex = 0;
+		CompactNames = 0;
+		Filters = 0;
+		nRecords = 0;
+		nReads = 0;
+		cbEnumBuffer = 0;
+	}
+};
+
+//Ways in which the results of a search were found, see SearchStats::Sources
+#define SEARCH_SOURCE_LAST_RESULT 1 //The query was the same as the last one, its results were reused
+#define SEARCH_SOURCE_PREVIOUS_RESULTS 2 //The results of a shorter query were filtered with FindInPreviousResults()
+#define SEARCH_SOURCE_SCAN 4 //FindInJournal() scanned the filters of the entries
+#define SEARCH_SOURCE_TRIGRAMS 8 //FindInJournal() compared the candidates of the trigram index
+#define SEARCH_SOURCE_EXTENSIONS 16 //FindInJournal() compared the entries with the extensions of the query
+
+//Counters and timings of the last Find() or NextResults() call, see GetSearchStats(). Times are in microseconds.
+//nFilterPassed / nScanned is the selectivity of the filters for the query, nFalsePositives / nScanned their false positive rate.
+struct SearchStats
+{
+	DWORDLONG Total;
+	DWORDLONG Prepare; //Parsing the query, making its filter and looking up candidates in the trigram and extension indexes
+	DWORDLONG Scan; //Testing the filters and comparing the names in FindInJournal(), on all search threads
+	DWORDLONG PreviousResults; //Reusing the results of the last query
+	DWORDLONG Results; //Building the paths of the results
+	DWORDLONG Sort; //Sorting the results
+	DWORDLONG nScanned; //Filters that were tested
+	DWORDLONG nFilterPassed; //Entries whose filter matched the query, their names were compared
+	DWORDLONG nFalsePositives; //Entries whose filter matched the query, but whose name didn't
+	DWORDLONG nIndexCandidates; //Entries from the trigram or extension index, their names were compared without testing the filter
+	DWORDLONG nFuzzySearches; //FuzzySearch() calls
+	DWORDLONG nPathsBuilt; //Paths that were built for results and to check if an entry is in the query path
+	DWORDLONG nResults;
+	DWORDLONG nNamesDecoded; //Names that were decoded for comparing them in the compact name mode
+	DWORD Sources; //SEARCH_SOURCE_ flags
+	SearchStats()
+	{
+		Total = 0;
+		Prepare = 0;
+		Scan = 0;
+		PreviousResults = 0;
+		Results = 0;
+		Sort = 0;
+		nScanned = 0;
+		nFilterPassed = 0;
+		nFalsePositives = 0;
+		nIndexCandidates = 0;
+		nFuzzySearches = 0;
+		nPathsBuilt = 0;
+		nResults = 0;
+		nNamesDecoded = 0;
+		Sources = 0;
+	}
+};
+
+//Number of buckets of SearchHistogram. Bucket k counts the searches that took at least 2^k and less than 2^(k+1) microseconds,
+//bucket 0 includes the faster ones and the last bucket the slower ones.
+#define SEARCH_HISTOGRAM_BUCKETS 24
+
+//Largest number of searches that can be kept for the histogram
+#define MAX_SEARCH_HISTORY 65536
+
+//Distribution of the times of the last SearchOptions::nSearchHistory searches, see GetSearchHistogram()
+struct SearchHistogram
+{
+	DWORD nSearches;
+	DWORD rgBuckets[SEARCH_HISTOGRAM_BUCKETS];
+	DWORDLONG nScanned; //Sums of the counters of these searches
+	DWORDLONG nFilterPassed;
+	DWORDLONG nFalsePositives;
+	DWORDLONG nIndexCandidates;
+	DWORDLONG nFuzzySearches;
+	DWORDLONG nPathsBuilt;
+	SearchHistogram()
+	{
+		nSearches = 0;
+		memset(rgBuckets, 0, sizeof(rgBuckets));
+		nScanned = 0;
+		nFilterPassed = 0;
+		nFalsePositives = 0;
+		nIndexCandidates = 0;
+		nFuzzySearches = 0;
+		nPathsBuilt = 0;
+	}
+};
+
+//Identifies index files written by SaveToDisk(). Older files start with the drive letter instead.
+#define INDEX_FILE_MAGIC 0x58495346 //"FSIX"
+//Files with another version are not loaded.
+#define INDEX_FILE_VERSION 1
+
+//Flags of IndexFileHeader
+#define INDEX_FILE_COMPACT_NAMES 1 //Names contains the data of a CNameDictionary, NameBlocks its block offsets
+
+//Alignment of the sections in an index file
+#define INDEX_FILE_ALIGNMENT 64
+
+//Position and number of elements of an array in an index file
+struct IndexFileSection
+{
+	DWORDLONG Offset; //From the start of the file, a multiple of INDEX_FILE_ALIGNMENT
+	DWORDLONG Count;
+};
+
+//Header of an index file. It is followed by the sections, which contain the arrays exactly as they are stored
+//in memory, so the file can be mapped and searched in place. The layout is the same for x86 and x64 builds.
+struct IndexFileHeader
+{
+	DWORD Magic;
+	DWORD Version;
+	DWORD cbHeader;
+	DWORD cbIndexedFile; //sizeof(IndexedFile) of the version that wrote the file
+	DWORD cbIndexedDirectory;
+	WCHAR Drive;
+	WCHAR Reserved;
+	DWORDLONG DriveFRN;
+	DWORDLONG UsnJournalID; //Journal state the index is based on, UpdateIndex() continues from here
+	USN NextUsn;
+	IndexFileSection Files;
+	IndexFileSection Directories;
+	IndexFileSection FileFilters;
+	IndexFileSection DirectoryFilters;
+	IndexFileSection Names;
+	IndexFileSection NameBlocks; //Empty unless INDEX_FILE_COMPACT_NAMES is set
+	DWORD nSortedNames; //See CNameDictionary::GetSortedCount()
+	DWORD Flags;
+	IndexFileSection FilterLayout; //One FilterLayoutData, the layout of FileFilters and DirectoryFilters
+};
+
 struct DriveInfo
 {
 	DWORDLONG NumFiles;
@@ -113,6 +553,10 @@ struct SearchResultFile
 	{
 		return MatchQuality == i.MatchQuality ? Path + Filename < i.Path + i.Filename : MatchQuality > i.MatchQuality;
 	}
+	static bool HasBetterQuality(const SearchResultFile& a, const SearchResultFile& b)
+	{
+		return a.MatchQuality > b.MatchQuality;
+	}
 };
 struct SearchResult
 {
@@ -122,6 +566,8 @@ struct SearchResult
 	int iOffset; //0 when finished
 	unsigned int SearchEndedWhere;
 	int maxResults;
+	BOOL bEnhancedSearch; //Search mode, results of other modes can't be reused
+	wstring Extensions; //Extensions of an ext: operator separated by commas, results for other extensions can't be reused
 	SearchResult()
 	{
 		Query = wstring();
@@ -130,58 +576,215 @@ struct SearchResult
 		iOffset = 0;
 		SearchEndedWhere = NO_WHERE;
 		maxResults = -1;
+		bEnhancedSearch = SEARCH_SUBSTRING;
+		Extensions = wstring();
 	}
 };
+//Number of results a search cursor looks for at once, see OpenSearch()
+#define CURSOR_PAGE_SIZE 1024
+
+//Return values of FetchResults() besides the number of results
+#define FETCH_BUFFER_TOO_SMALL -1 //The next result doesn't fit into the buffer
+#define FETCH_INDEX_CHANGED -2 //The index was updated or rebuilt after the cursor was opened
+
+//State of a search whose results are fetched in pages, see OpenSearch()
+struct SearchCursor
+{
+	CDriveIndex *pIndex;
+	wstring Query;
+	wstring QueryLower;
+	wstring QueryPathLower; //Empty if the search is not restricted to a path
+	vector<wstring> Extensions; //Extensions the results need to have, empty if the query has no ext: operator
+	CPatternMatcher Pattern; //Compiled query of glob and regex searches
+	DWORDLONG QueryFilter;
+	DWORDLONG QueryLength;
+	BOOL bEnhancedSearch;
+	unsigned int SearchWhere; //Index that is searched next, NO_WHERE when all results were found
+	unsigned int iOffset; //Entry where the next page starts
+	unsigned int nGeneration; //CDriveIndex::m_nGeneration when the cursor was opened
+	BOOL bIndexChanged;
+	vector<SearchResultFile> Results; //Current page
+	unsigned int iNextResult; //First result of the current page that wasn't fetched yet
+	SearchCursor()
+	{
+		pIndex = NULL;
+		QueryFilter = 0;
+		QueryLength = 0;
+		bEnhancedSearch = false;
+		SearchWhere = NO_WHERE;
+		iOffset = 0;
+		nGeneration = 0;
+		bIndexChanged = false;
+		iNextResult = 0;
+	}
+};
+
 class CDriveIndex {
 public:
 	CDriveIndex();
 	CDriveIndex(wstring &strPath);
 	~CDriveIndex();
 	BOOL Init(WCHAR cDrive);
-	int Find(wstring *strQuery, wstring *strPath, vector<SearchResultFile> *rgsrfResults, BOOL bSort = true, BOOL bEnhancedSearch = true, int maxResults = -1);
+	int Find(wstring *strQuery, wstring *strPath, vector<SearchResultFile> *rgsrfResults, BOOL bSort = true, BOOL bEnhancedSearch = true, int maxResults = -1, volatile LONG *pCancel = NULL, BOOL bTopResults = false);
+	SearchCursor* OpenCursor(wstring *strQuery, wstring *strPath, BOOL bEnhancedSearch = true);
+	BOOL NextResults(SearchCursor *pCursor);
 	void PopulateIndex();
+	void PopulateIndex(CRecordSource *pSource);
+	int UpdateIndex();
+	void ReadJournalBuffer(PBYTE pData, DWORD cb);
+	int ApplyJournalChanges();
 	BOOL SaveToDisk(wstring &strPath);
 	DriveInfo GetInfo();
+	WCHAR GetDrive();
+	IndexMemoryInfo GetMemoryInfo();
+	BuildStats GetBuildStats();
+	SearchStats GetSearchStats();
+	SearchHistogram GetSearchHistogram();
+	NameStats GetNameStats();
+	void SetEnumBufferSize(DWORD cbEnumBuffer);
+	void SetTrigramIndex(BOOL bEnable);
+	void SetOptions(SearchOptions *Options);
 
 protected:
 	BOOL Empty();
 	HANDLE Open(WCHAR cDriveLetter, DWORD dwAccess);
 	BOOL Create(DWORDLONG MaximumSize, DWORDLONG AllocationDelta);
 	BOOL Query(PUSN_JOURNAL_DATA pUsnJournalData);
-	void FindRecursively(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, vector<SearchResultFile> &rgsrfResults, BOOL bEnhancedSearch, int maxResults, int &nResults);
 	template <class T>
-	void FindInJournal(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, vector<T> &rgJournalIndex, vector<SearchResultFile> &rgsrfResults, unsigned int  iOffset, BOOL bEnhancedSearch, int maxResults, int &nResults);
-	void FindInPreviousResults(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, vector<SearchResultFile> &rgsrfResults, unsigned int  iOffset, BOOL bEnhancedSearch, int maxResults, int &nResults);
+	void FindInJournal(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, CIndexArray<T> &rgJournalIndex, CIndexArray<DWORDLONG> &rgFilters, CTrigramIndex *pTrigrams, CExtensionIndex *pExtensions, vector<wstring> *rgExtensions, CPatternMatcher *pPattern, vector<SearchResultFile> &rgsrfResults, unsigned int &iOffset, BOOL bEnhancedSearch, int maxResults, int &nResults, BOOL bTopResults = false);
+	template <class T>
+	unsigned int ScanRange(ScanJob<T> &Job, unsigned int iBegin, unsigned int iEnd, vector<ScanHit> &rgHits);
+	template <class T>
+	BOOL MatchCandidates(ScanJob<T> &Job, const unsigned int *rgCandidates, unsigned int nCandidates, vector<ScanHit> &rgHits, unsigned int &nFound, unsigned int &nMatches, ScanCounters &Counters);
+	template <class T>
+	static DWORD WINAPI ScanWorker(LPVOID lpParameter);
+	unsigned int GetSearchThreads();
+	void ReadRecords(CRecordSource *pSource, BuildJob &Job, LARGE_INTEGER &Timer);
+	void ParseBuffer(BuildStage &Stage, PBYTE pData, DWORD cb, unsigned int iSequence);
+	static DWORD WINAPI ParseWorker(LPVOID lpParameter);
+	void MergeStages(BuildJob &Job, vector<unsigned int> &rgFileParents, vector<unsigned int> &rgDirectoryParents);
+	void BuildRecordTable();
+	BOOL IsInPath(IndexedFile *i, wstring *strQueryPath);
+	unsigned int FindDirectoryByPath(wstring &strPathLower);
+	void FindInPreviousResults(wstring &strQuery, const WCHAR* &szQueryLower, DWORDLONG QueryFilter, DWORDLONG QueryLength, wstring * strQueryPath, BOOL bPathInIndex, vector<SearchResultFile> &rgsrfResults, unsigned int  iOffset, BOOL bEnhancedSearch, int maxResults, int &nResults);
 	
 	INT64 FindOffsetByIndex(DWORDLONG Index);
 	INT64 FindDirOffsetByIndex(DWORDLONG Index);
 	DWORDLONG MakeFilter(wstring *szName);
+	void ChooseFilterLayout();
+	void MakeFilters();
+	static DWORD WINAPI FilterWorker(LPVOID lpParameter);
+	void SetAdaptiveFilters(BOOL bAdaptive);
+	void MakePatternFilter(CPatternMatcher *pPattern, DWORDLONG &QueryFilter, DWORDLONG &QueryLength);
 	USNEntry FRNToName(DWORDLONG FRN);
+	wstring GetName(IndexedFile *i);
+	const WCHAR *GetNameChars(IndexedFile *i, wstring &strBuffer);
+	const WCHAR *GetNameCharsCached(IndexedFile *i);
+	void CopyName(IndexedFile *i, WCHAR *szName);
+	unsigned int AddName(wstring *szName);
+	void LinkParents(vector<unsigned int> &rgFileParents, vector<unsigned int> &rgDirectoryParents);
+	void ResolveFromVolume();
 	void CleanUp();
 	BOOL Add(DWORDLONG Index, wstring *szName, DWORDLONG ParentIndex, DWORDLONG Address = 0);
 	BOOL AddDir(DWORDLONG Index, wstring *szName, DWORDLONG ParentIndex, DWORDLONG Address = 0);
 	BOOL Get(DWORDLONG Index, wstring *sz);
 	BOOL GetDir(DWORDLONG Index, wstring *sz);
+	void GetDirPath(unsigned int iDirectory, wstring *sz);
+	void AdjustFileCount(unsigned int iDirectory, int nFiles);
+	void GetBottomUpOrder(vector<unsigned int> &rgOrder);
+	void CountSubtrees();
+	void BuildDirectoryTree();
+	void CompactNames();
+	void SetCompactNames(BOOL bCompact);
+	void BuildTrigramIndex();
+	void BuildExtensionIndex();
+	BOOL AreValidEntries(const IndexedFile *pFiles, size_t nFiles, const IndexedDirectory *pDirectories, size_t nDirectories, size_t nNames, BOOL bCompactNames);
+	BOOL LoadIndexFile(wstring &strPath);
+	void LoadLegacyFile(wstring &strPath);
+	void DetachIndexFile();
+	void CloseIndexFile();
 	unsigned int GetParentDirectory(DWORDLONG Index);
 	void ClearLastResult();
+	BOOL IsSearchCancelled();
+	int EndSearch(LARGE_INTEGER &Start, int nResults, size_t nReturned);
 	// Members used to enumerate journal records
 	HANDLE					m_hVol;			// handle to volume
 	WCHAR					m_cDrive;		// drive letter of volume
 	DWORDLONG				m_dwDriveFRN;	// drive FileReferenceNumber
 
+	// Members used to keep the database up to date with the USN journal
+	DWORDLONG				m_UsnJournalID;	// ID of the journal the database is based on
+	USN						m_NextUsn;		// first journal record that hasn't been read yet
+	hash_map<unsigned int, JournalChange> PendingChanges; // changes read by ReadJournalBuffer(), keyed by record number
+	size_t					m_nUnusedNames;	// characters in rgNames that aren't referenced anymore
+
+	// Members used to build the database
+	DWORD					m_cbEnumBuffer;	// size of the buffer for reading the MFT
+	BuildStats				m_BuildStats;	// timings of the last PopulateIndex() call
+
+	// Members used to measure searches
+	SearchStats				m_SearchStats;	// counters of the current or last search
+	volatile LONG			*m_pCancel;		// cancel flag of the running Find() call, NULL if it can't be cancelled
+	vector<SearchStats>		rgSearchHistory; // the last searches, used as a ring buffer
+	unsigned int			m_iNextSearchStats; // position in rgSearchHistory that is overwritten next
+	unsigned int			m_nSearches;	// number of searches in rgSearchHistory
+
 	//Database containers
-	vector<IndexedFile> rgFiles;
-	vector<IndexedDirectory> rgDirectories;
+	//The containers may be attached to the view of an index file (see LoadIndexFile())
+	HANDLE m_hIndexFile;
+	HANDLE m_hIndexMapping;
+	LPVOID m_pIndexView;
+	wstring m_strIndexFile;
+	CIndexArray<IndexedFile> rgFiles;
+	CIndexArray<IndexedDirectory> rgDirectories;
+	CIndexArray<DWORDLONG> rgFileFilters; //Filters of rgFiles, see MakeFilter(). They are scanned without touching the other members.
+	CIndexArray<DWORDLONG> rgDirectoryFilters; //Filters of rgDirectories
+	CFilterLayout FilterLayout; //Bits that the characters of names and queries set in their filters
+	BOOL m_bAdaptiveFilters; //FilterLayout was chosen for the names of the index, see SearchOptions::bAdaptiveFilters
+	CIndexArray<WCHAR> rgNames; //Names of all files and directories, referenced by NameOffset and NameLength. Empty in the compact name mode.
+	CNameDictionary NameDictionary; //Names of all files and directories in the compact name mode
+	BOOL m_bCompactNames; //NameOffset of the entries is the id of their name in NameDictionary, see SearchOptions::bCompactNames
+	hash_map<unsigned int, wstring> DirPathCache; //Full paths of recently used directories, keyed by their position in rgDirectories
+	//Position of the entry of each MFT record, rebuilt whenever entries are added or removed (see BuildRecordTable()).
+	//Directories are marked with RECORD_DIRECTORY, records without an entry are NO_RECORD.
+	vector<unsigned int> rgRecordOffsets;
+	//Directory tree, rebuilt whenever directories are added, removed or moved (see BuildDirectoryTree())
+	vector<unsigned int> rgChildStart; //The subdirectories of directory j are rgChildDirectories[rgChildStart[j]] to rgChildDirectories[rgChildStart[j + 1] - 1]
+	vector<unsigned int> rgChildDirectories;
+	vector<unsigned int> rgPreorder; //Depth-first number of each directory, NO_PARENT if it can't be reached from a root
+	BOOL m_bTrigramIndex; //Maintain FileTrigrams and DirectoryTrigrams for substring searches
+	CTrigramIndex FileTrigrams;
+	CTrigramIndex DirectoryTrigrams;
+	CExtensionIndex FileExtensions; //Positions of the entries by extension, for queries with an ext: operator
+	CExtensionIndex DirectoryExtensions;
 	SearchResult LastResult;
+
+	unsigned int m_nGeneration; //Changes whenever the positions of the entries change, used to invalidate search cursors
+
+	//Search options
+	int m_nSearchThreads;
+	BOOL m_bDeterministicSearch;
+	BOOL m_bTopResults;
+	int m_nMaxEditDistance;
 };
-float FuzzySearch(wstring &longer, wstring &shorter);
-DWORDLONG PathToFRN(wstring* strPath);
 
 //Exported functions
 CDriveIndex* _stdcall CreateIndex(WCHAR Drive);
+CDriveIndex* _stdcall CreateIndexEx(WCHAR Drive, DWORD cbEnumBuffer);
 void _stdcall DeleteIndex(CDriveIndex *di);
 WCHAR* _stdcall Search(CDriveIndex *di, WCHAR *szQuery, WCHAR *szPath, BOOL bSort, BOOL bEnhancedSearch, int maxResults, BOOL *bFoundAll);
 void _stdcall FreeResultsBuffer(WCHAR *szResults);
+SearchCursor* _stdcall OpenSearch(CDriveIndex *di, WCHAR *szQuery, WCHAR *szPath, BOOL bEnhancedSearch);
+int _stdcall FetchResults(SearchCursor *pCursor, WCHAR *szBuffer, DWORD cchBuffer);
+void _stdcall CloseSearch(SearchCursor *pCursor);
 BOOL _stdcall SaveIndexToDisk(CDriveIndex *di, WCHAR *szPath);
 CDriveIndex* _stdcall LoadIndexFromDisk(WCHAR *szPath);
-void _stdcall GetDriveInfo(CDriveIndex *di, DriveInfo *driveInfo);
\ No newline at end of file
+void _stdcall GetDriveInfo(CDriveIndex *di, DriveInfo *driveInfo);
+int _stdcall UpdateIndex(CDriveIndex *di);
+void _stdcall SetSearchOptions(CDriveIndex *di, SearchOptions *Options);
+void _stdcall SetTrigramIndex(CDriveIndex *di, BOOL bEnable);
+void _stdcall GetIndexMemoryInfo(CDriveIndex *di, IndexMemoryInfo *Info);
+void _stdcall GetBuildStats(CDriveIndex *di, BuildStats *Stats);
+void _stdcall GetSearchStats(CDriveIndex *di, SearchStats *Stats);
+void _stdcall GetSearchHistogram(CDriveIndex *di, SearchHistogram *Histogram);
+void _stdcall GetNameStats(CDriveIndex *di, NameStats *Stats);
\ No newline at end of file
@@ -0,0 +1,153 @@
+/**********************************************************************************
+Module name: CRecordSource.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "CRecordSource.h"
+
+
+
+// Constructor. HighUsn is usually USN_JOURNAL_DATA.NextUsn of the volume.
+CVolumeRecordSource::CVolumeRecordSource(HANDLE hVol, WCHAR cDrive, USN HighUsn)
+{
+	m_hVol = hVol;
+	m_cDrive = cDrive;
+	m_med.StartFileReferenceNumber = 0;
+	m_med.LowUsn = 0;
+	m_med.HighUsn = HighUsn;
+}
+
+
+
+// Reads the next chunk of records from the MFT
+BOOL CVolumeRecordSource::Read(PBYTE pData, DWORD cbData, DWORD *pcb)
+{
+	if(DeviceIoControl(m_hVol, FSCTL_ENUM_USN_DATA, &m_med, sizeof(m_med), pData, cbData, pcb, NULL) == FALSE)
+		return FALSE;
+	m_med.StartFileReferenceNumber = * (DWORDLONG *) pData;
+	return TRUE;
+}
+
+
+
+void CVolumeRecordSource::Rewind()
+{
+	m_med.StartFileReferenceNumber = 0;
+}
+
+
+
+WCHAR CVolumeRecordSource::GetDrive()
+{
+	return m_cDrive;
+}
+
+
+
+// Get the FRN of the root directory
+DWORDLONG CVolumeRecordSource::GetRootIndex()
+{
+	WCHAR szRoot[_MAX_PATH];
+	wsprintf(szRoot, TEXT("%c:\\"), m_cDrive);
+	HANDLE hDir = CreateFile(szRoot, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if(hDir == INVALID_HANDLE_VALUE)
+		return 0;
+	BY_HANDLE_FILE_INFORMATION fi;
+	GetFileInformationByHandle(hDir, &fi);
+	CloseHandle(hDir);
+	return (((DWORDLONG) fi.nFileIndexHigh) << 32) | fi.nFileIndexLow;
+}
+
+
+
+// Constructor. IndexRoot is the FRN of the root directory the captured records refer to.
+CBufferRecordSource::CBufferRecordSource(WCHAR cDrive, DWORDLONG IndexRoot)
+{
+	m_iPosition = 0;
+	m_cDrive = cDrive;
+	m_IndexRoot = IndexRoot;
+}
+
+
+
+// Adds all records of a FSCTL_ENUM_USN_DATA output buffer
+void CBufferRecordSource::AddBuffer(const BYTE *pData, DWORD cb)
+{
+	const BYTE *pRecord = pData + sizeof(USN);
+	while (pRecord < pData + cb)
+	{
+		DWORD RecordLength = ((const USN_RECORD *) pRecord)->RecordLength;
+		if(RecordLength == 0 || pRecord + RecordLength > pData + cb) // truncated capture
+			break;
+		AddRecord((const USN_RECORD *) pRecord);
+		pRecord += RecordLength;
+	}
+}
+
+
+
+// Adds a copy of a single record. RecordLength needs to include the file name.
+void CBufferRecordSource::AddRecord(const USN_RECORD *pRecord)
+{
+	m_rgRecords.insert(m_rgRecords.end(), (const BYTE *) pRecord, (const BYTE *) pRecord + pRecord->RecordLength);
+}
+
+
+
+void CBufferRecordSource::Rewind()
+{
+	m_iPosition = 0;
+}
+
+
+
+// Copies as many complete records as fit into pData, mimicking FSCTL_ENUM_USN_DATA
+BOOL CBufferRecordSource::Read(PBYTE pData, DWORD cbData, DWORD *pcb)
+{
+	if(m_iPosition >= m_rgRecords.size())
+	{
+		SetLastError(ERROR_HANDLE_EOF);
+		return FALSE;
+	}
+	size_t iStart = m_iPosition;
+	size_t iLast = m_iPosition;
+	size_t cbFree = cbData - sizeof(USN);
+	while (m_iPosition < m_rgRecords.size())
+	{
+		DWORD RecordLength = ((USN_RECORD *) &m_rgRecords[m_iPosition])->RecordLength;
+		if(m_iPosition - iStart + RecordLength > cbFree)
+			break;
+		iLast = m_iPosition;
+		m_iPosition += RecordLength;
+	}
+	if(m_iPosition == iStart)
+	{
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+	memcpy(pData + sizeof(USN), &m_rgRecords[iStart], m_iPosition - iStart);
+	*pcb = (DWORD) (sizeof(USN) + m_iPosition - iStart);
+
+	//FileReferenceNumber to continue with
+	if(m_iPosition < m_rgRecords.size())
+		* (DWORDLONG *) pData = ((USN_RECORD *) &m_rgRecords[m_iPosition])->FileReferenceNumber;
+	else
+		* (DWORDLONG *) pData = ((USN_RECORD *) &m_rgRecords[iLast])->FileReferenceNumber + 1;
+	return TRUE;
+}
+
+
+
+WCHAR CBufferRecordSource::GetDrive()
+{
+	return m_cDrive;
+}
+
+
+
+DWORDLONG CBufferRecordSource::GetRootIndex()
+{
+	return m_IndexRoot;
+}
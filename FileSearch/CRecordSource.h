@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <Windows.h>
+#include <WinIoCtl.h>
+using namespace std;
+
+// Default size of the buffer used by PopulateIndex() to read records (64k chunks).
+// Larger buffers need fewer calls on volumes with many files, see CDriveIndex::SetEnumBufferSize().
+#define ENUM_BUFFER_SIZE 0x10000
+#define MIN_ENUM_BUFFER_SIZE 0x1000
+#define MAX_ENUM_BUFFER_SIZE 0x1000000
+
+// A record source supplies the USN_RECORDs of a volume to CDriveIndex::PopulateIndex().
+// Read() fills pData in the same layout as FSCTL_ENUM_USN_DATA: the FileReferenceNumber
+// to continue with (8 bytes), followed by as many complete records as fit into the buffer.
+// It returns FALSE when there are no more records.
+class CRecordSource {
+public:
+	virtual ~CRecordSource() {}
+	virtual BOOL Read(PBYTE pData, DWORD cbData, DWORD *pcb) = 0;
+	// Restarts the enumeration at the first record
+	virtual void Rewind() = 0;
+	// Drive letter of the volume
+	virtual WCHAR GetDrive() = 0;
+	// FileReferenceNumber of the root directory of the volume
+	virtual DWORDLONG GetRootIndex() = 0;
+};
+
+// Enumerates the MFT of a mounted NTFS volume with FSCTL_ENUM_USN_DATA
+class CVolumeRecordSource : public CRecordSource {
+public:
+	CVolumeRecordSource(HANDLE hVol, WCHAR cDrive, USN HighUsn);
+	BOOL Read(PBYTE pData, DWORD cbData, DWORD *pcb);
+	void Rewind();
+	WCHAR GetDrive();
+	DWORDLONG GetRootIndex();
+
+protected:
+	HANDLE			m_hVol;		// handle to volume, owned by the caller
+	WCHAR			m_cDrive;	// drive letter of volume
+	MFT_ENUM_DATA	m_med;		// enumeration state
+};
+
+// Replays USN_RECORDs that were captured earlier, e.g. from FSCTL_ENUM_USN_DATA output buffers.
+// This allows building an index without access to an NTFS volume.
+class CBufferRecordSource : public CRecordSource {
+public:
+	CBufferRecordSource(WCHAR cDrive, DWORDLONG IndexRoot);
+	// Adds a buffer as returned by FSCTL_ENUM_USN_DATA, including the leading 8 bytes
+	void AddBuffer(const BYTE *pData, DWORD cb);
+	// Adds a single record
+	void AddRecord(const USN_RECORD *pRecord);
+	void Rewind();
+	BOOL Read(PBYTE pData, DWORD cbData, DWORD *pcb);
+	WCHAR GetDrive();
+	DWORDLONG GetRootIndex();
+
+protected:
+	vector<BYTE>	m_rgRecords;	// concatenated records
+	size_t			m_iPosition;	// offset of the next record in m_rgRecords
+	WCHAR			m_cDrive;
+	DWORDLONG		m_IndexRoot;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <Windows.h>
+using namespace std;
+
+// Number of elements per chunk of CChunkedArray
+#define CHUNK_SIZE 0x4000
+
+// Array that grows by adding fixed size chunks. Unlike a vector it never moves its elements when it grows,
+// so it is used by the parser threads of CDriveIndex::PopulateIndex() to collect the entries while the number
+// of entries is still unknown. The elements are copied into their final vectors once at the end.
+template <class T>
+class CChunkedArray {
+public:
+	CChunkedArray()
+	{
+		m_nSize = 0;
+	}
+
+	void Add(const T &Value)
+	{
+		if(m_nSize % CHUNK_SIZE == 0)
+			AddChunk();
+		rgChunks.back().insert(rgChunks.back().end(), Value);
+		m_nSize++;
+	}
+
+	// Adds n consecutive elements, they may be split over two or more chunks
+	void Add(const T *p, size_t n)
+	{
+		while(n > 0)
+		{
+			if(m_nSize % CHUNK_SIZE == 0)
+				AddChunk();
+			size_t nCopy = min(n, (size_t) (CHUNK_SIZE - m_nSize % CHUNK_SIZE));
+			rgChunks.back().insert(rgChunks.back().end(), p, p + nCopy);
+			m_nSize += nCopy;
+			p += nCopy;
+			n -= nCopy;
+		}
+	}
+
+	size_t size() const
+	{
+		return m_nSize;
+	}
+
+	T& operator[](size_t i)
+	{
+		return rgChunks[i / CHUNK_SIZE][i % CHUNK_SIZE];
+	}
+
+	// Copies n elements starting at iBegin to pDest
+	void CopyTo(size_t iBegin, size_t n, T *pDest) const
+	{
+		while(n > 0)
+		{
+			size_t nCopy = min(n, (size_t) (CHUNK_SIZE - iBegin % CHUNK_SIZE));
+			memcpy(pDest, &rgChunks[iBegin / CHUNK_SIZE][iBegin % CHUNK_SIZE], nCopy * sizeof(T));
+			pDest += nCopy;
+			iBegin += nCopy;
+			n -= nCopy;
+		}
+	}
+
+	void clear()
+	{
+		vector<vector<T> >().swap(rgChunks);
+		m_nSize = 0;
+	}
+
+protected:
+	void AddChunk()
+	{
+		rgChunks.resize(rgChunks.size() + 1);
+		rgChunks.back().reserve(CHUNK_SIZE);
+	}
+
+	vector<vector<T> > rgChunks; //Every chunk has a capacity of CHUNK_SIZE, so it is never reallocated
+	size_t m_nSize;
+};
@@ -0,0 +1,121 @@
+/**********************************************************************************
+Module name: ExtensionIndex.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "ExtensionIndex.h"
+#include "StringMatch.h"
+#include <algorithm>
+
+
+
+CExtensionIndex::CExtensionIndex()
+{
+	m_bBuilt = false;
+}
+
+
+
+// Frees all lists and forgets the extensions
+void CExtensionIndex::Clear()
+{
+	m_bBuilt = false;
+	hmIds.clear();
+	vector<unsigned int>().swap(rgBucketStart);
+	vector<unsigned int>().swap(rgBucketEntries);
+}
+
+
+
+BOOL CExtensionIndex::IsBuilt()
+{
+	return m_bBuilt;
+}
+
+
+
+// Names that end with a dot have no extension. A name that starts with its only dot (e.g. ".gitignore") has one.
+int CExtensionIndex::GetExtensionOffset(const WCHAR *szName, unsigned int nLength)
+{
+	for(unsigned int j = nLength; j != 0; j--)
+		if(szName[j - 1] == TEXT('.'))
+			return j < nLength ? (int) j : -1;
+	return -1;
+}
+
+
+
+// Returns the id of an extension, new extensions get the next id. The extension is folded like in CDriveIndex::Find().
+unsigned int CExtensionIndex::Intern(const WCHAR *szExtension, unsigned int nLength)
+{
+	wstring strExtension(szExtension, nLength);
+	FoldString(strExtension);
+	hash_map<wstring, unsigned int>::iterator it = hmIds.find(strExtension);
+	if(it != hmIds.end())
+		return it->second;
+	unsigned int iId = (unsigned int) hmIds.size();
+	hmIds[strExtension] = iId;
+	return iId;
+}
+
+
+
+// Sorts the entries into the lists of their extensions. rgIds contains the id of each entry or NO_EXTENSION.
+void CExtensionIndex::Finish(vector<unsigned int> &rgIds)
+{
+	rgBucketStart.assign(hmIds.size() + 1, 0);
+	for(unsigned int j = 0; j != rgIds.size(); j++)
+		if(rgIds[j] != NO_EXTENSION)
+			rgBucketStart[rgIds[j] + 1]++;
+	for(unsigned int j = 1; j != rgBucketStart.size(); j++)
+		rgBucketStart[j] += rgBucketStart[j - 1];
+
+	//Entries are added in ascending order, so every list is sorted
+	rgBucketEntries.resize(rgBucketStart.back());
+	vector<unsigned int> rgNext(rgBucketStart.begin(), rgBucketStart.end() - 1);
+	for(unsigned int j = 0; j != rgIds.size(); j++)
+		if(rgIds[j] != NO_EXTENSION)
+			rgBucketEntries[rgNext[rgIds[j]]++] = j;
+	m_bBuilt = true;
+}
+
+
+
+BOOL CExtensionIndex::Find(vector<wstring> &rgExtensions, vector<unsigned int> &rgCandidates)
+{
+	rgCandidates.clear();
+	if(!m_bBuilt)
+		return false;
+	unsigned int nLists = 0;
+	for(unsigned int j = 0; j != rgExtensions.size(); j++)
+	{
+		hash_map<wstring, unsigned int>::iterator it = hmIds.find(rgExtensions[j]);
+		if(it == hmIds.end())
+			continue;
+		rgCandidates.insert(rgCandidates.end(), rgBucketEntries.begin() + rgBucketStart[it->second], rgBucketEntries.begin() + rgBucketStart[it->second + 1]);
+		nLists++;
+	}
+	//Every entry has only one extension, so the lists don't overlap
+	if(nLists > 1)
+		sort(rgCandidates.begin(), rgCandidates.end());
+	return true;
+}
+
+
+
+unsigned int CExtensionIndex::GetExtensionCount()
+{
+	return (unsigned int) hmIds.size();
+}
+
+
+
+// The size of the interned extensions is estimated, the lists are counted exactly
+size_t CExtensionIndex::GetMemoryUsage()
+{
+	size_t cbExtensions = 0;
+	for(hash_map<wstring, unsigned int>::iterator it = hmIds.begin(); it != hmIds.end(); it++)
+		cbExtensions += sizeof(*it) + 2 * sizeof(void*) + (it->first.capacity() + 1) * sizeof(WCHAR);
+	return cbExtensions + (rgBucketStart.capacity() + rgBucketEntries.capacity()) * sizeof(unsigned int);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <Windows.h>
+#include <hash_map>
+#include "IndexArray.h"
+#include "NameDictionary.h"
+using namespace std;
+
+//Id of entries whose name has no extension
+#define NO_EXTENSION 0xFFFFFFFF
+
+// Groups the entries of an index by the extension of their names (the characters after the last dot).
+// Every distinct lowercase extension is interned once and gets an id. The positions of the entries with an
+// extension are stored as one ascending list per id, so a query for an extension only reads its list
+// instead of scanning all filters.
+class CExtensionIndex {
+public:
+	CExtensionIndex();
+	void Clear();
+	BOOL IsBuilt();
+	// Builds the index for rgEntries, T needs to be IndexedFile or IndexedDirectory. The names are in rgNames,
+	// or in pDictionary if it isn't NULL (see CDriveIndex::NameDictionary).
+	template <class T>
+	void Build(CIndexArray<T> &rgEntries, CIndexArray<WCHAR> &rgNames, CNameDictionary *pDictionary);
+	// rgCandidates receives the ascending positions of all entries with one of the extensions in rgExtensions
+	// (lowercase, without the dot). Returns FALSE if the index isn't built.
+	BOOL Find(vector<wstring> &rgExtensions, vector<unsigned int> &rgCandidates);
+	// Number of distinct extensions
+	unsigned int GetExtensionCount();
+	// Number of bytes used by the index
+	size_t GetMemoryUsage();
+	// Returns the position of the extension in a name or -1 if the name has none
+	static int GetExtensionOffset(const WCHAR *szName, unsigned int nLength);
+
+protected:
+	unsigned int Intern(const WCHAR *szExtension, unsigned int nLength);
+	void Finish(vector<unsigned int> &rgIds);
+
+	BOOL m_bBuilt;
+	hash_map<wstring, unsigned int> hmIds; //Lowercase extension -> id
+	vector<unsigned int> rgBucketStart; //The entries with extension id j are rgBucketEntries[rgBucketStart[j]] to rgBucketEntries[rgBucketStart[j + 1] - 1]
+	vector<unsigned int> rgBucketEntries;
+};
+
+
+
+template <class T>
+void CExtensionIndex::Build(CIndexArray<T> &rgEntries, CIndexArray<WCHAR> &rgNames, CNameDictionary *pDictionary)
+{
+	Clear();
+	vector<unsigned int> rgIds(rgEntries.size(), NO_EXTENSION);
+	wstring strName;
+	for(unsigned int j = 0; j != rgEntries.size(); j++)
+	{
+		if(rgEntries[j].NameLength == 0)
+			continue;
+		const WCHAR *szName = pDictionary != NULL ? pDictionary->Decode(rgEntries[j].NameOffset, strName) : &rgNames[rgEntries[j].NameOffset];
+		int iExtension = GetExtensionOffset(szName, rgEntries[j].NameLength);
+		if(iExtension != -1)
+			rgIds[j] = Intern(szName + iExtension, rgEntries[j].NameLength - (unsigned int) iExtension);
+	}
+	Finish(rgIds);
+}
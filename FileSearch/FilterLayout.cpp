@@ -0,0 +1,226 @@
+/**********************************************************************************
+Module name: FilterLayout.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "FilterLayout.h"
+#include "StringMatch.h"
+#include <algorithm>
+
+//Pairs of the default layout. Based off http://en.wikipedia.org/wiki/Letter_frequency
+static const char *g_szDefaultPairs = "thheanreerinonatndstesenofteedortihiasto";
+
+//Punctuation that shares the last character bit of the default layout
+static const char *g_szDefaultPunctuation = "!#$&'()+,-~_";
+
+
+
+//Orders character classes or pairs by the number of sampled names that contain them, the most frequent first
+struct FrequencyOrder
+{
+	const vector<DWORDLONG> *rgCounts;
+	bool operator()(unsigned int a, unsigned int b) const
+	{
+		return (*rgCounts)[a] != (*rgCounts)[b] ? (*rgCounts)[a] > (*rgCounts)[b] : a < b;
+	}
+};
+
+
+
+CFilterLayout::CFilterLayout()
+{
+	SetDefault();
+}
+
+
+
+void CFilterLayout::SetDefault()
+{
+	memset(&m_Data, 0, sizeof(m_Data));
+	memset(m_Data.rgCharacterBits, FILTER_NO_BIT, sizeof(m_Data.rgCharacterBits));
+	for(unsigned int c = 'a'; c <= 'z'; c++)
+		m_Data.rgCharacterBits[c] = (BYTE) (c - 'a');
+	for(unsigned int c = '0'; c <= '9'; c++)
+		m_Data.rgCharacterBits[c] = (BYTE) (c - '0' + 26);
+	m_Data.rgCharacterBits['.'] = 36;
+	m_Data.rgCharacterBits[' '] = 37;
+	for(const char *p = g_szDefaultPunctuation; *p != 0; p++)
+		m_Data.rgCharacterBits[*p] = 38;
+	for(unsigned int p = 0; p != FILTER_PAIR_COUNT; p++)
+	{
+		m_Data.rgPairs[p][0] = g_szDefaultPairs[2 * p];
+		m_Data.rgPairs[p][1] = g_szDefaultPairs[2 * p + 1];
+	}
+	BuildPairTable();
+}
+
+
+
+BOOL CFilterLayout::IsDefault()
+{
+	CFilterLayout Default;
+	return memcmp(&m_Data, &Default.m_Data, sizeof(m_Data)) == 0;
+}
+
+
+
+// Every character class in the sample gets a bit. The classes are assigned in the order of their frequency, the first
+// ones get a bit of their own and each of the others is added to the bit that is set in the fewest names so far.
+// Printable characters and hashed classes that don't occur in the sample share a bit as well, so queries which contain
+// them still exclude most names. A pair is rated by the number of names it is expected to exclude: queries contain it about as often as
+// names do, and it excludes the names which have the bits of both characters, but not the pair.
+void CFilterLayout::Choose(const vector<wstring> &rgSample)
+{
+	//Count the names that contain each character class
+	vector<DWORDLONG> rgClassCounts(FILTER_CHARACTER_CLASSES, 0);
+	vector<unsigned int> rgSeen(FILTER_CHARACTER_CLASSES, 0);
+	for(unsigned int j = 0; j != rgSample.size(); j++)
+	{
+		for(unsigned int i = 0; i != rgSample[j].length(); i++)
+		{
+			unsigned int k = GetClass(rgSample[j][i]);
+			if(rgSeen[k] != j + 1)
+			{
+				rgSeen[k] = j + 1;
+				rgClassCounts[k]++;
+			}
+		}
+	}
+	vector<unsigned int> rgOrder(FILTER_CHARACTER_CLASSES);
+	for(unsigned int k = 0; k != FILTER_CHARACTER_CLASSES; k++)
+		rgOrder[k] = k;
+	FrequencyOrder Order;
+	Order.rgCounts = &rgClassCounts;
+	sort(rgOrder.begin(), rgOrder.end(), Order);
+
+	memset(&m_Data, 0, sizeof(m_Data));
+	memset(m_Data.rgCharacterBits, FILTER_NO_BIT, sizeof(m_Data.rgCharacterBits));
+	vector<DWORDLONG> rgBitCounts(FILTER_CHARACTER_BIT_COUNT, 0);
+	unsigned int nAssigned = 0;
+	for(unsigned int o = 0; o != FILTER_CHARACTER_CLASSES; o++)
+	{
+		unsigned int k = rgOrder[o];
+		//Characters that are changed by folding never occur in folded names, NTFS names contain no control characters
+		if(rgClassCounts[k] == 0 && k < FILTER_OTHER_CHARACTERS && (k < 0x20 || k == 0x7F || FoldChar((WCHAR) k) != k))
+			continue;
+		unsigned int iBit = nAssigned < FILTER_CHARACTER_BIT_COUNT ? nAssigned : (unsigned int) (min_element(rgBitCounts.begin(), rgBitCounts.end()) - rgBitCounts.begin());
+		m_Data.rgCharacterBits[k] = (BYTE) iBit;
+		rgBitCounts[iBit] += rgClassCounts[k];
+		nAssigned++;
+	}
+
+	//Count the names that contain each pair of classes and keep the character bits of each name
+	vector<DWORDLONG> rgMasks(rgSample.size(), 0);
+	vector<DWORDLONG> rgPairCounts(FILTER_CHARACTER_CLASSES * FILTER_CHARACTER_CLASSES, 0);
+	vector<unsigned int> rgPairSeen(FILTER_CHARACTER_CLASSES * FILTER_CHARACTER_CLASSES, 0);
+	for(unsigned int j = 0; j != rgSample.size(); j++)
+	{
+		const wstring &strName = rgSample[j];
+		for(unsigned int i = 0; i != strName.length(); i++)
+		{
+			rgMasks[j] |= 1ui64 << m_Data.rgCharacterBits[GetClass(strName[i])];
+			if(i + 1 == strName.length())
+				continue;
+			unsigned int iPair = GetClass(strName[i]) * FILTER_CHARACTER_CLASSES + GetClass(strName[i + 1]);
+			if(rgPairSeen[iPair] != j + 1)
+			{
+				rgPairSeen[iPair] = j + 1;
+				rgPairCounts[iPair]++;
+			}
+		}
+	}
+
+	//Rate the most frequent pairs
+	vector<unsigned int> rgPairs;
+	for(unsigned int iPair = 0; iPair != rgPairCounts.size(); iPair++)
+		if(rgPairCounts[iPair] != 0)
+			rgPairs.insert(rgPairs.end(), iPair);
+	Order.rgCounts = &rgPairCounts;
+	sort(rgPairs.begin(), rgPairs.end(), Order);
+	if(rgPairs.size() > FILTER_PAIR_CANDIDATES)
+		rgPairs.resize(FILTER_PAIR_CANDIDATES);
+	vector<DWORDLONG> rgScores(rgPairCounts.size(), 0);
+	for(unsigned int p = 0; p != rgPairs.size(); p++)
+	{
+		DWORDLONG Mask = (1ui64 << m_Data.rgCharacterBits[rgPairs[p] / FILTER_CHARACTER_CLASSES]) | (1ui64 << m_Data.rgCharacterBits[rgPairs[p] % FILTER_CHARACTER_CLASSES]);
+		DWORDLONG nBoth = 0;
+		for(unsigned int j = 0; j != rgMasks.size(); j++)
+			nBoth += (rgMasks[j] & Mask) == Mask;
+		rgScores[rgPairs[p]] = rgPairCounts[rgPairs[p]] * (nBoth - rgPairCounts[rgPairs[p]]);
+	}
+	Order.rgCounts = &rgScores;
+	sort(rgPairs.begin(), rgPairs.end(), Order);
+	for(unsigned int p = 0; p != min((unsigned int) rgPairs.size(), (unsigned int) FILTER_PAIR_COUNT) && rgScores[rgPairs[p]] != 0; p++)
+	{
+		m_Data.rgPairs[p][0] = (WCHAR) (rgPairs[p] / FILTER_CHARACTER_CLASSES);
+		m_Data.rgPairs[p][1] = (WCHAR) (rgPairs[p] % FILTER_CHARACTER_CLASSES);
+	}
+	BuildPairTable();
+}
+
+
+
+BOOL CFilterLayout::SetData(const FilterLayoutData &Data)
+{
+	for(unsigned int k = 0; k != FILTER_CHARACTER_CLASSES; k++)
+		if(Data.rgCharacterBits[k] != FILTER_NO_BIT && Data.rgCharacterBits[k] >= FILTER_CHARACTER_BIT_COUNT)
+			return false;
+	for(unsigned int p = 0; p != FILTER_PAIR_COUNT; p++)
+		if(Data.rgPairs[p][0] >= FILTER_CHARACTER_CLASSES || Data.rgPairs[p][1] >= FILTER_CHARACTER_CLASSES)
+			return false;
+	m_Data = Data;
+	BuildPairTable();
+	return true;
+}
+
+
+
+const FilterLayoutData &CFilterLayout::GetData()
+{
+	return m_Data;
+}
+
+
+
+void CFilterLayout::BuildPairTable()
+{
+	memset(rgPairBits, FILTER_NO_BIT, sizeof(rgPairBits));
+	for(unsigned int p = 0; p != FILTER_PAIR_COUNT; p++)
+		if(m_Data.rgPairs[p][0] != 0 || m_Data.rgPairs[p][1] != 0)
+			rgPairBits[m_Data.rgPairs[p][0]][m_Data.rgPairs[p][1]] = (BYTE) (FILTER_FIRST_PAIR_BIT + p);
+}
+
+
+
+// Repetitions are counted per character class. A name that contains a query contains each of its characters at least
+// as often, so it has the repetition bits of the query, too.
+DWORDLONG CFilterLayout::MakeFilter(const WCHAR *szLower, size_t n) const
+{
+	if(n == 0)
+		return 0;
+	DWORDLONG Filter = 0;
+	BYTE rgCounts[FILTER_CHARACTER_CLASSES];
+	memset(rgCounts, 0, sizeof(rgCounts));
+	unsigned int k = GetClass(szLower[0]);
+	for(size_t i = 0; i != n; i++)
+	{
+		BYTE Bit = m_Data.rgCharacterBits[k];
+		if(Bit != FILTER_NO_BIT)
+		{
+			Filter |= 1ui64 << Bit;
+			if(rgCounts[k] != 3 && ++rgCounts[k] >= 2)
+				Filter |= 1ui64 << (rgCounts[k] == 2 ? FILTER_TWICE_BIT : FILTER_THRICE_BIT);
+		}
+		if(i + 1 != n)
+		{
+			unsigned int kNext = GetClass(szLower[i + 1]);
+			Bit = rgPairBits[k][kNext];
+			if(Bit != FILTER_NO_BIT)
+				Filter |= 1ui64 << Bit;
+			k = kNext;
+		}
+	}
+	Filter |= (DWORDLONG) min(n, (size_t) 7) << FILTER_LENGTH_SHIFT;
+	return Filter;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <Windows.h>
+using namespace std;
+
+//Bits of a filter. The bits 0-38 describe characters, the positions of the others are the same in every layout.
+#define FILTER_CHARACTER_BIT_COUNT 39
+#define FILTER_TWICE_BIT 39 //A character occurs at least twice
+#define FILTER_THRICE_BIT 40 //A character occurs at least three times
+#define FILTER_FIRST_PAIR_BIT 41 //Bits 41-60 describe pairs of adjacent characters
+#define FILTER_PAIR_COUNT 20
+#define FILTER_LENGTH_SHIFT 61 //Bits 61-63 contain the length, up to 7
+
+//Folded characters below 128 are classes of their own. The others are hashed into FILTER_HASHED_CLASSES classes
+//from FILTER_OTHER_CHARACTERS on, so the letters of a script are spread over several of them.
+#define FILTER_OTHER_CHARACTERS 128
+#define FILTER_HASHED_CLASSES 16
+#define FILTER_CHARACTER_CLASSES (FILTER_OTHER_CHARACTERS + FILTER_HASHED_CLASSES)
+
+//Character classes and pairs that don't set any bit
+#define FILTER_NO_BIT 0xFF
+
+//Number of names CDriveIndex samples for CFilterLayout::Choose()
+#define FILTER_LAYOUT_SAMPLE 65536
+
+//Number of the most frequent pairs of characters that CFilterLayout::Choose() rates
+#define FILTER_PAIR_CANDIDATES 256
+
+//A filter layout as it is stored in index files
+struct FilterLayoutData
+{
+	BYTE rgCharacterBits[FILTER_CHARACTER_CLASSES]; //Bit of each character class, FILTER_NO_BIT if it has none
+	WCHAR rgPairs[FILTER_PAIR_COUNT][2]; //Character classes of the pair of each pair bit, 0 0 if the bit is not used
+};
+
+// Decides which bit of a filter each character and pair of characters sets (see CDriveIndex::MakeFilter()).
+// Names and queries are turned into filters with the same layout, so a name can only contain a query if its filter
+// has all bits of the filter of the query.
+// The default layout is fixed: a-z, 0-9, '.', ' ' and punctuation have a bit each and 20 frequent pairs of English
+// letters have a pair bit each (older versions set one bit for all of them). Choose() adapts the layout to the names
+// of a volume instead: frequent characters get their own bits, rare ones share a bit, and the pair bits go to the
+// pairs which exclude the most names that have both characters, but not next to each other.
+// Characters above 127 are hashed into classes, so names in Cyrillic or CJK get bits and pairs like ASCII names
+// when they are common on a volume. The default layout gives them no bits.
+class CFilterLayout {
+public:
+	CFilterLayout();
+	void SetDefault();
+	BOOL IsDefault();
+	// Chooses the layout for names like the ones in rgSample, which need to be folded
+	void Choose(const vector<wstring> &rgSample);
+	// Uses a layout from an index file. Returns FALSE if it is damaged.
+	BOOL SetData(const FilterLayoutData &Data);
+	const FilterLayoutData &GetData();
+	// Returns the filter of a folded name or query
+	DWORDLONG MakeFilter(const WCHAR *szLower, size_t n) const;
+
+protected:
+	void BuildPairTable();
+	static unsigned int GetClass(WCHAR c)
+	{
+		//Fibonacci hashing, the top bits of the product depend on all bits of the character
+		return c < FILTER_OTHER_CHARACTERS ? c : FILTER_OTHER_CHARACTERS + (unsigned int) ((c * 0x9E3779B1u) >> 28) % FILTER_HASHED_CLASSES;
+	}
+
+	FilterLayoutData m_Data;
+	BYTE rgPairBits[FILTER_CHARACTER_CLASSES][FILTER_CHARACTER_CLASSES]; //Bit of each pair of character classes
+};
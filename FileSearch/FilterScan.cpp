@@ -0,0 +1,204 @@
+/**********************************************************************************
+Module name: FilterScan.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "FilterScan.h"
+#include <intrin.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#if _MSC_VER >= 1700 // AVX2 intrinsics are available since Visual Studio 2012
+#include <immintrin.h>
+#define FILTER_SCAN_HAS_AVX2
+#endif
+#endif
+
+/*
+An entry is a candidate for a query if its filter contains all bits of the query filter
+and its length (bits 61-63) is not shorter than the query:
+	(Filter & QueryFilter) == QueryFilter && (Filter >> 61) >= QueryLength
+Since the length is stored in the topmost bits, the second test is the same as
+	Filter >= QueryLength << 61
+which allows testing both conditions on the whole 64 bit value.
+*/
+
+
+
+// Plain C++ version, also used for the entries at the end of a range that don't fill a vector
+static unsigned int ScanFiltersScalar(const DWORDLONG *rgFilters, unsigned int iBegin, unsigned int iEnd, DWORDLONG QueryFilter, DWORDLONG MinFilter, unsigned int *rgCandidates)
+{
+	unsigned int nCandidates = 0;
+	for(unsigned int j = iBegin; j != iEnd; j++)
+	{
+		DWORDLONG Filter = rgFilters[j];
+		rgCandidates[nCandidates] = j;
+		nCandidates += (Filter & QueryFilter) == QueryFilter && Filter >= MinFilter;
+	}
+	return nCandidates;
+}
+
+
+
+// Writes the positions of the set bits in Mask, starting at iFirst
+static inline unsigned int AddCandidates(unsigned int Mask, unsigned int iFirst, unsigned int *rgCandidates)
+{
+	unsigned int nCandidates = 0;
+	unsigned long iBit;
+	while(_BitScanForward(&iBit, Mask))
+	{
+		rgCandidates[nCandidates++] = iFirst + iBit;
+		Mask &= Mask - 1;
+	}
+	return nCandidates;
+}
+
+
+
+#if defined(_M_IX86) || defined(_M_X64)
+// SSE2 version. SSE2 has no 64 bit comparisons, so the tests are done on 32 bit halves:
+// the bits must be present in both halves and the length is compared on the upper half only.
+// Tests 4 filters per iteration.
+static unsigned int ScanFiltersSSE2(const DWORDLONG *rgFilters, unsigned int iBegin, unsigned int iEnd, DWORDLONG QueryFilter, DWORDLONG MinFilter, unsigned int *rgCandidates)
+{
+	unsigned int nCandidates = 0;
+	__m128i Query = _mm_set_epi32((int) (QueryFilter >> 32), (int) QueryFilter, (int) (QueryFilter >> 32), (int) QueryFilter);
+	//Unsigned comparison through signed comparison by flipping the sign bits
+	__m128i SignBit = _mm_set1_epi32((int) 0x80000000);
+	__m128i MinLength = _mm_set1_epi32((int) ((DWORD) (MinFilter >> 32) ^ 0x80000000));
+	__m128i Zero = _mm_setzero_si128();
+	unsigned int j = iBegin;
+	for(; j + 4 <= iEnd; j += 4)
+	{
+		__m128i Filter1 = _mm_loadu_si128((const __m128i*) &rgFilters[j]);
+		__m128i Filter2 = _mm_loadu_si128((const __m128i*) &rgFilters[j + 2]);
+		//Bits of the query that are missing in the filter
+		int Complete1 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_andnot_si128(Filter1, Query), Zero)));
+		int Complete2 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_andnot_si128(Filter2, Query), Zero)));
+		int Short1 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(MinLength, _mm_xor_si128(Filter1, SignBit))));
+		int Short2 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(MinLength, _mm_xor_si128(Filter2, SignBit))));
+		//Bit 1 and 3 describe the upper halves, they are moved to bit 0 and 2 which describe the lower halves
+		int Pass = (Complete1 & (Complete1 >> 1) & ~(Short1 >> 1)) | ((Complete2 & (Complete2 >> 1) & ~(Short2 >> 1)) << 4);
+		//Bits 0, 2, 4 and 6 are the results of the 4 filters
+		unsigned int Mask = (Pass & 1) | ((Pass >> 1) & 2) | ((Pass >> 2) & 4) | ((Pass >> 3) & 8);
+		if(Mask)
+			nCandidates += AddCandidates(Mask, j, rgCandidates + nCandidates);
+	}
+	return nCandidates + ScanFiltersScalar(rgFilters, j, iEnd, QueryFilter, MinFilter, rgCandidates + nCandidates);
+}
+#endif
+
+
+
+#ifdef FILTER_SCAN_HAS_AVX2
+// AVX2 version, tests 8 filters per iteration
+static unsigned int ScanFiltersAVX2(const DWORDLONG *rgFilters, unsigned int iBegin, unsigned int iEnd, DWORDLONG QueryFilter, DWORDLONG MinFilter, unsigned int *rgCandidates)
+{
+	unsigned int nCandidates = 0;
+	__m256i Query = _mm256_set1_epi64x((__int64) QueryFilter);
+	//Unsigned comparison through signed comparison by flipping the sign bit
+	__m256i SignBit = _mm256_set1_epi64x((__int64) 0x8000000000000000ui64);
+	__m256i MinLength = _mm256_set1_epi64x((__int64) (MinFilter ^ 0x8000000000000000ui64));
+	__m256i Zero = _mm256_setzero_si256();
+	unsigned int j = iBegin;
+	for(; j + 8 <= iEnd; j += 8)
+	{
+		__m256i Filter1 = _mm256_loadu_si256((const __m256i*) &rgFilters[j]);
+		__m256i Filter2 = _mm256_loadu_si256((const __m256i*) &rgFilters[j + 4]);
+		__m256i Complete1 = _mm256_cmpeq_epi64(_mm256_andnot_si256(Filter1, Query), Zero);
+		__m256i Complete2 = _mm256_cmpeq_epi64(_mm256_andnot_si256(Filter2, Query), Zero);
+		__m256i Short1 = _mm256_cmpgt_epi64(MinLength, _mm256_xor_si256(Filter1, SignBit));
+		__m256i Short2 = _mm256_cmpgt_epi64(MinLength, _mm256_xor_si256(Filter2, SignBit));
+		unsigned int Mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_andnot_si256(Short1, Complete1)))
+			| (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_andnot_si256(Short2, Complete2))) << 4);
+		if(Mask)
+			nCandidates += AddCandidates(Mask, j, rgCandidates + nCandidates);
+	}
+	_mm256_zeroupper();
+	return nCandidates + ScanFiltersScalar(rgFilters, j, iEnd, QueryFilter, MinFilter, rgCandidates + nCandidates);
+}
+#endif
+
+
+
+// Checks which instruction sets can be used
+static int DetectFilterScanLevel()
+{
+	int Level = FILTER_SCAN_SCALAR;
+#if defined(_M_IX86) || defined(_M_X64)
+	int rgInfo[4];
+	__cpuid(rgInfo, 0);
+	int nIds = rgInfo[0];
+	__cpuid(rgInfo, 1);
+	if(rgInfo[3] & (1 << 26)) //SSE2
+		Level = FILTER_SCAN_SSE2;
+#ifdef FILTER_SCAN_HAS_AVX2
+	//The OS needs to save the AVX registers (OSXSAVE and XCR0 bits 1 and 2)
+	BOOL bAVX = (rgInfo[2] & (1 << 27)) && (rgInfo[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+	if(bAVX && nIds >= 7)
+	{
+		__cpuidex(rgInfo, 7, 0);
+		if(rgInfo[1] & (1 << 5)) //AVX2
+			Level = FILTER_SCAN_AVX2;
+	}
+#endif
+#endif
+	return Level;
+}
+
+
+
+// Returns the instruction set used by ScanFilters(). It is detected on the first call.
+int GetFilterScanLevel()
+{
+	static int Level = -1;
+	if(Level == -1)
+		Level = DetectFilterScanLevel(); //Threads that get here at the same time detect the same value
+	return Level;
+}
+
+
+
+unsigned int ScanFilters(const DWORDLONG *rgFilters, unsigned int iBegin, unsigned int iEnd, DWORDLONG QueryFilter, DWORDLONG QueryLength, unsigned int *rgCandidates)
+{
+	DWORDLONG MinFilter = QueryLength << 61;
+	switch(GetFilterScanLevel())
+	{
+#ifdef FILTER_SCAN_HAS_AVX2
+	case FILTER_SCAN_AVX2:
+		return ScanFiltersAVX2(rgFilters, iBegin, iEnd, QueryFilter, MinFilter, rgCandidates);
+#endif
+#if defined(_M_IX86) || defined(_M_X64)
+	case FILTER_SCAN_SSE2:
+		return ScanFiltersSSE2(rgFilters, iBegin, iEnd, QueryFilter, MinFilter, rgCandidates);
+#endif
+	default:
+		return ScanFiltersScalar(rgFilters, iBegin, iEnd, QueryFilter, MinFilter, rgCandidates);
+	}
+}
+
+
+
+unsigned int ScanFiltersLoose(const DWORDLONG *rgFilters, unsigned int iBegin, unsigned int iEnd, DWORDLONG QueryFilter, DWORDLONG QueryLength, unsigned int nMissing, unsigned int *rgCandidates)
+{
+	//Every edit removes at most one character of the query, so it clears at most one character bit
+	QueryFilter &= FILTER_CHARACTER_BITS;
+	DWORDLONG MinFilter = (QueryLength > nMissing ? QueryLength - nMissing : 0) << 61;
+	unsigned int nCandidates = 0;
+	for(unsigned int j = iBegin; j != iEnd; j++)
+	{
+		DWORDLONG Filter = rgFilters[j];
+		if(Filter < MinFilter)
+			continue;
+		DWORDLONG Missing = QueryFilter & ~Filter;
+		unsigned int nMissingBits = 0;
+		while(Missing != 0 && nMissingBits <= nMissing)
+		{
+			Missing &= Missing - 1;
+			nMissingBits++;
+		}
+		if(nMissingBits <= nMissing)
+			rgCandidates[nCandidates++] = j;
+	}
+	return nCandidates;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <Windows.h>
+
+// Number of filters tested by one call to ScanFilters() in the search loop
+#define FILTER_BLOCK_SIZE 1024
+
+// Tests the filters rgFilters[iBegin] to rgFilters[iEnd - 1] against the filter of a query, as built by
+// CDriveIndex::MakeFilter(). QueryFilter must not contain the length bits, QueryLength is the length of the query (0-7).
+// The positions of all entries that pass are written to rgCandidates in ascending order, which needs to have room for
+// iEnd - iBegin entries. Returns the number of candidates.
+// Depending on the processor this uses AVX2, SSE2 or plain C++.
+unsigned int ScanFilters(const DWORDLONG *rgFilters, unsigned int iBegin, unsigned int iEnd, DWORDLONG QueryFilter, DWORDLONG QueryLength, unsigned int *rgCandidates);
+
+// Bits of a filter that describe single characters (a-z, 0-9, . space and punctuation). The other bits describe
+// repeated characters and pairs of characters, which a single typo can remove.
+#define FILTER_CHARACTER_BITS 0x0000007FFFFFFFFFui64
+
+// Like ScanFilters(), but for approximate searches: up to nMissing character bits of the query filter may be missing
+// in a filter and the entry may be up to nMissing characters shorter than the query. Only the character bits are tested.
+unsigned int ScanFiltersLoose(const DWORDLONG *rgFilters, unsigned int iBegin, unsigned int iEnd, DWORDLONG QueryFilter, DWORDLONG QueryLength, unsigned int nMissing, unsigned int *rgCandidates);
+
+// Instruction set used by ScanFilters()
+#define FILTER_SCAN_SCALAR 0
+#define FILTER_SCAN_SSE2 1
+#define FILTER_SCAN_AVX2 2
+int GetFilterScanLevel();
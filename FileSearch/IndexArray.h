@@ -0,0 +1,138 @@
+#pragma once
+
+#include <vector>
+#include <Windows.h>
+using namespace std;
+
+// Array used for the database containers. It either owns its elements in a vector or uses elements that are
+// stored elsewhere, usually in a view of an index file (see CDriveIndex::LoadIndexFile()). Such an array can be
+// read and written in place. It is copied into a vector as soon as its size changes.
+// The interface is the subset of vector that is used by CDriveIndex.
+template <class T>
+class CIndexArray {
+public:
+	typedef T value_type;
+	typedef T* iterator;
+	typedef const T* const_iterator;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	CIndexArray()
+	{
+		m_pAttached = NULL;
+		m_nAttached = 0;
+	}
+
+	// Uses the n elements at p without copying them. p needs to stay valid until the array is cleared or detached.
+	void Attach(T *p, size_t n)
+	{
+		vector<T>().swap(m_rgOwned);
+		m_pAttached = p;
+		m_nAttached = n;
+	}
+
+	// Copies attached elements into the vector
+	void Detach()
+	{
+		if(m_pAttached == NULL)
+			return;
+		m_rgOwned.assign(m_pAttached, m_pAttached + m_nAttached);
+		m_pAttached = NULL;
+		m_nAttached = 0;
+	}
+
+	BOOL IsAttached() const
+	{
+		return m_pAttached != NULL;
+	}
+
+	size_t size() const
+	{
+		return m_pAttached != NULL ? m_nAttached : m_rgOwned.size();
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	// Attached elements are not counted, they don't use heap memory
+	size_t capacity() const
+	{
+		return m_pAttached != NULL ? 0 : m_rgOwned.capacity();
+	}
+
+	T* begin()
+	{
+		if(m_pAttached != NULL)
+			return m_pAttached;
+		return m_rgOwned.empty() ? NULL : &m_rgOwned[0];
+	}
+
+	T* end()
+	{
+		return begin() + size();
+	}
+
+	T& operator[](size_t i)
+	{
+		return m_pAttached != NULL ? m_pAttached[i] : m_rgOwned[i];
+	}
+
+	const T& operator[](size_t i) const
+	{
+		return m_pAttached != NULL ? m_pAttached[i] : m_rgOwned[i];
+	}
+
+	void insert(T *where, const T &Value)
+	{
+		size_t i = where - begin();
+		Detach();
+		m_rgOwned.insert(m_rgOwned.begin() + i, Value);
+	}
+
+	template <class It>
+	void insert(T *where, It first, It last)
+	{
+		size_t i = where - begin();
+		Detach();
+		m_rgOwned.insert(m_rgOwned.begin() + i, first, last);
+	}
+
+	void reserve(size_t n)
+	{
+		Detach();
+		m_rgOwned.reserve(n);
+	}
+
+	void resize(size_t n)
+	{
+		Detach();
+		m_rgOwned.resize(n);
+	}
+
+	void shrink_to_fit()
+	{
+		if(m_pAttached == NULL)
+			m_rgOwned.shrink_to_fit();
+	}
+
+	void clear()
+	{
+		m_pAttached = NULL;
+		m_nAttached = 0;
+		m_rgOwned.clear();
+	}
+
+	// Exchanges the elements with a vector. Attached elements are copied first.
+	void swap(vector<T> &rg)
+	{
+		Detach();
+		m_rgOwned.swap(rg);
+	}
+
+protected:
+	vector<T> m_rgOwned;
+	T *m_pAttached;
+	size_t m_nAttached;
+};
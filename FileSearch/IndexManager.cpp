@@ -0,0 +1,337 @@
+/**********************************************************************************
+Module name: IndexManager.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "IndexManager.h"
+#include <algorithm>
+
+
+
+// Exported function that creates a manager and builds the indexes of the drives in szDrives (e.g. "CDE") in parallel.
+// Drives that can't be opened are skipped. szDrives may be NULL to add indexes later with AddIndexToManager().
+CIndexManager* _stdcall CreateIndexManager(WCHAR *szDrives)
+{
+	CIndexManager *pManager = new CIndexManager();
+	if(szDrives)
+		pManager->AddVolumes(szDrives);
+	return pManager;
+}
+
+
+
+// Exported function to delete a manager and all of its indexes
+void _stdcall DeleteIndexManager(CIndexManager *pManager)
+{
+	if(dynamic_cast<CIndexManager*>(pManager))
+		delete pManager;
+}
+
+
+
+// Exported function that adds an index, for example one loaded with LoadIndexFromDisk(), to a manager.
+// The manager deletes the index when it is deleted. Returns false if the manager already has an index of the drive,
+// in this case the caller still owns the index.
+BOOL _stdcall AddIndexToManager(CIndexManager *pManager, CDriveIndex *di)
+{
+	if(dynamic_cast<CIndexManager*>(pManager) && dynamic_cast<CDriveIndex*>(di))
+		return pManager->AddIndex(di);
+	return false;
+}
+
+
+
+// Exported function to search in all indexes of a manager at once. The results of all drives are returned in one
+// string like Search() does, ranked by their match quality. maxResults limits the number of results of all drives together.
+// The returned string needs to be freed with FreeResultsBuffer().
+WCHAR* _stdcall SearchAll(CIndexManager *pManager, WCHAR *szQuery, WCHAR *szPath, BOOL bSort, BOOL bEnhancedSearch, int maxResults, int *nResults)
+{
+	if(dynamic_cast<CIndexManager*>(pManager) && szQuery)
+	{
+		vector<SearchResultFile> results;
+		wstring result;
+		int numResults = pManager->Find(&wstring(szQuery), szPath != NULL ? &wstring(szPath) : NULL, &results, bSort, bEnhancedSearch, maxResults);
+		if(nResults != NULL)
+			*nResults = numResults;
+		for(unsigned int i = 0; i != results.size(); i++)
+			result += (i == 0 ? TEXT("") : TEXT("\n")) + results[i].Path + results[i].Filename;
+		WCHAR * szOutput = new WCHAR[result.length() + 1];
+		ZeroMemory(szOutput, (result.length() + 1) * sizeof(szOutput[0]));
+		_snwprintf(szOutput, result.length(), TEXT("%s"), result.c_str());
+		return szOutput;
+	}
+	if(nResults != NULL)
+		*nResults = 0;
+	return NULL;
+}
+
+
+
+// Exported function that updates all indexes of a manager in parallel, see UpdateIndex().
+// Returns the number of changed files and directories on all drives, or -1 if one of the indexes had to be rebuilt.
+int _stdcall UpdateAllIndexes(CIndexManager *pManager)
+{
+	if(dynamic_cast<CIndexManager*>(pManager))
+		return pManager->UpdateIndexes();
+	return 0;
+}
+
+
+
+// Exported function that sets the search options of all indexes of a manager
+void _stdcall SetManagerSearchOptions(CIndexManager *pManager, SearchOptions *Options)
+{
+	if(dynamic_cast<CIndexManager*>(pManager) && Options)
+		pManager->SetOptions(Options);
+}
+
+
+
+CIndexManager::CIndexManager()
+{
+}
+
+
+
+CIndexManager::~CIndexManager()
+{
+	for(unsigned int i = 0; i != rgIndexes.size(); i++)
+		delete rgIndexes[i];
+}
+
+
+
+//Builds the indexes of the drives in szDrives in parallel. Other characters than drive letters are ignored,
+//so "C:\D:\" works as well as "CD". Drives that already have an index or can't be opened are skipped.
+//Returns the number of indexes that were added.
+unsigned int CIndexManager::AddVolumes(const WCHAR *szDrives)
+{
+	VolumeJob Job;
+	Job.Operation = VOLUME_BUILD;
+	for(const WCHAR *p = szDrives; *p != 0; p++)
+	{
+		WCHAR cDrive = towupper(*p);
+		if(cDrive >= TEXT('A') && cDrive <= TEXT('Z') && FindVolume(cDrive) == -1 && find(Job.rgDrives.begin(), Job.rgDrives.end(), cDrive) == Job.rgDrives.end())
+			Job.rgDrives.insert(Job.rgDrives.end(), cDrive);
+	}
+	Job.rgIndexes.resize(Job.rgDrives.size(), NULL);
+	RunOnVolumes(Job);
+
+	unsigned int nAdded = 0;
+	for(unsigned int i = 0; i != Job.rgIndexes.size(); i++)
+	{
+		if(Job.rgIndexes[i] != NULL)
+		{
+			rgIndexes.insert(rgIndexes.end(), Job.rgIndexes[i]);
+			nAdded++;
+		}
+	}
+	return nAdded;
+}
+
+
+
+//Adds an existing index. The manager owns it from now on, unless there already is an index of the same drive.
+BOOL CIndexManager::AddIndex(CDriveIndex *pIndex)
+{
+	if(FindVolume(pIndex->GetDrive()) != -1)
+		return false;
+	rgIndexes.insert(rgIndexes.end(), pIndex);
+	return true;
+}
+
+
+
+//Deletes the index of a drive
+BOOL CIndexManager::RemoveVolume(WCHAR cDrive)
+{
+	int iVolume = FindVolume(cDrive);
+	if(iVolume == -1)
+		return false;
+	delete rgIndexes[iVolume];
+	rgIndexes.erase(rgIndexes.begin() + iVolume);
+	return true;
+}
+
+
+
+//Returns the index of a drive or NULL. It is still owned by the manager.
+CDriveIndex* CIndexManager::GetIndex(WCHAR cDrive)
+{
+	int iVolume = FindVolume(cDrive);
+	return iVolume != -1 ? rgIndexes[iVolume] : NULL;
+}
+
+
+
+unsigned int CIndexManager::GetVolumeCount()
+{
+	return (unsigned int) rgIndexes.size();
+}
+
+
+
+//Returns the position of the index of a drive in rgIndexes or -1
+int CIndexManager::FindVolume(WCHAR cDrive)
+{
+	for(unsigned int i = 0; i != rgIndexes.size(); i++)
+		if(towupper(rgIndexes[i]->GetDrive()) == towupper(cDrive))
+			return (int) i;
+	return -1;
+}
+
+
+
+//Searches all indexes in parallel, see CDriveIndex::Find() for the parameters. A path that starts with a drive letter
+//only searches the index of that drive. The results of all drives are merged and ranked by MatchQuality, results of
+//equal quality keep the order of the drives. If bSort is set they are sorted like the results of one index.
+//maxResults applies to all drives together: every index returns its best maxResults results, whether SearchOptions::bTopResults
+//is set or not, and the best of those are kept.
+//Returns the number of results or -1 if there were more than maxResults.
+int CIndexManager::Find(wstring *strQuery, wstring *strPath, vector<SearchResultFile> *rgsrfResults, BOOL bSort, BOOL bEnhancedSearch, int maxResults)
+{
+	VolumeJob Job;
+	Job.Operation = VOLUME_SEARCH;
+	Job.strQuery = strQuery;
+	Job.strQueryPath = strPath;
+	Job.bEnhancedSearch = bEnhancedSearch;
+	Job.maxResults = maxResults;
+	if(strPath != NULL && strPath->length() >= 2 && (*strPath)[1] == TEXT(':'))
+	{
+		int iVolume = FindVolume((*strPath)[0]);
+		if(iVolume == -1)
+			return 0;
+		Job.rgIndexes.insert(Job.rgIndexes.end(), rgIndexes[iVolume]);
+	}
+	else
+		Job.rgIndexes = rgIndexes;
+	Job.rgVolumeResults.resize(Job.rgIndexes.size());
+	RunOnVolumes(Job);
+
+	BOOL bMoreResults = false;
+	size_t nResults = 0;
+	for(unsigned int i = 0; i != Job.rgVolumeResults.size(); i++)
+		nResults += Job.rgVolumeResults[i].size();
+	rgsrfResults->reserve(rgsrfResults->size() + nResults);
+	for(unsigned int i = 0; i != Job.rgVolumeResults.size(); i++)
+	{
+		if(Job.rgVolumeCounts[i] == -1)
+			bMoreResults = true;
+		rgsrfResults->insert(rgsrfResults->end(), Job.rgVolumeResults[i].begin(), Job.rgVolumeResults[i].end());
+	}
+	stable_sort(rgsrfResults->begin(), rgsrfResults->end(), SearchResultFile::HasBetterQuality);
+	if(maxResults != -1 && rgsrfResults->size() > (unsigned int) maxResults)
+	{
+		rgsrfResults->resize(maxResults);
+		bMoreResults = true;
+	}
+	if(bSort)
+		sort(rgsrfResults->begin(), rgsrfResults->end());
+	return bMoreResults ? -1 : (int) rgsrfResults->size();
+}
+
+
+
+//Updates all indexes in parallel. Returns the number of changed files and directories on all drives,
+//or -1 if one of the indexes had to be rebuilt.
+int CIndexManager::UpdateIndexes()
+{
+	VolumeJob Job;
+	Job.Operation = VOLUME_UPDATE;
+	Job.rgIndexes = rgIndexes;
+	RunOnVolumes(Job);
+
+	int nChanges = 0;
+	for(unsigned int i = 0; i != Job.rgVolumeCounts.size(); i++)
+	{
+		if(Job.rgVolumeCounts[i] == -1)
+			return -1;
+		nChanges += Job.rgVolumeCounts[i];
+	}
+	return nChanges;
+}
+
+
+
+//Applies the search options to all indexes
+void CIndexManager::SetOptions(SearchOptions *Options)
+{
+	for(unsigned int i = 0; i != rgIndexes.size(); i++)
+		rgIndexes[i]->SetOptions(Options);
+}
+
+
+
+//Runs the operation of a job on all of its volumes. The calling thread works on the volumes too, the other
+//volumes are handled by threads of the thread pool. Searches of the single indexes use their own search threads.
+void CIndexManager::RunOnVolumes(VolumeJob &Job)
+{
+	unsigned int nVolumes = (unsigned int) Job.rgIndexes.size();
+	Job.pManager = this;
+	Job.rgVolumeCounts.resize(nVolumes, 0);
+	Job.iNextVolume = 0;
+	Job.hDone = nVolumes > 1 ? CreateEvent(NULL, TRUE, FALSE, NULL) : NULL;
+	if(Job.hDone == NULL)
+	{
+		for(unsigned int i = 0; i != nVolumes; i++)
+			RunOnVolume(Job, i);
+		return;
+	}
+
+	//The calling thread counts as running until it called VolumeWorker() below.
+	//Building and searching wait for the threads of the index, so the pool is told that the work items take long.
+	Job.nRunning = 1;
+	for(unsigned int t = 1; t != nVolumes; t++)
+	{
+		InterlockedIncrement(&Job.nRunning);
+		if(!QueueUserWorkItem(VolumeWorker, &Job, WT_EXECUTELONGFUNCTION))
+		{
+			InterlockedDecrement(&Job.nRunning);
+			break;
+		}
+	}
+	VolumeWorker(&Job);
+	WaitForSingleObject(Job.hDone, INFINITE);
+	CloseHandle(Job.hDone);
+}
+
+
+
+//Runs the operation of a job on one volume
+void CIndexManager::RunOnVolume(VolumeJob &Job, unsigned int iVolume)
+{
+	if(Job.Operation == VOLUME_BUILD)
+	{
+		CDriveIndex *pIndex = new CDriveIndex();
+		if(pIndex->Init(Job.rgDrives[iVolume]))
+		{
+			pIndex->PopulateIndex();
+			Job.rgIndexes[iVolume] = pIndex;
+		}
+		else
+			delete pIndex;
+	}
+	else if(Job.Operation == VOLUME_SEARCH)
+		Job.rgVolumeCounts[iVolume] = Job.rgIndexes[iVolume]->Find(Job.strQuery, Job.strQueryPath, &Job.rgVolumeResults[iVolume], false, Job.bEnhancedSearch, Job.maxResults, NULL, true);
+	else if(Job.Operation == VOLUME_UPDATE)
+		Job.rgVolumeCounts[iVolume] = Job.rgIndexes[iVolume]->UpdateIndex();
+}
+
+
+
+//Thread function of RunOnVolumes(). Claims volumes until all of them are done.
+DWORD WINAPI CIndexManager::VolumeWorker(LPVOID lpParameter)
+{
+	VolumeJob *Job = (VolumeJob*) lpParameter;
+	for(;;)
+	{
+		unsigned int iVolume = (unsigned int) InterlockedIncrement(&Job->iNextVolume) - 1;
+		if(iVolume >= Job->rgIndexes.size())
+			break;
+		Job->pManager->RunOnVolume(*Job, iVolume);
+	}
+	if(InterlockedDecrement(&Job->nRunning) == 0)
+		SetEvent(Job->hDone);
+	return 0;
+}
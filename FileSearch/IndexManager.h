@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <Windows.h>
+#include "CDriveIndex.h"
+using namespace std;
+
+//Operations that CIndexManager runs on all of its volumes at once
+#define VOLUME_BUILD 0
+#define VOLUME_SEARCH 1
+#define VOLUME_UPDATE 2
+
+class CIndexManager;
+
+//State of an operation that runs on every volume of a CIndexManager. The volumes are claimed in order by
+//the threads, each volume writes only to its own slot of the result arrays.
+struct VolumeJob
+{
+	CIndexManager *pManager;
+	unsigned int Operation; //VOLUME_BUILD, VOLUME_SEARCH or VOLUME_UPDATE
+	vector<CDriveIndex*> rgIndexes; //Indexes the operation runs on, NULL entries are skipped
+	vector<WCHAR> rgDrives; //Drive letters of the indexes that are built
+	wstring *strQuery;
+	wstring *strQueryPath;
+	BOOL bEnhancedSearch;
+	int maxResults;
+	vector<vector<SearchResultFile> > rgVolumeResults; //Results of each volume
+	vector<int> rgVolumeCounts; //Return value of the operation on each volume
+	volatile LONG iNextVolume;
+	volatile LONG nRunning;
+	HANDLE hDone; //Set when the last thread finished
+};
+
+//Owns the indexes of several volumes and runs builds, updates and searches on all of them in parallel.
+//Searches return one list for all volumes, ranked by MatchQuality. Like CDriveIndex, a manager must not be used
+//by several threads at once.
+class CIndexManager {
+public:
+	CIndexManager();
+	~CIndexManager();
+	unsigned int AddVolumes(const WCHAR *szDrives);
+	BOOL AddIndex(CDriveIndex *pIndex);
+	BOOL RemoveVolume(WCHAR cDrive);
+	CDriveIndex* GetIndex(WCHAR cDrive);
+	unsigned int GetVolumeCount();
+	int Find(wstring *strQuery, wstring *strPath, vector<SearchResultFile> *rgsrfResults, BOOL bSort = true, BOOL bEnhancedSearch = true, int maxResults = -1);
+	int UpdateIndexes();
+	void SetOptions(SearchOptions *Options);
+
+protected:
+	void RunOnVolumes(VolumeJob &Job);
+	void RunOnVolume(VolumeJob &Job, unsigned int iVolume);
+	static DWORD WINAPI VolumeWorker(LPVOID lpParameter);
+	int FindVolume(WCHAR cDrive);
+
+	vector<CDriveIndex*> rgIndexes; //One per drive letter, in the order they were added
+};
+
+//Exported functions
+CIndexManager* _stdcall CreateIndexManager(WCHAR *szDrives);
+void _stdcall DeleteIndexManager(CIndexManager *pManager);
+BOOL _stdcall AddIndexToManager(CIndexManager *pManager, CDriveIndex *di);
+WCHAR* _stdcall SearchAll(CIndexManager *pManager, WCHAR *szQuery, WCHAR *szPath, BOOL bSort, BOOL bEnhancedSearch, int maxResults, int *nResults);
+int _stdcall UpdateAllIndexes(CIndexManager *pManager);
+void _stdcall SetManagerSearchOptions(CIndexManager *pManager, SearchOptions *Options);
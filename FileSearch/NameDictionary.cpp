@@ -0,0 +1,382 @@
+/**********************************************************************************
+Module name: NameDictionary.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "NameDictionary.h"
+
+
+
+CNameDictionary::CNameDictionary()
+{
+	m_nSorted = 0;
+	m_nCacheHits = 0;
+	m_nCacheMisses = 0;
+}
+
+
+
+// Frees all names and the cache
+void CNameDictionary::Clear()
+{
+	rgData.clear();
+	rgData.shrink_to_fit();
+	rgBlockOffsets.clear();
+	rgBlockOffsets.shrink_to_fit();
+	m_nSorted = 0;
+	hmAppended.clear();
+	vector<unsigned int>().swap(rgCacheIds);
+	vector<wstring>().swap(rgCacheNames);
+}
+
+
+
+unsigned int CNameDictionary::GetCount()
+{
+	return m_nSorted + GetAppendedCount();
+}
+
+
+
+unsigned int CNameDictionary::GetAppendedCount()
+{
+	return (unsigned int) rgBlockOffsets.size() - GetSortedBlocks();
+}
+
+
+
+unsigned int CNameDictionary::GetSortedCount()
+{
+	return m_nSorted;
+}
+
+
+
+unsigned int CNameDictionary::GetSortedBlocks()
+{
+	return (m_nSorted + NAME_BLOCK_SIZE - 1) / NAME_BLOCK_SIZE;
+}
+
+
+
+// Compares names by their characters like wcscmp(), a name comes before the longer names it is a prefix of
+int CNameDictionary::CompareNames(const WCHAR *szA, unsigned int nA, const WCHAR *szB, unsigned int nB)
+{
+	int iResult = wmemcmp(szA, szB, min(nA, nB));
+	if(iResult != 0)
+		return iResult;
+	return nA == nB ? 0 : (nA < nB ? -1 : 1);
+}
+
+
+
+// Adds the name with the id iName to new arrays. The names need to be added in ascending order, szPrevious is the name before it.
+void CNameDictionary::Encode(vector<WCHAR> &rgNewData, vector<unsigned int> &rgNewBlockOffsets, unsigned int iName, const WCHAR *szName, unsigned int nLength, const WCHAR *szPrevious, unsigned int nPrevious)
+{
+	if(iName % NAME_BLOCK_SIZE == 0)
+	{
+		rgNewBlockOffsets.insert(rgNewBlockOffsets.end(), (unsigned int) rgNewData.size());
+		rgNewData.insert(rgNewData.end(), (WCHAR) nLength);
+		rgNewData.insert(rgNewData.end(), szName, szName + nLength);
+		return;
+	}
+	unsigned int nPrefix = 0;
+	unsigned int nMaxPrefix = min(nLength, nPrevious);
+	while(nPrefix < nMaxPrefix && szName[nPrefix] == szPrevious[nPrefix])
+		nPrefix++;
+	rgNewData.insert(rgNewData.end(), (WCHAR) nPrefix);
+	rgNewData.insert(rgNewData.end(), (WCHAR) (nLength - nPrefix));
+	rgNewData.insert(rgNewData.end(), szName + nPrefix, szName + nLength);
+}
+
+
+
+// Replaces all names with the ones encoded in the vectors. The appended names are gone afterwards.
+void CNameDictionary::Replace(vector<WCHAR> &rgNewData, vector<unsigned int> &rgNewBlockOffsets, unsigned int nSorted)
+{
+	rgNewData.shrink_to_fit();
+	rgNewBlockOffsets.shrink_to_fit();
+	rgData.swap(rgNewData);
+	rgBlockOffsets.swap(rgNewBlockOffsets);
+	m_nSorted = nSorted;
+	hmAppended.clear();
+	//The ids have changed
+	rgCacheIds.assign(rgCacheIds.size(), NO_NAME);
+}
+
+
+
+// Decodes the sorted name iName into strName, which contains the name before it unless iName starts a block.
+// iOffset is the position of the name in rgData and is moved to the next name.
+void CNameDictionary::ReadSorted(unsigned int iName, size_t &iOffset, wstring &strName)
+{
+	const WCHAR *pData = rgData.begin() + iOffset;
+	if(iName % NAME_BLOCK_SIZE == 0)
+	{
+		strName.assign(pData + 1, pData[0]);
+		iOffset += 1 + pData[0];
+	}
+	else
+	{
+		strName.resize(pData[0]);
+		strName.append(pData + 2, pData[1]);
+		iOffset += 2 + pData[1];
+	}
+}
+
+
+
+// Returns the characters of an appended name in place
+const WCHAR *CNameDictionary::GetAppended(unsigned int iName, unsigned int &nLength)
+{
+	const WCHAR *pData = rgData.begin() + rgBlockOffsets[GetSortedBlocks() + iName - m_nSorted];
+	nLength = pData[0];
+	return pData + 1;
+}
+
+
+
+unsigned int CNameDictionary::Add(const WCHAR *szName, unsigned int nLength)
+{
+	unsigned int iName = Find(szName, nLength);
+	if(iName != NO_NAME)
+		return iName;
+	iName = GetCount();
+	rgBlockOffsets.insert(rgBlockOffsets.end(), (unsigned int) rgData.size());
+	rgData.insert(rgData.end(), (WCHAR) nLength);
+	rgData.insert(rgData.end(), szName, szName + nLength);
+	hmAppended[wstring(szName, nLength)] = iName;
+	return iName;
+}
+
+
+
+// The block is found by a binary search over the first names of the blocks, then it is decoded up to the name
+unsigned int CNameDictionary::Find(const WCHAR *szName, unsigned int nLength)
+{
+	unsigned int iLow = 0;
+	unsigned int iHigh = GetSortedBlocks();
+	while(iLow < iHigh)
+	{
+		unsigned int iMiddle = (iLow + iHigh) / 2;
+		const WCHAR *pFirst = rgData.begin() + rgBlockOffsets[iMiddle];
+		if(CompareNames(pFirst + 1, pFirst[0], szName, nLength) <= 0)
+			iLow = iMiddle + 1;
+		else
+			iHigh = iMiddle;
+	}
+	if(iLow != 0)
+	{
+		wstring strName;
+		size_t iOffset = rgBlockOffsets[iLow - 1];
+		unsigned int iEnd = min(iLow * NAME_BLOCK_SIZE, m_nSorted);
+		for(unsigned int iName = (iLow - 1) * NAME_BLOCK_SIZE; iName != iEnd; iName++)
+		{
+			ReadSorted(iName, iOffset, strName);
+			int iResult = CompareNames(strName.c_str(), (unsigned int) strName.length(), szName, nLength);
+			if(iResult == 0)
+				return iName;
+			if(iResult > 0)
+				break;
+		}
+	}
+	hash_map<wstring, unsigned int>::iterator it = hmAppended.find(wstring(szName, nLength));
+	return it != hmAppended.end() ? it->second : NO_NAME;
+}
+
+
+
+const WCHAR *CNameDictionary::Decode(unsigned int iName, wstring &strBuffer)
+{
+	if(iName >= m_nSorted)
+	{
+		unsigned int nLength;
+		return GetAppended(iName, nLength);
+	}
+	size_t iOffset = rgBlockOffsets[iName / NAME_BLOCK_SIZE];
+	for(unsigned int k = iName - iName % NAME_BLOCK_SIZE; k <= iName; k++)
+		ReadSorted(k, iOffset, strBuffer);
+	return strBuffer.c_str();
+}
+
+
+
+// A character at a position of nLength or more never moves in front of it, so the names before it in the block
+// only need to be decoded up to nLength characters as well.
+void CNameDictionary::DecodeTo(unsigned int iName, WCHAR *szName, unsigned int nLength)
+{
+	unsigned int nCopy;
+	if(iName >= m_nSorted)
+	{
+		const WCHAR *szAppended = GetAppended(iName, nCopy);
+		memcpy(szName, szAppended, min(nCopy, nLength) * sizeof(WCHAR));
+		return;
+	}
+	const WCHAR *pData = rgData.begin() + rgBlockOffsets[iName / NAME_BLOCK_SIZE];
+	nCopy = min((unsigned int) pData[0], nLength);
+	memcpy(szName, pData + 1, nCopy * sizeof(WCHAR));
+	pData += 1 + pData[0];
+	for(unsigned int k = iName - iName % NAME_BLOCK_SIZE + 1; k <= iName; k++)
+	{
+		//The first pData[0] characters are the ones of the name before
+		unsigned int nPrefix = pData[0];
+		if(nPrefix < nLength)
+			memcpy(szName + nPrefix, pData + 2, min((unsigned int) pData[1], nLength - nPrefix) * sizeof(WCHAR));
+		pData += 2 + pData[1];
+	}
+}
+
+
+
+// Only the lengths are read, nothing is decoded
+unsigned int CNameDictionary::GetLength(unsigned int iName)
+{
+	unsigned int nLength;
+	if(iName >= m_nSorted)
+	{
+		GetAppended(iName, nLength);
+		return nLength;
+	}
+	const WCHAR *pData = rgData.begin() + rgBlockOffsets[iName / NAME_BLOCK_SIZE];
+	nLength = pData[0];
+	pData += 1 + pData[0];
+	for(unsigned int k = iName - iName % NAME_BLOCK_SIZE + 1; k <= iName; k++)
+	{
+		nLength = pData[0] + pData[1];
+		pData += 2 + pData[1];
+	}
+	return nLength;
+}
+
+
+
+const WCHAR *CNameDictionary::DecodeCached(unsigned int iName)
+{
+	//Appended names are stored completely, they don't need the cache
+	if(iName >= m_nSorted)
+	{
+		unsigned int nLength;
+		return GetAppended(iName, nLength);
+	}
+	if(rgCacheIds.size() == 0)
+	{
+		rgCacheIds.assign(NAME_CACHE_SIZE, NO_NAME);
+		rgCacheNames.resize(NAME_CACHE_SIZE);
+	}
+	unsigned int iSlot = iName % NAME_CACHE_SIZE;
+	if(rgCacheIds[iSlot] == iName)
+	{
+		m_nCacheHits++;
+		return rgCacheNames[iSlot].c_str();
+	}
+	m_nCacheMisses++;
+	rgCacheIds[iSlot] = iName;
+	return Decode(iName, rgCacheNames[iSlot]);
+}
+
+
+
+BOOL CNameDictionary::Attach(WCHAR *pData, size_t nData, unsigned int *pBlockOffsets, size_t nBlockOffsets, unsigned int nSorted)
+{
+	Clear();
+	if(nBlockOffsets < (nSorted + NAME_BLOCK_SIZE - 1) / NAME_BLOCK_SIZE)
+		return false;
+	//Check every name once, so decoding never reads outside of pData. The appended names are checked like blocks of one name.
+	size_t nSortedBlocks = (nSorted + NAME_BLOCK_SIZE - 1) / NAME_BLOCK_SIZE;
+	for(size_t j = 0; j != nBlockOffsets; j++)
+	{
+		size_t iOffset = pBlockOffsets[j];
+		size_t nNames = j < nSortedBlocks ? min((size_t) NAME_BLOCK_SIZE, nSorted - j * NAME_BLOCK_SIZE) : 1;
+		size_t nPrevious = 0;
+		for(size_t k = 0; k != nNames; k++)
+		{
+			if(k == 0)
+			{
+				if(iOffset >= nData || pData[iOffset] > nData - iOffset - 1)
+					return false;
+				nPrevious = pData[iOffset];
+				iOffset += 1 + pData[iOffset];
+			}
+			else
+			{
+				if(iOffset + 2 > nData || pData[iOffset] > nPrevious || pData[iOffset + 1] > nData - iOffset - 2)
+					return false;
+				nPrevious = pData[iOffset] + pData[iOffset + 1];
+				iOffset += 2 + pData[iOffset + 1];
+			}
+		}
+	}
+	rgData.Attach(pData, nData);
+	rgBlockOffsets.Attach(pBlockOffsets, nBlockOffsets);
+	m_nSorted = nSorted;
+	for(unsigned int iName = m_nSorted; iName != GetCount(); iName++)
+	{
+		unsigned int nLength;
+		const WCHAR *szName = GetAppended(iName, nLength);
+		hmAppended[wstring(szName, nLength)] = iName;
+	}
+	return true;
+}
+
+
+
+void CNameDictionary::Detach()
+{
+	rgData.Detach();
+	rgBlockOffsets.Detach();
+}
+
+
+
+CIndexArray<WCHAR> &CNameDictionary::GetData()
+{
+	return rgData;
+}
+
+
+
+CIndexArray<unsigned int> &CNameDictionary::GetBlockOffsets()
+{
+	return rgBlockOffsets;
+}
+
+
+
+// The size of the appended names and of the cache is estimated
+size_t CNameDictionary::GetMemoryUsage()
+{
+	size_t cbAppended = 0;
+	for(hash_map<wstring, unsigned int>::iterator it = hmAppended.begin(); it != hmAppended.end(); it++)
+		cbAppended += sizeof(*it) + 2 * sizeof(void*) + (it->first.capacity() + 1) * sizeof(WCHAR);
+	size_t cbCache = rgCacheIds.capacity() * sizeof(unsigned int);
+	for(unsigned int j = 0; j != rgCacheNames.size(); j++)
+		cbCache += sizeof(wstring) + (rgCacheNames[j].capacity() + 1) * sizeof(WCHAR);
+	return rgData.capacity() * sizeof(WCHAR) + rgBlockOffsets.capacity() * sizeof(unsigned int) + cbAppended + cbCache;
+}
+
+
+
+size_t CNameDictionary::GetAttachedSize()
+{
+	size_t cbAttached = 0;
+	if(rgData.IsAttached())
+		cbAttached += rgData.size() * sizeof(WCHAR);
+	if(rgBlockOffsets.IsAttached())
+		cbAttached += rgBlockOffsets.size() * sizeof(unsigned int);
+	return cbAttached;
+}
+
+
+
+DWORDLONG CNameDictionary::GetCacheHits()
+{
+	return m_nCacheHits;
+}
+
+
+
+DWORDLONG CNameDictionary::GetCacheMisses()
+{
+	return m_nCacheMisses;
+}
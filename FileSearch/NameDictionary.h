@@ -0,0 +1,227 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <Windows.h>
+#include <hash_map>
+#include "IndexArray.h"
+using namespace std;
+
+//Number of names in a block of the sorted part of CNameDictionary. Only the first name of a block is stored
+//completely, larger blocks save more memory and make decoding slower.
+#define NAME_BLOCK_SIZE 16
+
+//Number of decoded names kept by CNameDictionary::DecodeCached()
+#define NAME_CACHE_SIZE 4096
+
+//Id of names that are not in the dictionary
+#define NO_NAME 0xFFFFFFFF
+
+// Stores every distinct name of the entries of an index once, the entries reference their name by its id.
+// The names are sorted and front-coded in blocks of NAME_BLOCK_SIZE names: the first name of a block is stored
+// completely (its length followed by its characters), each following name is stored as the number of characters
+// it shares with the name before it, the number of the remaining characters and these characters.
+// Common names like "index.js" or "__init__.py" are only stored once, and names in the same block usually
+// share a long prefix, so the dictionary needs a fraction of the memory of storing every name.
+// Names added after the dictionary was built (e.g. from the USN journal) are appended behind the blocks like the
+// first name of a block, Compact() sorts them into the blocks.
+// Decode() can be called by several threads at once. DecodeCached() and the functions that change the dictionary
+// may only be called by the thread that changes the index.
+class CNameDictionary {
+public:
+	CNameDictionary();
+	void Clear();
+	// Number of distinct names
+	unsigned int GetCount();
+	// Number of names that were appended after the dictionary was built or compacted
+	unsigned int GetAppendedCount();
+	// Builds the dictionary from the names of the entries and sets their NameOffset to the id of their name.
+	// T needs to be IndexedFile and U IndexedDirectory, their NameOffset refers to rgNames before.
+	template <class T, class U>
+	void Build(CIndexArray<T> &rgFiles, CIndexArray<U> &rgDirectories, CIndexArray<WCHAR> &rgNames);
+	// Sorts the appended names into the blocks and drops the names that aren't used by any entry anymore.
+	// This changes the ids, NameOffset of the entries is updated.
+	template <class T, class U>
+	void Compact(CIndexArray<T> &rgFiles, CIndexArray<U> &rgDirectories);
+	// Returns the id of a name. Names that aren't in the dictionary yet are appended.
+	unsigned int Add(const WCHAR *szName, unsigned int nLength);
+	// Returns the id of a name or NO_NAME
+	unsigned int Find(const WCHAR *szName, unsigned int nLength);
+	// Returns the characters of a name. Names in a block are decoded into strBuffer, appended names are returned in place.
+	const WCHAR *Decode(unsigned int iName, wstring &strBuffer);
+	// Writes the first nLength characters of a name to szName without allocating memory. Can be called like Decode().
+	void DecodeTo(unsigned int iName, WCHAR *szName, unsigned int nLength);
+	// Returns the length of a name
+	unsigned int GetLength(unsigned int iName);
+	// Same as Decode(), but recently decoded names are taken from a cache. The result is valid until the next call.
+	const WCHAR *DecodeCached(unsigned int iName);
+	// Uses arrays that are stored elsewhere (see CIndexArray::Attach()), as returned by GetData() and GetBlockOffsets().
+	// Returns FALSE if they don't fit to nSorted or a name doesn't lie within pData.
+	BOOL Attach(WCHAR *pData, size_t nData, unsigned int *pBlockOffsets, size_t nBlockOffsets, unsigned int nSorted);
+	// Copies attached arrays into memory
+	void Detach();
+	CIndexArray<WCHAR> &GetData();
+	CIndexArray<unsigned int> &GetBlockOffsets();
+	// Number of names in the blocks
+	unsigned int GetSortedCount();
+	// Number of bytes used on the heap, attached arrays are not included
+	size_t GetMemoryUsage();
+	// Number of bytes of the attached arrays
+	size_t GetAttachedSize();
+	DWORDLONG GetCacheHits();
+	DWORDLONG GetCacheMisses();
+
+protected:
+	// Orders the entries of an index by their name
+	template <class T, class U>
+	struct EntryOrder
+	{
+		CIndexArray<T> *rgFiles;
+		CIndexArray<U> *rgDirectories;
+		CIndexArray<WCHAR> *rgNames;
+		const WCHAR *GetName(unsigned int j, unsigned int &nLength) const
+		{
+			unsigned int nFiles = (unsigned int) rgFiles->size();
+			unsigned int NameOffset = j < nFiles ? (*rgFiles)[j].NameOffset : (*rgDirectories)[j - nFiles].NameOffset;
+			nLength = j < nFiles ? (*rgFiles)[j].NameLength : (*rgDirectories)[j - nFiles].NameLength;
+			return nLength != 0 ? &(*rgNames)[NameOffset] : TEXT("");
+		}
+		bool operator()(unsigned int a, unsigned int b) const
+		{
+			unsigned int nA, nB;
+			const WCHAR *szA = GetName(a, nA);
+			const WCHAR *szB = GetName(b, nB);
+			return CompareNames(szA, nA, szB, nB) < 0;
+		}
+	};
+	// Orders appended names
+	struct AppendedOrder
+	{
+		CNameDictionary *pDictionary;
+		bool operator()(unsigned int a, unsigned int b) const
+		{
+			unsigned int nA, nB;
+			const WCHAR *szA = pDictionary->GetAppended(a, nA);
+			const WCHAR *szB = pDictionary->GetAppended(b, nB);
+			return CompareNames(szA, nA, szB, nB) < 0;
+		}
+	};
+
+	static int CompareNames(const WCHAR *szA, unsigned int nA, const WCHAR *szB, unsigned int nB);
+	static void Encode(vector<WCHAR> &rgNewData, vector<unsigned int> &rgNewBlockOffsets, unsigned int iName, const WCHAR *szName, unsigned int nLength, const WCHAR *szPrevious, unsigned int nPrevious);
+	unsigned int GetSortedBlocks();
+	void ReadSorted(unsigned int iName, size_t &iOffset, wstring &strName);
+	const WCHAR *GetAppended(unsigned int iName, unsigned int &nLength);
+	void Replace(vector<WCHAR> &rgNewData, vector<unsigned int> &rgNewBlockOffsets, unsigned int nSorted);
+
+	CIndexArray<WCHAR> rgData; //The blocks followed by the appended names
+	CIndexArray<unsigned int> rgBlockOffsets; //Start of each block in rgData, followed by the start of each appended name
+	unsigned int m_nSorted; //Names in the blocks, the appended names have the ids from m_nSorted on
+	hash_map<wstring, unsigned int> hmAppended; //Appended name -> id
+
+	//Decode cache, a name is kept in the slot iName % NAME_CACHE_SIZE
+	vector<unsigned int> rgCacheIds;
+	vector<wstring> rgCacheNames;
+	DWORDLONG m_nCacheHits;
+	DWORDLONG m_nCacheMisses;
+};
+
+
+
+template <class T, class U>
+void CNameDictionary::Build(CIndexArray<T> &rgFiles, CIndexArray<U> &rgDirectories, CIndexArray<WCHAR> &rgNames)
+{
+	//Sort the positions of the entries by their names, files first and directories after them
+	unsigned int nFiles = (unsigned int) rgFiles.size();
+	vector<unsigned int> rgOrder(nFiles + rgDirectories.size());
+	for(unsigned int j = 0; j != rgOrder.size(); j++)
+		rgOrder[j] = j;
+	EntryOrder<T, U> Order;
+	Order.rgFiles = &rgFiles;
+	Order.rgDirectories = &rgDirectories;
+	Order.rgNames = &rgNames;
+	sort(rgOrder.begin(), rgOrder.end(), Order);
+
+	//Equal names follow each other now. Each entry is read once and gets the id right away, rgNames isn't changed.
+	vector<WCHAR> rgNewData;
+	vector<unsigned int> rgNewBlockOffsets;
+	unsigned int nSorted = 0;
+	const WCHAR *szPrevious = NULL;
+	unsigned int nPrevious = 0;
+	for(unsigned int k = 0; k != rgOrder.size(); k++)
+	{
+		unsigned int j = rgOrder[k];
+		unsigned int nLength;
+		const WCHAR *szName = Order.GetName(j, nLength);
+		if(szPrevious == NULL || CompareNames(szName, nLength, szPrevious, nPrevious) != 0)
+		{
+			Encode(rgNewData, rgNewBlockOffsets, nSorted++, szName, nLength, szPrevious, nPrevious);
+			szPrevious = szName;
+			nPrevious = nLength;
+		}
+		(j < nFiles ? rgFiles[j].NameOffset : rgDirectories[j - nFiles].NameOffset) = nSorted - 1;
+	}
+	Replace(rgNewData, rgNewBlockOffsets, nSorted);
+}
+
+
+
+template <class T, class U>
+void CNameDictionary::Compact(CIndexArray<T> &rgFiles, CIndexArray<U> &rgDirectories)
+{
+	//Mark the names that are still used
+	unsigned int nNames = GetCount();
+	vector<unsigned int> rgNewIds(nNames, NO_NAME);
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+		rgNewIds[rgFiles[j].NameOffset] = 0;
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+		rgNewIds[rgDirectories[j].NameOffset] = 0;
+	vector<unsigned int> rgAppended;
+	for(unsigned int iName = m_nSorted; iName != nNames; iName++)
+		if(rgNewIds[iName] != NO_NAME)
+			rgAppended.insert(rgAppended.end(), iName);
+	AppendedOrder Order;
+	Order.pDictionary = this;
+	sort(rgAppended.begin(), rgAppended.end(), Order);
+
+	//Merge the sorted names with the sorted appended names. The blocks are decoded one name after the other.
+	vector<WCHAR> rgNewData;
+	vector<unsigned int> rgNewBlockOffsets;
+	unsigned int nSorted = 0;
+	wstring strName;
+	wstring strPrevious;
+	size_t iOffset = 0;
+	size_t iAppended = 0;
+	for(unsigned int iName = 0; iName <= m_nSorted; iName++)
+	{
+		if(iName != m_nSorted)
+		{
+			ReadSorted(iName, iOffset, strName);
+			if(rgNewIds[iName] == NO_NAME)
+				continue;
+		}
+		while(iAppended != rgAppended.size())
+		{
+			unsigned int nLength;
+			const WCHAR *szAppended = GetAppended(rgAppended[iAppended], nLength);
+			if(iName != m_nSorted && CompareNames(szAppended, nLength, strName.c_str(), (unsigned int) strName.length()) > 0)
+				break;
+			Encode(rgNewData, rgNewBlockOffsets, nSorted, szAppended, nLength, strPrevious.c_str(), (unsigned int) strPrevious.length());
+			rgNewIds[rgAppended[iAppended++]] = nSorted++;
+			strPrevious.assign(szAppended, nLength);
+		}
+		if(iName != m_nSorted)
+		{
+			Encode(rgNewData, rgNewBlockOffsets, nSorted, strName.c_str(), (unsigned int) strName.length(), strPrevious.c_str(), (unsigned int) strPrevious.length());
+			rgNewIds[iName] = nSorted++;
+			strPrevious = strName;
+		}
+	}
+
+	for(unsigned int j = 0; j != rgFiles.size(); j++)
+		rgFiles[j].NameOffset = rgNewIds[rgFiles[j].NameOffset];
+	for(unsigned int j = 0; j != rgDirectories.size(); j++)
+		rgDirectories[j].NameOffset = rgNewIds[rgDirectories[j].NameOffset];
+	Replace(rgNewData, rgNewBlockOffsets, nSorted);
+}
@@ -0,0 +1,632 @@
+/**********************************************************************************
+Module name: PatternMatch.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "PatternMatch.h"
+#include "StringMatch.h"
+#include <algorithm>
+
+//Types of PatternNode
+#define PATTERN_NODE_EMPTY 0 //Matches the empty string
+#define PATTERN_NODE_CHARACTER 1 //Matches one character of a PatternClass
+#define PATTERN_NODE_CONCATENATION 2
+#define PATTERN_NODE_ALTERNATION 3
+#define PATTERN_NODE_STAR 4
+#define PATTERN_NODE_PLUS 5
+#define PATTERN_NODE_OPTIONAL 6
+
+//Limit for the nodes created by {n,m} repetitions, which copy their operand
+#define MAX_PATTERN_NODES 4096
+
+
+
+CPatternMatcher::CPatternMatcher()
+{
+	m_bCompiled = false;
+	m_bAnchoredStart = false;
+	m_bAnchoredEnd = false;
+	m_Accept = 0;
+	m_nPositions = 0;
+	m_nMinLength = 0;
+	m_iPos = 0;
+	m_bError = false;
+	m_bTopLevelAlternation = false;
+	memset(rgAsciiMasks, 0, sizeof(rgAsciiMasks));
+}
+
+
+
+BOOL CPatternMatcher::Compile(const wstring &strPattern, BOOL bRegex)
+{
+	m_bCompiled = false;
+	m_bAnchoredStart = false;
+	m_bAnchoredEnd = false;
+	m_bError = false;
+	m_bTopLevelAlternation = false;
+	rgRequiredLiterals.clear();
+	rgNodes.clear();
+	rgClasses.clear();
+	int iRoot;
+	if(bRegex)
+	{
+		m_strPattern = strPattern;
+		m_iPos = 0;
+		if(m_strPattern.length() != 0 && m_strPattern[0] == L'^')
+		{
+			m_bAnchoredStart = true;
+			m_iPos = 1;
+		}
+		//A $ at the end is an anchor unless it is escaped
+		size_t n = m_strPattern.length();
+		if(n > m_iPos && m_strPattern[n - 1] == L'$')
+		{
+			size_t nBackslashes = 0;
+			while(n - 1 - nBackslashes > m_iPos && m_strPattern[n - 2 - nBackslashes] == L'\\')
+				nBackslashes++;
+			if(nBackslashes % 2 == 0)
+			{
+				m_bAnchoredEnd = true;
+				m_strPattern.erase(n - 1);
+			}
+		}
+		iRoot = ParseAlternation(true);
+		//Only an unmatched ) can stop the parser before the end
+		if(m_iPos != m_strPattern.length())
+			m_bError = true;
+		//The anchors apply to the whole pattern, ^a|b$ would need different anchors for each alternative
+		if(m_bTopLevelAlternation && (m_bAnchoredStart || m_bAnchoredEnd))
+			m_bError = true;
+	}
+	else
+	{
+		//A glob matches the whole name, * is any number of characters and ? is one character
+		m_bAnchoredStart = true;
+		m_bAnchoredEnd = true;
+		iRoot = AddNode(PATTERN_NODE_EMPTY, -1);
+		PatternClass Any;
+		Any.bNegated = true;
+		for(unsigned int j = 0; j != strPattern.length(); j++)
+		{
+			int iNode;
+			if(strPattern[j] == L'*')
+			{
+				if(j > 0 && strPattern[j - 1] == L'*')
+					continue;
+				iNode = AddNode(PATTERN_NODE_STAR, AddCharacter(Any));
+			}
+			else if(strPattern[j] == L'?')
+				iNode = AddCharacter(Any);
+			else
+				iNode = AddLiteral(strPattern[j]);
+			iRoot = rgNodes[iRoot].Type == PATTERN_NODE_EMPTY ? iNode : AddNode(PATTERN_NODE_CONCATENATION, iRoot, iNode);
+		}
+	}
+	BOOL bBuilt = !m_bError && Build(iRoot);
+	if(bBuilt)
+	{
+		CollectLiterals(iRoot, rgRequiredLiterals);
+		m_nMinLength = MinLength(iRoot);
+	}
+	m_strPattern.clear();
+	vector<PatternNode>().swap(rgNodes);
+	vector<PatternClass>().swap(rgClasses);
+	m_bCompiled = bBuilt;
+	return m_bCompiled;
+}
+
+
+
+BOOL CPatternMatcher::IsCompiled() const
+{
+	return m_bCompiled;
+}
+
+
+
+const vector<wstring>& CPatternMatcher::GetRequiredLiterals() const
+{
+	return rgRequiredLiterals;
+}
+
+
+
+unsigned int CPatternMatcher::GetMinLength() const
+{
+	return m_nMinLength;
+}
+
+
+
+int CPatternMatcher::AddNode(unsigned int Type, int iLeft, int iRight)
+{
+	PatternNode Node;
+	Node.Type = Type;
+	Node.iLeft = iLeft;
+	Node.iRight = iRight;
+	rgNodes.insert(rgNodes.end(), Node);
+	return (int) rgNodes.size() - 1;
+}
+
+
+
+int CPatternMatcher::AddCharacter(const PatternClass &Class)
+{
+	rgClasses.insert(rgClasses.end(), Class);
+	int iNode = AddNode(PATTERN_NODE_CHARACTER, -1);
+	rgNodes[iNode].iClass = (int) rgClasses.size() - 1;
+	return iNode;
+}
+
+
+
+int CPatternMatcher::AddLiteral(WCHAR c)
+{
+	PatternClass Class;
+	Class.rgRanges.insert(Class.rgRanges.end(), make_pair(FoldChar(c), FoldChar(c)));
+	return AddCharacter(Class);
+}
+
+
+
+// Copies a subtree. The copies of character nodes share their class, but they become separate positions.
+int CPatternMatcher::CloneNode(int iNode)
+{
+	if(rgNodes.size() >= MAX_PATTERN_NODES)
+	{
+		m_bError = true;
+		return iNode;
+	}
+	PatternNode Node = rgNodes[iNode];
+	if(Node.iLeft != -1)
+		Node.iLeft = CloneNode(Node.iLeft);
+	if(Node.iRight != -1)
+		Node.iRight = CloneNode(Node.iRight);
+	rgNodes.insert(rgNodes.end(), Node);
+	return (int) rgNodes.size() - 1;
+}
+
+
+
+int CPatternMatcher::ParseAlternation(BOOL bTopLevel)
+{
+	int iNode = ParseConcatenation();
+	while(!m_bError && m_iPos < m_strPattern.length() && m_strPattern[m_iPos] == L'|')
+	{
+		m_iPos++;
+		if(bTopLevel)
+			m_bTopLevelAlternation = true;
+		int iRight = ParseConcatenation();
+		iNode = AddNode(PATTERN_NODE_ALTERNATION, iNode, iRight);
+	}
+	return iNode;
+}
+
+
+
+int CPatternMatcher::ParseConcatenation()
+{
+	int iNode = AddNode(PATTERN_NODE_EMPTY, -1);
+	while(!m_bError && m_iPos < m_strPattern.length() && m_strPattern[m_iPos] != L'|' && m_strPattern[m_iPos] != L')')
+	{
+		int iNext = ParseRepetition();
+		iNode = rgNodes[iNode].Type == PATTERN_NODE_EMPTY ? iNext : AddNode(PATTERN_NODE_CONCATENATION, iNode, iNext);
+	}
+	return iNode;
+}
+
+
+
+int CPatternMatcher::ParseRepetition()
+{
+	int iNode = ParseAtom();
+	while(!m_bError && m_iPos < m_strPattern.length())
+	{
+		WCHAR c = m_strPattern[m_iPos];
+		if(c == L'*')
+			iNode = AddNode(PATTERN_NODE_STAR, iNode);
+		else if(c == L'+')
+			iNode = AddNode(PATTERN_NODE_PLUS, iNode);
+		else if(c == L'?')
+			iNode = AddNode(PATTERN_NODE_OPTIONAL, iNode);
+		else if(c == L'{')
+		{
+			m_iPos++;
+			unsigned int nMin, nMax;
+			BOOL bUnbounded = false;
+			if(!ParseCount(nMin))
+				break;
+			nMax = nMin;
+			if(m_iPos < m_strPattern.length() && m_strPattern[m_iPos] == L',')
+			{
+				m_iPos++;
+				if(m_iPos < m_strPattern.length() && m_strPattern[m_iPos] == L'}')
+					bUnbounded = true;
+				else if(!ParseCount(nMax))
+					break;
+			}
+			if(m_iPos >= m_strPattern.length() || m_strPattern[m_iPos] != L'}' || nMax < nMin)
+			{
+				m_bError = true;
+				break;
+			}
+			//x{n,m} is n copies of x followed by m - n optional copies, x{n,} ends with x*
+			int iRepetition = AddNode(PATTERN_NODE_EMPTY, -1);
+			for(unsigned int k = 0; k != nMax + (bUnbounded ? 1 : 0) && !m_bError; k++)
+			{
+				int iCopy = CloneNode(iNode);
+				if(bUnbounded && k == nMax)
+					iCopy = AddNode(PATTERN_NODE_STAR, iCopy);
+				else if(k >= nMin)
+					iCopy = AddNode(PATTERN_NODE_OPTIONAL, iCopy);
+				iRepetition = rgNodes[iRepetition].Type == PATTERN_NODE_EMPTY ? iCopy : AddNode(PATTERN_NODE_CONCATENATION, iRepetition, iCopy);
+			}
+			iNode = iRepetition;
+		}
+		else
+			break;
+		m_iPos++;
+	}
+	return iNode;
+}
+
+
+
+// Reads the number of a {n,m} repetition
+BOOL CPatternMatcher::ParseCount(unsigned int &n)
+{
+	n = 0;
+	size_t iStart = m_iPos;
+	while(m_iPos < m_strPattern.length() && m_strPattern[m_iPos] >= L'0' && m_strPattern[m_iPos] <= L'9' && n <= MAX_PATTERN_REPEAT)
+		n = n * 10 + (m_strPattern[m_iPos++] - L'0');
+	if(m_iPos == iStart || n > MAX_PATTERN_REPEAT)
+		m_bError = true;
+	return !m_bError;
+}
+
+
+
+int CPatternMatcher::ParseAtom()
+{
+	WCHAR c = m_strPattern[m_iPos++];
+	if(c == L'(')
+	{
+		if(m_iPos + 1 < m_strPattern.length() && m_strPattern[m_iPos] == L'?' && m_strPattern[m_iPos + 1] == L':')
+			m_iPos += 2;
+		int iNode = ParseAlternation(false);
+		if(m_iPos >= m_strPattern.length() || m_strPattern[m_iPos] != L')')
+			m_bError = true;
+		else
+			m_iPos++;
+		return iNode;
+	}
+	if(c == L'[')
+		return ParseBracket();
+	if(c == L'.')
+	{
+		PatternClass Any;
+		Any.bNegated = true;
+		return AddCharacter(Any);
+	}
+	if(c == L'\\')
+	{
+		PatternClass Class;
+		if(!ParseEscape(Class))
+			m_bError = true;
+		return AddCharacter(Class);
+	}
+	//Quantifiers without an operand and anchors inside of the pattern
+	if(c == L'*' || c == L'+' || c == L'?' || c == L'{' || c == L'^' || c == L'$')
+		m_bError = true;
+	return AddLiteral(c);
+}
+
+
+
+// Reads the character after a backslash
+BOOL CPatternMatcher::ParseEscape(PatternClass &Class)
+{
+	if(m_iPos >= m_strPattern.length())
+		return false;
+	WCHAR c = m_strPattern[m_iPos++];
+	WCHAR cLower = c >= L'A' && c <= L'Z' ? c + (L'a' - L'A') : c;
+	if(cLower == L'd' || cLower == L'w')
+	{
+		Class.rgRanges.insert(Class.rgRanges.end(), make_pair(L'0', L'9'));
+		if(cLower == L'w')
+		{
+			Class.rgRanges.insert(Class.rgRanges.end(), make_pair(L'a', L'z'));
+			Class.rgRanges.insert(Class.rgRanges.end(), make_pair(L'_', L'_'));
+		}
+		Class.bNegated = c != cLower;
+	}
+	else if(cLower == L's')
+	{
+		Class.rgRanges.insert(Class.rgRanges.end(), make_pair(L' ', L' '));
+		Class.rgRanges.insert(Class.rgRanges.end(), make_pair(L'\t', L'\t'));
+		Class.bNegated = c != cLower;
+	}
+	else
+		Class.rgRanges.insert(Class.rgRanges.end(), make_pair(FoldChar(c), FoldChar(c)));
+	return true;
+}
+
+
+
+// Reads a character class after the [. Ranges of uppercase letters are folded like the names.
+int CPatternMatcher::ParseBracket()
+{
+	PatternClass Class;
+	if(m_iPos < m_strPattern.length() && m_strPattern[m_iPos] == L'^')
+	{
+		Class.bNegated = true;
+		m_iPos++;
+	}
+	BOOL bFirst = true;
+	while(!m_bError && m_iPos < m_strPattern.length() && (m_strPattern[m_iPos] != L']' || bFirst))
+	{
+		bFirst = false;
+		WCHAR cLow = m_strPattern[m_iPos++];
+		if(cLow == L'\\')
+		{
+			PatternClass Escaped;
+			if(!ParseEscape(Escaped) || Escaped.bNegated)
+				m_bError = true;
+			Class.rgRanges.insert(Class.rgRanges.end(), Escaped.rgRanges.begin(), Escaped.rgRanges.end());
+			continue;
+		}
+		WCHAR cHigh = cLow;
+		if(m_iPos + 1 < m_strPattern.length() && m_strPattern[m_iPos] == L'-' && m_strPattern[m_iPos + 1] != L']')
+		{
+			cHigh = m_strPattern[m_iPos + 1];
+			m_iPos += 2;
+			if(cHigh == L'\\' && m_iPos < m_strPattern.length())
+				cHigh = m_strPattern[m_iPos++];
+			if(cHigh < cLow)
+				m_bError = true;
+		}
+		Class.rgRanges.insert(Class.rgRanges.end(), make_pair(cLow, cHigh));
+		//The uppercase letters of a range are matched by the folded characters. Letters that fold to consecutive
+		//characters like A-Z or the Cyrillic capitals share a range.
+		size_t iFolded = Class.rgRanges.size();
+		for(unsigned int c = cLow; c <= cHigh && !m_bError; c++)
+		{
+			WCHAR cFolded = FoldChar((WCHAR) c);
+			if(cFolded == c)
+				continue;
+			if(Class.rgRanges.size() > iFolded && Class.rgRanges.back().second + 1 == cFolded)
+				Class.rgRanges.back().second = cFolded;
+			else
+				Class.rgRanges.insert(Class.rgRanges.end(), make_pair(cFolded, cFolded));
+		}
+	}
+	if(m_iPos >= m_strPattern.length())
+		m_bError = true;
+	else
+		m_iPos++;
+	return AddCharacter(Class);
+}
+
+
+
+// Numbers the positions and creates the tables for matching
+BOOL CPatternMatcher::Build(int iRoot)
+{
+	m_nPositions = 0;
+	rgPositionClasses.assign(1, PatternClass());
+	rgFollow.assign(MAX_PATTERN_POSITIONS + 1, 0);
+	NodeInfo Root = Analyze(iRoot);
+	if(m_bError)
+		return false;
+	rgFollow.resize(m_nPositions + 1);
+	rgFollow[0] = Root.First;
+	m_Accept = Root.Last | (Root.bNullable ? 1ui64 : 0ui64);
+
+	//Each table combines the follow sets of 8 states, entry b is the union for the states whose bits are set in b
+	unsigned int nTables = (m_nPositions + 8) / 8;
+	rgFollowTables.assign(nTables * 256, 0);
+	for(unsigned int t = 0; t != nTables; t++)
+	{
+		for(unsigned int b = 1; b != 256; b++)
+		{
+			unsigned int iLowest = 0;
+			while(!(b & (1 << iLowest)))
+				iLowest++;
+			unsigned int iState = t * 8 + iLowest;
+			rgFollowTables[t * 256 + b] = rgFollowTables[t * 256 + (b & (b - 1))] | (iState <= m_nPositions ? rgFollow[iState] : 0);
+		}
+	}
+
+	for(unsigned int c = 0; c != 128; c++)
+	{
+		rgAsciiMasks[c] = 0;
+		for(unsigned int p = 1; p <= m_nPositions; p++)
+			if(ClassContains(rgPositionClasses[p], (WCHAR) c))
+				rgAsciiMasks[c] |= 1ui64 << p;
+	}
+	return true;
+}
+
+
+
+// Computes whether a subtree matches the empty string and which positions can start and end its matches.
+// The follow sets of the positions are filled in on the way.
+CPatternMatcher::NodeInfo CPatternMatcher::Analyze(int iNode)
+{
+	NodeInfo Info;
+	Info.bNullable = false;
+	Info.First = 0;
+	Info.Last = 0;
+	const PatternNode &Node = rgNodes[iNode];
+	if(Node.Type == PATTERN_NODE_EMPTY)
+		Info.bNullable = true;
+	else if(Node.Type == PATTERN_NODE_CHARACTER)
+	{
+		if(m_nPositions == MAX_PATTERN_POSITIONS)
+		{
+			m_bError = true;
+			return Info;
+		}
+		m_nPositions++;
+		rgPositionClasses.insert(rgPositionClasses.end(), rgClasses[Node.iClass]);
+		Info.First = Info.Last = 1ui64 << m_nPositions;
+	}
+	else if(Node.Type == PATTERN_NODE_CONCATENATION)
+	{
+		NodeInfo Left = Analyze(Node.iLeft);
+		NodeInfo Right = Analyze(Node.iRight);
+		for(unsigned int p = 1; p <= m_nPositions; p++)
+			if(Left.Last & (1ui64 << p))
+				rgFollow[p] |= Right.First;
+		Info.bNullable = Left.bNullable && Right.bNullable;
+		Info.First = Left.First | (Left.bNullable ? Right.First : 0);
+		Info.Last = Right.Last | (Right.bNullable ? Left.Last : 0);
+	}
+	else if(Node.Type == PATTERN_NODE_ALTERNATION)
+	{
+		NodeInfo Left = Analyze(Node.iLeft);
+		NodeInfo Right = Analyze(Node.iRight);
+		Info.bNullable = Left.bNullable || Right.bNullable;
+		Info.First = Left.First | Right.First;
+		Info.Last = Left.Last | Right.Last;
+	}
+	else
+	{
+		Info = Analyze(Node.iLeft);
+		if(Node.Type != PATTERN_NODE_OPTIONAL)
+			for(unsigned int p = 1; p <= m_nPositions; p++)
+				if(Info.Last & (1ui64 << p))
+					rgFollow[p] |= Info.First;
+		if(Node.Type != PATTERN_NODE_PLUS)
+			Info.bNullable = true;
+	}
+	return Info;
+}
+
+
+
+// Adds the literals that every match of a subtree contains. Consecutive characters of a concatenation are combined
+// to one literal. Of alternatives only the characters that all of them need are kept.
+void CPatternMatcher::CollectLiterals(int iNode, vector<wstring> &rgLiterals)
+{
+	const PatternNode &Node = rgNodes[iNode];
+	if(Node.Type == PATTERN_NODE_CHARACTER || Node.Type == PATTERN_NODE_CONCATENATION)
+	{
+		//Flatten the concatenation, its operands may be concatenations themselves
+		vector<int> rgParts;
+		vector<int> rgStack(1, iNode);
+		while(rgStack.size() != 0)
+		{
+			int iPart = rgStack.back();
+			rgStack.pop_back();
+			if(rgNodes[iPart].Type == PATTERN_NODE_CONCATENATION)
+			{
+				rgStack.insert(rgStack.end(), rgNodes[iPart].iRight);
+				rgStack.insert(rgStack.end(), rgNodes[iPart].iLeft);
+			}
+			else
+				rgParts.insert(rgParts.end(), iPart);
+		}
+		wstring strRun;
+		for(unsigned int j = 0; j <= rgParts.size(); j++)
+		{
+			const PatternClass *pClass = j < rgParts.size() && rgNodes[rgParts[j]].Type == PATTERN_NODE_CHARACTER ? &rgClasses[rgNodes[rgParts[j]].iClass] : NULL;
+			if(pClass != NULL && !pClass->bNegated && pClass->rgRanges.size() == 1 && pClass->rgRanges[0].first == pClass->rgRanges[0].second)
+			{
+				strRun += pClass->rgRanges[0].first;
+				continue;
+			}
+			if(strRun.length() != 0)
+				rgLiterals.insert(rgLiterals.end(), strRun);
+			strRun.clear();
+			if(j < rgParts.size() && pClass == NULL)
+				CollectLiterals(rgParts[j], rgLiterals);
+		}
+	}
+	else if(Node.Type == PATTERN_NODE_ALTERNATION)
+	{
+		vector<wstring> rgLeft, rgRight;
+		CollectLiterals(Node.iLeft, rgLeft);
+		CollectLiterals(Node.iRight, rgRight);
+		wstring strLeft, strRight, strCommon;
+		for(unsigned int j = 0; j != rgLeft.size(); j++)
+			strLeft += rgLeft[j];
+		for(unsigned int j = 0; j != rgRight.size(); j++)
+			strRight += rgRight[j];
+		for(unsigned int j = 0; j != strLeft.length(); j++)
+			if(strRight.find(strLeft[j]) != wstring::npos && strCommon.find(strLeft[j]) == wstring::npos)
+				strCommon += strLeft[j];
+		for(unsigned int j = 0; j != strCommon.length(); j++)
+			rgLiterals.insert(rgLiterals.end(), wstring(1, strCommon[j]));
+	}
+	else if(Node.Type == PATTERN_NODE_PLUS)
+		CollectLiterals(Node.iLeft, rgLiterals);
+}
+
+
+
+unsigned int CPatternMatcher::MinLength(int iNode)
+{
+	const PatternNode &Node = rgNodes[iNode];
+	if(Node.Type == PATTERN_NODE_CHARACTER)
+		return 1;
+	if(Node.Type == PATTERN_NODE_CONCATENATION)
+		return MinLength(Node.iLeft) + MinLength(Node.iRight);
+	if(Node.Type == PATTERN_NODE_ALTERNATION)
+		return min(MinLength(Node.iLeft), MinLength(Node.iRight));
+	if(Node.Type == PATTERN_NODE_PLUS)
+		return MinLength(Node.iLeft);
+	return 0;
+}
+
+
+
+BOOL CPatternMatcher::ClassContains(const PatternClass &Class, WCHAR c)
+{
+	WCHAR cFolded = FoldChar(c);
+	BOOL bContained = false;
+	for(unsigned int j = 0; j != Class.rgRanges.size() && !bContained; j++)
+		bContained = cFolded >= Class.rgRanges[j].first && cFolded <= Class.rgRanges[j].second;
+	return bContained != Class.bNegated;
+}
+
+
+
+// Returns the positions that match a character of a name
+DWORDLONG CPatternMatcher::GetCharacterMask(WCHAR c) const
+{
+	if(c < 128)
+		return rgAsciiMasks[c];
+	DWORDLONG Mask = 0;
+	for(unsigned int p = 1; p <= m_nPositions; p++)
+		if(ClassContains(rgPositionClasses[p], c))
+			Mask |= 1ui64 << p;
+	return Mask;
+}
+
+
+
+BOOL CPatternMatcher::Match(const WCHAR *szName, unsigned int nLength) const
+{
+	//A pattern that matches the empty string matches every name if it is not anchored at the end
+	if(!m_bAnchoredEnd && (m_Accept & 1))
+		return true;
+	unsigned int nTables = (unsigned int) rgFollowTables.size() / 256;
+	DWORDLONG Active = 1;
+	for(unsigned int j = 0; j != nLength; j++)
+	{
+		DWORDLONG Next = 0;
+		for(unsigned int t = 0; t != nTables; t++)
+			Next |= rgFollowTables[t * 256 + (unsigned int) ((Active >> (t * 8)) & 0xFF)];
+		Active = Next & GetCharacterMask(szName[j]);
+		//Without ^ a match can start at every character
+		if(!m_bAnchoredStart)
+			Active |= 1;
+		else if(Active == 0)
+			return false;
+		if(!m_bAnchoredEnd && (Active & m_Accept) != 0)
+			return true;
+	}
+	return (Active & m_Accept) != 0;
+}
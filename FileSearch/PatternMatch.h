@@ -0,0 +1,107 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <Windows.h>
+using namespace std;
+
+// Maximum number of characters and character classes in a compiled pattern. Every one of them is a state of the
+// automaton, which is kept in the bits of a DWORDLONG together with the start state.
+#define MAX_PATTERN_POSITIONS 63
+
+// Upper bound for the counts of a {n,m} repetition
+#define MAX_PATTERN_REPEAT 32
+
+// Set of characters matched by one position of a pattern. The ranges contain folded characters.
+struct PatternClass
+{
+	vector<pair<WCHAR, WCHAR> > rgRanges;
+	BOOL bNegated; //Matches every character that is not in rgRanges, so an empty negated class is "."
+	PatternClass()
+	{
+		bNegated = false;
+	}
+};
+
+// Node of the syntax tree of a pattern, only used while the pattern is compiled
+struct PatternNode
+{
+	unsigned int Type; //One of the PATTERN_NODE_ values in PatternMatch.cpp
+	int iLeft; //Operand, for concatenations and alternatives the first one
+	int iRight; //Second operand of concatenations and alternatives
+	int iClass; //Position in CPatternMatcher::rgClasses of a character node
+	PatternNode()
+	{
+		Type = 0;
+		iLeft = -1;
+		iRight = -1;
+		iClass = -1;
+	}
+};
+
+// Matches names against a glob (* and ?, the whole name has to match) or a regular expression (matches any part
+// of the name unless it is anchored with ^ or $). Both are compiled once per query into a position automaton
+// (Glushkov), which is simulated with bit operations: the states that are active after a character are one
+// DWORDLONG, the next states are looked up in tables 8 states at a time. This never backtracks, so every name is
+// matched in linear time. Matching is case-insensitive, characters are folded with FoldChar().
+// Supported regular expressions: literals, ., [...] and [^...] with ranges, \d \w \s and escaped characters,
+// groups (...) and (?:...), |, *, +, ?, {n}, {n,} and {n,m}. ^ and $ are only allowed at the start and end.
+// Match() can be called by several threads at once.
+class CPatternMatcher {
+public:
+	CPatternMatcher();
+	// Returns false if the pattern is invalid or has more than MAX_PATTERN_POSITIONS characters and classes
+	BOOL Compile(const wstring &strPattern, BOOL bRegex);
+	BOOL IsCompiled() const;
+	BOOL Match(const WCHAR *szName, unsigned int nLength) const;
+	// Folded strings that every match contains, for prefiltering names with CDriveIndex::MakeFilter()
+	const vector<wstring>& GetRequiredLiterals() const;
+	// Minimum length of a match
+	unsigned int GetMinLength() const;
+
+protected:
+	struct NodeInfo
+	{
+		BOOL bNullable;
+		DWORDLONG First;
+		DWORDLONG Last;
+	};
+
+	int AddNode(unsigned int Type, int iLeft, int iRight = -1);
+	int AddCharacter(const PatternClass &Class);
+	int AddLiteral(WCHAR c);
+	int CloneNode(int iNode);
+	int ParseAlternation(BOOL bTopLevel);
+	int ParseConcatenation();
+	int ParseRepetition();
+	int ParseAtom();
+	int ParseBracket();
+	BOOL ParseEscape(PatternClass &Class);
+	BOOL ParseCount(unsigned int &n);
+	BOOL Build(int iRoot);
+	NodeInfo Analyze(int iNode);
+	void CollectLiterals(int iNode, vector<wstring> &rgLiterals);
+	unsigned int MinLength(int iNode);
+	static BOOL ClassContains(const PatternClass &Class, WCHAR c);
+	DWORDLONG GetCharacterMask(WCHAR c) const;
+
+	BOOL m_bCompiled;
+	BOOL m_bAnchoredStart;
+	BOOL m_bAnchoredEnd;
+	DWORDLONG m_Accept; //States that end a match
+	unsigned int m_nPositions;
+	unsigned int m_nMinLength;
+	vector<wstring> rgRequiredLiterals;
+	vector<PatternClass> rgPositionClasses; //Characters matched by each position, position 0 is the start state
+	vector<DWORDLONG> rgFollow; //States that can follow each state
+	vector<DWORDLONG> rgFollowTables; //256 entries per 8 states: the states that can follow any combination of them
+	DWORDLONG rgAsciiMasks[128]; //Positions that match each character below 128
+
+	//Only used while compiling
+	wstring m_strPattern;
+	size_t m_iPos;
+	BOOL m_bError;
+	BOOL m_bTopLevelAlternation;
+	vector<PatternNode> rgNodes;
+	vector<PatternClass> rgClasses;
+};
@@ -0,0 +1,318 @@
+/**********************************************************************************
+Module name: SearchSession.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "SearchSession.h"
+
+
+
+// Exported function that opens a session to search an index in the background. The session needs to be closed with
+// CloseSession() before the index is deleted.
+CSearchSession* _stdcall OpenSession(CDriveIndex *di)
+{
+	if(dynamic_cast<CDriveIndex*>(di))
+		return new CSearchSession(di);
+	return NULL;
+}
+
+
+
+// Exported function that submits a search to a session and returns at once. The parameters are the ones of Search().
+// Returns the ticket of the search or 0 if the parameters are invalid. An earlier search of the session is cancelled.
+// pCallback may be NULL, otherwise it is called when the search is done or cancelled.
+DWORD _stdcall SubmitSearch(CSearchSession *pSession, WCHAR *szQuery, WCHAR *szPath, BOOL bSort, BOOL bEnhancedSearch, int maxResults, SearchCallback pCallback, void *pContext)
+{
+	if(dynamic_cast<CSearchSession*>(pSession) && szQuery)
+		return pSession->Submit(&wstring(szQuery), szPath != NULL ? &wstring(szPath) : NULL, bSort, bEnhancedSearch, maxResults, pCallback, pContext);
+	return 0;
+}
+
+
+
+// Exported function that returns one of the SESSION_SEARCH_ states of a search
+int _stdcall GetSearchState(CSearchSession *pSession, DWORD Ticket)
+{
+	if(dynamic_cast<CSearchSession*>(pSession))
+		return pSession->GetState(Ticket);
+	return SESSION_SEARCH_UNKNOWN;
+}
+
+
+
+// Exported function that waits until a search is done or cancelled, dwMilliseconds may be INFINITE.
+// Returns false if it took longer.
+BOOL _stdcall WaitForSearch(CSearchSession *pSession, DWORD Ticket, DWORD dwMilliseconds)
+{
+	if(dynamic_cast<CSearchSession*>(pSession))
+		return pSession->Wait(Ticket, dwMilliseconds);
+	return true;
+}
+
+
+
+// Exported function that returns the results of a search that is done in a string like Search() does.
+// The string needs to be freed with FreeResultsBuffer(). The results can only be taken once, NULL is returned
+// if the search isn't done (see GetSearchState()) or its results were already taken.
+WCHAR* _stdcall TakeSearchResults(CSearchSession *pSession, DWORD Ticket, int *nResults)
+{
+	if(dynamic_cast<CSearchSession*>(pSession))
+	{
+		vector<SearchResultFile> results;
+		int numResults = pSession->TakeResults(Ticket, results);
+		if(numResults != FIND_CANCELLED)
+		{
+			wstring result;
+			if(nResults != NULL)
+				*nResults = numResults;
+			for(unsigned int i = 0; i != results.size(); i++)
+				result += (i == 0 ? TEXT("") : TEXT("\n")) + results[i].Path + results[i].Filename;
+			WCHAR * szOutput = new WCHAR[result.length() + 1];
+			ZeroMemory(szOutput, (result.length() + 1) * sizeof(szOutput[0]));
+			_snwprintf(szOutput, result.length(), TEXT("%s"), result.c_str());
+			return szOutput;
+		}
+	}
+	if(nResults != NULL)
+		*nResults = 0;
+	return NULL;
+}
+
+
+
+// Exported function that cancels the search of a session. It returns when the index isn't used by the session anymore,
+// so the index can be updated or saved afterwards.
+void _stdcall CancelSessionSearch(CSearchSession *pSession)
+{
+	if(dynamic_cast<CSearchSession*>(pSession))
+		pSession->Cancel();
+}
+
+
+
+// Exported function that cancels the search of a session and deletes it
+void _stdcall CloseSession(CSearchSession *pSession)
+{
+	if(dynamic_cast<CSearchSession*>(pSession))
+		delete pSession;
+}
+
+
+
+CSearchSession::CSearchSession(CDriveIndex *pIndex)
+{
+	m_pIndex = pIndex;
+	InitializeCriticalSection(&csState);
+	m_nLastTicket = 0;
+	m_State = SESSION_SEARCH_UNKNOWN;
+	m_bPending = false;
+	m_bCancel = 0;
+	m_bWorking = false;
+	hIdle = CreateEvent(NULL, TRUE, TRUE, NULL);
+	hFinished = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_nResults = FIND_CANCELLED;
+}
+
+
+
+CSearchSession::~CSearchSession()
+{
+	Cancel();
+	//The thread of the pool sets hIdle before it leaves the critical section
+	EnterCriticalSection(&csState);
+	LeaveCriticalSection(&csState);
+	CloseHandle(hIdle);
+	CloseHandle(hFinished);
+	DeleteCriticalSection(&csState);
+}
+
+
+
+CDriveIndex* CSearchSession::GetIndex()
+{
+	return m_pIndex;
+}
+
+
+
+// The new search replaces the waiting one. If a search runs, its cancel flag is set and the thread that runs it starts
+// the new search after Find() returned, otherwise a thread of the pool is started.
+DWORD CSearchSession::Submit(wstring *strQuery, wstring *strPath, BOOL bSort, BOOL bEnhancedSearch, int maxResults, SearchCallback pCallback, void *pContext)
+{
+	SessionRequest Request;
+	Request.Query = *strQuery;
+	Request.bPath = strPath != NULL;
+	if(strPath != NULL)
+		Request.Path = *strPath;
+	Request.bSort = bSort;
+	Request.bEnhancedSearch = bEnhancedSearch;
+	Request.maxResults = maxResults;
+	Request.pCallback = pCallback;
+	Request.pContext = pContext;
+
+	SessionRequest Dropped;
+	EnterCriticalSection(&csState);
+	Request.Ticket = ++m_nLastTicket;
+	BOOL bDropped = m_bPending;
+	if(bDropped)
+		Dropped = m_Pending;
+	m_Pending = Request;
+	m_bPending = true;
+	m_State = SESSION_SEARCH_QUEUED;
+	m_nResults = FIND_CANCELLED;
+	rgResults.clear();
+	//Wake the threads that wait for the earlier search, it is cancelled now
+	SetEvent(hFinished);
+	ResetEvent(hFinished);
+	BOOL bStart = !m_bWorking;
+	if(bStart)
+	{
+		m_bWorking = true;
+		ResetEvent(hIdle);
+	}
+	else
+		m_bCancel = 1;
+	LeaveCriticalSection(&csState);
+
+	//The searches run on the calling thread if no thread of the pool could be started
+	if(bStart && !QueueUserWorkItem(SessionWorker, this, WT_EXECUTELONGFUNCTION))
+		RunSearches();
+	if(bDropped)
+		Notify(Dropped, SESSION_SEARCH_CANCELLED, 0);
+	return Request.Ticket;
+}
+
+
+
+// Searches before the newest one are cancelled, either while they ran or before they started.
+int CSearchSession::GetState(DWORD Ticket)
+{
+	EnterCriticalSection(&csState);
+	int State = m_State;
+	if(Ticket == 0 || Ticket > m_nLastTicket)
+		State = SESSION_SEARCH_UNKNOWN;
+	else if(Ticket != m_nLastTicket)
+		State = SESSION_SEARCH_CANCELLED;
+	LeaveCriticalSection(&csState);
+	return State;
+}
+
+
+
+// hFinished is set when the newest search is done or cancelled and pulsed when a search is submitted,
+// so the state is checked again each time it is set.
+BOOL CSearchSession::Wait(DWORD Ticket, DWORD dwMilliseconds)
+{
+	DWORD dwStart = GetTickCount();
+	for(;;)
+	{
+		int State = GetState(Ticket);
+		if(State != SESSION_SEARCH_QUEUED && State != SESSION_SEARCH_RUNNING)
+			return true;
+		DWORD dwWaited = GetTickCount() - dwStart;
+		if(dwMilliseconds != INFINITE && dwWaited >= dwMilliseconds)
+			return false;
+		WaitForSingleObject(hFinished, dwMilliseconds == INFINITE ? INFINITE : dwMilliseconds - dwWaited);
+	}
+}
+
+
+
+int CSearchSession::TakeResults(DWORD Ticket, vector<SearchResultFile> &rgTaken)
+{
+	int nResults = FIND_CANCELLED;
+	EnterCriticalSection(&csState);
+	if(Ticket != 0 && Ticket == m_nLastTicket && m_State == SESSION_SEARCH_DONE)
+	{
+		rgTaken.swap(rgResults);
+		rgResults.clear();
+		nResults = m_nResults;
+		m_nResults = FIND_CANCELLED;
+	}
+	LeaveCriticalSection(&csState);
+	return nResults;
+}
+
+
+
+// The waiting search is dropped at once, the running one stops at the next chunk of its scan.
+void CSearchSession::Cancel()
+{
+	SessionRequest Dropped;
+	EnterCriticalSection(&csState);
+	BOOL bDropped = m_bPending;
+	if(bDropped)
+	{
+		Dropped = m_Pending;
+		m_bPending = false;
+		m_State = SESSION_SEARCH_CANCELLED;
+		SetEvent(hFinished);
+	}
+	if(m_bWorking)
+		m_bCancel = 1;
+	LeaveCriticalSection(&csState);
+	if(bDropped)
+		Notify(Dropped, SESSION_SEARCH_CANCELLED, 0);
+	WaitForSingleObject(hIdle, INFINITE);
+}
+
+
+
+//Thread that runs the searches of a session
+DWORD WINAPI CSearchSession::SessionWorker(LPVOID lpParameter)
+{
+	((CSearchSession*) lpParameter)->RunSearches();
+	return 0;
+}
+
+
+
+// Runs the newest search until no search is waiting. A search only counts as done if no newer one was submitted
+// and it wasn't cancelled while it ran, even if Find() returned its results.
+void CSearchSession::RunSearches()
+{
+	for(;;)
+	{
+		EnterCriticalSection(&csState);
+		if(!m_bPending)
+		{
+			m_bWorking = false;
+			SetEvent(hIdle);
+			LeaveCriticalSection(&csState);
+			return;
+		}
+		SessionRequest Request = m_Pending;
+		m_bPending = false;
+		m_State = SESSION_SEARCH_RUNNING;
+		m_bCancel = 0;
+		LeaveCriticalSection(&csState);
+
+		vector<SearchResultFile> rgFound;
+		int nFound = m_pIndex->Find(&Request.Query, Request.bPath ? &Request.Path : NULL, &rgFound, Request.bSort, Request.bEnhancedSearch, Request.maxResults, &m_bCancel);
+
+		EnterCriticalSection(&csState);
+		int State = SESSION_SEARCH_CANCELLED;
+		if(Request.Ticket == m_nLastTicket)
+		{
+			if(nFound != FIND_CANCELLED && m_bCancel == 0)
+			{
+				State = SESSION_SEARCH_DONE;
+				rgResults.swap(rgFound);
+				m_nResults = nFound;
+			}
+			m_State = State;
+			SetEvent(hFinished);
+		}
+		LeaveCriticalSection(&csState);
+		Notify(Request, State, State == SESSION_SEARCH_DONE ? nFound : 0);
+	}
+}
+
+
+
+void CSearchSession::Notify(SessionRequest &Request, int State, int nResults)
+{
+	if(Request.pCallback)
+		Request.pCallback(Request.Ticket, State, nResults, Request.pContext);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <Windows.h>
+#include "CDriveIndex.h"
+using namespace std;
+
+//States of a search submitted to a CSearchSession, see GetSearchState()
+#define SESSION_SEARCH_QUEUED 0 //Waits until the search before it stopped
+#define SESSION_SEARCH_RUNNING 1
+#define SESSION_SEARCH_DONE 2 //The results can be taken with TakeSearchResults()
+#define SESSION_SEARCH_CANCELLED 3 //A newer search was submitted or the search was cancelled with CancelSessionSearch()
+#define SESSION_SEARCH_UNKNOWN 4 //The ticket wasn't returned by this session
+
+//Called when a search is done or cancelled, on the thread of the pool that ran it or, for searches that never started,
+//on the thread that replaced them. nResults is the return value of Find() for searches that are done and 0 for
+//cancelled ones. The callback must not cancel or close the session.
+typedef void (_stdcall *SearchCallback)(DWORD Ticket, int State, int nResults, void *pContext);
+
+//A search that was submitted to a CSearchSession and not started yet
+struct SessionRequest
+{
+	DWORD Ticket;
+	wstring Query;
+	wstring Path;
+	BOOL bPath; //Path is used, otherwise the search isn't restricted to a path
+	BOOL bSort;
+	BOOL bEnhancedSearch;
+	int maxResults;
+	SearchCallback pCallback;
+	void *pContext;
+	SessionRequest()
+	{
+		Ticket = 0;
+		bPath = false;
+		bSort = true;
+		bEnhancedSearch = true;
+		maxResults = -1;
+		pCallback = NULL;
+		pContext = NULL;
+	}
+};
+
+// Runs the searches of a client like a search box in the background, so the client doesn't wait while the user types.
+// Submit() returns a ticket at once, the client polls GetState() or gets a callback when the search is done.
+// Only the newest search of a session matters: submitting a search cancels the one that runs (it stops at the next
+// chunk of the scan, see CDriveIndex::Find()) and drops the one that waits. So the time until the results of the last
+// keystroke arrive doesn't depend on the number of keystrokes before it.
+// The searches run on one thread of the pool at a time and use the index like Find() does. While a session has a
+// search, the index must not be used in other ways, e.g. updated, call Cancel() before.
+class CSearchSession {
+public:
+	CSearchSession(CDriveIndex *pIndex);
+	// Cancels the search and waits until it stopped
+	~CSearchSession();
+	// Returns the ticket of the search, tickets of a session increase and are never 0
+	DWORD Submit(wstring *strQuery, wstring *strPath, BOOL bSort, BOOL bEnhancedSearch, int maxResults, SearchCallback pCallback, void *pContext);
+	// Returns one of the SESSION_SEARCH_ states. Searches before the newest one are always cancelled.
+	int GetState(DWORD Ticket);
+	// Waits until the search is done or cancelled. Returns false if this took longer than dwMilliseconds.
+	BOOL Wait(DWORD Ticket, DWORD dwMilliseconds);
+	// Moves the results of a search that is done to rgResults and returns the return value of Find().
+	// Returns FIND_CANCELLED if the search isn't done or its results were already taken.
+	int TakeResults(DWORD Ticket, vector<SearchResultFile> &rgResults);
+	// Cancels the waiting and the running search and waits until the index isn't used by the session anymore
+	void Cancel();
+	CDriveIndex* GetIndex();
+
+protected:
+	static DWORD WINAPI SessionWorker(LPVOID lpParameter);
+	void RunSearches();
+	void Notify(SessionRequest &Request, int State, int nResults);
+
+	CDriveIndex *m_pIndex;
+	CRITICAL_SECTION csState; //Protects the members below, the index is only used by the thread that runs the searches
+	DWORD m_nLastTicket; //Ticket of the newest search
+	int m_State; //State of the newest search
+	SessionRequest m_Pending; //Newest search if it wasn't started yet
+	BOOL m_bPending;
+	volatile LONG m_bCancel; //Cancel flag of the running search, see CDriveIndex::Find()
+	BOOL m_bWorking; //A thread of the pool runs the searches
+	HANDLE hIdle; //Set while no thread runs searches
+	HANDLE hFinished; //Set when the newest search is done or cancelled
+	vector<SearchResultFile> rgResults; //Results of the newest search when it is done
+	int m_nResults;
+};
+
+//Exported functions
+CSearchSession* _stdcall OpenSession(CDriveIndex *di);
+DWORD _stdcall SubmitSearch(CSearchSession *pSession, WCHAR *szQuery, WCHAR *szPath, BOOL bSort, BOOL bEnhancedSearch, int maxResults, SearchCallback pCallback, void *pContext);
+int _stdcall GetSearchState(CSearchSession *pSession, DWORD Ticket);
+BOOL _stdcall WaitForSearch(CSearchSession *pSession, DWORD Ticket, DWORD dwMilliseconds);
+WCHAR* _stdcall TakeSearchResults(CSearchSession *pSession, DWORD Ticket, int *nResults);
+void _stdcall CancelSessionSearch(CSearchSession *pSession);
+void _stdcall CloseSession(CSearchSession *pSession);
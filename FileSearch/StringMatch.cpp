@@ -0,0 +1,313 @@
+/**********************************************************************************
+Module name: StringMatch.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "StringMatch.h"
+#include "FilterScan.h"
+#include <intrin.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+WCHAR g_rgFoldTable[0x10000];
+WCHAR g_rgUpperTable[0x10000];
+
+// Fills g_rgFoldTable when the module is loaded. Letters with a single lowercase letter are folded to it (simple case
+// folding) for Latin, Greek, Cyrillic, Armenian and the fullwidth forms. The rules are fixed instead of asking the OS,
+// because the filters in index files are made of folded names and need to stay the same on every machine.
+// Letters whose lowercase form has several characters like U+0130 are not folded. g_rgUpperTable is the inverse.
+static struct FoldTableInit
+{
+	//Folds the uppercase letters from cFirst to cLast, which are followed by their lowercase letter in pairs
+	static void FoldPairs(unsigned int cFirst, unsigned int cLast)
+	{
+		for(unsigned int c = cFirst; c <= cLast; c += 2)
+			g_rgFoldTable[c] = (WCHAR) (c + 1);
+	}
+	//Folds the uppercase letters from cFirst to cLast to the letters Offset behind them
+	static void FoldRange(unsigned int cFirst, unsigned int cLast, unsigned int Offset)
+	{
+		for(unsigned int c = cFirst; c <= cLast; c++)
+			g_rgFoldTable[c] = (WCHAR) (c + Offset);
+	}
+	FoldTableInit()
+	{
+		for(unsigned int c = 0; c != 0x10000; c++)
+			g_rgFoldTable[c] = (WCHAR) c;
+		FoldRange(L'A', L'Z', L'a' - L'A');
+		//Latin-1 and Latin Extended-A
+		FoldRange(0x00C0, 0x00D6, 0x20);
+		FoldRange(0x00D8, 0x00DE, 0x20);
+		FoldPairs(0x0100, 0x012E);
+		FoldPairs(0x0132, 0x0136);
+		FoldPairs(0x0139, 0x0147);
+		FoldPairs(0x014A, 0x0176);
+		g_rgFoldTable[0x0178] = 0x00FF;
+		FoldPairs(0x0179, 0x017D);
+		//Greek
+		g_rgFoldTable[0x0386] = 0x03AC;
+		FoldRange(0x0388, 0x038A, 0x25);
+		g_rgFoldTable[0x038C] = 0x03CC;
+		FoldRange(0x038E, 0x038F, 0x3F);
+		FoldRange(0x0391, 0x03A1, 0x20);
+		FoldRange(0x03A3, 0x03AB, 0x20);
+		//Cyrillic
+		FoldRange(0x0400, 0x040F, 0x50);
+		FoldRange(0x0410, 0x042F, 0x20);
+		FoldPairs(0x0460, 0x0480);
+		FoldPairs(0x048A, 0x04BE);
+		g_rgFoldTable[0x04C0] = 0x04CF;
+		FoldPairs(0x04C1, 0x04CD);
+		FoldPairs(0x04D0, 0x052E);
+		//Armenian
+		FoldRange(0x0531, 0x0556, 0x30);
+		//Latin Extended Additional, U+1E9E (capital sharp s) folds to several characters
+		FoldPairs(0x1E00, 0x1E94);
+		FoldPairs(0x1EA0, 0x1EFE);
+		//Fullwidth Latin letters
+		FoldRange(0xFF21, 0xFF3A, 0x20);
+
+		for(unsigned int c = 0; c != 0x10000; c++)
+			g_rgUpperTable[c] = (WCHAR) c;
+		for(unsigned int c = 0; c != 0x10000; c++)
+			if(g_rgFoldTable[c] != c)
+				g_rgUpperTable[g_rgFoldTable[c]] = (WCHAR) c;
+	}
+} s_FoldTableInit;
+
+
+
+void FoldString(const WCHAR *sz, size_t n, WCHAR *szDest)
+{
+	for(size_t j = 0; j != n; j++)
+		szDest[j] = FoldChar(sz[j]);
+}
+
+
+
+void FoldString(wstring &str)
+{
+	if(str.length() != 0)
+		FoldString(&str[0], str.length(), &str[0]);
+}
+
+
+
+int FindString(const WCHAR *szText, unsigned int nText, const WCHAR *szPattern, unsigned int nPattern)
+{
+	if(nPattern == 0)
+		return 0;
+	if(nPattern > nText)
+		return -1;
+	unsigned int nStarts = nText - nPattern + 1; //Number of positions where the pattern fits
+	WCHAR cFirst = szPattern[0];
+	size_t cbRest = (nPattern - 1) * sizeof(WCHAR);
+	unsigned int j = 0;
+#if defined(_M_IX86) || defined(_M_X64)
+	if(GetFilterScanLevel() >= FILTER_SCAN_SSE2)
+	{
+		//Compares 8 characters at once with the first character of the pattern, the rest is only compared at the hits
+		__m128i First = _mm_set1_epi16((short) cFirst);
+		for(; j + 8 <= nStarts; j += 8)
+		{
+			unsigned int Mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*) (szText + j)), First));
+			unsigned long iBit;
+			while(_BitScanForward(&iBit, Mask))
+			{
+				unsigned int i = j + iBit / 2;
+				if(memcmp(szText + i + 1, szPattern + 1, cbRest) == 0)
+					return (int) i;
+				Mask &= ~(3u << iBit); //Each character sets two bits
+			}
+		}
+	}
+#endif
+	for(; j != nStarts; j++)
+		if(szText[j] == cFirst && memcmp(szText + j + 1, szPattern + 1, cbRest) == 0)
+			return (int) j;
+	return -1;
+}
+
+
+
+int FindFolded(const WCHAR *szText, unsigned int nText, const WCHAR *szPatternLower, unsigned int nPattern)
+{
+	if(nText <= MATCH_BUFFER_SIZE)
+	{
+		WCHAR szTextLower[MATCH_BUFFER_SIZE];
+		FoldString(szText, nText, szTextLower);
+		return FindString(szTextLower, nText, szPatternLower, nPattern);
+	}
+	for(unsigned int j = 0; j + nPattern <= nText; j++)
+	{
+		unsigned int k = 0;
+		while(k != nPattern && FoldChar(szText[j + k]) == szPatternLower[k])
+			k++;
+		if(k == nPattern)
+			return (int) j;
+	}
+	return -1;
+}
+
+
+
+float FuzzySearch(const WCHAR *szLonger, unsigned int lenl, const WCHAR *szShorter, const WCHAR *szShorterLower, unsigned int lens)
+{
+	//Note: All string lengths are shorter than MAX_PATH, so an uint is perfectly fitted.
+	if(lens > lenl)
+		return 0.0f;
+
+	//Check if the shorter string is a substring of the longer string
+	int Contained = FindString(szLonger, lenl, szShorter, lens);
+	if(Contained != -1)
+		return Contained == 0 ? 1.0f : 0.8f;
+
+	//Check if the shorter string is a substring of the longer string, ignoring the case
+	Contained = FindFolded(szLonger, lenl, szShorterLower, lens);
+	if(Contained != -1)
+		return Contained == 0 ? 0.9f : 0.7f;
+
+	//Check if string can be matched by omitting characters
+	if(lens < 5)
+	{
+		unsigned int pos = 0;
+		unsigned int matched = 0;
+		for(unsigned int i = 0; i != lens; i++)
+		{
+			WCHAR c = UpperChar(szShorter[i]); //only look for capital letters in longer string, (e.g. match tc in TrueCrypt)
+			for(unsigned int j = pos; j != lenl; j++)
+			{
+				if(szLonger[j] == c)
+				{
+					pos = j + 1;
+					matched++;
+					break;
+				}
+			}
+		}
+		if(matched == lens)
+			return 0.9f; //Slightly worse than direct matches
+	}
+	return 0;
+}
+
+
+
+//Performs a fuzzy search for shorter in longer.
+//return values range from 0.0 = no match to 1.0 = match at the start. 0.6 seems appropriate as threshold.
+float FuzzySearch(wstring &longer, wstring &shorter)
+{
+	wstring shorterlower(shorter);
+	FoldString(shorterlower);
+	return FuzzySearch(longer.c_str(), (unsigned int) longer.length(), shorter.c_str(), shorterlower.c_str(), (unsigned int) shorter.length());
+}
+
+
+
+CApproximateMatcher::CApproximateMatcher()
+{
+	m_nPattern = 0;
+	m_nMaxEdits = 0;
+	m_nHighChars = 0;
+}
+
+
+
+void CApproximateMatcher::Init(const WCHAR *szPatternLower, unsigned int nPattern, unsigned int nMaxEdits)
+{
+	m_nPattern = nPattern;
+	m_nMaxEdits = nPattern <= 64 ? nMaxEdits : 0;
+	m_nHighChars = 0;
+	memset(rgLowMasks, 0, sizeof(rgLowMasks));
+	if(m_nMaxEdits == 0)
+		return;
+	for(unsigned int j = 0; j != nPattern; j++)
+	{
+		WCHAR c = szPatternLower[j];
+		if(c < 256)
+		{
+			rgLowMasks[c] |= 1ui64 << j;
+			continue;
+		}
+		unsigned int k = 0;
+		while(k != m_nHighChars && rgHighChars[k] != c)
+			k++;
+		if(k == m_nHighChars)
+		{
+			rgHighChars[k] = c;
+			rgHighMasks[k] = 0;
+			m_nHighChars++;
+		}
+		rgHighMasks[k] |= 1ui64 << j;
+	}
+}
+
+
+
+BOOL CApproximateMatcher::IsEnabled() const
+{
+	return m_nMaxEdits != 0;
+}
+
+
+
+unsigned int CApproximateMatcher::GetMaxEdits() const
+{
+	return m_nMaxEdits;
+}
+
+
+
+DWORDLONG CApproximateMatcher::GetMask(WCHAR c) const
+{
+	if(c < 256)
+		return rgLowMasks[c];
+	for(unsigned int k = 0; k != m_nHighChars; k++)
+		if(rgHighChars[k] == c)
+			return rgHighMasks[k];
+	return 0;
+}
+
+
+
+unsigned int CApproximateMatcher::Distance(const WCHAR *szText, unsigned int nText) const
+{
+	//Pv and Mv describe the vertical differences of the current column (+1 and -1), Score is its last value.
+	//A match may start anywhere in the text, so the first row is always 0 and no carry is shifted into it.
+	DWORDLONG Pv = ~0ui64;
+	DWORDLONG Mv = 0;
+	DWORDLONG High = 1ui64 << (m_nPattern - 1);
+	unsigned int Score = m_nPattern;
+	unsigned int Best = Score;
+	for(unsigned int j = 0; j != nText && Best != 0; j++)
+	{
+		DWORDLONG Eq = GetMask(FoldChar(szText[j]));
+		DWORDLONG Xv = Eq | Mv;
+		DWORDLONG Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq;
+		DWORDLONG Ph = Mv | ~(Xh | Pv);
+		DWORDLONG Mh = Pv & Xh;
+		if(Ph & High)
+			Score++;
+		else if(Mh & High)
+			Score--;
+		Ph <<= 1;
+		Mh <<= 1;
+		Pv = Mh | ~(Xv | Ph);
+		Mv = Ph & Xv;
+		if(Score < Best)
+			Best = Score;
+	}
+	return Best;
+}
+
+
+
+float CApproximateMatcher::MatchQuality(const WCHAR *szText, unsigned int nText) const
+{
+	unsigned int nEdits = Distance(szText, nText);
+	if(nEdits > m_nMaxEdits)
+		return 0.0f;
+	return 0.6f + 0.1f * (float) (m_nPattern - nEdits) / (float) (m_nPattern + 1);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <Windows.h>
+using namespace std;
+
+// Names up to this length are folded into a buffer on the stack before they are searched. NTFS names are
+// limited to 255 characters, so only paths can be longer. They are folded character by character instead.
+#define MATCH_BUFFER_SIZE MAX_PATH
+
+// Lowercase version of every UTF-16 code unit. Queries, names and paths are all folded through this table,
+// so every case-insensitive comparison in the index uses the same rules.
+extern WCHAR g_rgFoldTable[0x10000];
+
+inline WCHAR FoldChar(WCHAR c)
+{
+	return g_rgFoldTable[c];
+}
+
+// Uppercase version of every UTF-16 code unit by the rules of g_rgFoldTable. Letters without an uppercase letter
+// and characters without case are not changed.
+extern WCHAR g_rgUpperTable[0x10000];
+
+inline WCHAR UpperChar(WCHAR c)
+{
+	return g_rgUpperTable[g_rgFoldTable[c]];
+}
+
+// Folds n characters from sz to szDest. Both may point to the same buffer.
+void FoldString(const WCHAR *sz, size_t n, WCHAR *szDest);
+void FoldString(wstring &str);
+
+// Returns the position of the first occurrence of szPattern in szText or -1. The comparison is case-sensitive.
+// Positions where the first character of the pattern occurs are searched with SSE2 if it is available.
+int FindString(const WCHAR *szText, unsigned int nText, const WCHAR *szPattern, unsigned int nPattern);
+
+// Like FindString(), but szText is folded before it is searched. szPatternLower needs to be folded already.
+int FindFolded(const WCHAR *szText, unsigned int nText, const WCHAR *szPatternLower, unsigned int nPattern);
+
+// Performs a fuzzy search for szShorter in szLonger. szShorterLower is the folded version of szShorter, it is
+// passed in so that a query only needs to be folded once. Doesn't allocate any memory.
+// Returns 1.0 for a match at the start of szLonger, lower values for worse matches and 0.0 if there is no match.
+float FuzzySearch(const WCHAR *szLonger, unsigned int lenl, const WCHAR *szShorter, const WCHAR *szShorterLower, unsigned int lens);
+float FuzzySearch(wstring &longer, wstring &shorter);
+
+// Finds approximate occurrences of a pattern with Myers' bit-parallel algorithm. Every column of the edit distance
+// matrix is kept in a few 64 bit words, so the pattern can have at most 64 characters.
+// The pattern is prepared once per search, Distance() can then be called by several threads at once.
+class CApproximateMatcher {
+public:
+	CApproximateMatcher();
+	// szPatternLower needs to be folded. Approximate matching is disabled if nMaxEdits is 0 or the pattern is too long.
+	void Init(const WCHAR *szPatternLower, unsigned int nPattern, unsigned int nMaxEdits);
+	BOOL IsEnabled() const;
+	unsigned int GetMaxEdits() const;
+	// Returns the smallest number of edits (insertions, deletions, substitutions) needed to find the pattern in the
+	// folded text. The text is not folded in advance.
+	unsigned int Distance(const WCHAR *szText, unsigned int nText) const;
+	// Maps the distance to the range of FuzzySearch() below its worst case-insensitive match (0.7), so typos
+	// rank behind all exact matches. Returns 0.0 if more than the allowed number of edits are needed.
+	float MatchQuality(const WCHAR *szText, unsigned int nText) const;
+
+protected:
+	DWORDLONG GetMask(WCHAR c) const;
+
+	unsigned int m_nPattern;
+	unsigned int m_nMaxEdits;
+	DWORDLONG rgLowMasks[256]; //Positions of each character below 256 in the pattern
+	WCHAR rgHighChars[64]; //Other characters of the pattern
+	DWORDLONG rgHighMasks[64];
+	unsigned int m_nHighChars;
+};
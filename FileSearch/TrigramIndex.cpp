@@ -0,0 +1,199 @@
+/**********************************************************************************
+Module name: TrigramIndex.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+#include "stdafx.h"
+#include "TrigramIndex.h"
+#include "StringMatch.h"
+#include <algorithm>
+
+
+
+CTrigramIndex::CTrigramIndex()
+{
+	m_bBuilt = false;
+}
+
+
+
+// Frees all posting lists
+void CTrigramIndex::Clear()
+{
+	m_bBuilt = false;
+	vector<DWORDLONG>().swap(rgKeys);
+	vector<unsigned int>().swap(rgListOffsets);
+	vector<unsigned int>().swap(rgListCounts);
+	vector<BYTE>().swap(rgPostings);
+}
+
+
+
+BOOL CTrigramIndex::IsBuilt()
+{
+	return m_bBuilt;
+}
+
+
+
+// Combines three characters to a key. The characters are folded like in CDriveIndex::Find().
+DWORDLONG CTrigramIndex::MakeKey(const WCHAR *sz)
+{
+	return ((DWORDLONG) FoldChar(sz[0]) << 32) | ((DWORDLONG) FoldChar(sz[1]) << 16) | (DWORDLONG) FoldChar(sz[2]);
+}
+
+
+
+// Adds all trigrams of a name to the posting lists. Entries need to be added in ascending order.
+void CTrigramIndex::AddName(unsigned int iEntry, const WCHAR *szName, unsigned int nLength)
+{
+	for(unsigned int j = 0; j + 3 <= nLength; j++)
+	{
+		DWORDLONG Key = MakeKey(szName + j);
+		hash_map<DWORDLONG, unsigned int>::iterator it = hmBuildLists.find(Key);
+		unsigned int iList;
+		if(it == hmBuildLists.end())
+		{
+			iList = (unsigned int) rgBuildPostings.size();
+			hmBuildLists[Key] = iList;
+			rgBuildPostings.resize(iList + 1);
+			rgBuildLast.insert(rgBuildLast.end(), 0);
+			rgBuildCounts.insert(rgBuildCounts.end(), 0);
+		}
+		else
+			iList = it->second;
+
+		//Trigrams that occur several times in a name are only added once
+		if(rgBuildLast[iList] == iEntry + 1)
+			continue;
+		unsigned int Delta = iEntry + 1 - rgBuildLast[iList];
+		rgBuildLast[iList] = iEntry + 1;
+		rgBuildCounts[iList]++;
+		vector<BYTE> &rgList = rgBuildPostings[iList];
+		while(Delta >= 0x80)
+		{
+			rgList.insert(rgList.end(), (BYTE) (Delta | 0x80));
+			Delta >>= 7;
+		}
+		rgList.insert(rgList.end(), (BYTE) Delta);
+	}
+}
+
+
+
+// Moves the posting lists into one buffer, ordered by trigram, and frees the memory used while building
+void CTrigramIndex::Finish()
+{
+	vector<pair<DWORDLONG, unsigned int> > rgOrder;
+	rgOrder.reserve(hmBuildLists.size());
+	size_t cbPostings = 0;
+	for(hash_map<DWORDLONG, unsigned int>::iterator it = hmBuildLists.begin(); it != hmBuildLists.end(); it++)
+	{
+		rgOrder.insert(rgOrder.end(), *it);
+		cbPostings += rgBuildPostings[it->second].size();
+	}
+	sort(rgOrder.begin(), rgOrder.end());
+
+	rgKeys.reserve(rgOrder.size());
+	rgListOffsets.reserve(rgOrder.size());
+	rgListCounts.reserve(rgOrder.size());
+	rgPostings.reserve(cbPostings);
+	for(unsigned int j = 0; j != rgOrder.size(); j++)
+	{
+		vector<BYTE> &rgList = rgBuildPostings[rgOrder[j].second];
+		rgKeys.insert(rgKeys.end(), rgOrder[j].first);
+		rgListOffsets.insert(rgListOffsets.end(), (unsigned int) rgPostings.size());
+		rgListCounts.insert(rgListCounts.end(), rgBuildCounts[rgOrder[j].second]);
+		rgPostings.insert(rgPostings.end(), rgList.begin(), rgList.end());
+		vector<BYTE>().swap(rgList);
+	}
+
+	hash_map<DWORDLONG, unsigned int>().swap(hmBuildLists);
+	vector<vector<BYTE> >().swap(rgBuildPostings);
+	vector<unsigned int>().swap(rgBuildLast);
+	vector<unsigned int>().swap(rgBuildCounts);
+	m_bBuilt = true;
+}
+
+
+
+// Decodes the next difference of a posting list
+inline unsigned int CTrigramIndex::ReadDelta(const BYTE* &pList)
+{
+	unsigned int Delta = 0;
+	unsigned int Shift = 0;
+	BYTE b;
+	do
+	{
+		b = *pList++;
+		Delta |= (unsigned int) (b & 0x7F) << Shift;
+		Shift += 7;
+	} while(b & 0x80);
+	return Delta;
+}
+
+
+
+// Keeps only the candidates that are contained in the posting list iList
+void CTrigramIndex::Intersect(unsigned int iList, vector<unsigned int> &rgCandidates)
+{
+	const BYTE *pList = &rgPostings[rgListOffsets[iList]];
+	unsigned int nCommon = 0;
+	unsigned int iCandidate = 0;
+	unsigned int Position = 0;
+	for(unsigned int j = 0; j != rgListCounts[iList] && iCandidate != rgCandidates.size(); j++)
+	{
+		Position += ReadDelta(pList);
+		unsigned int iEntry = Position - 1;
+		while(iCandidate != rgCandidates.size() && rgCandidates[iCandidate] < iEntry)
+			iCandidate++;
+		if(iCandidate != rgCandidates.size() && rgCandidates[iCandidate] == iEntry)
+			rgCandidates[nCommon++] = rgCandidates[iCandidate++];
+	}
+	rgCandidates.resize(nCommon);
+}
+
+
+
+BOOL CTrigramIndex::Find(wstring &strQuery, vector<unsigned int> &rgCandidates)
+{
+	rgCandidates.clear();
+	if(!m_bBuilt || strQuery.length() < 3)
+		return FALSE;
+
+	//Find the posting lists of all trigrams of the query
+	vector<pair<unsigned int, unsigned int> > rgLists; //Number of entries, list
+	for(unsigned int j = 0; j + 3 <= strQuery.length(); j++)
+	{
+		DWORDLONG Key = MakeKey(strQuery.c_str() + j);
+		vector<DWORDLONG>::iterator it = lower_bound(rgKeys.begin(), rgKeys.end(), Key);
+		if(it == rgKeys.end() || *it != Key)
+			return TRUE; //No name contains this trigram
+		unsigned int iList = (unsigned int) (it - rgKeys.begin());
+		rgLists.insert(rgLists.end(), pair<unsigned int, unsigned int>(rgListCounts[iList], iList));
+	}
+
+	//Start with the shortest list, so the candidates only get fewer
+	sort(rgLists.begin(), rgLists.end());
+	rgLists.erase(unique(rgLists.begin(), rgLists.end()), rgLists.end());
+	unsigned int iList = rgLists[0].second;
+	rgCandidates.resize(rgListCounts[iList]);
+	const BYTE *pList = &rgPostings[rgListOffsets[iList]];
+	unsigned int Position = 0;
+	for(unsigned int j = 0; j != rgCandidates.size(); j++)
+	{
+		Position += ReadDelta(pList);
+		rgCandidates[j] = Position - 1;
+	}
+	for(unsigned int j = 1; j != rgLists.size() && !rgCandidates.empty(); j++)
+		Intersect(rgLists[j].second, rgCandidates);
+	return TRUE;
+}
+
+
+
+size_t CTrigramIndex::GetMemoryUsage()
+{
+	return rgKeys.capacity() * sizeof(DWORDLONG) + rgListOffsets.capacity() * sizeof(unsigned int)
+		+ rgListCounts.capacity() * sizeof(unsigned int) + rgPostings.capacity();
+}
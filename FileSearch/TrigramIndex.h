@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <Windows.h>
+#include <hash_map>
+#include "IndexArray.h"
+#include "NameDictionary.h"
+using namespace std;
+
+// Inverted index from the trigrams (3 consecutive characters) of lowercase names to the positions of the entries
+// that contain them. Each posting list is stored as ascending positions, encoded as differences in a variable
+// length format (7 bits per byte, the highest bit marks that more bytes follow).
+// A name contains a query only if it contains all trigrams of the query, so intersecting their posting lists
+// yields a small superset of the matching entries.
+class CTrigramIndex {
+public:
+	CTrigramIndex();
+	void Clear();
+	BOOL IsBuilt();
+	// Builds the index for rgEntries, T needs to be IndexedFile or IndexedDirectory. The names are in rgNames,
+	// or in pDictionary if it isn't NULL (see CDriveIndex::NameDictionary).
+	template <class T>
+	void Build(CIndexArray<T> &rgEntries, CIndexArray<WCHAR> &rgNames, CNameDictionary *pDictionary);
+	// Returns FALSE if the query is shorter than 3 characters and can't be looked up. Otherwise rgCandidates
+	// receives the ascending positions of all entries that contain every trigram of the query.
+	BOOL Find(wstring &strQuery, vector<unsigned int> &rgCandidates);
+	// Number of bytes used by the index
+	size_t GetMemoryUsage();
+
+protected:
+	static DWORDLONG MakeKey(const WCHAR *sz);
+	static unsigned int ReadDelta(const BYTE* &pList);
+	void AddName(unsigned int iEntry, const WCHAR *szName, unsigned int nLength);
+	void Finish();
+	void Intersect(unsigned int iList, vector<unsigned int> &rgCandidates);
+
+	BOOL m_bBuilt;
+	vector<DWORDLONG> rgKeys; //Sorted trigrams, 16 bits per character
+	vector<unsigned int> rgListOffsets; //Start of the posting list of each trigram in rgPostings
+	vector<unsigned int> rgListCounts; //Number of entries in the posting list of each trigram
+	vector<BYTE> rgPostings; //All posting lists
+
+	//Only used while building
+	hash_map<DWORDLONG, unsigned int> hmBuildLists; //trigram -> list in rgBuildPostings
+	vector<vector<BYTE> > rgBuildPostings;
+	vector<unsigned int> rgBuildLast; //Last position added to each list + 1, 0 for empty lists
+	vector<unsigned int> rgBuildCounts;
+};
+
+
+
+template <class T>
+void CTrigramIndex::Build(CIndexArray<T> &rgEntries, CIndexArray<WCHAR> &rgNames, CNameDictionary *pDictionary)
+{
+	Clear();
+	wstring strName;
+	for(unsigned int j = 0; j != rgEntries.size(); j++)
+	{
+		if(rgEntries[j].NameLength < 3)
+			continue;
+		const WCHAR *szName = pDictionary != NULL ? pDictionary->Decode(rgEntries[j].NameOffset, strName) : &rgNames[rgEntries[j].NameOffset];
+		AddName(j, szName, rgEntries[j].NameLength);
+	}
+	Finish();
+}
@@ -0,0 +1,416 @@
+/**********************************************************************************
+Module name: JournalTest.cpp
+Written by: Christian Sander
+**********************************************************************************/
+
+// Builds an index of a small volume from recorded records and replays USN journal buffers on it, the way
+// UpdateIndex() passes the output of FSCTL_READ_USN_JOURNAL to ReadJournalBuffer() and ApplyJournalChanges().
+// After each replay the paths of the changed entries, their types and the file and directory counts of their
+// parents are checked. A search for the best matches on a larger volume checks that the scan ends early.
+// Prints the failed checks and returns 0 if all checks passed. Usage: JournalTest
+
+#include "stdafx.h"
+#include <stdio.h>
+#include "CDriveIndex.h"
+
+//Drive letter of the test volume
+#define TEST_DRIVE TEXT('T')
+
+//FileReferenceNumber of the root directory of NTFS volumes: MFT record 5, sequence number 5
+#define TEST_ROOT_FRN 0x0005000000000005ui64
+
+//FileReferenceNumber of an MFT record. The sequence number is increased when the record is reused.
+#define TEST_FRN(RecordNumber, Sequence) ((((DWORDLONG) (Sequence)) << 48) | (RecordNumber))
+
+//Records of the test volume:
+//T:\readme.txt
+//T:\docs\a.txt
+//T:\docs\old\b.txt
+//T:\src\main.cpp
+#define RECORD_DOCS 20
+#define RECORD_SRC 21
+#define RECORD_OLD 22
+#define RECORD_README 30
+#define RECORD_A 31
+#define RECORD_B 32
+#define RECORD_MAIN 33
+
+static unsigned int nChecks = 0;
+static unsigned int nFailed = 0;
+
+
+
+// Builds a USN_RECORD like the ones FSCTL_ENUM_USN_DATA and FSCTL_READ_USN_JOURNAL return
+static void MakeRecord(vector<BYTE> &rgRecord, DWORDLONG FRN, DWORDLONG ParentFRN, const WCHAR *szName, BOOL bDirectory, DWORD Reason, USN Usn)
+{
+	DWORD cbName = (DWORD) (wcslen(szName) * sizeof(WCHAR));
+	DWORD RecordLength = (DWORD) ((FIELD_OFFSET(USN_RECORD, FileName) + cbName + 7) & ~7);
+	rgRecord.assign(RecordLength, 0);
+	USN_RECORD *pRecord = (USN_RECORD *) &rgRecord[0];
+	pRecord->RecordLength = RecordLength;
+	pRecord->MajorVersion = 2;
+	pRecord->FileReferenceNumber = FRN;
+	pRecord->ParentFileReferenceNumber = ParentFRN;
+	pRecord->Usn = Usn;
+	pRecord->Reason = Reason;
+	pRecord->FileAttributes = bDirectory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+	pRecord->FileNameLength = (WORD) cbName;
+	pRecord->FileNameOffset = (WORD) FIELD_OFFSET(USN_RECORD, FileName);
+	memcpy(pRecord->FileName, szName, cbName);
+}
+
+
+
+// Collects journal records in the layout of a FSCTL_READ_USN_JOURNAL output buffer: the USN to continue with,
+// followed by the records
+class CJournalBuffer {
+public:
+	CJournalBuffer()
+	{
+		m_NextUsn = 0x1000;
+		rgData.assign(sizeof(USN), 0);
+	}
+
+	void Add(DWORDLONG FRN, DWORDLONG ParentFRN, const WCHAR *szName, BOOL bDirectory, DWORD Reason)
+	{
+		vector<BYTE> rgRecord;
+		MakeRecord(rgRecord, FRN, ParentFRN, szName, bDirectory, Reason, m_NextUsn);
+		rgData.insert(rgData.end(), rgRecord.begin(), rgRecord.end());
+		m_NextUsn += rgRecord.size();
+	}
+
+	// Passes the buffer to the index like UpdateIndex() does and starts a new buffer
+	void Replay(CDriveIndex *pIndex)
+	{
+		*(USN *) &rgData[0] = m_NextUsn;
+		pIndex->ReadJournalBuffer(&rgData[0], (DWORD) rgData.size());
+		pIndex->ApplyJournalChanges();
+		rgData.assign(sizeof(USN), 0);
+	}
+
+protected:
+	vector<BYTE> rgData;
+	USN m_NextUsn;
+};
+
+
+
+// Gives the checks access to the entries of the index
+class CTestIndex : public CDriveIndex {
+public:
+	// Full path of the entry of a record, e.g. "T:\docs\a.txt", or an empty string if the record has no entry
+	wstring GetPath(unsigned int RecordNumber)
+	{
+		wstring strPath;
+		if(!Get(RecordNumber, &strPath))
+			strPath = TEXT("");
+		return strPath;
+	}
+
+	BOOL IsDirectory(unsigned int RecordNumber)
+	{
+		return FindDirOffsetByIndex(RecordNumber) != -1;
+	}
+
+	// Number of files and subdirectories below a directory, see CountSubtrees(). Returns false if the record
+	// isn't a directory.
+	BOOL GetCounts(unsigned int RecordNumber, unsigned int &nFiles, unsigned int &nDirectories)
+	{
+		INT64 iOffset = FindDirOffsetByIndex(RecordNumber);
+		if(iOffset == -1)
+			return false;
+		nFiles = rgDirectories[(unsigned int) iOffset].nFiles;
+		nDirectories = rgDirectories[(unsigned int) iOffset].nDirectories;
+		return true;
+	}
+};
+
+
+
+static void Check(BOOL bPassed, const char *szTest, const char *szCheck)
+{
+	nChecks++;
+	if(!bPassed)
+	{
+		nFailed++;
+		printf("%s: %s failed\n", szTest, szCheck);
+	}
+}
+
+
+
+// Checks the path of a record, an empty path checks that the record has no entry
+static void CheckPath(CTestIndex &Index, const char *szTest, unsigned int RecordNumber, const WCHAR *szPath)
+{
+	wstring strPath = Index.GetPath(RecordNumber);
+	nChecks++;
+	if(strPath != szPath)
+	{
+		nFailed++;
+		printf("%s: record %u is \"%S\" instead of \"%S\"\n", szTest, RecordNumber, strPath.c_str(), szPath);
+	}
+}
+
+
+
+static void CheckCounts(CTestIndex &Index, const char *szTest, unsigned int RecordNumber, unsigned int nFiles, unsigned int nDirectories)
+{
+	unsigned int nIndexFiles = 0;
+	unsigned int nIndexDirectories = 0;
+	BOOL bDirectory = Index.GetCounts(RecordNumber, nIndexFiles, nIndexDirectories);
+	nChecks++;
+	if(!bDirectory || nIndexFiles != nFiles || nIndexDirectories != nDirectories)
+	{
+		nFailed++;
+		printf("%s: directory %u has %u files and %u directories instead of %u and %u\n", szTest, RecordNumber, nIndexFiles, nIndexDirectories, nFiles, nDirectories);
+	}
+}
+
+
+
+// Checks the number of files and directories of the index, the root directory is one of the directories
+static void CheckTotals(CTestIndex &Index, const char *szTest, DWORDLONG nFiles, DWORDLONG nDirectories)
+{
+	DriveInfo Info = Index.GetInfo();
+	nChecks++;
+	if(Info.NumFiles != nFiles || Info.NumDirectories != nDirectories)
+	{
+		nFailed++;
+		printf("%s: the index has %llu files and %llu directories instead of %llu and %llu\n", szTest, Info.NumFiles, Info.NumDirectories, nFiles, nDirectories);
+	}
+}
+
+
+
+// Checks the number of results of a substring search, so the indexes of the names are checked as well
+static void CheckFind(CTestIndex &Index, const char *szTest, const WCHAR *szQuery, int nResults)
+{
+	wstring strQuery(szQuery);
+	vector<SearchResultFile> rgResults;
+	int nFound = Index.Find(&strQuery, NULL, &rgResults, false, SEARCH_SUBSTRING, -1);
+	nChecks++;
+	if(nFound != nResults)
+	{
+		nFailed++;
+		printf("%s: \"%S\" finds %d results instead of %d\n", szTest, szQuery, nFound, nResults);
+	}
+}
+
+
+
+// Builds the index of the test volume. The records are in the order of their record numbers like
+// FSCTL_ENUM_USN_DATA returns them, so the directories are seen before the files in them.
+static void BuildVolume(CTestIndex &Index)
+{
+	CBufferRecordSource Source(TEST_DRIVE, TEST_ROOT_FRN);
+	vector<BYTE> rgRecord;
+	MakeRecord(rgRecord, TEST_FRN(RECORD_DOCS, 1), TEST_ROOT_FRN, TEXT("docs"), true, 0, 0);
+	Source.AddRecord((USN_RECORD *) &rgRecord[0]);
+	MakeRecord(rgRecord, TEST_FRN(RECORD_SRC, 1), TEST_ROOT_FRN, TEXT("src"), true, 0, 0);
+	Source.AddRecord((USN_RECORD *) &rgRecord[0]);
+	MakeRecord(rgRecord, TEST_FRN(RECORD_OLD, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("old"), true, 0, 0);
+	Source.AddRecord((USN_RECORD *) &rgRecord[0]);
+	MakeRecord(rgRecord, TEST_FRN(RECORD_README, 1), TEST_ROOT_FRN, TEXT("readme.txt"), false, 0, 0);
+	Source.AddRecord((USN_RECORD *) &rgRecord[0]);
+	MakeRecord(rgRecord, TEST_FRN(RECORD_A, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("a.txt"), false, 0, 0);
+	Source.AddRecord((USN_RECORD *) &rgRecord[0]);
+	MakeRecord(rgRecord, TEST_FRN(RECORD_B, 1), TEST_FRN(RECORD_OLD, 1), TEXT("b.txt"), false, 0, 0);
+	Source.AddRecord((USN_RECORD *) &rgRecord[0]);
+	MakeRecord(rgRecord, TEST_FRN(RECORD_MAIN, 1), TEST_FRN(RECORD_SRC, 1), TEXT("main.cpp"), false, 0, 0);
+	Source.AddRecord((USN_RECORD *) &rgRecord[0]);
+	Index.PopulateIndex(&Source);
+}
+
+
+
+static void TestBuild()
+{
+	CTestIndex Index;
+	BuildVolume(Index);
+	CheckPath(Index, "build", RECORD_README, TEXT("T:\\readme.txt"));
+	CheckPath(Index, "build", RECORD_A, TEXT("T:\\docs\\a.txt"));
+	CheckPath(Index, "build", RECORD_B, TEXT("T:\\docs\\old\\b.txt"));
+	CheckPath(Index, "build", RECORD_MAIN, TEXT("T:\\src\\main.cpp"));
+	CheckCounts(Index, "build", RECORD_NUMBER(TEST_ROOT_FRN), 4, 3);
+	CheckCounts(Index, "build", RECORD_DOCS, 2, 1);
+	CheckCounts(Index, "build", RECORD_OLD, 1, 0);
+	CheckCounts(Index, "build", RECORD_SRC, 1, 0);
+	CheckTotals(Index, "build", 4, 4);
+}
+
+
+
+// A new directory and a file in it are created in the same buffer, the file is reported first
+static void TestCreate()
+{
+	CTestIndex Index;
+	BuildVolume(Index);
+	CJournalBuffer Journal;
+	Journal.Add(TEST_FRN(41, 1), TEST_FRN(40, 1), TEXT("new.txt"), false, USN_REASON_FILE_CREATE);
+	Journal.Add(TEST_FRN(40, 1), TEST_FRN(RECORD_SRC, 1), TEXT("new"), true, USN_REASON_FILE_CREATE);
+	Journal.Add(TEST_FRN(40, 1), TEST_FRN(RECORD_SRC, 1), TEXT("new"), true, USN_REASON_FILE_CREATE | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(41, 1), TEST_FRN(40, 1), TEXT("new.txt"), false, USN_REASON_FILE_CREATE | USN_REASON_DATA_EXTEND | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(42, 1), TEST_FRN(RECORD_OLD, 1), TEXT("c.txt"), false, USN_REASON_FILE_CREATE);
+	Journal.Replay(&Index);
+	CheckPath(Index, "create", 40, TEXT("T:\\src\\new"));
+	CheckPath(Index, "create", 41, TEXT("T:\\src\\new\\new.txt"));
+	CheckPath(Index, "create", 42, TEXT("T:\\docs\\old\\c.txt"));
+	Check(Index.IsDirectory(40) && !Index.IsDirectory(41), "create", "entry types");
+	CheckCounts(Index, "create", 40, 1, 0);
+	CheckCounts(Index, "create", RECORD_SRC, 2, 1);
+	CheckCounts(Index, "create", RECORD_OLD, 2, 0);
+	CheckCounts(Index, "create", RECORD_DOCS, 3, 1);
+	CheckCounts(Index, "create", RECORD_NUMBER(TEST_ROOT_FRN), 6, 4);
+	CheckTotals(Index, "create", 6, 5);
+	CheckFind(Index, "create", TEXT("new"), 2);
+}
+
+
+
+// A file is deleted, and a directory is deleted after the file in it
+static void TestDelete()
+{
+	CTestIndex Index;
+	BuildVolume(Index);
+	CJournalBuffer Journal;
+	Journal.Add(TEST_FRN(RECORD_README, 1), TEST_ROOT_FRN, TEXT("readme.txt"), false, USN_REASON_FILE_DELETE | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(RECORD_B, 1), TEST_FRN(RECORD_OLD, 1), TEXT("b.txt"), false, USN_REASON_FILE_DELETE | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(RECORD_OLD, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("old"), true, USN_REASON_FILE_DELETE | USN_REASON_CLOSE);
+	Journal.Replay(&Index);
+	CheckPath(Index, "delete", RECORD_README, TEXT(""));
+	CheckPath(Index, "delete", RECORD_B, TEXT(""));
+	CheckPath(Index, "delete", RECORD_OLD, TEXT(""));
+	CheckPath(Index, "delete", RECORD_A, TEXT("T:\\docs\\a.txt"));
+	CheckPath(Index, "delete", RECORD_MAIN, TEXT("T:\\src\\main.cpp"));
+	CheckCounts(Index, "delete", RECORD_DOCS, 1, 0);
+	CheckCounts(Index, "delete", RECORD_NUMBER(TEST_ROOT_FRN), 2, 2);
+	CheckTotals(Index, "delete", 2, 3);
+	CheckFind(Index, "delete", TEXT("b.txt"), 0);
+}
+
+
+
+// A file and a directory are renamed. The journal reports the old name before the new one.
+static void TestRename()
+{
+	CTestIndex Index;
+	BuildVolume(Index);
+	CJournalBuffer Journal;
+	Journal.Add(TEST_FRN(RECORD_A, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("a.txt"), false, USN_REASON_RENAME_OLD_NAME);
+	Journal.Add(TEST_FRN(RECORD_A, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("renamed.txt"), false, USN_REASON_RENAME_NEW_NAME);
+	Journal.Add(TEST_FRN(RECORD_A, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("renamed.txt"), false, USN_REASON_RENAME_NEW_NAME | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(RECORD_DOCS, 1), TEST_ROOT_FRN, TEXT("docs"), true, USN_REASON_RENAME_OLD_NAME);
+	Journal.Add(TEST_FRN(RECORD_DOCS, 1), TEST_ROOT_FRN, TEXT("documents"), true, USN_REASON_RENAME_NEW_NAME | USN_REASON_CLOSE);
+	Journal.Replay(&Index);
+	CheckPath(Index, "rename", RECORD_A, TEXT("T:\\documents\\renamed.txt"));
+	CheckPath(Index, "rename", RECORD_DOCS, TEXT("T:\\documents"));
+	CheckPath(Index, "rename", RECORD_B, TEXT("T:\\documents\\old\\b.txt"));
+	CheckCounts(Index, "rename", RECORD_DOCS, 2, 1);
+	CheckTotals(Index, "rename", 4, 4);
+	CheckFind(Index, "rename", TEXT("renamed"), 1);
+	CheckFind(Index, "rename", TEXT("a.txt"), 0);
+}
+
+
+
+// A directory with a file in it and a file are moved to other directories
+static void TestMove()
+{
+	CTestIndex Index;
+	BuildVolume(Index);
+	CJournalBuffer Journal;
+	Journal.Add(TEST_FRN(RECORD_OLD, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("old"), true, USN_REASON_RENAME_OLD_NAME);
+	Journal.Add(TEST_FRN(RECORD_OLD, 1), TEST_FRN(RECORD_SRC, 1), TEXT("old"), true, USN_REASON_RENAME_NEW_NAME | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(RECORD_MAIN, 1), TEST_FRN(RECORD_SRC, 1), TEXT("main.cpp"), false, USN_REASON_RENAME_OLD_NAME);
+	Journal.Add(TEST_FRN(RECORD_MAIN, 1), TEST_ROOT_FRN, TEXT("main.cpp"), false, USN_REASON_RENAME_NEW_NAME | USN_REASON_CLOSE);
+	Journal.Replay(&Index);
+	CheckPath(Index, "move", RECORD_OLD, TEXT("T:\\src\\old"));
+	CheckPath(Index, "move", RECORD_B, TEXT("T:\\src\\old\\b.txt"));
+	CheckPath(Index, "move", RECORD_MAIN, TEXT("T:\\main.cpp"));
+	CheckCounts(Index, "move", RECORD_DOCS, 1, 0);
+	CheckCounts(Index, "move", RECORD_SRC, 1, 1);
+	CheckCounts(Index, "move", RECORD_OLD, 1, 0);
+	CheckCounts(Index, "move", RECORD_NUMBER(TEST_ROOT_FRN), 4, 3);
+	CheckTotals(Index, "move", 4, 4);
+}
+
+
+
+// Records are deleted and reused with a new sequence number in the same buffer: the record of a file becomes
+// a directory with a file in it, and the record of a directory becomes a file
+static void TestReuse()
+{
+	CTestIndex Index;
+	BuildVolume(Index);
+	CJournalBuffer Journal;
+	Journal.Add(TEST_FRN(RECORD_A, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("a.txt"), false, USN_REASON_FILE_DELETE | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(RECORD_A, 2), TEST_FRN(RECORD_SRC, 1), TEXT("cache"), true, USN_REASON_FILE_CREATE | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(43, 1), TEST_FRN(RECORD_A, 2), TEXT("cache.bin"), false, USN_REASON_FILE_CREATE | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(RECORD_B, 1), TEST_FRN(RECORD_OLD, 1), TEXT("b.txt"), false, USN_REASON_FILE_DELETE | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(RECORD_OLD, 1), TEST_FRN(RECORD_DOCS, 1), TEXT("old"), true, USN_REASON_FILE_DELETE | USN_REASON_CLOSE);
+	Journal.Add(TEST_FRN(RECORD_OLD, 2), TEST_ROOT_FRN, TEXT("notes.txt"), false, USN_REASON_FILE_CREATE | USN_REASON_CLOSE);
+	Journal.Replay(&Index);
+	CheckPath(Index, "reuse", RECORD_A, TEXT("T:\\src\\cache"));
+	CheckPath(Index, "reuse", 43, TEXT("T:\\src\\cache\\cache.bin"));
+	CheckPath(Index, "reuse", RECORD_OLD, TEXT("T:\\notes.txt"));
+	CheckPath(Index, "reuse", RECORD_B, TEXT(""));
+	Check(Index.IsDirectory(RECORD_A) && !Index.IsDirectory(RECORD_OLD), "reuse", "entry types");
+	CheckCounts(Index, "reuse", RECORD_A, 1, 0);
+	CheckCounts(Index, "reuse", RECORD_SRC, 2, 1);
+	CheckCounts(Index, "reuse", RECORD_DOCS, 0, 0);
+	CheckCounts(Index, "reuse", RECORD_NUMBER(TEST_ROOT_FRN), 4, 3);
+	CheckTotals(Index, "reuse", 4, 4);
+	CheckFind(Index, "reuse", TEXT("a.txt"), 0);
+	CheckFind(Index, "reuse", TEXT("notes"), 1);
+}
+
+
+
+// Keeps the best 50 of 5000 files whose names all contain the query. The scan on one thread ends at the first
+// match that can't get into the results, so only the first block of filters is tested.
+static void TestTopResults()
+{
+	CTestIndex Index;
+	SearchOptions Options;
+	Options.nThreads = 1;
+	Index.SetOptions(&Options);
+	CBufferRecordSource Source(TEST_DRIVE, TEST_ROOT_FRN);
+	vector<BYTE> rgRecord;
+	WCHAR szName[32];
+	for(unsigned int i = 0; i != 5000; i++)
+	{
+		wsprintf(szName, TEXT("match%u.txt"), i);
+		MakeRecord(rgRecord, TEST_FRN(40 + i, 1), TEST_ROOT_FRN, szName, false, 0, 0);
+		Source.AddRecord((USN_RECORD *) &rgRecord[0]);
+	}
+	Index.PopulateIndex(&Source);
+
+	wstring strQuery(TEXT("match"));
+	vector<SearchResultFile> rgResults;
+	int nFound = Index.Find(&strQuery, NULL, &rgResults, false, SEARCH_SUBSTRING, 50, NULL, true);
+	SearchStats Stats = Index.GetSearchStats();
+	Check(rgResults.size() == 50, "top results", "number of results");
+	Check(nFound == -1, "top results", "more results");
+	Check(rgResults.size() != 0 && rgResults[0].Filename == TEXT("match0.txt"), "top results", "first result");
+	nChecks++;
+	if(Stats.nScanned >= 5000)
+	{
+		nFailed++;
+		printf("top results: %llu filters were tested instead of stopping early\n", Stats.nScanned);
+	}
+}
+
+
+
+int wmain(int argc, WCHAR *argv[])
+{
+	TestBuild();
+	TestCreate();
+	TestDelete();
+	TestRename();
+	TestMove();
+	TestReuse();
+	TestTopResults();
+	printf("%u checks, %u failed\n", nChecks, nFailed);
+	return nFailed == 0 ? 0 : 1;
+}